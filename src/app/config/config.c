@@ -343,7 +343,10 @@ static config_var_t option_vars_[] = {
   V(ClientTransportPlugin,       LINELIST, NULL),
   V(ClientUseIPv6,               BOOL,     "0"),
   V(ClientUseIPv4,               BOOL,     "1"),
+  V(ComposeConsensusDiffs,       BOOL,     "0"),
+  V(CompressedResponseCacheSize, MEMUNIT,  "16 MB"),
   V(ConsensusParams,             STRING,   NULL),
+  V(ConsensusSnapshot,           BOOL,     "0"),
   V(ConnLimit,                   UINT,     "1000"),
   V(ConnDirectionStatistics,     BOOL,     "0"),
   V(ConstrainedSockets,          BOOL,     "0"),
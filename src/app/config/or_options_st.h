@@ -861,6 +861,11 @@ struct or_options_t {
    * If -1, Tor decides. */
   int UseMicrodescriptors;
 
+  /** Bool (default: 0): If true, keep a binary snapshot of the routerstatus
+   * entries in each consensus we accept, so that we don't have to parse
+   * them again when we load the consensus from the cache. */
+  int ConsensusSnapshot;
+
   /** File where we should write the ControlPort. */
   char *ControlPortWriteToFile;
   /** Should that file be group-readable? */
@@ -1017,6 +1022,15 @@ struct or_options_t {
    * use the default. */
   int MaxConsensusAgeForDiffs;
 
+  /** Bool (default: 0): If true, build consensus diffs from older
+   * consensuses by composing their diffs to the previous consensus with the
+   * diff from the previous consensus to the latest one. */
+  int ComposeConsensusDiffs;
+
+  /** How many bytes of already-compressed descriptor and microdescriptor
+   * responses should we keep around for reuse?  If 0, keep none. */
+  uint64_t CompressedResponseCacheSize;
+
   /** Bool (default: 0). Tells Tor to never try to exec another program.
    */
   int NoExec;
@@ -43,6 +43,7 @@
 #include "feature/dirauth/bwauth.h"
 #include "feature/dirauth/keypin.h"
 #include "feature/dirauth/process_descs.h"
+#include "feature/dirauth/reachability.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircache/dirserv.h"
 #include "feature/dirparse/routerparse.h"
@@ -764,6 +765,7 @@ tor_free_all(int postfork)
   addressmap_free_all();
   dirserv_free_fingerprint_list();
   dirserv_free_all();
+  dirserv_reachability_free_all();
   dirserv_clear_measured_bw_cache();
   rend_cache_free_all();
   rend_service_authorization_free_all();
@@ -1294,8 +1296,13 @@ run_tor_main_loop(void)
 
   /* Initialize the keypinning log. */
   if (authdir_mode_v3(get_options())) {
+    char *store_fname = get_datadir_fname("key-pinning-store");
     char *fname = get_datadir_fname("key-pinning-journal");
     int r = 0;
+    if (keypin_load_store(store_fname)<0) {
+      log_err(LD_DIR, "Error loading key-pinning store: %s",strerror(errno));
+      r = -1;
+    }
     if (keypin_load_journal(fname)<0) {
       log_err(LD_DIR, "Error loading key-pinning journal: %s",strerror(errno));
       r = -1;
@@ -1304,6 +1311,7 @@ run_tor_main_loop(void)
       log_err(LD_DIR, "Error opening key-pinning journal: %s",strerror(errno));
       r = -1;
     }
+    tor_free(store_fname);
     tor_free(fname);
     if (r)
       return r;
@@ -109,6 +109,7 @@
 #include "lib/net/buffers_net.h"
 #include "lib/tls/tortls.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 #include "lib/compress/compress.h"
 
 #ifdef HAVE_PWD_H
@@ -359,6 +360,7 @@ dir_connection_new(int socket_family)
 {
   dir_connection_t *dir_conn = tor_malloc_zero(sizeof(dir_connection_t));
   connection_init(time(NULL), TO_CONN(dir_conn), CONN_TYPE_DIR, socket_family);
+  dir_conn->sendfile_fd = -1;
   return dir_conn;
 }
 
@@ -517,6 +519,7 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = TOR_INVALID_SOCKET; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
+  conn->conn_type_array_index = -1;
   conn->global_identifier = n_connections_allocated++;
 
   conn->type = type;
@@ -638,6 +641,7 @@ connection_free_minimal(connection_t *conn)
   }
 
   tor_free(conn->address);
+  timer_free(conn->housekeeping_timer);
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -715,11 +719,7 @@ connection_free_minimal(connection_t *conn)
     tor_free(dir_conn->requested_resource);
 
     tor_compress_free(dir_conn->compress_state);
-    if (dir_conn->spool) {
-      SMARTLIST_FOREACH(dir_conn->spool, spooled_resource_t *, spooled,
-                        spooled_resource_free(spooled));
-      smartlist_free(dir_conn->spool);
-    }
+    dir_conn_clear_spool(dir_conn);
 
     rend_data_free(dir_conn->rend_data);
     hs_ident_dir_conn_free(dir_conn->hs_ident);
@@ -3867,6 +3867,11 @@ connection_fetch_from_buf_http(connection_t *conn,
 int
 connection_wants_to_flush(connection_t *conn)
 {
+  /* A pending sendfile() only counts while the connection is live: once
+   * it is marked, only the outbuf is flushed before closing. */
+  if (conn->type == CONN_TYPE_DIR && !conn->marked_for_close &&
+      connection_dirserv_sendfile_pending(TO_DIR_CONN(conn)))
+    return 1;
   return conn->outbuf_flushlen > 0;
 }
 
@@ -4101,6 +4106,14 @@ connection_handle_write_impl(connection_t *conn, int force)
     CONN_LOG_PROTECT(conn,
                      result = buf_flush_to_socket(conn->outbuf, conn->s,
                                         max_to_write, &conn->outbuf_flushlen));
+    if (result >= 0 && conn->type == CONN_TYPE_DIR &&
+        buf_datalen(conn->outbuf) == 0 && result < max_to_write &&
+        connection_dirserv_sendfile_pending(TO_DIR_CONN(conn))) {
+      /* The outbuf is empty: we can send straight from a file. */
+      ssize_t r = connection_dirserv_sendfile(TO_DIR_CONN(conn),
+                                              max_to_write - result);
+      result = (r < 0) ? -1 : result + (int) r;
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -4340,9 +4353,11 @@ connection_buf_add_buf(connection_t *conn, buf_t *buf)
   connection_write_to_buf_commit(conn, len);
 }
 
-#define CONN_GET_ALL_TEMPLATE(var, test) \
+/** Return a new smartlist of all connections of type <b>type</b> that
+ * satisfy test on var, and that are not marked for close. */
+#define CONN_GET_ALL_TEMPLATE(type, var, test) \
   STMT_BEGIN \
-    smartlist_t *conns = get_connection_array();   \
+    smartlist_t *conns = get_connection_array_by_type(type); \
     smartlist_t *ret_conns = smartlist_new();     \
     SMARTLIST_FOREACH_BEGIN(conns, connection_t *, var) { \
       if (var && (test) && !var->marked_for_close) \
@@ -4358,7 +4373,7 @@ connection_buf_add_buf(connection_t *conn, buf_t *buf)
 smartlist_t *
 connection_list_by_type_state(int type, int state)
 {
-  CONN_GET_ALL_TEMPLATE(conn, (conn->type == type && conn->state == state));
+  CONN_GET_ALL_TEMPLATE(type, conn, conn->state == state);
 }
 
 /* Return a list of connections that aren't close and matches the given type
@@ -4368,8 +4383,7 @@ connection_list_by_type_state(int type, int state)
 smartlist_t *
 connection_list_by_type_purpose(int type, int purpose)
 {
-  CONN_GET_ALL_TEMPLATE(conn,
-                        (conn->type == type && conn->purpose == purpose));
+  CONN_GET_ALL_TEMPLATE(type, conn, conn->purpose == purpose);
 }
 
 /** Return a connection_t * from get_connection_array() that satisfies test on
@@ -4385,6 +4399,19 @@ connection_list_by_type_purpose(int type, int purpose)
     return NULL;                                   \
   STMT_END
 
+/** As CONN_GET_TEMPLATE, but only look at connections of type <b>type</b>,
+ * without scanning the whole connection array. */
+#define CONN_GET_BY_TYPE_TEMPLATE(type, var, test)            \
+  STMT_BEGIN                                                  \
+    smartlist_t *conns = get_connection_array_by_type(type);  \
+    SMARTLIST_FOREACH(conns, connection_t *, var,             \
+    {                                                         \
+      if (var && (test) && !var->marked_for_close)            \
+        return var;                                           \
+    });                                                       \
+    return NULL;                                              \
+  STMT_END
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists (or if all such connections are marked
  * for close). */
@@ -4393,9 +4420,8 @@ connection_get_by_type_addr_port_purpose,(int type,
                                          const tor_addr_t *addr, uint16_t port,
                                          int purpose))
 {
-  CONN_GET_TEMPLATE(conn,
-       (conn->type == type &&
-        tor_addr_eq(&conn->addr, addr) &&
+  CONN_GET_BY_TYPE_TEMPLATE(type, conn,
+       (tor_addr_eq(&conn->addr, addr) &&
         conn->port == port &&
         conn->purpose == purpose));
 }
@@ -4414,7 +4440,7 @@ connection_get_by_global_id(uint64_t id)
 connection_t *
 connection_get_by_type(int type)
 {
-  CONN_GET_TEMPLATE(conn, conn->type == type);
+  CONN_GET_BY_TYPE_TEMPLATE(type, conn, 1);
 }
 
 /** Return a connection of type <b>type</b> that is in state <b>state</b>,
@@ -4423,7 +4449,7 @@ connection_get_by_type(int type)
 connection_t *
 connection_get_by_type_state(int type, int state)
 {
-  CONN_GET_TEMPLATE(conn, conn->type == type && conn->state == state);
+  CONN_GET_BY_TYPE_TEMPLATE(type, conn, conn->state == state);
 }
 
 /** Return a connection of type <b>type</b> that has rendquery equal
@@ -4438,9 +4464,8 @@ connection_get_by_type_state_rendquery(int type, int state,
              type == CONN_TYPE_AP || type == CONN_TYPE_EXIT);
   tor_assert(rendquery);
 
-  CONN_GET_TEMPLATE(conn,
-       (conn->type == type &&
-        (!state || state == conn->state)) &&
+  CONN_GET_BY_TYPE_TEMPLATE(type, conn,
+       (!state || state == conn->state) &&
         (
          (type == CONN_TYPE_DIR &&
           TO_DIR_CONN(conn)->rend_data &&
@@ -4454,18 +4479,17 @@ connection_get_by_type_state_rendquery(int type, int state,
          ));
 }
 
-/** Return a new smartlist of dir_connection_t * from get_connection_array()
- * that satisfy conn_test on connection_t *conn_var, and dirconn_test on
- * dir_connection_t *dirconn_var. conn_var must be of CONN_TYPE_DIR and not
+/** Return a new smartlist of dir_connection_t * for all directory
+ * connections that satisfy conn_test on connection_t *conn_var, and
+ * dirconn_test on dir_connection_t *dirconn_var. conn_var must not be
  * marked for close to be included in the list. */
 #define DIR_CONN_LIST_TEMPLATE(conn_var, conn_test,             \
                                dirconn_var, dirconn_test)       \
   STMT_BEGIN                                                    \
-    smartlist_t *conns = get_connection_array();                \
+    smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR); \
     smartlist_t *dir_conns = smartlist_new();                   \
     SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn_var) {  \
       if (conn_var && (conn_test)                               \
-          && conn_var->type == CONN_TYPE_DIR                    \
           && !conn_var->marked_for_close) {                     \
         dir_connection_t *dirconn_var = TO_DIR_CONN(conn_var);  \
         if (dirconn_var && (dirconn_test)) {                    \
@@ -4522,8 +4546,8 @@ connection_dir_list_by_purpose_resource_and_state(
 static connection_t *
 connection_get_another_active_or_conn(const or_connection_t *this_conn)
 {
-  CONN_GET_TEMPLATE(conn,
-                    conn != TO_CONN(this_conn) && conn->type == CONN_TYPE_OR);
+  CONN_GET_BY_TYPE_TEMPLATE(CONN_TYPE_OR, conn,
+                            conn != TO_CONN(this_conn));
 }
 
 /** Return 1 if there are any active OR connections apart from
@@ -4545,6 +4569,7 @@ any_other_active_or_conns(const or_connection_t *this_conn)
 }
 
 #undef CONN_GET_TEMPLATE
+#undef CONN_GET_BY_TYPE_TEMPLATE
 
 /** Return 1 if <b>conn</b> is a listener conn, else return 0. */
 int
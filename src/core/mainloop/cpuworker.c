@@ -73,6 +73,8 @@ worker_state_free_void(void *arg)
 
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** How many threads are there in <b>threadpool</b>? */
+static int threadpool_n_threads = 0;
 
 static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
@@ -105,6 +107,7 @@ cpu_init(void)
     int r = threadpool_register_reply_event(threadpool, NULL);
 
     tor_assert(r == 0);
+    threadpool_n_threads = n_threads;
   }
 
   /* Total voodoo. Can we make this more sensible? */
@@ -507,6 +510,154 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Return the number of threads that can run work queued with
+ * cpuworker_queue_work(), or 0 if we haven't started any. */
+MOCK_IMPL(int,
+cpuworker_get_n_threads,(void))
+{
+  return threadpool ? threadpool_n_threads : 0;
+}
+
+/** State shared by the main thread and the cpuworkers while they work
+ * through the items of a single cpuworker_run_parallel() call. */
+typedef struct parallel_job_t {
+  /** Reference count. Only touched from the main thread. */
+  int refcnt;
+  /** The number of items, and the most that one thread claims at once. */
+  int n_items;
+  int batch;
+  /** The function to run on each batch, and its argument. */
+  cpuworker_batch_fn_t fn;
+  void *arg;
+
+  /** Protects the fields below. */
+  tor_mutex_t lock;
+  /** Signalled once every item is done. */
+  tor_cond_t all_done;
+  /** The first item that nobody has claimed yet. */
+  int next_item;
+  /** How many items are done? */
+  int n_done;
+} parallel_job_t;
+
+/** Drop a reference to <b>job</b>, and free it if that was the last. */
+static void
+parallel_job_decref(parallel_job_t *job)
+{
+  if (--job->refcnt > 0)
+    return;
+  tor_mutex_uninit(&job->lock);
+  tor_cond_uninit(&job->all_done);
+  tor_free(job);
+}
+
+/** Claim and run batches from <b>job</b> until there are none left.  May
+ * run in any thread. */
+static void
+parallel_job_run_batches(parallel_job_t *job)
+{
+  while (1) {
+    int start, end;
+    tor_mutex_acquire(&job->lock);
+    start = job->next_item;
+    end = MIN(start + job->batch, job->n_items);
+    job->next_item = end;
+    tor_mutex_release(&job->lock);
+    if (start >= end)
+      break;
+
+    job->fn(job->arg, start, end);
+
+    tor_mutex_acquire(&job->lock);
+    job->n_done += end - start;
+    if (job->n_done == job->n_items)
+      tor_cond_signal_all(&job->all_done);
+    tor_mutex_release(&job->lock);
+  }
+}
+
+/** Worker function: help with the parallel_job_t in <b>arg</b>. */
+static workqueue_reply_t
+parallel_job_threadfn(void *state_, void *arg)
+{
+  (void) state_;
+  parallel_job_run_batches(arg);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: a worker is done with the parallel_job_t in
+ * <b>arg</b>. */
+static void
+parallel_job_replyfn(void *arg)
+{
+  parallel_job_decref(arg);
+}
+
+/**
+ * Call <b>fn</b>(<b>arg</b>, lo, hi) on batches of at most <b>batch</b>
+ * items, until every item from 0 through <b>n_items</b>-1 is in exactly one
+ * batch.  If we're in the main thread and have a threadpool, and there is
+ * more than one batch, share the batches between this thread and the
+ * cpuworkers; otherwise, do everything in this thread.  Either way, return
+ * only once every batch is done.
+ *
+ * <b>fn</b> may run in any thread, and at the same time as itself on other
+ * batches.  Return 1 if we used the cpuworkers, and 0 otherwise.
+ */
+int
+cpuworker_run_parallel(int n_items, int batch,
+                       cpuworker_batch_fn_t fn, void *arg)
+{
+  const int n_threads = in_main_thread() ? cpuworker_get_n_threads() : 0;
+  batch = MAX(batch, 1);
+  const int n_batches = CEIL_DIV(n_items, batch);
+
+  if (n_threads <= 0 || n_batches <= 1) {
+    if (n_items > 0)
+      fn(arg, 0, n_items);
+    return 0;
+  }
+
+  parallel_job_t *job = tor_malloc_zero(sizeof(parallel_job_t));
+  job->refcnt = 1;
+  job->n_items = n_items;
+  job->batch = batch;
+  job->fn = fn;
+  job->arg = arg;
+  tor_mutex_init_nonrecursive(&job->lock);
+  tor_cond_init(&job->all_done);
+
+  /* Ask for help, then do as much as we can ourselves. */
+  smartlist_t *queued = smartlist_new();
+  int i;
+  for (i = 0; i < MIN(n_threads, n_batches - 1); ++i) {
+    workqueue_entry_t *work = cpuworker_queue_work(WQ_PRI_HIGH,
+                                                   parallel_job_threadfn,
+                                                   parallel_job_replyfn,
+                                                   job);
+    if (!work)
+      break;
+    ++job->refcnt;
+    smartlist_add(queued, work);
+  }
+  parallel_job_run_batches(job);
+
+  /* Any worker that hasn't started yet has nothing left to do; any other
+   * worker is about to finish. */
+  SMARTLIST_FOREACH_BEGIN(queued, workqueue_entry_t *, work) {
+    if (workqueue_entry_cancel(work))
+      parallel_job_decref(job);
+  } SMARTLIST_FOREACH_END(work);
+  smartlist_free(queued);
+  tor_mutex_acquire(&job->lock);
+  while (job->n_done < job->n_items)
+    tor_cond_wait(&job->all_done, &job->lock, NULL);
+  tor_mutex_release(&job->lock);
+
+  parallel_job_decref(job);
+  return 1;
+}
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
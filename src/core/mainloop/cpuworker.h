@@ -22,6 +22,13 @@ MOCK_DECL(struct workqueue_entry_s *, cpuworker_queue_work, (
                     enum workqueue_reply_t (*fn)(void *, void *),
                     void (*reply_fn)(void *),
                     void *arg));
+MOCK_DECL(int, cpuworker_get_n_threads, (void));
+
+/** A function for cpuworker_run_parallel() to call on the items from
+ * <b>lo</b> through <b>hi</b>-1. */
+typedef void (*cpuworker_batch_fn_t)(void *arg, int lo, int hi);
+int cpuworker_run_parallel(int n_items, int batch,
+                           cpuworker_batch_fn_t fn, void *arg);
 
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
@@ -74,6 +74,7 @@
 #include "feature/client/transports.h"
 #include "feature/control/control.h"
 #include "feature/dirauth/authmode.h"
+#include "feature/dirauth/keypin.h"
 #include "feature/dirauth/reachability.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircache/dirserv.h"
@@ -102,6 +103,7 @@
 
 #include "lib/net/buffers_net.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 
 #include <event2/event.h>
 
@@ -165,6 +167,13 @@ static unsigned newnym_epoch = 0;
 
 /** Smartlist of all open connections. */
 STATIC smartlist_t *connection_array = NULL;
+/** Smartlists of all open connections, one for each connection type.  Each
+ * connection in connection_array is also in exactly one of these, so that
+ * code that only cares about one type doesn't need to scan everything. */
+static smartlist_t *connection_array_by_type[CONN_TYPE_MAX_ + 1];
+/** True iff OR and directory connections get housekeeping from their own
+ * timers.  This stays off until the timer subsystem is running. */
+static int housekeeping_timers_enabled = 0;
 /** List of connections that have been marked for close and need to be freed
  * and removed from connection_array. */
 static smartlist_t *closeable_connection_lst = NULL;
@@ -206,6 +215,7 @@ static int connection_should_read_from_linked_conn(connection_t *conn);
 static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
 static void second_elapsed_callback(periodic_timer_t *timer, void *args);
+static void connection_schedule_housekeeping(connection_t *conn, int delay);
 static void shutdown_did_not_work_callback(evutil_socket_t fd, short event,
                                            void *arg) ATTR_NORETURN;
 
@@ -241,6 +251,39 @@ note_that_we_maybe_cant_complete_circuits(void)
   can_complete_circuits = 0;
 }
 
+/** Add <b>conn</b> to the per-type list for its connection type. */
+STATIC void
+connection_array_by_type_add(connection_t *conn)
+{
+  smartlist_t *lst = get_connection_array_by_type(conn->type);
+  tor_assert(conn->conn_type_array_index == -1);
+  conn->conn_type_array_index = smartlist_len(lst);
+  smartlist_add(lst, conn);
+}
+
+/** Remove <b>conn</b> from the per-type list for its connection type, if it
+ * is there.  Like connection_remove(), this shifts the last connection of
+ * that type into the position occupied by conn. */
+STATIC void
+connection_array_by_type_remove(connection_t *conn)
+{
+  smartlist_t *lst = get_connection_array_by_type(conn->type);
+  int idx = conn->conn_type_array_index;
+  connection_t *tmp;
+
+  if (idx < 0)
+    return;
+  tor_assert(idx < smartlist_len(lst));
+  tor_assert(smartlist_get(lst, idx) == conn);
+
+  smartlist_del(lst, idx);
+  conn->conn_type_array_index = -1;
+  if (idx < smartlist_len(lst)) {
+    tmp = smartlist_get(lst, idx);
+    tmp->conn_type_array_index = idx;
+  }
+}
+
 /** Add <b>conn</b> to the array of connections that we can poll on.  The
  * connection's socket must be set; the connection starts out
  * non-reading and non-writing.
@@ -257,6 +300,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
   tor_assert(conn->conn_array_index == -1); /* can only connection_add once */
   conn->conn_array_index = smartlist_len(connection_array);
   smartlist_add(connection_array, conn);
+  connection_array_by_type_add(conn);
+  connection_schedule_housekeeping(conn, 1);
 
   (void) is_connecting;
 
@@ -319,6 +364,9 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  connection_array_by_type_remove(conn);
+  if (conn->housekeeping_timer)
+    timer_disable(conn->housekeeping_timer);
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -449,6 +497,20 @@ get_connection_array, (void))
   return connection_array;
 }
 
+/** Return a list of all the connections in connection_array whose type is
+ * <b>type</b>.  The list must not be modified, and its order is not
+ * meaningful.  If <b>type</b> is not a valid connection type, the list is
+ * empty. */
+smartlist_t *
+get_connection_array_by_type(int type)
+{
+  if (type < 0 || type > CONN_TYPE_MAX_)
+    type = 0; /* No connection has this type. */
+  if (!connection_array_by_type[type])
+    connection_array_by_type[type] = smartlist_new();
+  return connection_array_by_type[type];
+}
+
 /**
  * Return the amount of network traffic read, in bytes, over the life of this
  * process.
@@ -1139,20 +1201,41 @@ directory_info_has_arrived(time_t now, int from_cache, int suppress_logs)
    router_do_reachability_checks(1, 1);
 }
 
-/** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+/** Longest we will wait between two housekeeping passes on a single
+ * connection, in seconds. */
+#define CONN_HOUSEKEEPING_MAX_DELAY 3600
+
+/** Return the number of seconds from <b>now</b> until <b>when</b>, clipped
+ * to the range [1, CONN_HOUSEKEEPING_MAX_DELAY]. */
+static int
+housekeeping_delay_until(time_t now, time_t when)
+{
+  if (when <= now)
+    return 1;
+  if (when - now > CONN_HOUSEKEEPING_MAX_DELAY)
+    return CONN_HOUSEKEEPING_MAX_DELAY;
+  return (int)(when - now);
+}
+
+/** Perform regular maintenance tasks for a single OR or directory
+ * connection.  This function gets run from each such connection's
+ * housekeeping timer; connections of other types have nothing to do here.
+ *
+ * Return the number of seconds until this function next needs to run for
+ * <b>conn</b>, or 0 if it never needs to run again (because <b>conn</b> is
+ * closing, or isn't a type we care about).
  */
-static void
-run_connection_housekeeping(int i, time_t now)
+STATIC int
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
   int have_any_circuits;
   int past_keepalive =
     now >= conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+  time_t next;
 
   if (conn->outbuf && !connection_get_outbuf_len(conn) &&
       conn->type == CONN_TYPE_OR)
@@ -1160,18 +1243,18 @@ run_connection_housekeeping(int i, time_t now)
 
   if (conn->marked_for_close) {
     /* nothing to do here */
-    return;
+    return 0;
   }
 
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
-  if (conn->type == CONN_TYPE_DIR &&
-      ((DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_last_write_allowed
-            + options->TestingDirConnectionMaxStall < now) ||
-       (!DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_last_read_allowed
-            + options->TestingDirConnectionMaxStall < now))) {
+  if (conn->type == CONN_TYPE_DIR) {
+    time_t last_active = DIR_CONN_IS_SERVER(conn) ?
+      conn->timestamp_last_write_allowed : conn->timestamp_last_read_allowed;
+    if (last_active + options->TestingDirConnectionMaxStall >= now) {
+      return housekeeping_delay_until(now,
+                  last_active + options->TestingDirConnectionMaxStall + 1);
+    }
     log_info(LD_DIR,"Expiring wedged directory conn (fd %d, purpose %d)",
              (int)conn->s, conn->purpose);
     /* This check is temporary; it's to let us know whether we should consider
@@ -1184,11 +1267,11 @@ run_connection_housekeeping(int i, time_t now)
     } else {
       connection_mark_for_close(conn);
     }
-    return;
+    return conn->marked_for_close ? 0 : 1;
   }
 
   if (!connection_speaks_cells(conn))
-    return; /* we're all done here, the rest is just for OR conns */
+    return 0; /* we're all done here, the rest is just for OR conns */
 
   /* If we haven't flushed to an OR connection for a while, then either nuke
      the connection or send a keepalive, depending. */
@@ -1218,13 +1301,17 @@ run_connection_housekeeping(int i, time_t now)
                                    END_OR_CONN_REASON_TIMEOUT,
                                    "Tor gave up on the connection");
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!connection_state_is_open(conn)) {
     if (past_keepalive) {
       /* We never managed to actually get this connection open and happy. */
       log_info(LD_OR,"Expiring non-open OR connection to fd %d (%s:%d).",
                (int)conn->s,conn->address, conn->port);
       connection_or_close_normally(TO_OR_CONN(conn), 0);
+      return 0;
     }
+    return housekeeping_delay_until(now,
+             conn->timestamp_last_write_allowed + options->KeepalivePeriod);
   } else if (we_are_hibernating() &&
              ! have_any_circuits &&
              !connection_get_outbuf_len(conn)) {
@@ -1234,6 +1321,7 @@ run_connection_housekeeping(int i, time_t now)
              "[Hibernating or exiting].",
              (int)conn->s,conn->address, conn->port);
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!have_any_circuits &&
              now - or_conn->idle_timeout >=
                                          chan->timestamp_last_had_circuits) {
@@ -1245,6 +1333,7 @@ run_connection_housekeeping(int i, time_t now)
              or_conn->idle_timeout,
              or_conn->is_canonical ? "" : "non");
     connection_or_close_normally(TO_OR_CONN(conn), 0);
+    return 0;
   } else if (
       now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
       now >=
@@ -1256,6 +1345,7 @@ run_connection_housekeeping(int i, time_t now)
            (int)connection_get_outbuf_len(conn),
            (int)(now-conn->timestamp_last_write_allowed));
     connection_or_close_normally(TO_OR_CONN(conn), 0);
+    return 0;
   } else if (past_keepalive && !connection_get_outbuf_len(conn)) {
     /* send a padding cell */
     log_fn(LOG_DEBUG,LD_OR,"Sending keepalive to (%s:%d)",
@@ -1263,9 +1353,117 @@ run_connection_housekeeping(int i, time_t now)
     memset(&cell,0,sizeof(cell_t));
     cell.command = CELL_PADDING;
     connection_or_write_cell_to_buf(&cell, or_conn);
+  } else if (channelpadding_decide_to_pad_channel(chan) !=
+             CHANNELPADDING_WONTPAD) {
+    /* The padding machinery expects to be consulted once a second. */
+    return 1;
+  }
+
+  /* Nothing to do right now: sleep until the next deadline that could make
+   * one of the checks above fire. */
+  if (we_are_hibernating())
+    return 1;
+  next = conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+  if (next <= now) {
+    /* Still waiting for the outbuf to drain before we send a keepalive. */
+    next = now + 1;
+  }
+  next = MIN(next, MAX(or_conn->timestamp_lastempty,
+                       conn->timestamp_last_write_allowed) +
+                   options->KeepalivePeriod*10);
+  if (have_any_circuits) {
+    /* We won't notice the last circuit going away by polling: see
+     * channel_note_housekeeping_needed(). */
+    next = MIN(next, now + or_conn->idle_timeout);
   } else {
-    channelpadding_decide_to_pad_channel(chan);
+    next = MIN(next, chan->timestamp_last_had_circuits +
+                     or_conn->idle_timeout);
   }
+  return housekeeping_delay_until(now, next);
+}
+
+/** Timer callback: run housekeeping for the connection in <b>arg</b>, and
+ * schedule the next pass if it needs one. */
+static void
+connection_housekeeping_cb(tor_timer_t *timer, void *arg,
+                           const struct monotime_t *now_mono)
+{
+  connection_t *conn = arg;
+  int delay;
+  (void) timer;
+  (void) now_mono;
+
+  delay = run_connection_housekeeping(conn, time(NULL));
+  if (delay > 0 && !conn->marked_for_close)
+    connection_schedule_housekeeping(conn, delay);
+}
+
+/** Arrange for run_connection_housekeeping() to run on <b>conn</b> in
+ * <b>delay</b> seconds, replacing any pass that was already scheduled.  Does
+ * nothing for connections that don't need housekeeping, or before
+ * housekeeping timers have been enabled. */
+static void
+connection_schedule_housekeeping(connection_t *conn, int delay)
+{
+  struct timeval tv;
+
+  if (!housekeeping_timers_enabled)
+    return;
+  if (conn->type != CONN_TYPE_OR && conn->type != CONN_TYPE_DIR)
+    return;
+  if (conn->conn_array_index < 0 || conn->marked_for_close)
+    return;
+
+  if (!conn->housekeeping_timer)
+    conn->housekeeping_timer = timer_new(connection_housekeeping_cb, conn);
+  tv.tv_sec = delay;
+  tv.tv_usec = 0;
+  timer_schedule(conn->housekeeping_timer, &tv);
+}
+
+/** Run housekeeping for <b>conn</b> as soon as possible: call this when
+ * something has happened that may make it eligible to be closed. */
+MOCK_IMPL(void,
+connection_reschedule_housekeeping, (connection_t *conn))
+{
+  tor_assert(conn);
+  connection_schedule_housekeeping(conn, 0);
+}
+
+/** Change the type of <b>conn</b> to <b>type</b>.  If <b>conn</b> is in the
+ * connection array, move it to the per-type list for its new type, and give
+ * it a housekeeping pass if its new type needs one.  Never assign to the
+ * type of a connection that might be in the array without calling this. */
+void
+connection_set_type(connection_t *conn, int type)
+{
+  tor_assert(conn);
+  if (conn->type == type)
+    return;
+
+  if (conn->conn_type_array_index >= 0) {
+    connection_array_by_type_remove(conn);
+    conn->type = type;
+    connection_array_by_type_add(conn);
+    connection_schedule_housekeeping(conn, 1);
+  } else {
+    conn->type = type;
+  }
+}
+
+/** Start running run_connection_housekeeping() from per-connection timers,
+ * and schedule a first pass for every OR and directory connection we
+ * already have.  The timer subsystem must already be initialized. */
+STATIC void
+connection_housekeeping_timers_enable(void)
+{
+  housekeeping_timers_enabled = 1;
+  SMARTLIST_FOREACH(get_connection_array_by_type(CONN_TYPE_OR),
+                    connection_t *, conn,
+                    connection_schedule_housekeeping(conn, 1));
+  SMARTLIST_FOREACH(get_connection_array_by_type(CONN_TYPE_DIR),
+                    connection_t *, conn,
+                    connection_schedule_housekeeping(conn, 1));
 }
 
 /** Honor a NEWNYM request: make future requests unlinkable to past
@@ -1351,6 +1549,7 @@ CALLBACK(check_for_reachability_bw);
 CALLBACK(check_onion_keys_expiry_time);
 CALLBACK(clean_caches);
 CALLBACK(clean_consdiffmgr);
+CALLBACK(compact_keypin_store);
 CALLBACK(dirvote);
 CALLBACK(downrate_stability);
 CALLBACK(expire_old_ciruits_serverside);
@@ -1416,6 +1615,7 @@ STATIC periodic_event_item_t periodic_events[] = {
 
   /* Directory authority only. */
   CALLBACK(check_authority_cert, PERIODIC_EVENT_ROLE_DIRAUTH, 0),
+  CALLBACK(compact_keypin_store, PERIODIC_EVENT_ROLE_DIRAUTH, 0),
   CALLBACK(dirvote, PERIODIC_EVENT_ROLE_DIRAUTH, PERIODIC_EVENT_FLAG_NEED_NET),
 
   /* Relay only. */
@@ -1769,12 +1969,10 @@ run_scheduled_events(time_t now)
     circuit_expire_old_circs_as_needed(now);
   }
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. Mark old OR connections as bad for new circuits.  The rest of the
+   *    housekeeping for OR and directory connections runs from their own
+   *    timers: see run_connection_housekeeping(). */
   channel_update_bad_for_new_circs(NULL, 0);
-  int i;
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
 
   /* 11b. check pending unconfigured managed proxies */
   if (!net_is_disabled() && pt_proxies_configuration_pending())
@@ -1932,10 +2130,11 @@ add_entropy_callback(time_t now, const or_options_t *options)
 static int
 launch_reachability_tests_callback(time_t now, const or_options_t *options)
 {
+  (void)now;
   if (authdir_mode_tests_reachability(options) &&
       !net_is_disabled()) {
     /* try to determine reachability of the other Tor relays */
-    dirserv_test_reachability(now);
+    dirserv_test_reachability();
   }
   return REACHABILITY_TEST_INTERVAL;
 }
@@ -1971,6 +2170,20 @@ save_stability_callback(time_t now, const or_options_t *options)
   return SAVE_STABILITY_INTERVAL;
 }
 
+/**
+ * Periodic callback: if we're a v3 authority, fold a long key-pinning
+ * journal into the key-pinning store, so that we can start up quickly.
+ */
+static int
+compact_keypin_store_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  keypin_compact_store_if_needed();
+#define COMPACT_KEYPIN_STORE_INTERVAL (60*60)
+  return COMPACT_KEYPIN_STORE_INTERVAL;
+}
+
 /**
  * Periodic callback: if we're an authority, check on our authority
  * certificate (the one that authenticates our authority signing key).
@@ -2711,6 +2924,8 @@ do_main_loop(void)
    */
   initialize_periodic_events();
   initialize_mainloop_events();
+  connection_housekeeping_timers_enable();
+  dirserv_reachability_enable_pacing();
 
   /* set up once-a-second callback. */
   reschedule_per_second_timer();
@@ -2897,6 +3112,9 @@ void
 tor_mainloop_free_all(void)
 {
   smartlist_free(connection_array);
+  for (int i = 0; i <= CONN_TYPE_MAX_; ++i)
+    smartlist_free(connection_array_by_type[i]);
+  housekeeping_timers_enabled = 0;
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
   periodic_timer_free(second_timer);
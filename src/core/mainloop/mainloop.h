@@ -26,6 +26,9 @@ void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
 
 MOCK_DECL(smartlist_t *, get_connection_array, (void));
+smartlist_t *get_connection_array_by_type(int type);
+void connection_set_type(connection_t *conn, int type);
+MOCK_DECL(void, connection_reschedule_housekeeping, (connection_t *conn));
 MOCK_DECL(uint64_t,get_bytes_read,(void));
 MOCK_DECL(uint64_t,get_bytes_written,(void));
 void stats_increment_bytes_read_and_written(uint64_t r, uint64_t w);
@@ -102,6 +105,10 @@ STATIC void close_closeable_connections(void);
 STATIC void initialize_periodic_events(void);
 STATIC void teardown_periodic_events(void);
 STATIC int get_my_roles(const or_options_t *);
+STATIC void connection_array_by_type_add(connection_t *conn);
+STATIC void connection_array_by_type_remove(connection_t *conn);
+STATIC int run_connection_housekeeping(connection_t *conn, time_t now);
+STATIC void connection_housekeeping_timers_enable(void);
 #ifdef TOR_UNIT_TESTS
 extern smartlist_t *connection_array;
 
@@ -52,10 +52,16 @@ periodic_event_dispatch(mainloop_event_t *ev, void *data)
   time_t now = time(NULL);
   update_current_time(now);
   const or_options_t *options = get_options();
+  monotime_t start, end;
 //  log_debug(LD_GENERAL, "Dispatching %s", event->name);
+  monotime_get(&start);
   int r = event->fn(now, options);
+  monotime_get(&end);
   int next_interval = 0;
 
+  log_debug(LD_GENERAL, "Periodic event %s took %"PRId64" usec.",
+            event->name, monotime_diff_usec(&start, &end));
+
   if (!periodic_event_is_enabled(event)) {
     /* The event got disabled from inside its callback; no need to
      * reschedule. */
@@ -7,22 +7,29 @@
 #ifndef PACKED_CELL_ST_H
 #define PACKED_CELL_ST_H
 
-#include "tor_queue.h"
-
 /** A cell as packed for writing to the network. */
 struct packed_cell_t {
-  /** Next cell queued on this circuit. */
-  TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_timestamp; /**< Time (in timestamp units) when this cell
                                 * was inserted */
 };
 
+/** A block of cells stored contiguously in a cell_queue_t.  Cells are
+ * appended at <b>end</b> and removed from <b>first</b>; once every cell in
+ * a chunk has been removed, the chunk is freed. */
+typedef struct cell_queue_chunk_t {
+  struct cell_queue_chunk_t *next; /**< The next chunk in the queue. */
+  uint16_t capacity; /**< How many cells fit in <b>cells</b>. */
+  uint16_t first; /**< Index of the oldest cell in this chunk. */
+  uint16_t end; /**< Index just past the newest cell in this chunk. */
+  packed_cell_t cells[FLEXIBLE_ARRAY_MEMBER];
+} cell_queue_chunk_t;
+
 /** A queue of cells on a circuit, waiting to be added to the
  * or_connection_t's outbuf. */
 struct cell_queue_t {
-  /** Linked list of packed_cell_t*/
-  TOR_SIMPLEQ_HEAD(cell_simpleq, packed_cell_t) head;
+  cell_queue_chunk_t *head; /**< Chunk holding the oldest cells. */
+  cell_queue_chunk_t *tail; /**< Chunk we add new cells to. */
   int n; /**< The number of cells in the queue. */
 };
 
@@ -1457,20 +1457,17 @@ write_packed_cell(channel_t *chan, packed_cell_t *cell)
 }
 
 /**
- * Write a packed cell to a channel.
+ * Write a packed cell to a channel, leaving the cell with the caller.
  *
- * Write a packed cell to a channel using the write_cell() method.  This is
- * called by the transport-independent code to deliver a packed cell to a
- * channel for transmission.
+ * As channel_write_packed_cell(), but <b>cell</b> is not freed: use this
+ * for cells that live in storage owned by someone else, such as a cell
+ * queue.
  *
- * Return 0 on success else a negative value. In both cases, the caller should
- * not access the cell anymore, it is freed both on success and error.
+ * Return 0 on success else a negative value.
  */
 int
-channel_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+channel_write_packed_cell_no_free(channel_t *chan, packed_cell_t *cell)
 {
-  int ret = -1;
-
   tor_assert(chan);
   tor_assert(cell);
 
@@ -1478,15 +1475,30 @@ channel_write_packed_cell(channel_t *chan, packed_cell_t *cell)
     log_debug(LD_CHANNEL, "Discarding %p on closing channel %p with "
               "global ID %"PRIu64, cell, chan,
               (chan->global_identifier));
-    goto end;
+    return -1;
   }
   log_debug(LD_CHANNEL,
             "Writing %p to channel %p with global ID "
             "%"PRIu64, cell, chan, (chan->global_identifier));
 
-  ret = write_packed_cell(chan, cell);
+  return write_packed_cell(chan, cell);
+}
+
+/**
+ * Write a packed cell to a channel.
+ *
+ * Write a packed cell to a channel using the write_cell() method.  This is
+ * called by the transport-independent code to deliver a packed cell to a
+ * channel for transmission.
+ *
+ * Return 0 on success else a negative value. In both cases, the caller should
+ * not access the cell anymore, it is freed both on success and error.
+ */
+int
+channel_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  int ret = channel_write_packed_cell_no_free(chan, cell);
 
- end:
   /* Whatever happens, we free the cell. Either an error occurred or the cell
    * was put on the connection outbuf, both cases we have ownership of the
    * cell and we free it. */
@@ -2644,6 +2656,12 @@ channel_dump_statistics, (channel_t *chan, int severity))
       (chan->n_cells_recved),
       (chan->n_bytes_xmitted),
       (chan->n_cells_xmitted));
+  tor_log(severity, LD_GENERAL,
+      " * Channel %"PRIu64 " has answered %"PRIu64 " circuit ID lookups "
+      "from its cache and %"PRIu64 " from the global map",
+      (chan->global_identifier),
+      (chan->n_circid_cache_hits),
+      (chan->n_circid_cache_misses));
   if (now > chan->timestamp_created &&
       chan->timestamp_created > 0) {
     if (chan->n_bytes_recved > 0) {
@@ -2900,6 +2918,25 @@ channel_mark_bad_for_new_circs(channel_t *chan)
   tor_assert(chan);
 
   chan->is_bad_for_new_circs = 1;
+  channel_note_housekeeping_needed(chan);
+}
+
+/**
+ * Note that something has changed that housekeeping looks at for
+ * <b>chan</b>: it may have become eligible for closing, or for keepalives
+ * or padding.
+ *
+ * Connection housekeeping runs on a per-connection timer that can sleep for
+ * a long time, so ask the lower layer for an early pass, if it has a way to
+ * do that.
+ */
+void
+channel_note_housekeeping_needed(channel_t *chan)
+{
+  tor_assert(chan);
+
+  if (chan->note_housekeeping_needed)
+    chan->note_housekeeping_needed(chan);
 }
 
 /**
@@ -3211,7 +3248,12 @@ channel_timestamp_client(channel_t *chan)
 
   tor_assert(chan);
 
-  chan->timestamp_client = now;
+  /* Padding decisions depend on this timestamp, so make sure housekeeping
+   * looks at the channel again; but not more than once a second. */
+  if (chan->timestamp_client != now) {
+    chan->timestamp_client = now;
+    channel_note_housekeeping_needed(chan);
+  }
 }
 
 /**
@@ -45,6 +45,10 @@ typedef enum {
 } circ_id_type_t;
 #define circ_id_type_bitfield_t ENUM_BF(circ_id_type_t)
 
+/** How many slots are in each channel's circuit ID lookup cache?  Must be a
+ * power of two. */
+#define CHANNEL_CIRCID_CACHE_SIZE 64
+
 /* channel states for channel_t */
 
 typedef enum {
@@ -350,6 +354,11 @@ struct channel_s {
   const char * (*get_remote_descr)(channel_t *, int);
   /** Check if the lower layer has queued writes */
   int (*has_queued_writes)(channel_t *);
+  /**
+   * Optional: ask the lower layer to run its housekeeping for this channel
+   * soon, because something it depends on has changed.
+   */
+  void (*note_housekeeping_needed)(channel_t *);
   /**
    * If the second param is zero, ask the lower layer if this is
    * 'canonical', for a transport-specific definition of canonical; if
@@ -415,6 +424,17 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /**
+   * Small direct-mapped cache of entries in circuitlist.c's (chan,circid)
+   * map, indexed by the low bits of the circuit ID.  This keeps the lookup
+   * that we do for every incoming cell local to the channel.  Managed
+   * entirely by circuitlist.c.
+   */
+  struct chan_circid_circuit_map_t *circid_cache[CHANNEL_CIRCID_CACHE_SIZE];
+  /** How many circuit ID lookups on this channel were answered from
+   * circid_cache, and how many had to go to the global map? */
+  uint64_t n_circid_cache_hits, n_circid_cache_misses;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -448,9 +468,9 @@ struct channel_s {
   time_t timestamp_recv; /* Cell received from lower layer */
   time_t timestamp_xmit; /* Cell sent to lower layer */
 
-  /** Timestamp for run_connection_housekeeping(). We update this once a
-   * second when we run housekeeping and find a circuit on this channel, and
-   * whenever we add a circuit to the channel. */
+  /** Timestamp for run_connection_housekeeping(). We update this when we
+   * run housekeeping and find a circuit on this channel, whenever we add a
+   * circuit to the channel, and when its last circuit goes away. */
   time_t timestamp_last_had_circuits;
 
   /** Unique ID for measuring direct network status requests;vtunneled ones
@@ -529,6 +549,7 @@ channel_listener_state_to_string(channel_listener_state_t state);
 
 void channel_mark_for_close(channel_t *chan);
 int channel_write_packed_cell(channel_t *chan, packed_cell_t *cell);
+int channel_write_packed_cell_no_free(channel_t *chan, packed_cell_t *cell);
 
 void channel_listener_mark_for_close(channel_listener_t *chan_l);
 
@@ -732,6 +753,7 @@ const char * channel_get_canonical_remote_descr(channel_t *chan);
 int channel_has_queued_writes(channel_t *chan);
 int channel_is_bad_for_new_circs(channel_t *chan);
 void channel_mark_bad_for_new_circs(channel_t *chan);
+void channel_note_housekeeping_needed(channel_t *chan);
 int channel_is_canonical(channel_t *chan);
 int channel_is_canonical_is_reliable(channel_t *chan);
 int channel_is_client(const channel_t *chan);
@@ -275,6 +275,7 @@ channelpadding_update_padding_for_channel(channel_t *chan,
   /* Max must not be lower than ito_low_ms */
   chan->padding_timeout_high_ms = MAX(chan->padding_timeout_low_ms,
                                       pad_vars->ito_high_ms);
+  channel_note_housekeeping_needed(chan);
 
   log_fn(LOG_INFO,LD_OR,
          "Negotiated padding=%d, lo=%d, hi=%d on %"PRIu64,
@@ -703,14 +704,15 @@ channelpadding_reduce_padding_on_channel(channel_t *chan)
 }
 
 /**
- * This function is called once per second by run_connection_housekeeping(),
- * but only if the channel is still open, valid, and non-wedged.
+ * This function is called by run_connection_housekeeping(), but only if the
+ * channel is still open, valid, and non-wedged.
  *
  * It decides if and when we should send a padding cell, and if needed,
  * schedules a callback to send that cell at the appropriate time.
  *
  * Returns an enum that represents the current padding decision state.
- * Return value is currently used only by unit tests.
+ * Housekeeping uses it to keep calling us once per second for as long as we
+ * return anything other than CHANNELPADDING_WONTPAD.
  */
 channelpadding_decision_t
 channelpadding_decide_to_pad_channel(channel_t *chan)
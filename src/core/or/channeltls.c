@@ -46,6 +46,7 @@
 #include "core/or/command.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/connection_or.h"
 #include "feature/control/control.h"
 #include "feature/client/entrynodes.h"
@@ -106,6 +107,7 @@ channel_tls_get_transport_name_method(channel_t *chan, char **transport_out);
 static const char *
 channel_tls_get_remote_descr_method(channel_t *chan, int flags);
 static int channel_tls_has_queued_writes_method(channel_t *chan);
+static void channel_tls_note_housekeeping_needed_method(channel_t *chan);
 static int channel_tls_is_canonical_method(channel_t *chan, int req);
 static int
 channel_tls_matches_extend_info_method(channel_t *chan,
@@ -163,6 +165,8 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->get_remote_descr = channel_tls_get_remote_descr_method;
   chan->get_transport_name = channel_tls_get_transport_name_method;
   chan->has_queued_writes = channel_tls_has_queued_writes_method;
+  chan->note_housekeeping_needed =
+    channel_tls_note_housekeeping_needed_method;
   chan->is_canonical = channel_tls_is_canonical_method;
   chan->matches_extend_info = channel_tls_matches_extend_info_method;
   chan->matches_target = channel_tls_matches_target_method;
@@ -640,6 +644,24 @@ channel_tls_has_queued_writes_method(channel_t *chan)
   return (outbuf_len > 0);
 }
 
+/**
+ * Ask for an early housekeeping pass on our connection.
+ *
+ * This implements the note_housekeeping_needed method for channel_tls_t:
+ * run_connection_housekeeping() looks after the or_connection_t, and its
+ * timer may otherwise be asleep until the next keepalive.
+ */
+static void
+channel_tls_note_housekeeping_needed_method(channel_t *chan)
+{
+  channel_tls_t *tlschan = BASE_CHAN_TO_TLS(chan);
+
+  tor_assert(tlschan);
+
+  if (tlschan->conn)
+    connection_reschedule_housekeeping(TO_CONN(tlschan->conn));
+}
+
 /**
  * Tell the upper layer if we're canonical.
  *
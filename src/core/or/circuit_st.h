@@ -109,6 +109,14 @@ struct circuit_t {
   /** Temporary field used during circuits_handle_oom. */
   uint32_t age_tmp;
 
+  /** Index of this circuit in the heap of circuits that have queued cells,
+   * ordered by the age of their oldest cell; -1 if it is not in the heap. */
+  int cell_age_idx;
+  /** Coarse timestamp of the oldest cell queued on this circuit, as of when
+   * we last placed it in the heap.  Cells only leave from the front of a
+   * queue, so the real oldest cell is never older than this. */
+  uint32_t oldest_cell_ts;
+
   /** For storage while n_chan is pending (state CIRCUIT_STATE_CHAN_WAIT). */
   struct create_cell_t *n_chan_create_cell;
 
@@ -963,8 +963,10 @@ circuit_send_first_onion_skin(origin_circuit_t *circ)
      * analysis (such as netflow record retention). That means we want
      * to pad it.
      */
-    if (circ->base_.n_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS)
+    if (circ->base_.n_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS) {
       circ->base_.n_chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+      channel_note_housekeeping_needed(circ->base_.n_chan);
+    }
   }
 
   node = node_get_by_id(circ->base_.n_chan->identity_digest);
@@ -1789,7 +1791,7 @@ choose_good_exit_server_general(router_crn_flags_t flags)
   const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
   const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
 
-  connections = get_connection_array();
+  connections = get_connection_array_by_type(CONN_TYPE_AP);
 
   /* Count how many connections are waiting for a circuit to be built.
    * We use this for log messages now, but in the future we may depend on it.
@@ -21,7 +21,9 @@
  * circuit_set_n_circid_chan().  To look up a circuit from this map, most
  * callers should use circuit_get_by_circid_channel(), though
  * circuit_get_by_circid_channel_even_if_marked() is appropriate under some
- * circumstances.
+ * circumstances.  Each channel also keeps a small direct-mapped cache of
+ * its own entries in this table (channel_t.circid_cache), so that most
+ * lookups never have to hash into the global map.
  *
  * We also need to allow for the possibility that we have blocked use of a
  * circuit ID (because we are waiting to send a DESTROY cell), but the
@@ -119,6 +121,11 @@ static smartlist_t *global_origin_circuit_list = NULL;
 /** A list of all the circuits in CIRCUIT_STATE_CHAN_WAIT. */
 static smartlist_t *circuits_pending_chans = NULL;
 
+/** A heap of all the circuits that have cells queued, with the circuit whose
+ * oldest queued cell is oldest at the top.  Used by circuits_handle_oom() to
+ * pick victims without looking at every circuit. */
+static smartlist_t *circuits_by_cell_age = NULL;
+
 /** List of all the (origin) circuits whose state is
  * CIRCUIT_STATE_GUARD_WAIT. */
 static smartlist_t *circuits_pending_other_guards = NULL;
@@ -131,6 +138,7 @@ static void circuit_free_cpath_node(crypt_path_t *victim);
 static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 static void circuit_about_to_free_atexit(circuit_t *circ);
 static void circuit_about_to_free(circuit_t *circ);
+static void circuit_cell_age_index_remove(circuit_t *circ);
 
 /**
  * A cached value of the current state of the origin circuit list.  Has the
@@ -213,11 +221,26 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** Return the slot in <b>chan</b>'s circuit ID cache where an entry for
+ * <b>circ_id</b> would be stored. */
+static inline chan_circid_circuit_map_t **
+chan_circid_cache_slot(channel_t *chan, circid_t circ_id)
+{
+  return &chan->circid_cache[circ_id & (CHANNEL_CIRCID_CACHE_SIZE - 1)];
+}
+
+/** Remove <b>ent</b> from the circuit ID cache of its channel, if it is
+ * there.  Must be called before <b>ent</b> is freed. */
+static inline void
+chan_circid_cache_forget(chan_circid_circuit_map_t *ent)
+{
+  chan_circid_circuit_map_t **slot;
+  if (!ent)
+    return;
+  slot = chan_circid_cache_slot(ent->chan, ent->circ_id);
+  if (*slot == ent)
+    *slot = NULL;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -250,14 +273,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -276,6 +291,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     search.chan = old_chan;
     found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
     if (found) {
+      chan_circid_cache_forget(found);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -284,6 +300,11 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
         /* One fewer circuits use old_chan as p_chan */
         --(old_chan->num_p_circuits);
       }
+      if (channel_num_circuits(old_chan) == 0) {
+        /* The idle timeout for old_chan starts now. */
+        old_chan->timestamp_last_had_circuits = approx_time();
+        channel_note_housekeeping_needed(old_chan);
+      }
     }
   }
 
@@ -390,8 +411,7 @@ channel_mark_circid_usable(channel_t *chan, circid_t id)
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
+  chan_circid_cache_forget(ent);
   tor_free(ent);
 }
 
@@ -932,6 +952,7 @@ init_circuit_base(circuit_t *circ)
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
   cell_queue_init(&circ->n_chan_cells);
+  circ->cell_age_idx = -1;
 
   smartlist_add(circuit_get_global_list(), circ);
   circ->global_circuitlist_idx = smartlist_len(circuit_get_global_list()) - 1;
@@ -1164,6 +1185,8 @@ circuit_free_(circuit_t *circ)
     }
   }
 
+  circuit_cell_age_index_remove(circ);
+
   /* Remove from map. */
   circuit_set_n_circid_chan(circ, 0, NULL);
 
@@ -1246,6 +1269,9 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_chans);
   circuits_pending_chans = NULL;
 
+  smartlist_free(circuits_by_cell_age);
+  circuits_by_cell_age = NULL;
+
   smartlist_free(circuits_pending_close);
   circuits_pending_close = NULL;
 
@@ -1390,16 +1416,18 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
 {
   chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
+  chan_circid_circuit_map_t **slot = chan_circid_cache_slot(chan, circ_id);
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
+  if (*slot && (*slot)->circ_id == circ_id) {
+    found = *slot;
+    ++chan->n_circid_cache_hits;
   } else {
     search.circ_id = circ_id;
     search.chan = chan;
     found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
+    if (found)
+      *slot = found;
+    ++chan->n_circid_cache_misses;
   }
   if (found && found->circuit) {
     log_debug(LD_CIRC,
@@ -2365,23 +2393,28 @@ circuit_about_to_free(circuit_t *circ)
 }
 
 /** Given a marked circuit <b>circ</b>, aggressively free its cell queues to
- * recover memory. */
-static void
+ * recover memory. Return the number of bytes recovered. */
+static size_t
 marked_circuit_free_cells(circuit_t *circ)
 {
+  size_t n_bytes;
   if (!circ->marked_for_close) {
     log_warn(LD_BUG, "Called on non-marked circuit");
-    return;
+    return 0;
   }
+  n_bytes = cell_queue_get_allocation(&circ->n_chan_cells);
   cell_queue_clear(&circ->n_chan_cells);
   if (circ->n_mux)
     circuitmux_clear_num_cells(circ->n_mux, circ);
   if (! CIRCUIT_IS_ORIGIN(circ)) {
     or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    n_bytes += cell_queue_get_allocation(&orcirc->p_chan_cells);
     cell_queue_clear(&orcirc->p_chan_cells);
     if (orcirc->p_mux)
       circuitmux_clear_num_cells(orcirc->p_mux, circ);
   }
+  circuit_cell_age_index_remove(circ);
+  return n_bytes;
 }
 
 static size_t
@@ -2474,14 +2507,14 @@ STATIC uint32_t
 circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
 {
   uint32_t age = 0;
-  packed_cell_t *cell;
+  const packed_cell_t *cell;
 
-  if (NULL != (cell = TOR_SIMPLEQ_FIRST(&c->n_chan_cells.head)))
+  if (NULL != (cell = cell_queue_peek(&c->n_chan_cells)))
     age = now - cell->inserted_timestamp;
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
-    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
+    if (NULL != (cell = cell_queue_peek(&orcirc->p_chan_cells))) {
       uint32_t age2 = now - cell->inserted_timestamp;
       if (age2 > age)
         return age2;
@@ -2547,6 +2580,7 @@ circuit_max_queued_data_age(const circuit_t *c, uint32_t now)
   }
 }
 
+#ifdef TOR_UNIT_TESTS
 /** Return the age of the oldest cell or stream buffer chunk on the circuit
  * <b>c</b>, where age is taken in timestamp units before the timestamp
  * <b>now</b> */
@@ -2560,6 +2594,115 @@ circuit_max_queued_item_age(const circuit_t *c, uint32_t now)
   else
     return data_age;
 }
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Helper to order circuits_by_cell_age: the circuit whose oldest queued
+ * cell is oldest comes first.  Timestamps are compared as a signed
+ * difference, so this stays correct when the coarse clock wraps, as long as
+ * no cell has been queued for more than about 24 days. */
+static int
+circuits_compare_by_oldest_cell_ts_(const void *a_, const void *b_)
+{
+  const circuit_t *a = a_;
+  const circuit_t *b = b_;
+  int32_t diff = (int32_t)(a->oldest_cell_ts - b->oldest_cell_ts);
+
+  if (diff < 0)
+    return -1;
+  else if (diff == 0)
+    return 0;
+  else
+    return 1;
+}
+
+#define CELL_AGE_IDX_OFFSET offsetof(circuit_t, cell_age_idx)
+
+/** Return true iff <b>circ</b> is in circuits_by_cell_age. */
+static int
+circuit_in_cell_age_index(const circuit_t *circ)
+{
+  return circuits_by_cell_age &&
+    circ->cell_age_idx >= 0 &&
+    circ->cell_age_idx < smartlist_len(circuits_by_cell_age) &&
+    smartlist_get(circuits_by_cell_age, circ->cell_age_idx) == circ;
+}
+
+/** Remove <b>circ</b> from circuits_by_cell_age, if it is there. */
+static void
+circuit_cell_age_index_remove(circuit_t *circ)
+{
+  if (!circuit_in_cell_age_index(circ))
+    return;
+  smartlist_pqueue_remove(circuits_by_cell_age,
+                          circuits_compare_by_oldest_cell_ts_,
+                          CELL_AGE_IDX_OFFSET, circ);
+}
+
+/** Note that a cell with the coarse timestamp <b>inserted_timestamp</b> was
+ * just queued on <b>circ</b>.
+ *
+ * A circuit that already has queued cells keeps its place, since a new cell
+ * is never older than the ones already queued.  Circuits that are not in
+ * the global circuit list are never OOM victims, so we don't track them.
+ * This function is part of the fast path. */
+void
+circuit_note_cell_queued(circuit_t *circ, uint32_t inserted_timestamp)
+{
+  if (circuit_in_cell_age_index(circ))
+    return;
+  if (!global_circuitlist ||
+      circ->global_circuitlist_idx < 0 ||
+      circ->global_circuitlist_idx >= smartlist_len(global_circuitlist) ||
+      smartlist_get(global_circuitlist, circ->global_circuitlist_idx) != circ)
+    return;
+  if (!circuits_by_cell_age)
+    circuits_by_cell_age = smartlist_new();
+  circ->oldest_cell_ts = inserted_timestamp;
+  smartlist_pqueue_add(circuits_by_cell_age,
+                       circuits_compare_by_oldest_cell_ts_,
+                       CELL_AGE_IDX_OFFSET, circ);
+}
+
+/** Note that one or more cells were removed from the queues of <b>circ</b>.
+ *
+ * We only drop the circuit from circuits_by_cell_age once it has no cells
+ * left; otherwise its position goes stale, and circuits_handle_oom() fixes it
+ * up if it ever needs to. This function is part of the fast path. */
+void
+circuit_note_cells_dequeued(circuit_t *circ)
+{
+  if (n_cells_in_circ_queues(circ) == 0)
+    circuit_cell_age_index_remove(circ);
+}
+
+/** Return the circuit whose oldest queued cell is the oldest of all queued
+ * cells, or NULL if no circuit has queued cells.  Requires that <b>now</b>
+ * be the current coarse timestamp.
+ *
+ * The heap positions are only updated when a circuit gains its first cell,
+ * so we refresh the top of the heap until it is accurate.  Each circuit is
+ * refreshed at most once per call to circuits_handle_oom(), because a
+ * refreshed position stays accurate until cells are sent. */
+static circuit_t *
+circuit_cell_age_index_get_oldest(uint32_t now)
+{
+  while (circuits_by_cell_age && smartlist_len(circuits_by_cell_age)) {
+    circuit_t *circ = smartlist_get(circuits_by_cell_age, 0);
+    uint32_t ts;
+
+    if (n_cells_in_circ_queues(circ) == 0) {
+      circuit_cell_age_index_remove(circ);
+      continue;
+    }
+    ts = now - circuit_max_queued_cell_age(circ, now);
+    if (ts == circ->oldest_cell_ts)
+      return circ;
+
+    circuit_cell_age_index_remove(circ);
+    circuit_note_cell_queued(circ, ts);
+  }
+  return NULL;
+}
 
 /** Helper to sort a list of circuit_t by age of oldest item, in descending
  * order. */
@@ -2579,10 +2722,51 @@ circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
     return -1;
 }
 
+/** Return a new list of the circuits that have data queued on the buffers of
+ * their streams, sorted by the age of that data in descending order.  Set the
+ * age_tmp field of each one to that age, in timestamp units before the
+ * timestamp <b>now</b>.
+ *
+ * We find these circuits through the stream connections, so that we don't
+ * have to look at the many circuits that carry no streams at all. */
+static smartlist_t *
+circuits_get_with_queued_stream_data(uint32_t now)
+{
+  static const int stream_types[] = { CONN_TYPE_AP, CONN_TYPE_EXIT };
+  smartlist_t *result = smartlist_new();
+  unsigned i;
+
+  /* Mark every circuit with a stream as not yet visited ... */
+  for (i = 0; i < ARRAY_LENGTH(stream_types); ++i) {
+    smartlist_t *conns = get_connection_array_by_type(stream_types[i]);
+    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+      circuit_t *circ = TO_EDGE_CONN(conn)->on_circuit;
+      if (circ)
+        circ->age_tmp = UINT32_MAX;
+    } SMARTLIST_FOREACH_END(conn);
+  }
+
+  /* ... and then look at each of those circuits once. */
+  for (i = 0; i < ARRAY_LENGTH(stream_types); ++i) {
+    smartlist_t *conns = get_connection_array_by_type(stream_types[i]);
+    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+      circuit_t *circ = TO_EDGE_CONN(conn)->on_circuit;
+      if (!circ || circ->age_tmp != UINT32_MAX)
+        continue;
+      circ->age_tmp = circuit_max_queued_data_age(circ, now);
+      if (circ->age_tmp)
+        smartlist_add(result, circ);
+    } SMARTLIST_FOREACH_END(conn);
+  }
+
+  smartlist_sort(result, circuits_compare_by_oldest_queued_item_);
+  return result;
+}
+
 static uint32_t now_ts_for_buf_cmp;
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
+/** Helper to sort a list of connection_t by age of oldest buffered data, in
+ * descending order. */
 static int
 conns_compare_by_buffer_age_(const void **a_, const void **b_)
 {
@@ -2599,20 +2783,46 @@ conns_compare_by_buffer_age_(const void **a_, const void **b_)
     return -1;
 }
 
+/** Return a new list of the non-linked directory connections, sorted by the
+ * age of their oldest buffered data before the timestamp <b>now</b>, in
+ * descending order. */
+static smartlist_t *
+dirconns_get_sorted_by_buffer_age(uint32_t now)
+{
+  smartlist_t *result = smartlist_new();
+
+  SMARTLIST_FOREACH(get_connection_array_by_type(CONN_TYPE_DIR),
+                    connection_t *, conn,
+                    if (conn->linked_conn == NULL)
+                      smartlist_add(result, conn));
+
+  now_ts_for_buf_cmp = now;
+  smartlist_sort(result, conns_compare_by_buffer_age_);
+  now_ts_for_buf_cmp = 0;
+  return result;
+}
+
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
 
 /** We're out of memory for cells, having allocated <b>current_allocation</b>
  * bytes' worth.  Kill the 'worst' circuits until we're under
- * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage. */
+ * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage.
+ *
+ * The worst circuits are the ones with the oldest queued cells or stream
+ * data.  We take victims in that order from circuits_by_cell_age and from
+ * the circuits that have streams, so the cost is proportional to the number
+ * of victims and streams, not to the number of circuits. */
 void
 circuits_handle_oom(size_t current_allocation)
 {
-  smartlist_t *circlist;
-  smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  smartlist_t *stream_circs;
+  smartlist_t *dirconns;
+  int stream_circ_idx = 0;
+  int dirconn_idx = 0;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
+  size_t n_cells_killed=0;
   int n_dirconns_killed=0;
   uint32_t now_ts;
   log_notice(LD_GENERAL, "We're low on memory (cell queues total alloc:"
@@ -2641,86 +2851,89 @@ circuits_handle_oom(size_t current_allocation)
 
   now_ts = monotime_coarse_get_stamp();
 
-  circlist = circuit_get_global_list();
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->age_tmp = circuit_max_queued_item_age(circ, now_ts);
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
+  stream_circs = circuits_get_with_queued_stream_data(now_ts);
+  dirconns = dirconns_get_sorted_by_buffer_age(now_ts);
 
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
+  while (1) {
+    circuit_t *cell_circ = circuit_cell_age_index_get_oldest(now_ts);
+    circuit_t *data_circ = NULL;
+    circuit_t *circ = NULL;
+    uint32_t age = 0;
+    size_t freed;
 
-  /* Now sort the connection array ... */
-  now_ts_for_buf_cmp = now_ts;
-  smartlist_sort(connection_array, conns_compare_by_buffer_age_);
-  now_ts_for_buf_cmp = 0;
+    /* Skip the stream circuits that we already killed for their cells. */
+    while (stream_circ_idx < smartlist_len(stream_circs)) {
+      data_circ = smartlist_get(stream_circs, stream_circ_idx);
+      if (data_circ->age_tmp)
+        break;
+      data_circ = NULL;
+      ++stream_circ_idx;
+    }
 
-  /* Fix up the connection array to its new order. */
-  SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    conn->conn_array_index = conn_sl_idx;
-  } SMARTLIST_FOREACH_END(conn);
-
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
-  conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
-    size_t freed;
+    /* The worst circuit is whichever of these has the older item. */
+    if (cell_circ) {
+      circ = cell_circ;
+      age = now_ts - cell_circ->oldest_cell_ts;
+    }
+    if (data_circ && (!circ || data_circ->age_tmp > age)) {
+      circ = data_circ;
+      age = data_circ->age_tmp;
+      ++stream_circ_idx;
+    }
 
     /* Free storage in any non-linked directory connections that have buffered
      * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
+    while (dirconn_idx < smartlist_len(dirconns)) {
+      connection_t *conn = smartlist_get(dirconns, dirconn_idx);
       uint32_t conn_age = conn_get_buffer_age(conn, now_ts);
-      if (conn_age < circ->age_tmp) {
+      if (circ && conn_age < age) {
         break;
       }
-      if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
-        if (!conn->marked_for_close)
-          connection_mark_for_close(conn);
-        mem_recovered += single_conn_free_bytes(conn);
+      if (!conn->marked_for_close)
+        connection_mark_for_close(conn);
+      mem_recovered += single_conn_free_bytes(conn);
 
-        ++n_dirconns_killed;
+      ++n_dirconns_killed;
+      ++dirconn_idx;
 
-        if (mem_recovered >= mem_to_recover)
-          goto done_recovering_mem;
-      }
-      ++conn_idx;
+      if (mem_recovered >= mem_to_recover)
+        goto done_recovering_mem;
     }
 
+    if (!circ)
+      break;
+
     /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
+    n_cells_killed += n_cells_in_circ_queues(circ);
     const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
     if (! circ->marked_for_close) {
       circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     }
-    marked_circuit_free_cells(circ);
+    mem_recovered += marked_circuit_free_cells(circ);
     freed = marked_circuit_free_stream_bytes(circ);
+    /* Don't take it again from stream_circs. */
+    circ->age_tmp = 0;
 
     ++n_circuits_killed;
 
-    mem_recovered += n * packed_cell_mem_cost();
     mem_recovered += half_stream_alloc;
     mem_recovered += freed;
 
     if (mem_recovered >= mem_to_recover)
       goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+  }
 
  done_recovering_mem:
+  smartlist_free(stream_circs);
+  smartlist_free(dirconns);
 
-  log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
-             "%d circuits remain alive. Also killed %d non-linked directory "
-             "connections.",
+  log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits "
+             "with %"TOR_PRIuSZ" queued cells; %d circuits remain alive. "
+             "Also killed %d non-linked directory connections.",
              mem_recovered,
              n_circuits_killed,
-             smartlist_len(circlist) - n_circuits_killed,
+             n_cells_killed,
+             smartlist_len(circuit_get_global_list()) - n_circuits_killed,
              n_dirconns_killed);
 }
 
@@ -229,6 +229,8 @@ void assert_cpath_layer_ok(const crypt_path_t *cp);
 MOCK_DECL(void, assert_circuit_ok,(const circuit_t *c));
 void circuit_free_all(void);
 void circuits_handle_oom(size_t current_allocation);
+void circuit_note_cell_queued(circuit_t *circ, uint32_t inserted_timestamp);
+void circuit_note_cells_dequeued(circuit_t *circ);
 
 void circuit_clear_testing_cell_stats(circuit_t *circ);
 
@@ -244,7 +246,9 @@ STATIC void circuit_free_(circuit_t *circ);
 STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
+#ifdef TOR_UNIT_TESTS
 STATIC uint32_t circuit_max_queued_item_age(const circuit_t *c, uint32_t now);
+#endif
 #endif /* defined(CIRCUITLIST_PRIVATE) */
 
 #endif /* !defined(TOR_CIRCUITLIST_H) */
@@ -1059,10 +1059,10 @@ connection_ap_expire_beginning(void)
   int severity;
   int cutoff;
   int seconds_idle, seconds_since_born;
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
-    if (base_conn->type != CONN_TYPE_AP || base_conn->marked_for_close)
+    if (base_conn->marked_for_close)
       continue;
     entry_conn = TO_ENTRY_CONN(base_conn);
     conn = ENTRY_TO_EDGE_CONN(entry_conn);
@@ -1176,14 +1176,13 @@ void
 connection_ap_rescan_and_attach_pending(void)
 {
   entry_connection_t *entry_conn;
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
 
   if (PREDICT_UNLIKELY(NULL == pending_entry_connections))
     pending_entry_connections = smartlist_new();
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
 
@@ -1378,10 +1377,9 @@ connection_ap_fail_onehop(const char *failed_digest,
 {
   entry_connection_t *entry_conn;
   char digest[DIGEST_LEN];
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
     entry_conn = TO_ENTRY_CONN(conn);
@@ -1419,10 +1417,9 @@ circuit_discard_optional_exit_enclaves(extend_info_t *info)
   entry_connection_t *entry_conn;
   const node_t *r1, *r2;
 
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
     entry_conn = TO_ENTRY_CONN(conn);
@@ -4114,7 +4111,6 @@ connection_exit_connect_dir(edge_connection_t *exitconn)
   tor_addr_copy(&dirconn->base_.addr, &exitconn->base_.addr);
   dirconn->base_.port = 0;
   dirconn->base_.address = tor_strdup(exitconn->base_.address);
-  dirconn->base_.type = CONN_TYPE_DIR;
   dirconn->base_.purpose = DIR_PURPOSE_SERVER;
   dirconn->base_.state = DIR_CONN_STATE_SERVER_COMMAND_WAIT;
 
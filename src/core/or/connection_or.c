@@ -129,13 +129,9 @@ connection_or_clear_identity(or_connection_t *conn)
 void
 connection_or_clear_identity_map(void)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_OR);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->type == CONN_TYPE_OR) {
-      connection_or_clear_identity(TO_OR_CONN(conn));
-    }
-  });
+                    connection_or_clear_identity(TO_OR_CONN(conn)));
 }
 
 /** Change conn->identity_digest to digest, and add conn into
@@ -2233,6 +2229,9 @@ connection_or_set_state_open(or_connection_t *conn)
   or_handshake_state_free(conn->handshake_state);
   conn->handshake_state = NULL;
   connection_start_reading(TO_CONN(conn));
+  /* Housekeeping slept until the handshake timeout; now it has keepalives
+   * and padding to think about. */
+  connection_reschedule_housekeeping(TO_CONN(conn));
 
   return 0;
 }
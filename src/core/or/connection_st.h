@@ -8,6 +8,7 @@
 #define CONNECTION_ST_H
 
 struct buf_t;
+struct timeout;
 
 /* Values for connection_t.magic: used to make sure that downcasts (casts from
 * connection_t to foo_connection_t) are safe. */
@@ -87,9 +88,14 @@ struct connection_t {
    * or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  int conn_type_array_index; /**< Index into the list of connections of this
+                              * type; see get_connection_array_by_type(). */
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
+  /** Timer that runs run_connection_housekeeping() for this connection, if
+   * it is an OR or directory connection. */
+  struct timeout *housekeeping_timer;
   struct buf_t *inbuf; /**< Buffer holding data read over this connection. */
   struct buf_t *outbuf; /**< Buffer holding data to write over this
                          * connection. */
@@ -580,13 +580,12 @@ dos_geoip_entry_about_to_free(const clientmap_entry_t *geoip_ent)
   /* For each connection matching the geoip entry address, we'll clear the
    * tracked flag because the entry is about to get removed from the geoip
    * cache. We do not try to decrement if the flag is not set. */
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
-    if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      if (!tor_addr_compare(&geoip_ent->addr, &or_conn->real_addr,
-                            CMP_EXACT)) {
-        or_conn->tracked_for_dos_mitigation = 0;
-      }
+  SMARTLIST_FOREACH_BEGIN(get_connection_array_by_type(CONN_TYPE_OR),
+                          connection_t *, conn) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    if (!tor_addr_compare(&geoip_ent->addr, &or_conn->real_addr,
+                          CMP_EXACT)) {
+      or_conn->tracked_for_dos_mitigation = 0;
     }
   } SMARTLIST_FOREACH_END(conn);
 
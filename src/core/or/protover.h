@@ -29,6 +29,11 @@ struct smartlist_t;
 /** The protover version number that signifies HSv3 rendezvous point support */
 #define PROTOVER_HS_RENDEZVOUS_POINT_V3 2
 
+/** Maximum allowed length of any single subprotocol name. */
+/// C_RUST_COUPLED: src/rust/protover/protover.rs
+///                 `MAX_PROTOCOL_NAME_LENGTH`
+#define MAX_PROTOCOL_NAME_LENGTH 100U
+
 /** List of recognized subprotocols. */
 /// C_RUST_COUPLED: src/rust/protover/ffi.rs `translate_to_rust`
 /// C_RUST_COUPLED: src/rust/protover/protover.rs `Proto`
@@ -184,6 +184,7 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
     if (circ->n_chan->channel_usage == CHANNEL_USED_FOR_FULL_CIRCS &&
         cell->command == CELL_RELAY) {
       circ->n_chan->channel_usage = CHANNEL_USED_FOR_USER_TRAFFIC;
+      channel_note_housekeeping_needed(circ->n_chan);
     }
   } else {
     /* If we're a relay circuit, the question is more complicated. Basically:
@@ -205,9 +206,13 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
       if (cell->command == CELL_RELAY_EARLY) {
         if (or_circ->p_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS) {
           or_circ->p_chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+          channel_note_housekeeping_needed(or_circ->p_chan);
         }
-      } else if (cell->command == CELL_RELAY) {
+      } else if (cell->command == CELL_RELAY &&
+                 or_circ->p_chan->channel_usage !=
+                 CHANNEL_USED_FOR_USER_TRAFFIC) {
         or_circ->p_chan->channel_usage = CHANNEL_USED_FOR_USER_TRAFFIC;
+        channel_note_housekeeping_needed(or_circ->p_chan);
       }
     }
   }
@@ -2392,14 +2397,26 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
   }
 }
 
-/** The total number of cells we have allocated. */
-static size_t total_cells_allocated = 0;
+/** The total number of bytes we have allocated for cells: both standalone
+ * packed cells, and every cell queue chunk, header included. */
+static size_t total_cell_bytes_allocated = 0;
+
+/** The smallest and largest number of cells we allocate room for in a new
+ * cell queue chunk.  In between, a new chunk gets room for as many cells as
+ * its queue already holds, so a growing queue doubles its room with each
+ * chunk until the chunks reach the largest size. */
+#define CELL_QUEUE_CHUNK_MIN_CELLS 2
+#define CELL_QUEUE_CHUNK_MAX_CELLS 16
+/** Return the number of bytes needed for a cell queue chunk that can hold
+ * <b>n</b> cells. */
+#define CELL_QUEUE_CHUNK_ALLOC_SIZE(n) \
+  (offsetof(cell_queue_chunk_t, cells) + (n) * sizeof(packed_cell_t))
 
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
-  --total_cells_allocated;
+  total_cell_bytes_allocated -= sizeof(packed_cell_t);
   tor_free(cell);
 }
 
@@ -2407,7 +2424,7 @@ packed_cell_free_unchecked(packed_cell_t *cell)
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
-  ++total_cells_allocated;
+  total_cell_bytes_allocated += sizeof(packed_cell_t);
   return tor_malloc_zero(sizeof(packed_cell_t));
 }
 
@@ -2427,52 +2444,90 @@ dump_cell_pool_usage(int severity)
 {
   int n_circs = 0;
   int n_cells = 0;
+  size_t n_slots = 0, n_bytes = 0;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     n_cells += c->n_chan_cells.n;
-    if (!CIRCUIT_IS_ORIGIN(c))
-      n_cells += TO_OR_CIRCUIT(c)->p_chan_cells.n;
+    n_slots += cell_queue_get_capacity(&c->n_chan_cells);
+    n_bytes += cell_queue_get_allocation(&c->n_chan_cells);
+    if (!CIRCUIT_IS_ORIGIN(c)) {
+      const cell_queue_t *p_cells = &TO_OR_CIRCUIT(c)->p_chan_cells;
+      n_cells += p_cells->n;
+      n_slots += cell_queue_get_capacity(p_cells);
+      n_bytes += cell_queue_get_allocation(p_cells);
+    }
     ++n_circs;
   }
   SMARTLIST_FOREACH_END(c);
   tor_log(severity, LD_MM,
-          "%d cells allocated on %d circuits. %d cells leaked.",
-          n_cells, n_circs, (int)total_cells_allocated - n_cells);
+          "%d cells allocated on %d circuits, in room for %d cells "
+          "(%"TOR_PRIuSZ" bytes). %"TOR_PRIuSZ" bytes of cells leaked.",
+          n_cells, n_circs, (int)n_slots, n_bytes,
+          total_cell_bytes_allocated - n_bytes);
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
-static inline packed_cell_t *
-packed_cell_copy(const cell_t *cell, int wide_circ_ids)
+/** Allocate a new chunk with room for <b>capacity</b> cells. */
+static cell_queue_chunk_t *
+cell_queue_chunk_new(int capacity)
 {
-  packed_cell_t *c = packed_cell_new();
-  cell_pack(c, cell, wide_circ_ids);
-  return c;
+  cell_queue_chunk_t *chunk =
+    tor_malloc(CELL_QUEUE_CHUNK_ALLOC_SIZE(capacity));
+  chunk->next = NULL;
+  chunk->capacity = capacity;
+  chunk->first = chunk->end = 0;
+  total_cell_bytes_allocated += CELL_QUEUE_CHUNK_ALLOC_SIZE(capacity);
+  return chunk;
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
-void
-cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
+/** Release storage held by <b>chunk</b>, and every cell in it. */
+static void
+cell_queue_chunk_free(cell_queue_chunk_t *chunk)
 {
-  TOR_SIMPLEQ_INSERT_TAIL(&queue->head, cell, next);
+  total_cell_bytes_allocated -= CELL_QUEUE_CHUNK_ALLOC_SIZE(chunk->capacity);
+  tor_free(chunk);
+}
+
+/** Return a pointer to a new, uninitialized cell at the end of <b>queue</b>.
+ * The caller must fill it in before anything else uses the queue. */
+static packed_cell_t *
+cell_queue_append_slot(cell_queue_t *queue)
+{
+  cell_queue_chunk_t *tail = queue->tail;
+
+  if (!tail || tail->end == tail->capacity) {
+    /* Size new chunks after the queue, so that short queues waste little
+     * room, and long ones need few allocations. */
+    const int capacity = CLAMP(CELL_QUEUE_CHUNK_MIN_CELLS, queue->n,
+                               CELL_QUEUE_CHUNK_MAX_CELLS);
+    cell_queue_chunk_t *chunk = cell_queue_chunk_new(capacity);
+    if (tail)
+      tail->next = chunk;
+    else
+      queue->head = chunk;
+    queue->tail = tail = chunk;
+  }
+
   ++queue->n;
+  return &tail->cells[tail->end++];
 }
 
 /** Append a newly allocated copy of <b>cell</b> to the end of the
  * <b>exitward</b> (or app-ward) <b>queue</b> of <b>circ</b>.  If
- * <b>use_stats</b> is true, record statistics about the cell.
+ * <b>use_stats</b> is true, record statistics about the cell.  If
+ * <b>circ</b> is NULL, the queue does not belong to any circuit.
  */
 void
 cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                               int exitward, const cell_t *cell,
                               int wide_circ_ids, int use_stats)
 {
-  packed_cell_t *copy = packed_cell_copy(cell, wide_circ_ids);
-  (void)circ;
+  packed_cell_t *copy = cell_queue_append_slot(queue);
   (void)exitward;
   (void)use_stats;
 
+  cell_pack(copy, cell, wide_circ_ids);
   copy->inserted_timestamp = monotime_coarse_get_stamp();
-
-  cell_queue_append(queue, copy);
+  if (circ)
+    circuit_note_cell_queued(circ, copy->inserted_timestamp);
 }
 
 /** Initialize <b>queue</b> as an empty cell queue. */
@@ -2480,34 +2535,92 @@ void
 cell_queue_init(cell_queue_t *queue)
 {
   memset(queue, 0, sizeof(cell_queue_t));
-  TOR_SIMPLEQ_INIT(&queue->head);
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell;
-  while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
-    TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    packed_cell_free_unchecked(cell);
+  cell_queue_chunk_t *chunk, *next;
+  for (chunk = queue->head; chunk; chunk = next) {
+    next = chunk->next;
+    cell_queue_chunk_free(chunk);
   }
-  TOR_SIMPLEQ_INIT(&queue->head);
+  queue->head = queue->tail = NULL;
   queue->n = 0;
 }
 
-/** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
+/** Return the cell at the head of <b>queue</b>, or NULL if <b>queue</b> is
+ * empty.  The cell stays in the queue. */
+packed_cell_t *
+cell_queue_peek(const cell_queue_t *queue)
+{
+  const cell_queue_chunk_t *head = queue->head;
+  if (!head)
+    return NULL;
+  return (packed_cell_t *) &head->cells[head->first];
+}
+
+/** Remove and free the cell at the head of the nonempty <b>queue</b>. */
+void
+cell_queue_drop_first(cell_queue_t *queue)
+{
+  cell_queue_chunk_t *head = queue->head;
+  tor_assert(head);
+  tor_assert(head->first < head->end);
+
+  --queue->n;
+  if (++head->first == head->end) {
+    /* Either the chunk is full and we've sent all of it, or it's the tail
+     * and the queue is now empty.  Either way, nothing more will be added
+     * to it. */
+    queue->head = head->next;
+    if (queue->tail == head)
+      queue->tail = NULL;
+    cell_queue_chunk_free(head);
+  }
+}
+
+/** Return the number of cells we have allocated room for in <b>queue</b>.
+ * This is never less than <b>queue</b>-&gt;n. */
+size_t
+cell_queue_get_capacity(const cell_queue_t *queue)
+{
+  const cell_queue_chunk_t *chunk;
+  size_t n = 0;
+  for (chunk = queue->head; chunk; chunk = chunk->next)
+    n += chunk->capacity;
+  return n;
+}
+
+/** Return the number of bytes we have allocated for the chunks of
+ * <b>queue</b>, headers included. */
+size_t
+cell_queue_get_allocation(const cell_queue_t *queue)
+{
+  const cell_queue_chunk_t *chunk;
+  size_t n = 0;
+  for (chunk = queue->head; chunk; chunk = chunk->next)
+    n += CELL_QUEUE_CHUNK_ALLOC_SIZE(chunk->capacity);
+  return n;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Extract and return a newly allocated copy of the cell at the head of
+ * <b>queue</b>; return NULL if <b>queue</b> is empty. */
 STATIC packed_cell_t *
 cell_queue_pop(cell_queue_t *queue)
 {
-  packed_cell_t *cell = TOR_SIMPLEQ_FIRST(&queue->head);
-  if (!cell)
+  packed_cell_t *head = cell_queue_peek(queue);
+  packed_cell_t *cell;
+  if (!head)
     return NULL;
-  TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-  --queue->n;
+  cell = packed_cell_new();
+  memcpy(cell, head, sizeof(packed_cell_t));
+  cell_queue_drop_first(queue);
   return cell;
 }
+#endif /* defined(TOR_UNIT_TESTS) */
 
 /** Initialize <b>queue</b> as an empty cell queue. */
 void
@@ -2575,19 +2688,21 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   return packed;
 }
 
-/** Return the total number of bytes used for each packed_cell in a queue.
- * Approximate. */
+/** Return the total number of bytes used for each packed_cell, not counting
+ * the header of the cell queue chunk that holds it.  Approximate. */
 size_t
 packed_cell_mem_cost(void)
 {
   return sizeof(packed_cell_t);
 }
 
-/* DOCDOC */
+/** Return the number of bytes allocated for cells: both standalone packed
+ * cells, and every cell queue chunk, counted by capacity rather than by how
+ * many cells it holds right now. */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return total_cell_bytes_allocated;
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2865,7 +2980,7 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * selection, so we have to loop around for another even if this circuit
      * has more than one.
      */
-    cell = cell_queue_pop(queue);
+    cell = cell_queue_peek(queue);
 
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics ||
@@ -2897,27 +3012,25 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
       }
     }
 
-    /* If we just flushed our queue and this circuit is used for a
+    /* If we're about to flush our queue and this circuit is used for a
      * tunneled directory request, possibly advance its state. */
-    if (queue->n == 0 && chan->dirreq_id)
+    if (queue->n == 1 && chan->dirreq_id)
       geoip_change_dirreq_state(chan->dirreq_id,
                                 DIRREQ_TUNNELED,
                                 DIRREQ_CIRC_QUEUE_FLUSHED);
 
-    /* Now send the cell. It is very unlikely that this fails but just in
-     * case, get rid of the channel. */
-    if (channel_write_packed_cell(chan, cell) < 0) {
-      /* The cell has been freed at this point. */
+    /* Now send the cell straight out of the queue's storage, and only then
+     * remove it. It is very unlikely that sending fails but just in case,
+     * get rid of the channel. */
+    int write_failed = channel_write_packed_cell_no_free(chan, cell) < 0;
+    cell_queue_drop_first(queue);
+    cell = NULL;
+    if (queue->n == 0)
+      circuit_note_cells_dequeued(circ);
+    if (write_failed) {
       channel_mark_for_close(chan);
       continue;
     }
-    cell = NULL;
-
-    /*
-     * Don't packed_cell_free_unchecked(cell) here because the channel will
-     * do so when it gets out of the channel queue (probably already did, in
-     * which case that was an immediate double-free bug).
-     */
 
     /* Update the counter */
     ++n_flushed;
@@ -3149,6 +3262,7 @@ circuit_clear_cell_queue(circuit_t *circ, channel_t *chan)
 
   /* Clear the queue */
   cell_queue_clear(queue);
+  circuit_note_cells_dequeued(circ);
 
   /* Update the cell counter in the cmux */
   if (chan->cmux && circuitmux_is_circuit_attached(chan->cmux, circ))
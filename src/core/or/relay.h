@@ -60,7 +60,10 @@ void packed_cell_free_(packed_cell_t *cell);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
-void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+packed_cell_t *cell_queue_peek(const cell_queue_t *queue);
+void cell_queue_drop_first(cell_queue_t *queue);
+size_t cell_queue_get_capacity(const cell_queue_t *queue);
+size_t cell_queue_get_allocation(const cell_queue_t *queue);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
@@ -111,7 +114,9 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
 STATIC packed_cell_t *packed_cell_new(void);
+#ifdef TOR_UNIT_TESTS
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+#endif
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC int cell_queues_check_size(void);
 STATIC int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
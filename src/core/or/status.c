@@ -31,6 +31,10 @@
 #include "feature/hs/hs_service.h"
 #include "core/or/dos.h"
 #include "feature/stats/geoip_stats.h"
+#include "feature/dircache/respcache.h"
+#include "feature/dirauth/authmode.h"
+#include "feature/dirauth/process_descs.h"
+#include "feature/dirauth/reachability.h"
 
 #include "app/config/or_state_st.h"
 #include "feature/nodelist/routerinfo_st.h"
@@ -177,6 +181,14 @@ log_heartbeat(time_t now)
 
   circuit_log_ancient_one_hop_circuits(1800);
 
+  if (dir_server_mode(options))
+    respcache_log_heartbeat();
+
+  if (authdir_mode(options))
+    dirserv_log_upload_heartbeat();
+  if (authdir_mode_tests_reachability(options))
+    dirserv_reachability_log_heartbeat();
+
   if (options->BridgeRelay) {
     char *msg = NULL;
     msg = format_client_stats_heartbeat(now);
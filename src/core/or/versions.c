@@ -420,3 +420,32 @@ summarize_protover_flags(protover_summary_flags_t *out,
     }
   }
 }
+
+/** Return true if summarize_protover_flags() might log a warning about
+ * <b>protocols</b>, because some entry in it has an overlong name.  Unlike
+ * summarize_protover_flags(), this function never logs, so it is safe to
+ * call from any thread.
+ */
+int
+summarize_protover_flags_would_warn(const char *protocols)
+{
+  const char *s = protocols;
+  if (!s)
+    return 0;
+
+  while (*s) {
+    const char *end_of_entry = strchr(s, ' ');
+    const char *equals;
+    if (!end_of_entry)
+      end_of_entry = s + strlen(s);
+
+    equals = memchr(s, '=', end_of_entry - s);
+    if (equals && equals - s > (int)MAX_PROTOCOL_NAME_LENGTH)
+      return 1;
+
+    s = end_of_entry;
+    while (*s == ' ')
+      ++s;
+  }
+  return 0;
+}
@@ -40,5 +40,6 @@ void sort_version_list(smartlist_t *lst, int remove_duplicates);
 void summarize_protover_flags(protover_summary_flags_t *out,
                               const char *protocols,
                               const char *version);
+int summarize_protover_flags_would_warn(const char *protocols);
 
 #endif /* !defined(TOR_VERSIONS_H) */
@@ -65,8 +65,9 @@ typedef struct mbw_cache_entry_s {
 static digestmap_t *mbw_cache = NULL;
 
 /** Store a measured bandwidth cache entry when reading the measured
- * bandwidths file. */
-STATIC void
+ * bandwidths file.  Return 1 if we added the entry or changed its
+ * bandwidth, and 0 otherwise. */
+STATIC int
 dirserv_cache_measured_bw(const measured_bw_line_t *parsed_line,
                           time_t as_of)
 {
@@ -83,15 +84,19 @@ dirserv_cache_measured_bw(const measured_bw_line_t *parsed_line,
   if (e) {
     /* Check that we really are newer, and update */
     if (as_of > e->as_of) {
+      const int changed = (e->mbw_kb != parsed_line->bw_kb);
       e->mbw_kb = parsed_line->bw_kb;
       e->as_of = as_of;
+      return changed;
     }
+    return 0;
   } else {
     /* We'll have to insert a new entry */
     e = tor_malloc(sizeof(*e));
     e->mbw_kb = parsed_line->bw_kb;
     e->as_of = as_of;
     digestmap_set(mbw_cache, parsed_line->node_id, e);
+    return 1;
   }
 }
 
@@ -209,6 +214,7 @@ dirserv_read_measured_bandwidths(const char *from_file,
 {
   FILE *fp = tor_fopen_cloexec(from_file, "r");
   int applied_lines = 0;
+  int changed_lines = 0;
   time_t file_time, now;
   int ok;
    /* This flag will be 1 only when the first successful bw measurement line
@@ -273,7 +279,8 @@ dirserv_read_measured_bandwidths(const char *from_file,
          * has been encountered, which means the end of the header lines. */
         line_is_after_headers = 1;
         /* Also cache the line for dirserv_get_bandwidth_for_router() */
-        dirserv_cache_measured_bw(&parsed_line, file_time);
+        if (dirserv_cache_measured_bw(&parsed_line, file_time))
+          changed_lines++;
         if (measured_bw_line_apply(&parsed_line, routerstatuses) > 0)
           applied_lines++;
       /* if the terminator is found, it is the end of header lines, set the
@@ -302,7 +309,8 @@ dirserv_read_measured_bandwidths(const char *from_file,
 
   log_info(LD_DIRSERV,
            "Bandwidth measurement file successfully read. "
-           "Applied %d measurements.", applied_lines);
+           "Applied %d measurements; %d cached measurements changed.",
+           applied_lines, changed_lines);
   rv = 0;
 
  err:
@@ -332,95 +340,99 @@ STATIC int
 measured_bw_line_parse(measured_bw_line_t *out, const char *orig_line,
                        int line_is_after_headers)
 {
-  char *line = tor_strdup(orig_line);
-  char *cp = line;
+  /* We look at the tokens where they are in orig_line, rather than copying
+   * the line and splitting it, since we do this for every relay in the
+   * file. */
+  const size_t len = strlen(orig_line);
+  const char *eol = orig_line + len;
+  const char *cp;
+  size_t tok_len;
   int got_bw = 0;
   int got_node_id = 0;
-  char *strtok_state; /* lame sauce d'jour */
 
-  if (strlen(line) == 0) {
+  if (len == 0) {
     log_warn(LD_DIRSERV, "Empty line in bandwidth file");
-    tor_free(line);
     return -1;
   }
 
-  /* Remove end of line character, so that is not part of the token */
-  if (line[strlen(line) - 1] == '\n') {
-    line[strlen(line) - 1] = '\0';
-  }
+  /* The end of line character is not part of the last token. */
+  if (eol[-1] == '\n')
+    --eol;
 
-  cp = tor_strtok_r(cp, " \t", &strtok_state);
-
-  if (!cp) {
+  cp = orig_line + strspn(orig_line, " \t");
+  if (cp >= eol) {
     log_warn(LD_DIRSERV, "Invalid line in bandwidth file: %s",
              escaped(orig_line));
-    tor_free(line);
     return -1;
   }
 
-  if (orig_line[strlen(orig_line)-1] != '\n') {
+  if (orig_line[len-1] != '\n') {
     log_warn(LD_DIRSERV, "Incomplete line in bandwidth file: %s",
              escaped(orig_line));
-    tor_free(line);
     return -1;
   }
 
   do {
-    if (strcmpstart(cp, "bw=") == 0) {
+    tok_len = strcspn(cp, " \t");
+    if (tok_len > (size_t)(eol - cp))
+      tok_len = eol - cp;
+
+    if (tok_len >= strlen("bw=") && strcmpstart(cp, "bw=") == 0) {
       int parse_ok = 0;
       char *endptr;
       if (got_bw) {
         log_warn(LD_DIRSERV, "Double bw= in bandwidth file line: %s",
                  escaped(orig_line));
-        tor_free(line);
         return -1;
       }
-      cp+=strlen("bw=");
 
-      out->bw_kb = tor_parse_long(cp, 10, 0, LONG_MAX, &parse_ok, &endptr);
-      if (!parse_ok || (*endptr && !TOR_ISSPACE(*endptr))) {
+      /* Don't let tor_parse_long() skip over the separator to the next
+       * token. */
+      if (tok_len > strlen("bw="))
+        out->bw_kb = tor_parse_long(cp + strlen("bw="), 10, 0, LONG_MAX,
+                                    &parse_ok, &endptr);
+      if (!parse_ok || (endptr < cp + tok_len && !TOR_ISSPACE(*endptr))) {
         log_warn(LD_DIRSERV, "Invalid bandwidth in bandwidth file line: %s",
                  escaped(orig_line));
-        tor_free(line);
         return -1;
       }
       got_bw=1;
-    } else if (strcmpstart(cp, "node_id=$") == 0) {
+    } else if (tok_len >= strlen("node_id=$") &&
+               strcmpstart(cp, "node_id=$") == 0) {
+      const char *hex = cp + strlen("node_id=$");
       if (got_node_id) {
         log_warn(LD_DIRSERV, "Double node_id= in bandwidth file line: %s",
                  escaped(orig_line));
-        tor_free(line);
         return -1;
       }
-      cp+=strlen("node_id=$");
 
-      if (strlen(cp) != HEX_DIGEST_LEN ||
+      if (tok_len - strlen("node_id=$") != HEX_DIGEST_LEN ||
           base16_decode(out->node_id, DIGEST_LEN,
-                        cp, HEX_DIGEST_LEN) != DIGEST_LEN) {
+                        hex, HEX_DIGEST_LEN) != DIGEST_LEN) {
         log_warn(LD_DIRSERV, "Invalid node_id in bandwidth file line: %s",
                  escaped(orig_line));
-        tor_free(line);
         return -1;
       }
-      strlcpy(out->node_hex, cp, sizeof(out->node_hex));
+      memcpy(out->node_hex, hex, HEX_DIGEST_LEN);
+      out->node_hex[HEX_DIGEST_LEN] = '\0';
       got_node_id=1;
     }
-  } while ((cp = tor_strtok_r(NULL, " \t", &strtok_state)));
+
+    cp += tok_len;
+    cp += strspn(cp, " \t");
+  } while (cp < eol);
 
   if (got_bw && got_node_id) {
-    tor_free(line);
     return 0;
   } else if (line_is_after_headers == 0) {
     /* There could be additional header lines, therefore do not give warnings
      * but returns -1 since it's not a complete bw line. */
     log_debug(LD_DIRSERV, "Missing bw or node_id in bandwidth file line: %s",
              escaped(orig_line));
-    tor_free(line);
     return -1;
   } else {
     log_warn(LD_DIRSERV, "Incomplete line in bandwidth file: %s",
              escaped(orig_line));
-    tor_free(line);
     return -1;
   }
 }
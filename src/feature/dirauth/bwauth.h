@@ -50,8 +50,8 @@ STATIC int measured_bw_line_parse(measured_bw_line_t *out, const char *line,
 STATIC int measured_bw_line_apply(measured_bw_line_t *parsed_line,
                            smartlist_t *routerstatuses);
 
-STATIC void dirserv_cache_measured_bw(const measured_bw_line_t *parsed_line,
-                               time_t as_of);
+STATIC int dirserv_cache_measured_bw(const measured_bw_line_t *parsed_line,
+                                     time_t as_of);
 STATIC void dirserv_expire_measured_bw_cache(time_t now);
 #endif /* defined(BWAUTH_PRIVATE) */
 
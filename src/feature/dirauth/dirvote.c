@@ -6,6 +6,7 @@
 #define DIRVOTE_PRIVATE
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/policies.h"
 #include "core/or/protover.h"
 #include "core/or/tor_version_st.h"
@@ -713,9 +714,13 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
                                                   compare_orports_);
     if (most_alt_orport) {
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
+      char addrbuf[TOR_ADDR_BUF_LEN];
+      /* Not fmt_addrport(): we might be in a cpuworker. */
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%u",
                 most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+                tor_addr_to_str(addrbuf, &most_alt_orport->addr,
+                                sizeof(addrbuf), 1),
+                most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -1457,6 +1462,576 @@ compute_nth_protocol_set(int n, int n_voters, const smartlist_t *votes)
   return result;
 }
 
+/** Everything that consensus_entry_compute() needs to know about the votes
+ * and the consensus that we're making.  None of it changes while we compute
+ * the entries, so any number of threads can share it. */
+typedef struct consensus_entry_ctx_t {
+  const smartlist_t *votes;
+  /** The flags that any vote knows about, sorted. */
+  const smartlist_t *flags;
+  dircollator_t *collator;
+  int total_authorities;
+  int consensus_method;
+  consensus_flavor_t flavor;
+  routerstatus_format_type_t rs_format;
+  uint32_t max_unmeasured_bw_kb;
+  int n_authorities_measuring_bandwidth;
+  /** See the locals of the same names in networkstatus_compute_consensus().
+   */
+  const int *n_voter_flags;
+  const int *n_flag_voters;
+  int * const *flag_map;
+  const int *named_flag;
+  const strmap_t *name_to_id_map;
+} consensus_entry_ctx_t;
+
+/** What we decided about one router while computing a consensus. */
+typedef struct consensus_entry_t {
+  /** The text of the router's entry in the consensus, or NULL if we don't
+   * list it. */
+  char *text;
+  /** True iff the router counts towards the bandwidth weights; if so, the
+   * router's status and its flags for the weights. */
+  unsigned int counts_for_weights : 1;
+  unsigned int is_exit : 1;
+  unsigned int is_guard : 1;
+  routerstatus_t rs;
+} consensus_entry_t;
+
+/** Scratch space for consensus_entry_compute(), so that we don't need to
+ * allocate it again for every router.  Each thread needs its own. */
+typedef struct consensus_entry_scratch_t {
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  smartlist_t *matching_descs;
+  smartlist_t *chosen_flags;
+  smartlist_t *versions;
+  smartlist_t *protocols;
+  smartlist_t *exitsummaries;
+  uint32_t *bandwidths_kb;
+  uint32_t *measured_bws_kb;
+  uint32_t *measured_guardfraction;
+} consensus_entry_scratch_t;
+
+/** Allocate and return scratch space for computing entries with
+ * <b>ctx</b>. */
+static consensus_entry_scratch_t *
+consensus_entry_scratch_new(const consensus_entry_ctx_t *ctx)
+{
+  consensus_entry_scratch_t *sc =
+    tor_malloc_zero(sizeof(consensus_entry_scratch_t));
+  const int n_votes = smartlist_len(ctx->votes);
+  sc->flag_counts = tor_calloc(smartlist_len(ctx->flags), sizeof(int));
+  sc->matching_descs = smartlist_new();
+  sc->chosen_flags = smartlist_new();
+  sc->versions = smartlist_new();
+  sc->protocols = smartlist_new();
+  sc->exitsummaries = smartlist_new();
+  sc->bandwidths_kb = tor_calloc(n_votes, sizeof(uint32_t));
+  sc->measured_bws_kb = tor_calloc(n_votes, sizeof(uint32_t));
+  sc->measured_guardfraction = tor_calloc(n_votes, sizeof(uint32_t));
+  return sc;
+}
+
+/** Release all storage held by <b>sc</b>. */
+static void
+consensus_entry_scratch_free(consensus_entry_scratch_t *sc)
+{
+  if (!sc)
+    return;
+  tor_free(sc->flag_counts);
+  smartlist_free(sc->matching_descs);
+  smartlist_free(sc->chosen_flags);
+  smartlist_free(sc->versions);
+  smartlist_free(sc->protocols);
+  smartlist_free(sc->exitsummaries);
+  tor_free(sc->bandwidths_kb);
+  tor_free(sc->measured_bws_kb);
+  tor_free(sc->measured_guardfraction);
+  tor_free(sc);
+}
+
+/** Decide what the consensus described by <b>ctx</b> says about the router
+ * at position <b>idx</b> in its collator, and store the result in
+ * <b>out</b>, which must be zeroed.  Uses <b>sc</b> for scratch space.
+ *
+ * Doesn't touch any global state, so that we can compute different entries
+ * in different threads at once. */
+static void
+consensus_entry_compute(const consensus_entry_ctx_t *ctx,
+                        consensus_entry_scratch_t *sc,
+                        int idx, consensus_entry_t *out)
+{
+  const smartlist_t *votes = ctx->votes;
+  const smartlist_t *flags = ctx->flags;
+  const int total_authorities = ctx->total_authorities;
+  const int consensus_method = ctx->consensus_method;
+  const consensus_flavor_t flavor = ctx->flavor;
+  const int *n_voter_flags = ctx->n_voter_flags;
+  const int *n_flag_voters = ctx->n_flag_voters;
+  int * const *flag_map = ctx->flag_map;
+  const int *named_flag = ctx->named_flag;
+  int *flag_counts = sc->flag_counts;
+  smartlist_t *matching_descs = sc->matching_descs;
+  smartlist_t *chosen_flags = sc->chosen_flags;
+  smartlist_t *versions = sc->versions;
+  smartlist_t *protocols = sc->protocols;
+  smartlist_t *exitsummaries = sc->exitsummaries;
+  uint32_t *bandwidths_kb = sc->bandwidths_kb;
+  uint32_t *measured_bws_kb = sc->measured_bws_kb;
+  uint32_t *measured_guardfraction = sc->measured_guardfraction;
+  smartlist_t *chunks;
+
+  vote_routerstatus_t **vrs_lst =
+    dircollator_get_votes_for_router(ctx->collator, idx);
+
+  vote_routerstatus_t *rs;
+  routerstatus_t rs_out;
+  const char *current_rsa_id = NULL;
+  const char *chosen_version;
+  const char *chosen_protocol_list;
+  const char *chosen_name = NULL;
+  int exitsummary_disagreement = 0;
+  int is_named = 0, is_unnamed = 0, is_running = 0, is_valid = 0;
+  int is_guard = 0, is_exit = 0, is_bad_exit = 0;
+  int naming_conflict = 0;
+  int n_listing = 0;
+  char microdesc_digest[DIGEST256_LEN];
+  tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
+
+  int num_bandwidths = 0;
+  int num_mbws = 0;
+  int num_guardfraction_inputs = 0;
+
+  memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
+  smartlist_clear(matching_descs);
+  smartlist_clear(chosen_flags);
+  smartlist_clear(versions);
+  smartlist_clear(protocols);
+  int ed_consensus = 0;
+  const uint8_t *ed_consensus_val = NULL;
+
+  /* Okay, go through all the entries for this digest. */
+  for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
+    if (vrs_lst[voter_idx] == NULL)
+      continue; /* This voter had nothing to say about this entry. */
+    rs = vrs_lst[voter_idx];
+    ++n_listing;
+
+    current_rsa_id = rs->status.identity_digest;
+
+    smartlist_add(matching_descs, rs);
+    if (rs->version && rs->version[0])
+      smartlist_add(versions, rs->version);
+
+    if (rs->protocols) {
+      /* We include this one even if it's empty: voting for an
+       * empty protocol list actually is meaningful. */
+      smartlist_add(protocols, rs->protocols);
+    }
+
+    /* Tally up all the flags. */
+    for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
+      if (rs->flags & (UINT64_C(1) << flag))
+        ++flag_counts[flag_map[voter_idx][flag]];
+    }
+    if (named_flag[voter_idx] >= 0 &&
+        (rs->flags & (UINT64_C(1) << named_flag[voter_idx]))) {
+      if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+        log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
+                   chosen_name, rs->status.nickname);
+        naming_conflict = 1;
+      }
+      chosen_name = rs->status.nickname;
+    }
+
+    /* Count guardfraction votes and note down the values. */
+    if (rs->status.has_guardfraction) {
+      measured_guardfraction[num_guardfraction_inputs++] =
+        rs->status.guardfraction_percentage;
+    }
+
+    /* count bandwidths */
+    if (rs->has_measured_bw)
+      measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
+
+    if (rs->status.has_bandwidth)
+      bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
+
+    /* Count number for which ed25519 is canonical. */
+    if (rs->ed25519_reflects_consensus) {
+      ++ed_consensus;
+      if (ed_consensus_val) {
+        tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
+                              ED25519_PUBKEY_LEN));
+      } else {
+        ed_consensus_val = rs->ed25519_id;
+      }
+    }
+  }
+
+  /* We don't include this router at all unless more than half of
+   * the authorities we believe in list it. */
+  if (n_listing <= total_authorities/2)
+    return;
+
+  if (ed_consensus > 0) {
+    if (ed_consensus <= total_authorities / 2) {
+      log_warn(LD_BUG, "Not enough entries had ed_consensus set; how "
+               "can we have a consensus of %d?", ed_consensus);
+    }
+  }
+
+  /* The clangalyzer can't figure out that this will never be NULL
+   * if n_listing is at least 1 */
+  tor_assert(current_rsa_id);
+
+  /* Figure out the most popular opinion of what the most recent
+   * routerinfo and its contents are. */
+  memset(microdesc_digest, 0, sizeof(microdesc_digest));
+  rs = compute_routerstatus_consensus(matching_descs, consensus_method,
+                                      microdesc_digest, &alt_orport);
+  /* Copy bits of that into rs_out. */
+  memset(&rs_out, 0, sizeof(rs_out));
+  tor_assert(fast_memeq(current_rsa_id,
+                        rs->status.identity_digest,DIGEST_LEN));
+  memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
+  memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+         DIGEST_LEN);
+  rs_out.addr = rs->status.addr;
+  rs_out.published_on = rs->status.published_on;
+  rs_out.dir_port = rs->status.dir_port;
+  rs_out.or_port = rs->status.or_port;
+  tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
+  rs_out.ipv6_orport = alt_orport.port;
+  rs_out.has_bandwidth = 0;
+  rs_out.has_exitsummary = 0;
+
+  if (chosen_name && !naming_conflict) {
+    strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+  } else {
+    strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+  }
+
+  {
+    const char *d = strmap_get_lc(ctx->name_to_id_map, rs_out.nickname);
+    if (!d) {
+      is_named = is_unnamed = 0;
+    } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
+      is_named = 1; is_unnamed = 0;
+    } else {
+      is_named = 0; is_unnamed = 1;
+    }
+  }
+
+  /* Set the flags. */
+  smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
+  SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
+    if (!strcmp(fl, "Named")) {
+      if (is_named)
+        smartlist_add(chosen_flags, (char*)fl);
+    } else if (!strcmp(fl, "Unnamed")) {
+      if (is_unnamed)
+        smartlist_add(chosen_flags, (char*)fl);
+    } else if (!strcmp(fl, "NoEdConsensus")) {
+      if (ed_consensus <= total_authorities/2)
+        smartlist_add(chosen_flags, (char*)fl);
+    } else {
+      if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
+        smartlist_add(chosen_flags, (char*)fl);
+        if (!strcmp(fl, "Exit"))
+          is_exit = 1;
+        else if (!strcmp(fl, "Guard"))
+          is_guard = 1;
+        else if (!strcmp(fl, "Running"))
+          is_running = 1;
+        else if (!strcmp(fl, "BadExit"))
+          is_bad_exit = 1;
+        else if (!strcmp(fl, "Valid"))
+          is_valid = 1;
+      }
+    }
+  } SMARTLIST_FOREACH_END(fl);
+
+  /* Starting with consensus method 4 we do not list servers
+   * that are not running in a consensus.  See Proposal 138 */
+  if (!is_running)
+    return;
+
+  /* Starting with consensus method 24, we don't list servers
+   * that are not valid in a consensus.  See Proposal 272 */
+  if (!is_valid)
+    return;
+
+  /* Pick the version. */
+  if (smartlist_len(versions)) {
+    sort_version_list(versions, 0);
+    chosen_version = get_most_frequent_member(versions);
+  } else {
+    chosen_version = NULL;
+  }
+
+  /* Pick the protocol list */
+  if (smartlist_len(protocols)) {
+    smartlist_sort_strings(protocols);
+    chosen_protocol_list = get_most_frequent_member(protocols);
+  } else {
+    chosen_protocol_list = NULL;
+  }
+
+  /* If it's a guard and we have enough guardfraction votes,
+     calculate its consensus guardfraction value. */
+  if (is_guard && num_guardfraction_inputs > 2) {
+    rs_out.has_guardfraction = 1;
+    rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
+                                                 num_guardfraction_inputs);
+    /* final value should be an integer percentage! */
+    tor_assert(rs_out.guardfraction_percentage <= 100);
+  }
+
+  /* Pick a bandwidth */
+  if (num_mbws > 2) {
+    rs_out.has_bandwidth = 1;
+    rs_out.bw_is_unmeasured = 0;
+    rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
+  } else if (num_bandwidths > 0) {
+    rs_out.has_bandwidth = 1;
+    rs_out.bw_is_unmeasured = 1;
+    rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
+    if (ctx->n_authorities_measuring_bandwidth > 2) {
+      /* Cap non-measured bandwidths. */
+      if (rs_out.bandwidth_kb > ctx->max_unmeasured_bw_kb) {
+        rs_out.bandwidth_kb = ctx->max_unmeasured_bw_kb;
+      }
+    }
+  }
+
+  /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+  is_exit = is_exit && !is_bad_exit;
+
+  /* Our caller updates the total bandwidth weights with the bandwidths of
+   * this router. */
+  out->counts_for_weights = 1;
+  out->is_exit = is_exit;
+  out->is_guard = is_guard;
+
+  /* Ok, we already picked a descriptor digest we want to list
+   * previously.  Now we want to use the exit policy summary from
+   * that descriptor.  If everybody plays nice all the voters who
+   * listed that descriptor will have the same summary.  If not then
+   * something is fishy and we'll use the most common one (breaking
+   * ties in favor of lexicographically larger one (only because it
+   * lets me reuse more existing code)).
+   *
+   * The other case that can happen is that no authority that voted
+   * for that descriptor has an exit policy summary.  That's
+   * probably quite unlikely but can happen.  In that case we use
+   * the policy that was most often listed in votes, again breaking
+   * ties like in the previous case.
+   */
+  {
+    /* Okay, go through all the votes for this router.  We prepared
+     * that list previously */
+    const char *chosen_exitsummary = NULL;
+    smartlist_clear(exitsummaries);
+    SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
+      /* Check if the vote where this status comes from had the
+       * proper descriptor */
+      tor_assert(fast_memeq(rs_out.identity_digest,
+                         vsr->status.identity_digest,
+                         DIGEST_LEN));
+      if (vsr->status.has_exitsummary &&
+           fast_memeq(rs_out.descriptor_digest,
+                   vsr->status.descriptor_digest,
+                   DIGEST_LEN)) {
+        tor_assert(vsr->status.exitsummary);
+        smartlist_add(exitsummaries, vsr->status.exitsummary);
+        if (!chosen_exitsummary) {
+          chosen_exitsummary = vsr->status.exitsummary;
+        } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+          /* Great.  There's disagreement among the voters.  That
+           * really shouldn't be */
+          exitsummary_disagreement = 1;
+        }
+      }
+    } SMARTLIST_FOREACH_END(vsr);
+
+    if (exitsummary_disagreement) {
+      char id[HEX_DIGEST_LEN+1];
+      char dd[HEX_DIGEST_LEN+1];
+      base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+      base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+      log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
+               " for router %s with descriptor %s.  This really shouldn't"
+               " have happened.", id, dd);
+
+      smartlist_sort_strings(exitsummaries);
+      chosen_exitsummary = get_most_frequent_member(exitsummaries);
+    } else if (!chosen_exitsummary) {
+      char id[HEX_DIGEST_LEN+1];
+      char dd[HEX_DIGEST_LEN+1];
+      base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+      base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+      log_warn(LD_DIR, "Not one of the voters that made us select"
+               "descriptor %s for router %s had an exit policy"
+               "summary", dd, id);
+
+      /* Ok, none of those voting for the digest we chose had an
+       * exit policy for us.  Well, that kinda sucks.
+       */
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+        if (vsr->status.has_exitsummary)
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+      });
+      smartlist_sort_strings(exitsummaries);
+      chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+      if (!chosen_exitsummary)
+        log_warn(LD_DIR, "Wow, not one of the voters had an exit "
+                 "policy summary for %s.  Wow.", id);
+    }
+
+    if (chosen_exitsummary) {
+      rs_out.has_exitsummary = 1;
+      /* yea, discards the const */
+      rs_out.exitsummary = (char *)chosen_exitsummary;
+    }
+  }
+
+  memcpy(&out->rs, &rs_out, sizeof(rs_out));
+
+  if (flavor == FLAV_MICRODESC &&
+      tor_digest256_is_zero(microdesc_digest)) {
+    /* With no microdescriptor digest, we omit the entry entirely. */
+    return;
+  }
+
+  chunks = smartlist_new();
+
+  {
+    char *buf;
+    /* Okay!! Now we can write the descriptor... */
+    /*     First line goes into "buf". */
+    buf = routerstatus_format_entry(&rs_out, NULL, NULL,
+                                    ctx->rs_format, consensus_method, NULL);
+    if (buf)
+      smartlist_add(chunks, buf);
+  }
+  /*     Now an m line, if applicable. */
+  if (flavor == FLAV_MICRODESC &&
+      !tor_digest256_is_zero(microdesc_digest)) {
+    char m[BASE64_DIGEST256_LEN+1];
+    digest256_to_base64(m, microdesc_digest);
+    smartlist_add_asprintf(chunks, "m %s\n", m);
+  }
+  /*     Next line is all flags.  The "\n" is missing. */
+  smartlist_add(chunks,
+                smartlist_join_strings(chosen_flags, " ", 0, NULL));
+  /*     Now the version line. */
+  if (chosen_version) {
+    smartlist_add_strdup(chunks, "\nv ");
+    smartlist_add_strdup(chunks, chosen_version);
+  }
+  smartlist_add_strdup(chunks, "\n");
+  if (chosen_protocol_list &&
+      consensus_method >= MIN_METHOD_FOR_RS_PROTOCOLS) {
+    smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
+  }
+  /*     Now the weight line. */
+  if (rs_out.has_bandwidth) {
+    char *guardfraction_str = NULL;
+    int unmeasured = rs_out.bw_is_unmeasured;
+
+    /* If we have guardfraction info, include it in the 'w' line. */
+    if (rs_out.has_guardfraction) {
+      tor_asprintf(&guardfraction_str,
+                   " GuardFraction=%u", rs_out.guardfraction_percentage);
+    }
+    smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
+                           rs_out.bandwidth_kb,
+                           unmeasured?" Unmeasured=1":"",
+                           guardfraction_str ? guardfraction_str : "");
+
+    tor_free(guardfraction_str);
+  }
+
+  /*     Now the exitpolicy summary line. */
+  if (rs_out.has_exitsummary && flavor == FLAV_NS) {
+    smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+  }
+
+  out->text = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+}
+
+/** Compute the entries for the routers at positions <b>lo</b> through
+ * <b>hi</b>-1 in the collator of <b>ctx</b>, into the matching members of
+ * <b>entries</b>.  May run in any thread. */
+static void
+consensus_entries_compute_range(const consensus_entry_ctx_t *ctx,
+                                consensus_entry_t *entries, int lo, int hi)
+{
+  consensus_entry_scratch_t *sc = consensus_entry_scratch_new(ctx);
+  int i;
+  for (i = lo; i < hi; ++i)
+    consensus_entry_compute(ctx, sc, i, &entries[i]);
+  consensus_entry_scratch_free(sc);
+}
+
+/** If a consensus lists at least this many routers, and we have a
+ * threadpool, we compute the router entries in parallel. */
+#define CONSENSUS_PARALLEL_MIN_ROUTERS 1024
+/** How many routers do we put in each chunk when we compute their entries
+ * in parallel? */
+#define CONSENSUS_CHUNK_ROUTERS 256
+
+/** Current values for CONSENSUS_PARALLEL_MIN_ROUTERS and
+ * CONSENSUS_CHUNK_ROUTERS; tests may change them. */
+STATIC int consensus_parallel_min_routers = CONSENSUS_PARALLEL_MIN_ROUTERS;
+STATIC int consensus_chunk_routers = CONSENSUS_CHUNK_ROUTERS;
+
+/** What the main thread and the cpuworkers need to compute the router
+ * entries of a single consensus. */
+typedef struct consensus_entries_job_t {
+  /** The consensus we're computing. */
+  const consensus_entry_ctx_t *ctx;
+  /** Where the entries go. */
+  consensus_entry_t *entries;
+} consensus_entries_job_t;
+
+/** Batch function for cpuworker_run_parallel(): compute the entries of the
+ * consensus_entries_job_t in <b>arg</b> from <b>lo</b> through
+ * <b>hi</b>-1. */
+static void
+consensus_entries_job_run_chunk(void *arg, int lo, int hi)
+{
+  consensus_entries_job_t *job = arg;
+  consensus_entries_compute_range(job->ctx, job->entries, lo, hi);
+}
+
+/**
+ * Compute the entries for all <b>n_routers</b> routers in the collator of
+ * <b>ctx</b>, into <b>entries</b>.  If there are enough routers, and we
+ * have cpuworker threads, split the routers into chunks, and share the
+ * chunks between this thread and the cpuworkers.  The result is the same
+ * either way.
+ */
+static void
+consensus_entries_compute(const consensus_entry_ctx_t *ctx,
+                          consensus_entry_t *entries, int n_routers)
+{
+  if (n_routers < consensus_parallel_min_routers) {
+    consensus_entries_compute_range(ctx, entries, 0, n_routers);
+    return;
+  }
+
+  consensus_entries_job_t job = { ctx, entries };
+  cpuworker_run_parallel(n_routers, consensus_chunk_routers,
+                         consensus_entries_job_run_chunk, &job);
+}
+
 /** Given a list of vote networkstatus_t in <b>votes</b>, our public
  * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
  * and the number of <b>total_authorities</b> that we believe exist in our
@@ -1476,7 +2051,7 @@ compute_nth_protocol_set(int n, int n_voters, const smartlist_t *votes)
  * behavior, and make the new behavior conditional on a new-enough
  * consensus_method.
  **/
-STATIC char *
+char *
 networkstatus_compute_consensus(smartlist_t *votes,
                                 int total_authorities,
                                 crypto_pk_t *identity_key,
@@ -1764,23 +2339,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
   /* Add the actual router entries. */
   {
     int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
     int i;
-    smartlist_t *matching_descs = smartlist_new();
-    smartlist_t *chosen_flags = smartlist_new();
-    smartlist_t *versions = smartlist_new();
-    smartlist_t *protocols = smartlist_new();
-    smartlist_t *exitsummaries = smartlist_new();
-    uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
-                                         sizeof(uint32_t));
-    uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
-                                           sizeof(uint32_t));
-    uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
-                                                  sizeof(uint32_t));
-    int num_bandwidths;
-    int num_mbws;
-    int num_guardfraction_inputs;
 
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
@@ -1902,387 +2461,39 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
     dircollator_collate(collator, consensus_method);
 
-    /* Now go through all the votes */
-    flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
+    /* Now decide what to say about each router, and list them in order. */
     const int num_routers = dircollator_n_routers(collator);
+    consensus_entry_ctx_t ctx = {
+      .votes = votes,
+      .flags = flags,
+      .collator = collator,
+      .total_authorities = total_authorities,
+      .consensus_method = consensus_method,
+      .flavor = flavor,
+      .rs_format = rs_format,
+      .max_unmeasured_bw_kb = max_unmeasured_bw_kb,
+      .n_authorities_measuring_bandwidth = n_authorities_measuring_bandwidth,
+      .n_voter_flags = n_voter_flags,
+      .n_flag_voters = n_flag_voters,
+      .flag_map = flag_map,
+      .named_flag = named_flag,
+      .name_to_id_map = name_to_id_map,
+    };
+    consensus_entry_t *entries =
+      tor_calloc(MAX(num_routers, 1), sizeof(consensus_entry_t));
+    consensus_entries_compute(&ctx, entries, num_routers);
     for (i = 0; i < num_routers; ++i) {
-      vote_routerstatus_t **vrs_lst =
-        dircollator_get_votes_for_router(collator, i);
-
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *current_rsa_id = NULL;
-      const char *chosen_version;
-      const char *chosen_protocol_list;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0, is_valid = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      char microdesc_digest[DIGEST256_LEN];
-      tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions);
-      smartlist_clear(protocols);
-      num_bandwidths = 0;
-      num_mbws = 0;
-      num_guardfraction_inputs = 0;
-      int ed_consensus = 0;
-      const uint8_t *ed_consensus_val = NULL;
-
-      /* Okay, go through all the entries for this digest. */
-      for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
-        if (vrs_lst[voter_idx] == NULL)
-          continue; /* This voter had nothing to say about this entry. */
-        rs = vrs_lst[voter_idx];
-        ++n_listing;
-
-        current_rsa_id = rs->status.identity_digest;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions, rs->version);
-
-        if (rs->protocols) {
-          /* We include this one even if it's empty: voting for an
-           * empty protocol list actually is meaningful. */
-          smartlist_add(protocols, rs->protocols);
-        }
-
-        /* Tally up all the flags. */
-        for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
-          if (rs->flags & (UINT64_C(1) << flag))
-            ++flag_counts[flag_map[voter_idx][flag]];
-        }
-        if (named_flag[voter_idx] >= 0 &&
-            (rs->flags & (UINT64_C(1) << named_flag[voter_idx]))) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
-                       chosen_name, rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* Count guardfraction votes and note down the values. */
-        if (rs->status.has_guardfraction) {
-          measured_guardfraction[num_guardfraction_inputs++] =
-            rs->status.guardfraction_percentage;
-        }
-
-        /* count bandwidths */
-        if (rs->has_measured_bw)
-          measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
-
-        if (rs->status.has_bandwidth)
-          bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
-
-        /* Count number for which ed25519 is canonical. */
-        if (rs->ed25519_reflects_consensus) {
-          ++ed_consensus;
-          if (ed_consensus_val) {
-            tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
-                                  ED25519_PUBKEY_LEN));
-          } else {
-            ed_consensus_val = rs->ed25519_id;
-          }
-        }
-      }
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      if (ed_consensus > 0) {
-        if (ed_consensus <= total_authorities / 2) {
-          log_warn(LD_BUG, "Not enough entries had ed_consensus set; how "
-                   "can we have a consensus of %d?", ed_consensus);
-        }
-      }
-
-      /* The clangalyzer can't figure out that this will never be NULL
-       * if n_listing is at least 1 */
-      tor_assert(current_rsa_id);
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest, &alt_orport);
-      /* Copy bits of that into rs_out. */
-      memset(&rs_out, 0, sizeof(rs_out));
-      tor_assert(fast_memeq(current_rsa_id,
-                            rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      rs_out.addr = rs->status.addr;
-      rs_out.published_on = rs->status.published_on;
-      rs_out.dir_port = rs->status.dir_port;
-      rs_out.or_port = rs->status.or_port;
-      tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
-      rs_out.ipv6_orport = alt_orport.port;
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
-      SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed")) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "NoEdConsensus")) {
-          if (ed_consensus <= total_authorities/2)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-            else if (!strcmp(fl, "Valid"))
-              is_valid = 1;
-          }
-        }
-      } SMARTLIST_FOREACH_END(fl);
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (!is_running)
-        continue;
-
-      /* Starting with consensus method 24, we don't list servers
-       * that are not valid in a consensus.  See Proposal 272 */
-      if (!is_valid)
-        continue;
-
-      /* Pick the version. */
-      if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* Pick the protocol list */
-      if (smartlist_len(protocols)) {
-        smartlist_sort_strings(protocols);
-        chosen_protocol_list = get_most_frequent_member(protocols);
-      } else {
-        chosen_protocol_list = NULL;
-      }
-
-      /* If it's a guard and we have enough guardfraction votes,
-         calculate its consensus guardfraction value. */
-      if (is_guard && num_guardfraction_inputs > 2) {
-        rs_out.has_guardfraction = 1;
-        rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
-                                                     num_guardfraction_inputs);
-        /* final value should be an integer percentage! */
-        tor_assert(rs_out.guardfraction_percentage <= 100);
-      }
-
-      /* Pick a bandwidth */
-      if (num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 0;
-        rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
-      } else if (num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 1;
-        rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
-        if (n_authorities_measuring_bandwidth > 2) {
-          /* Cap non-measured bandwidths. */
-          if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
-            rs_out.bandwidth_kb = max_unmeasured_bw_kb;
-          }
-        }
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      is_exit = is_exit && !is_bad_exit;
-
+      consensus_entry_t *ent = &entries[i];
       /* Update total bandwidth weights with the bandwidths of this router. */
-      {
-        update_total_bandwidth_weights(&rs_out,
-                                       is_exit, is_guard,
+      if (ent->counts_for_weights) {
+        update_total_bandwidth_weights(&ent->rs,
+                                       ent->is_exit, ent->is_guard,
                                        &G, &M, &E, &D, &T);
       }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code)).
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        } SMARTLIST_FOREACH_END(vsr);
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
-                   " for router %s with descriptor %s.  This really shouldn't"
-                   " have happened.", id, dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "Not one of the voters that made us select"
-                   "descriptor %s for router %s had an exit policy"
-                   "summary", dd, id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR, "Wow, not one of the voters had an exit "
-                     "policy summary for %s.  Wow.", id);
-        }
-
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
-
-      if (flavor == FLAV_MICRODESC &&
-          tor_digest256_is_zero(microdesc_digest)) {
-        /* With no microdescriptor digest, we omit the entry entirely. */
-        continue;
-      }
-
-      {
-        char *buf;
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        buf = routerstatus_format_entry(&rs_out, NULL, NULL,
-                                        rs_format, consensus_method, NULL);
-        if (buf)
-          smartlist_add(chunks, buf);
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        char m[BASE64_DIGEST256_LEN+1];
-        digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
-      }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add_strdup(chunks, "\nv ");
-        smartlist_add_strdup(chunks, chosen_version);
-      }
-      smartlist_add_strdup(chunks, "\n");
-      if (chosen_protocol_list &&
-          consensus_method >= MIN_METHOD_FOR_RS_PROTOCOLS) {
-        smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
-      }
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        char *guardfraction_str = NULL;
-        int unmeasured = rs_out.bw_is_unmeasured;
-
-        /* If we have guardfraction info, include it in the 'w' line. */
-        if (rs_out.has_guardfraction) {
-          tor_asprintf(&guardfraction_str,
-                       " GuardFraction=%u", rs_out.guardfraction_percentage);
-        }
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
-                               rs_out.bandwidth_kb,
-                               unmeasured?" Unmeasured=1":"",
-                               guardfraction_str ? guardfraction_str : "");
-
-        tor_free(guardfraction_str);
-      }
-
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
-      }
-
-      /* And the loop is over and we move on to the next router */
+      if (ent->text)
+        smartlist_add(chunks, ent->text);
     }
+    tor_free(entries);
 
     tor_free(size);
     tor_free(n_voter_flags);
@@ -2290,18 +2501,9 @@ networkstatus_compute_consensus(smartlist_t *votes,
     for (i = 0; i < smartlist_len(votes); ++i)
       tor_free(flag_map[i]);
     tor_free(flag_map);
-    tor_free(flag_counts);
     tor_free(named_flag);
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions);
-    smartlist_free(protocols);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths_kb);
-    tor_free(measured_bws_kb);
-    tor_free(measured_guardfraction);
   }
 
   /* Mark the directory footer region */
@@ -12,7 +12,9 @@
 
 #include "orconfig.h"
 
+#include "lib/arch/bytes.h"
 #include "lib/cc/torint.h"
+#include "lib/container/bitarray.h"
 #include "lib/crypt_ops/crypto_digest.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_format.h"
@@ -20,6 +22,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/encoding/time_fmt.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/fdio/fdio.h"
 #include "lib/fs/files.h"
 #include "lib/fs/mmap.h"
@@ -29,6 +32,9 @@
 #include "lib/string/printf.h"
 #include "lib/wallclock/approx_time.h"
 
+#include "core/or/or.h"
+#include "core/mainloop/cpuworker.h"
+
 #include "ht.h"
 #include "feature/dirauth/keypin.h"
 
@@ -75,6 +81,13 @@
  * Empty lines, misformed lines, and lines beginning with # are
  * ignored. Lines beginning with @ are reserved for future extensions.
  *
+ * Reading a long journal at every startup is slow, so every so often we fold
+ * the journal into a binary key-pinning store, and start the journal over.
+ * The store holds every entry, sorted by RSA identity, followed by the index
+ * of every entry in order of ed25519 key.  We mmap the store and search it
+ * in place, so that the hash tables only need to hold the entries from the
+ * journal.
+ *
  * The dirserv.c module is the main user of these functions.
  */
 
@@ -85,6 +98,7 @@ static int keypin_check_and_add_impl(const uint8_t *rsa_id_digest,
                                      const int do_not_add,
                                      const int replace);
 static int keypin_add_or_replace_entry_in_map(keypin_ent_t *ent);
+static void keypin_compact_note_added(const keypin_ent_t *ent);
 
 static HT_HEAD(rsamap, keypin_ent_st) the_rsa_map = HT_INITIALIZER();
 static HT_HEAD(edmap, keypin_ent_st) the_ed_map = HT_INITIALIZER();
@@ -129,6 +143,114 @@ HT_PROTOTYPE(edmap, keypin_ent_st, edmap_node, keypin_ent_hash_ed,
 HT_GENERATE2(edmap, keypin_ent_st, edmap_node, keypin_ent_hash_ed,
                keypin_ents_eq_ed, 0.6, tor_reallocarray, tor_free_)
 
+/** The string that starts every key-pinning store. It is followed by the
+ * number of entries, as a 32-bit network-order integer. */
+#define KEYPIN_STORE_MAGIC "keypin-store-v1\n"
+/** Length of KEYPIN_STORE_MAGIC. */
+#define KEYPIN_STORE_MAGIC_LEN 16
+/** Length of the header of a key-pinning store. */
+#define KEYPIN_STORE_HDR_LEN (KEYPIN_STORE_MAGIC_LEN + 4)
+/** Length of an entry in a key-pinning store: an RSA identity digest, then
+ * an ed25519 key. */
+#define KEYPIN_STORE_ENTRY_LEN (DIGEST_LEN + DIGEST256_LEN)
+
+/** The mmap of the key-pinning store, or NULL if we don't have one. */
+static tor_mmap_t *keypin_store_mmap = NULL;
+/** How many entries are there in the key-pinning store? */
+static uint32_t keypin_store_n_entries = 0;
+/** The entries of the key-pinning store, in order of RSA identity. */
+static const uint8_t *keypin_store_entries = NULL;
+/** The index of every entry in the key-pinning store, in order of ed25519
+ * key, as 32-bit network-order integers. */
+static const uint8_t *keypin_store_ed_order = NULL;
+/** One bit for each entry in the key-pinning store: true if an entry from
+ * the journal has superseded it. */
+static bitarray_t *keypin_store_superseded = NULL;
+/** How many bits are set in keypin_store_superseded? */
+static uint32_t keypin_store_n_superseded = 0;
+
+/** Return the RSA identity digest of entry <b>idx</b> in the store. */
+static inline const uint8_t *
+keypin_store_rsa_id(uint32_t idx)
+{
+  return keypin_store_entries + (size_t)idx * KEYPIN_STORE_ENTRY_LEN;
+}
+
+/** Return the ed25519 key of entry <b>idx</b> in the store. */
+static inline const uint8_t *
+keypin_store_ed_key(uint32_t idx)
+{
+  return keypin_store_rsa_id(idx) + DIGEST_LEN;
+}
+
+/** Return the index of the store entry at position <b>pos</b> in order of
+ * ed25519 key. */
+static inline uint32_t
+keypin_store_ed_order_get(uint32_t pos)
+{
+  return tor_ntohl(get_uint32(keypin_store_ed_order + (size_t)pos * 4));
+}
+
+/** Return <b>idx</b> if store entry <b>idx</b> has not been superseded, and
+ * -1 if it has. */
+static inline int
+keypin_store_live_index(uint32_t idx)
+{
+  return bitarray_is_set(keypin_store_superseded, idx) ? -1 : (int)idx;
+}
+
+/** Return the index of the store entry for the RSA identity digest
+ * <b>rsa_id</b>, or -1 if the store has no such entry that is still
+ * live. */
+static int
+keypin_store_find_rsa(const uint8_t *rsa_id)
+{
+  uint32_t lo = 0, hi = keypin_store_n_entries;
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    const int c = fast_memcmp(keypin_store_rsa_id(mid), rsa_id, DIGEST_LEN);
+    if (c == 0)
+      return keypin_store_live_index(mid);
+    else if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+/** Return the index of the store entry for the ed25519 key <b>ed_key</b>,
+ * or -1 if the store has no such entry that is still live. */
+static int
+keypin_store_find_ed(const uint8_t *ed_key)
+{
+  uint32_t lo = 0, hi = keypin_store_n_entries;
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    const uint32_t idx = keypin_store_ed_order_get(mid);
+    const int c = fast_memcmp(keypin_store_ed_key(idx), ed_key,
+                              DIGEST256_LEN);
+    if (c == 0)
+      return keypin_store_live_index(idx);
+    else if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+/** Mark store entry <b>idx</b> as superseded, unless <b>idx</b> is
+ * negative. */
+static void
+keypin_store_supersede(int idx)
+{
+  if (idx < 0 || bitarray_is_set(keypin_store_superseded, idx))
+    return;
+  bitarray_set(keypin_store_superseded, idx);
+  ++keypin_store_n_superseded;
+}
+
 /**
  * Check whether we already have an entry in the key pinning table for a
  * router with RSA ID digest <b>rsa_id_digest</b> or for ed25519 key
@@ -170,6 +292,8 @@ keypin_check_and_add_impl(const uint8_t *rsa_id_digest,
                           const int replace)
 {
   keypin_ent_t search, *ent;
+  const uint8_t *found_ed25519_key = NULL;
+  int idx;
   memset(&search, 0, sizeof(search));
   memcpy(search.rsa_id, rsa_id_digest, sizeof(search.rsa_id));
   memcpy(search.ed25519_key, ed25519_id_key, sizeof(search.ed25519_key));
@@ -178,7 +302,12 @@ keypin_check_and_add_impl(const uint8_t *rsa_id_digest,
   ent = HT_FIND(rsamap, &the_rsa_map, &search);
   if (ent) {
     tor_assert(fast_memeq(ent->rsa_id, rsa_id_digest, sizeof(ent->rsa_id)));
-    if (tor_memeq(ent->ed25519_key, ed25519_id_key,sizeof(ent->ed25519_key))) {
+    found_ed25519_key = ent->ed25519_key;
+  } else if ((idx = keypin_store_find_rsa(rsa_id_digest)) >= 0) {
+    found_ed25519_key = keypin_store_ed_key(idx);
+  }
+  if (found_ed25519_key) {
+    if (tor_memeq(found_ed25519_key, ed25519_id_key, DIGEST256_LEN)) {
       return KEYPIN_FOUND; /* Match on both keys. Great. */
     } else {
       if (!replace)
@@ -196,6 +325,8 @@ keypin_check_and_add_impl(const uint8_t *rsa_id_digest,
       tor_assert(fast_memneq(ent->rsa_id, rsa_id_digest, sizeof(ent->rsa_id)));
       return KEYPIN_MISMATCH;
     }
+    if (keypin_store_find_ed(ed25519_id_key) >= 0)
+      return KEYPIN_MISMATCH;
   }
 
   /* Okay, this one is new to us. */
@@ -210,6 +341,7 @@ keypin_check_and_add_impl(const uint8_t *rsa_id_digest,
     tor_assert(r != 0);
   }
   keypin_journal_append_entry(rsa_id_digest, ed25519_id_key);
+  keypin_compact_note_added(&search);
   return KEYPIN_ADDED;
 }
 
@@ -236,12 +368,15 @@ keypin_add_or_replace_entry_in_map(keypin_ent_t *ent)
   int r = 1;
   keypin_ent_t *ent2 = HT_FIND(rsamap, &the_rsa_map, ent);
   keypin_ent_t *ent3 = HT_FIND(edmap, &the_ed_map, ent);
-  if (ent2 &&
-      fast_memeq(ent2->ed25519_key, ent->ed25519_key, DIGEST256_LEN)) {
+  const int idx2 = keypin_store_find_rsa(ent->rsa_id);
+  const int idx3 = keypin_store_find_ed(ent->ed25519_key);
+  if ((ent2 &&
+       fast_memeq(ent2->ed25519_key, ent->ed25519_key, DIGEST256_LEN)) ||
+      (idx2 >= 0 && idx2 == idx3)) {
     /* We already have this mapping stored. Ignore it. */
     tor_free(ent);
     return 0;
-  } else if (ent2 || ent3) {
+  } else if (ent2 || ent3 || idx2 >= 0 || idx3 >= 0) {
     /* We have a conflict. (If we had no entry, we would have ent2 == ent3
      * == NULL. If we had a non-conflicting duplicate, we would have found
      * it above.)
@@ -266,6 +401,9 @@ keypin_add_or_replace_entry_in_map(keypin_ent_t *ent)
       tor_free(ent3);
     }
     tor_free(ent2);
+    /* Entries in the store can't be removed, so we mark them instead. */
+    keypin_store_supersede(idx2);
+    keypin_store_supersede(idx3);
     r = -1;
     /* Fall through */
   }
@@ -289,7 +427,7 @@ keypin_check_lone_rsa(const uint8_t *rsa_id_digest)
 
   /* Search by RSA key digest first */
   ent = HT_FIND(rsamap, &the_rsa_map, &search);
-  if (ent) {
+  if (ent || keypin_store_find_rsa(rsa_id_digest) >= 0) {
     return KEYPIN_MISMATCH;
   } else {
     return KEYPIN_NOT_FOUND;
@@ -298,6 +436,11 @@ keypin_check_lone_rsa(const uint8_t *rsa_id_digest)
 
 /** Open fd to the keypinning journal file. */
 static int keypin_journal_fd = -1;
+/** Name of the keypinning journal file, while we have it open. */
+static char *keypin_journal_fname = NULL;
+/** How many entries have we read from or added to the journal since it was
+ * last folded into the store? */
+static int keypin_journal_n_entries = 0;
 
 /** Open the key-pinning journal to append to <b>fname</b>.  Return 0 on
  * success, -1 on failure. */
@@ -327,6 +470,10 @@ keypin_open_journal(const char *fname)
     goto err;
 
   keypin_journal_fd = fd;
+  if (fname != keypin_journal_fname) {
+    tor_free(keypin_journal_fname);
+    keypin_journal_fname = tor_strdup(fname);
+  }
   return 0;
  err:
   if (fd >= 0)
@@ -341,12 +488,26 @@ keypin_close_journal(void)
   if (keypin_journal_fd >= 0)
     close(keypin_journal_fd);
   keypin_journal_fd = -1;
+  tor_free(keypin_journal_fname);
   return 0;
 }
 
 /** Length of a keypinning journal line, including terminating newline. */
 #define JOURNAL_LINE_LEN (BASE64_DIGEST_LEN + BASE64_DIGEST256_LEN + 2)
 
+/** Write the keypinning journal line that maps <b>rsa_id_digest</b> and
+ * <b>ed25519_id_key</b> into the JOURNAL_LINE_LEN bytes at <b>line</b>. */
+static void
+keypin_format_journal_line(char *line, const uint8_t *rsa_id_digest,
+                           const uint8_t *ed25519_id_key)
+{
+  digest_to_base64(line, (const char*)rsa_id_digest);
+  line[BASE64_DIGEST_LEN] = ' ';
+  digest256_to_base64(line + BASE64_DIGEST_LEN + 1,
+                      (const char*)ed25519_id_key);
+  line[BASE64_DIGEST_LEN+1+BASE64_DIGEST256_LEN] = '\n';
+}
+
 /** Add an entry to the keypinning journal to map <b>rsa_id_digest</b> and
  * <b>ed25519_id_key</b>. */
 static int
@@ -356,11 +517,7 @@ keypin_journal_append_entry(const uint8_t *rsa_id_digest,
   if (keypin_journal_fd == -1)
     return -1;
   char line[JOURNAL_LINE_LEN];
-  digest_to_base64(line, (const char*)rsa_id_digest);
-  line[BASE64_DIGEST_LEN] = ' ';
-  digest256_to_base64(line + BASE64_DIGEST_LEN + 1,
-                      (const char*)ed25519_id_key);
-  line[BASE64_DIGEST_LEN+1+BASE64_DIGEST256_LEN] = '\n';
+  keypin_format_journal_line(line, rsa_id_digest, ed25519_id_key);
 
   if (write_all_to_fd(keypin_journal_fd, line, JOURNAL_LINE_LEN)<0) {
     log_warn(LD_DIRSERV, "Error while adding a line to the key-pinning "
@@ -369,6 +526,7 @@ keypin_journal_append_entry(const uint8_t *rsa_id_digest,
     return -1;
   }
 
+  ++keypin_journal_n_entries;
   return 0;
 }
 
@@ -433,6 +591,7 @@ keypin_load_journal_impl(const char *data, size_t size)
 
     ++n_entries;
   }
+  keypin_journal_n_entries += n_entries;
 
   int severity = (n_corrupt_lines || n_duplicates) ? LOG_NOTICE : LOG_INFO;
   tor_log(severity, LD_DIRSERV,
@@ -463,6 +622,375 @@ keypin_load_journal(const char *fname)
   return r;
 }
 
+/** Name of the key-pinning store, once we've loaded it. */
+static char *keypin_store_fname = NULL;
+
+/** Check whether the <b>size</b>-byte region at <b>data</b> is a
+ * well-formed key-pinning store, with its entries in order and no key
+ * listed twice.  On success, set *<b>n_out</b> to the number of entries
+ * and return 0.  Return -1 on failure. */
+static int
+keypin_store_check(const char *data, size_t size, uint32_t *n_out)
+{
+  if (size < KEYPIN_STORE_HDR_LEN ||
+      fast_memneq(data, KEYPIN_STORE_MAGIC, KEYPIN_STORE_MAGIC_LEN))
+    return -1;
+  const uint32_t n = tor_ntohl(get_uint32(data + KEYPIN_STORE_MAGIC_LEN));
+  if (n > INT_MAX ||
+      (size - KEYPIN_STORE_HDR_LEN) / (KEYPIN_STORE_ENTRY_LEN + 4) != n ||
+      (size - KEYPIN_STORE_HDR_LEN) % (KEYPIN_STORE_ENTRY_LEN + 4) != 0)
+    return -1;
+
+  const char *entries = data + KEYPIN_STORE_HDR_LEN;
+  const char *ed_order = entries + (size_t)n * KEYPIN_STORE_ENTRY_LEN;
+  const char *prev_ed = NULL;
+  for (uint32_t i = 0; i < n; ++i) {
+    const char *ent = entries + (size_t)i * KEYPIN_STORE_ENTRY_LEN;
+    if (i > 0 &&
+        fast_memcmp(ent - KEYPIN_STORE_ENTRY_LEN, ent, DIGEST_LEN) >= 0)
+      return -1;
+    const uint32_t idx = tor_ntohl(get_uint32(ed_order + (size_t)i * 4));
+    if (idx >= n)
+      return -1;
+    const char *ed = entries + (size_t)idx * KEYPIN_STORE_ENTRY_LEN
+      + DIGEST_LEN;
+    if (prev_ed && fast_memcmp(prev_ed, ed, DIGEST256_LEN) >= 0)
+      return -1;
+    prev_ed = ed;
+  }
+  *n_out = n;
+  return 0;
+}
+
+/** Stop using the key-pinning store, if we have one. */
+static void
+keypin_store_unmap(void)
+{
+  if (keypin_store_mmap && tor_munmap_file(keypin_store_mmap) < 0)
+    log_warn(LD_FS, "Unable to munmap key-pinning store");
+  keypin_store_mmap = NULL;
+  keypin_store_entries = keypin_store_ed_order = NULL;
+  keypin_store_n_entries = keypin_store_n_superseded = 0;
+  bitarray_free(keypin_store_superseded);
+}
+
+/** Map the key-pinning store in <b>fname</b>, and use it in place of the
+ * store we have, if any.  Return 0 on success, and -1 if the store is
+ * missing or corrupt. */
+static int
+keypin_store_map_file(const char *fname)
+{
+  uint32_t n;
+  tor_mmap_t *map = tor_mmap_file(fname);
+  if (!map)
+    return -1;
+  if (keypin_store_check(map->data, map->size, &n) < 0) {
+    log_warn(LD_DIRSERV, "Key-pinning store %s is corrupt.", escaped(fname));
+    tor_munmap_file(map);
+    errno = EINVAL;
+    return -1;
+  }
+
+  keypin_store_unmap();
+  keypin_store_mmap = map;
+  keypin_store_n_entries = n;
+  keypin_store_entries = (const uint8_t *)map->data + KEYPIN_STORE_HDR_LEN;
+  keypin_store_ed_order =
+    keypin_store_entries + (size_t)n * KEYPIN_STORE_ENTRY_LEN;
+  keypin_store_superseded = bitarray_init_zero(n);
+  return 0;
+}
+
+/**
+ * Load the key-pinning store from the file called <b>fname</b>, and
+ * remember to fold the journal into it later.  Do this before loading the
+ * journal.  Return 0 on success (or if there is no store yet), -1 on
+ * failure.
+ */
+int
+keypin_load_store(const char *fname)
+{
+  if (fname != keypin_store_fname) {
+    tor_free(keypin_store_fname);
+    keypin_store_fname = tor_strdup(fname);
+  }
+  if (keypin_store_map_file(fname) < 0)
+    return (errno == ENOENT) ? 0 : -1;
+  log_info(LD_DIRSERV, "Loaded %"PRIu32" entries from key-pinning store.",
+           keypin_store_n_entries);
+  return 0;
+}
+
+/** Fold the journal into the store once it has at least this many
+ * entries. */
+#define KEYPIN_COMPACT_MIN_JOURNAL_ENTRIES 1024
+
+/** Work for a cpuworker thread: write a new key-pinning store. */
+typedef struct keypin_compact_job_t {
+  /** True if we called keypin_clear() while the worker had this job. */
+  int cancelled;
+  /** Set by the worker if it couldn't write the new store. */
+  int write_failed;
+  /** Where the worker writes the new store. */
+  char *fname_new;
+  /** Every live entry, in the store's entry format.  The worker sorts
+   * these. */
+  uint8_t *entries;
+  /** How many entries are there in <b>entries</b>? */
+  uint32_t n_entries;
+  /** A keypin_ent_t for every entry that we added while the worker had this
+   * job, in order. */
+  smartlist_t *added;
+} keypin_compact_job_t;
+
+/** The compaction job that a worker is running, if any. */
+static keypin_compact_job_t *keypin_compact_job = NULL;
+
+/** Release all storage held by <b>job</b>. */
+static void
+keypin_compact_job_free(keypin_compact_job_t *job)
+{
+  if (!job)
+    return;
+  SMARTLIST_FOREACH(job->added, keypin_ent_t *, ent, tor_free(ent));
+  smartlist_free(job->added);
+  tor_free(job->entries);
+  tor_free(job->fname_new);
+  tor_free(job);
+}
+
+/** Remember that we added <b>ent</b> while a worker was writing a new
+ * store, so that we can put it in the new journal. */
+static void
+keypin_compact_note_added(const keypin_ent_t *ent)
+{
+  if (keypin_compact_job && !keypin_compact_job->cancelled)
+    smartlist_add(keypin_compact_job->added, tor_memdup(ent, sizeof(*ent)));
+}
+
+/** Helper for qsort: compare two store entries by RSA identity. */
+static int
+compare_keypin_store_entries_(const void *a, const void *b)
+{
+  return fast_memcmp(a, b, DIGEST_LEN);
+}
+
+/** Helper for qsort: compare two pointers to store entries by ed25519
+ * key. */
+static int
+compare_keypin_store_entry_ptrs_by_ed_(const void **a, const void **b)
+{
+  const uint8_t *ent_a = *a, *ent_b = *b;
+  return fast_memcmp(ent_a + DIGEST_LEN, ent_b + DIGEST_LEN, DIGEST256_LEN);
+}
+
+/** Sort the <b>n</b> store entries at <b>entries</b>, which must not list
+ * any key twice, and return a newly allocated key-pinning store that holds
+ * them.  Set *<b>len_out</b> to the length of the store. */
+STATIC char *
+keypin_store_encode(uint8_t *entries, uint32_t n, size_t *len_out)
+{
+  const size_t entries_len = (size_t)n * KEYPIN_STORE_ENTRY_LEN;
+  const size_t len = KEYPIN_STORE_HDR_LEN + entries_len + (size_t)n * 4;
+  char *out = tor_malloc(len);
+  const uint8_t **by_ed = tor_calloc(n ? n : 1, sizeof(uint8_t *));
+
+  qsort(entries, n, KEYPIN_STORE_ENTRY_LEN, compare_keypin_store_entries_);
+  for (uint32_t i = 0; i < n; ++i)
+    by_ed[i] = entries + (size_t)i * KEYPIN_STORE_ENTRY_LEN;
+  qsort((void*)by_ed, n, sizeof(uint8_t *),
+        (int (*)(const void *, const void *))
+        compare_keypin_store_entry_ptrs_by_ed_);
+
+  memcpy(out, KEYPIN_STORE_MAGIC, KEYPIN_STORE_MAGIC_LEN);
+  set_uint32(out + KEYPIN_STORE_MAGIC_LEN, tor_htonl(n));
+  memcpy(out + KEYPIN_STORE_HDR_LEN, entries, entries_len);
+  char *cp = out + KEYPIN_STORE_HDR_LEN + entries_len;
+  for (uint32_t i = 0; i < n; ++i) {
+    const uint32_t idx =
+      (uint32_t)((by_ed[i] - entries) / KEYPIN_STORE_ENTRY_LEN);
+    set_uint32(cp + (size_t)i * 4, tor_htonl(idx));
+  }
+
+  tor_free(by_ed);
+  *len_out = len;
+  return out;
+}
+
+/** Worker thread function: write the new store for the
+ * keypin_compact_job_t in <b>arg</b>. */
+static workqueue_reply_t
+keypin_compact_job_threadfn(void *state_, void *arg)
+{
+  (void) state_;
+  keypin_compact_job_t *job = arg;
+  size_t len;
+  char *body = keypin_store_encode(job->entries, job->n_entries, &len);
+  if (write_bytes_to_file(job->fname_new, body, len, 1) < 0)
+    job->write_failed = 1;
+  tor_free(body);
+  return WQ_RPL_REPLY;
+}
+
+/** Replace the journal with one that holds only the entries in
+ * <b>added</b>, and reopen it.  Return 0 on success, -1 on failure. */
+static int
+keypin_rewrite_journal(const smartlist_t *added)
+{
+  char *fname = tor_strdup(keypin_journal_fname);
+  char tbuf[ISO_TIME_LEN+1];
+  smartlist_t *chunks = smartlist_new();
+  char *body = NULL;
+  int r = -1;
+
+  format_iso_time(tbuf, approx_time());
+  smartlist_add_asprintf(chunks, "@compacted-at %s\n", tbuf);
+  SMARTLIST_FOREACH_BEGIN(added, const keypin_ent_t *, ent) {
+    char *line = tor_malloc_zero(JOURNAL_LINE_LEN + 1);
+    keypin_format_journal_line(line, ent->rsa_id, ent->ed25519_key);
+    smartlist_add(chunks, line);
+  } SMARTLIST_FOREACH_END(ent);
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+
+  keypin_close_journal();
+  if (write_str_to_file(fname, body, 1) < 0) {
+    log_warn(LD_FS, "Unable to write new key-pinning journal: %s",
+             strerror(errno));
+  } else {
+    keypin_journal_n_entries = smartlist_len(added);
+    r = 0;
+  }
+  /* If we couldn't write the new journal, the old one is still correct: it
+   * has every entry since the last compaction, and replaying entries that
+   * are already in the store changes nothing. */
+  if (keypin_open_journal(fname) < 0) {
+    log_warn(LD_FS, "Unable to reopen key-pinning journal: %s",
+             strerror(errno));
+    r = -1;
+  }
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(body);
+  tor_free(fname);
+  return r;
+}
+
+/** Main thread function: the worker is done with the keypin_compact_job_t
+ * in <b>arg</b>.  Replace the store, and start the journal over. */
+static void
+keypin_compact_job_replyfn(void *arg)
+{
+  keypin_compact_job_t *job = arg;
+  tor_assert(job == keypin_compact_job);
+  keypin_compact_job = NULL;
+
+  if (job->cancelled || job->write_failed) {
+    if (job->write_failed)
+      log_warn(LD_FS, "Error writing key-pinning store to disk.");
+    tor_unlink(job->fname_new);
+    goto done;
+  }
+  if (replace_file(job->fname_new, keypin_store_fname) < 0) {
+    log_warn(LD_FS, "Error replacing key-pinning store: %s", strerror(errno));
+    tor_unlink(job->fname_new);
+    goto done;
+  }
+  if (keypin_store_map_file(keypin_store_fname) < 0) {
+    /* We keep using the old mapping; the journal still has everything. */
+    log_warn(LD_BUG, "Unable to map the key-pinning store that we just "
+             "wrote.");
+    goto done;
+  }
+
+  /* The new store has everything that was in the journal when we started,
+   * so the hash tables only need what we added since. */
+  keypin_ent_t **ent, **next, *this;
+  for (ent = HT_START(rsamap, &the_rsa_map); ent != NULL; ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(rsamap, &the_rsa_map, ent);
+    HT_REMOVE(edmap, &the_ed_map, this);
+    tor_free(this);
+  }
+  SMARTLIST_FOREACH(job->added, keypin_ent_t *, added,
+                    keypin_add_or_replace_entry_in_map(
+                                      tor_memdup(added, sizeof(*added))));
+
+  if (keypin_journal_fname)
+    keypin_rewrite_journal(job->added);
+
+  log_notice(LD_DIRSERV, "Folded the key-pinning journal into the "
+             "key-pinning store, which now has %"PRIu32" entries.",
+             keypin_store_n_entries);
+
+ done:
+  keypin_compact_job_free(job);
+}
+
+/**
+ * Fold the key-pinning journal into the key-pinning store, in the
+ * background if we can.  Return 0 if we started doing so, and -1 if we
+ * can't.
+ */
+STATIC int
+keypin_compact_store(void)
+{
+#ifdef _WIN32
+  /* Windows can't replace a file that we have mapped. */
+  return -1;
+#else
+  if (!keypin_store_fname || keypin_journal_fd < 0 || keypin_compact_job)
+    return -1;
+
+  keypin_compact_job_t *job = tor_malloc_zero(sizeof(*job));
+  tor_asprintf(&job->fname_new, "%s.new", keypin_store_fname);
+  job->added = smartlist_new();
+
+  /* Copy every live entry, so that the worker doesn't need to look at the
+   * store or the hash tables. */
+  const size_t n = HT_SIZE(&the_rsa_map) +
+    keypin_store_n_entries - keypin_store_n_superseded;
+  uint8_t *cp = job->entries =
+    tor_malloc((n ? n : 1) * KEYPIN_STORE_ENTRY_LEN);
+  for (uint32_t i = 0; i < keypin_store_n_entries; ++i) {
+    if (keypin_store_live_index(i) < 0)
+      continue;
+    memcpy(cp, keypin_store_rsa_id(i), KEYPIN_STORE_ENTRY_LEN);
+    cp += KEYPIN_STORE_ENTRY_LEN;
+  }
+  keypin_ent_t **ent;
+  HT_FOREACH(ent, rsamap, &the_rsa_map) {
+    memcpy(cp, (*ent)->rsa_id, DIGEST_LEN);
+    memcpy(cp + DIGEST_LEN, (*ent)->ed25519_key, DIGEST256_LEN);
+    cp += KEYPIN_STORE_ENTRY_LEN;
+  }
+  tor_assert(cp == job->entries + n * KEYPIN_STORE_ENTRY_LEN);
+  job->n_entries = (uint32_t)n;
+
+  keypin_compact_job = job;
+  if (cpuworker_get_n_threads() > 0 &&
+      cpuworker_queue_work(WQ_PRI_LOW, keypin_compact_job_threadfn,
+                           keypin_compact_job_replyfn, job)) {
+    return 0;
+  }
+  /* No worker threads: do it all now. */
+  keypin_compact_job_threadfn(NULL, job);
+  keypin_compact_job_replyfn(job);
+  return 0;
+#endif /* defined(_WIN32) */
+}
+
+/**
+ * If the key-pinning journal has grown long, start folding it into the
+ * key-pinning store, so that we don't have to parse it all at startup.
+ */
+void
+keypin_compact_store_if_needed(void)
+{
+  if (keypin_journal_n_entries >= KEYPIN_COMPACT_MIN_JOURNAL_ENTRIES)
+    keypin_compact_store();
+}
+
 /** Parse a single keypinning journal line entry from <b>cp</b>.  The input
  * does not need to be NUL-terminated, but it <em>does</em> need to have
  * KEYPIN_JOURNAL_LINE_LEN -1 bytes available to read.  Return a new entry
@@ -486,7 +1014,8 @@ keypin_parse_journal_line(const char *cp)
   }
 }
 
-/** Remove all entries from the keypinning table.*/
+/** Remove all entries from the keypinning table, and forget the
+ * key-pinning store.*/
 void
 keypin_clear(void)
 {
@@ -508,6 +1037,12 @@ keypin_clear(void)
   HT_CLEAR(edmap,&the_ed_map);
   HT_CLEAR(rsamap,&the_rsa_map);
 
+  keypin_store_unmap();
+  tor_free(keypin_store_fname);
+  keypin_journal_n_entries = 0;
+  if (keypin_compact_job)
+    keypin_compact_job->cancelled = 1;
+
   if (bad_entries) {
     log_warn(LD_BUG, "Found %d discrepencies in the keypin database.",
              bad_entries);
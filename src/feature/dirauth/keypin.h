@@ -15,6 +15,8 @@ int keypin_check(const uint8_t *rsa_id_digest,
 int keypin_open_journal(const char *fname);
 int keypin_close_journal(void);
 int keypin_load_journal(const char *fname);
+int keypin_load_store(const char *fname);
+void keypin_compact_store_if_needed(void);
 void keypin_clear(void);
 int keypin_check_lone_rsa(const uint8_t *rsa_id_digest);
 
@@ -39,6 +41,9 @@ typedef struct keypin_ent_st {
 
 STATIC keypin_ent_t * keypin_parse_journal_line(const char *cp);
 STATIC int keypin_load_journal_impl(const char *data, size_t size);
+STATIC char *keypin_store_encode(uint8_t *entries, uint32_t n,
+                                 size_t *len_out);
+STATIC int keypin_compact_store(void);
 
 MOCK_DECL(STATIC void, keypin_add_entry_to_map, (keypin_ent_t *ent));
 #endif /* defined(KEYPIN_PRIVATE) */
@@ -12,10 +12,13 @@
  * them make those decisions.
  **/
 
+#define PROCESS_DESCS_PRIVATE
 #include "core/or/or.h"
 #include "feature/dirauth/process_descs.h"
 
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/policies.h"
 #include "core/or/versions.h"
 #include "feature/dirauth/keypin.h"
@@ -24,10 +27,12 @@
 #include "feature/dircommon/directory.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/routerparse.h"
+#include "feature/dirparse/unparseable.h"
 #include "feature/nodelist/torcert.h"
 #include "feature/relay/router.h"
 
@@ -507,6 +512,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
 {
   node->is_valid = (authstatus & FP_INVALID) ? 0 : 1;
   node->is_bad_exit = (authstatus & FP_BADEXIT) ? 1 : 0;
+  node_select_nodelist_changed();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -516,8 +522,97 @@ WRA_MORE_SEVERE(was_router_added_t a, was_router_added_t b)
   return a < b;
 }
 
+/** If a single upload has at least this many router descriptors, and we
+ * have a threadpool, we check their signatures in parallel. */
+#define DESC_SIGCHECK_PARALLEL_MIN 16
+/** How many router descriptors does a thread check at a time when we check
+ * them in parallel? */
+#define DESC_SIGCHECK_BATCH 8
+
+/** Current values for DESC_SIGCHECK_PARALLEL_MIN and DESC_SIGCHECK_BATCH;
+ * tests may change them. */
+STATIC int desc_sigcheck_parallel_min = DESC_SIGCHECK_PARALLEL_MIN;
+STATIC int desc_sigcheck_batch = DESC_SIGCHECK_BATCH;
+
+/** How many router descriptors have been uploaded to us since we started,
+ * and how many of them had bad signatures? */
+static uint64_t desc_upload_n_descs = 0;
+static uint64_t desc_upload_n_bad_sigs = 0;
+/** How many uploads have we checked on the cpuworkers? */
+static uint64_t desc_upload_n_parallel = 0;
+/** How many microseconds have we spent on each stage of handling uploaded
+ * router descriptors? */
+static uint64_t desc_upload_parse_usec = 0;
+static uint64_t desc_upload_verify_usec = 0;
+static uint64_t desc_upload_insert_usec = 0;
+
+/** What the main thread and the cpuworkers need to check the signatures on
+ * the router descriptors from a single upload. */
+typedef struct desc_sigcheck_job_t {
+  /** The signatures to check. */
+  const smartlist_t *sigchecks;
+  /** The result of router_sigcheck_run() for each of <b>sigchecks</b>. */
+  int *results;
+} desc_sigcheck_job_t;
+
+/** Batch function for cpuworker_run_parallel(): run the checks of the
+ * desc_sigcheck_job_t in <b>arg</b> from <b>lo</b> through <b>hi</b>-1. */
+static void
+desc_sigcheck_job_run_batch(void *arg, int lo, int hi)
+{
+  desc_sigcheck_job_t *job = arg;
+  int i;
+  for (i = lo; i < hi; ++i)
+    job->results[i] = router_sigcheck_run(smartlist_get(job->sigchecks, i));
+}
+
+/**
+ * Check every router_sigcheck_t in <b>sigchecks</b>, and set the
+ * corresponding element of <b>results_out</b> to the result of
+ * router_sigcheck_run() on it.  If there are enough of them, and we have
+ * a threadpool, share them out in batches between this thread and the
+ * cpuworkers.  Return 1 if we used the cpuworkers, and 0 otherwise.
+ */
+STATIC int
+dirserv_check_descriptor_sigs(const smartlist_t *sigchecks, int *results_out)
+{
+  const int n_checks = smartlist_len(sigchecks);
+  desc_sigcheck_job_t job = { sigchecks, results_out };
+
+  if (n_checks < desc_sigcheck_parallel_min) {
+    desc_sigcheck_job_run_batch(&job, 0, n_checks);
+    return 0;
+  }
+
+  return cpuworker_run_parallel(n_checks, desc_sigcheck_batch,
+                                desc_sigcheck_job_run_batch, &job);
+}
+
+/** Log how long we have spent handling uploaded router descriptors since we
+ * started. */
+void
+dirserv_log_upload_heartbeat(void)
+{
+  if (desc_upload_n_descs == 0)
+    return;
+
+  log_notice(LD_HEARTBEAT,
+             "Since startup, we have handled %"PRIu64" uploaded router "
+             "descriptors (%"PRIu64" with bad signatures), spending "
+             "%"PRIu64" msec parsing them, %"PRIu64" msec checking their "
+             "signatures (%"PRIu64" uploads in parallel), and %"PRIu64" "
+             "msec adding them to the routerlist.",
+             desc_upload_n_descs, desc_upload_n_bad_sigs,
+             desc_upload_parse_usec / 1000, desc_upload_verify_usec / 1000,
+             desc_upload_n_parallel, desc_upload_insert_usec / 1000);
+}
+
 /** As for dirserv_add_descriptor(), but accepts multiple documents, and
- * returns the most severe error that occurred for any one of them. */
+ * returns the most severe error that occurred for any one of them.
+ *
+ * We handle router descriptors in three stages: we parse them all, then
+ * check all their signatures (in parallel, if there are many), and then add
+ * the good ones to the routerlist one by one. */
 was_router_added_t
 dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
                                  const char *source,
@@ -525,9 +620,10 @@ dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
 {
   was_router_added_t r, r_tmp;
   const char *msg_out;
-  smartlist_t *list;
+  smartlist_t *list, *sigchecks;
+  monotime_t start, end;
   const char *s;
-  int n_parsed = 0;
+  int n_parsed = 0, n_bad_sigs = 0;
   time_t now = time(NULL);
   char annotation_buf[ROUTER_ANNOTATION_BUF_LEN];
   char time_buf[ISO_TIME_LEN+1];
@@ -552,19 +648,48 @@ dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
 
   s = desc;
   list = smartlist_new();
-  if (!router_parse_list_from_string(&s, NULL, list, SAVED_NOWHERE, 0, 0,
-                                     annotation_buf, NULL)) {
-    SMARTLIST_FOREACH(list, routerinfo_t *, ri, {
-        msg_out = NULL;
-        tor_assert(ri->purpose == purpose);
-        r_tmp = dirserv_add_descriptor(ri, &msg_out, source);
-        if (WRA_MORE_SEVERE(r_tmp, r)) {
-          r = r_tmp;
-          *msg = msg_out;
-        }
-      });
-  }
-  n_parsed += smartlist_len(list);
+  sigchecks = smartlist_new();
+  monotime_get(&start);
+  if (!router_parse_list_deferring_sigs(&s, NULL, list, SAVED_NOWHERE, 0,
+                                        annotation_buf, sigchecks)) {
+    monotime_get(&end);
+    desc_upload_parse_usec += monotime_diff_usec(&start, &end);
+
+    int *sig_ok = tor_calloc(smartlist_len(list), sizeof(int));
+    start = end;
+    if (dirserv_check_descriptor_sigs(sigchecks, sig_ok))
+      ++desc_upload_n_parallel;
+    monotime_get(&end);
+    desc_upload_verify_usec += monotime_diff_usec(&start, &end);
+
+    start = end;
+    SMARTLIST_FOREACH_BEGIN(list, routerinfo_t *, ri) {
+      ++desc_upload_n_descs;
+      if (sig_ok[ri_sl_idx] < 0) {
+        /* Just as if we had failed to parse it. */
+        ++desc_upload_n_bad_sigs;
+        dump_desc(signed_descriptor_get_body(&ri->cache_info),
+                  "router descriptor");
+        routerinfo_free(ri);
+        ++n_bad_sigs;
+        continue;
+      }
+      msg_out = NULL;
+      tor_assert(ri->purpose == purpose);
+      r_tmp = dirserv_add_descriptor(ri, &msg_out, source);
+      if (WRA_MORE_SEVERE(r_tmp, r)) {
+        r = r_tmp;
+        *msg = msg_out;
+      }
+    } SMARTLIST_FOREACH_END(ri);
+    monotime_get(&end);
+    desc_upload_insert_usec += monotime_diff_usec(&start, &end);
+    tor_free(sig_ok);
+  }
+  SMARTLIST_FOREACH(sigchecks, router_sigcheck_t *, sc,
+                    router_sigcheck_free(sc));
+  smartlist_free(sigchecks);
+  n_parsed += smartlist_len(list) - n_bad_sigs;
   smartlist_clear(list);
 
   s = desc;
@@ -833,6 +958,7 @@ directory_remove_invalid(void)
       node->is_bad_exit = (r&FP_BADEXIT) ? 1: 0;
     }
   } SMARTLIST_FOREACH_END(node);
+  node_select_nodelist_changed();
 
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
@@ -35,4 +35,15 @@ void dirserv_set_node_flags_from_authoritative_status(node_t *node,
 
 int dirserv_would_reject_router(const routerstatus_t *rs);
 
+void dirserv_log_upload_heartbeat(void);
+
+#ifdef PROCESS_DESCS_PRIVATE
+STATIC int dirserv_check_descriptor_sigs(const smartlist_t *sigchecks,
+                                         int *results_out);
+#ifdef TOR_UNIT_TESTS
+extern int desc_sigcheck_parallel_min;
+extern int desc_sigcheck_batch;
+#endif
+#endif
+
 #endif
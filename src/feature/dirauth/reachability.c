@@ -9,6 +9,7 @@
  * running.
  */
 
+#define REACHABILITY_PRIVATE
 #include "core/or/or.h"
 #include "feature/dirauth/reachability.h"
 
@@ -23,11 +24,79 @@
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
 #include "feature/stats/rephist.h"
+#include "lib/evloop/timers.h"
+#include "lib/evloop/token_bucket.h"
 
 #include "feature/nodelist/node_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 #include "feature/nodelist/routerlist_st.h"
 
+#include "tor_queue.h"
+
+/** A relay that we want to test for reachability, or that we are testing
+ * right now. */
+typedef struct reachability_test_t {
+  /** The relay's identity digest. */
+  char identity[DIGEST_LEN];
+  /** True iff we have launched the test, and are waiting to hear back. */
+  unsigned int in_flight : 1;
+  /** When did we launch the test, in msec on the monotonic clock? */
+  uint64_t launched_msec;
+  /** Position in reachability_queue or reachability_in_flight. */
+  TOR_TAILQ_ENTRY(reachability_test_t) link;
+} reachability_test_t;
+
+TOR_TAILQ_HEAD(reachability_test_list_t, reachability_test_t);
+
+/** Map from identity digest to the reachability_test_t for every relay that
+ * is queued or in flight. */
+static digestmap_t *reachability_tests = NULL;
+/** Tests that we have yet to launch, in the order we will launch them. */
+static struct reachability_test_list_t reachability_queue =
+  TOR_TAILQ_HEAD_INITIALIZER(reachability_queue);
+/** Tests that we have launched, in the order we launched them.  Since every
+ * test gets the same time to finish, this is also the order in which they
+ * time out. */
+static struct reachability_test_list_t reachability_in_flight =
+  TOR_TAILQ_HEAD_INITIALIZER(reachability_in_flight);
+
+/** How long do we wait to hear back from a relay before we stop counting a
+ * test as in flight? */
+#define REACHABILITY_TEST_TIMEOUT_MSEC (60*1000)
+/** How often do we launch more tests, while any are queued? */
+#define REACHABILITY_DISPATCH_MSEC 100
+/** Never launch fewer than this many tests per second. */
+#define REACHABILITY_MIN_TESTS_PER_SEC 4
+
+/** True iff we spread our tests out in time; until the main loop is
+ * running, we launch every test at once. */
+static int reachability_pacing_enabled = 0;
+/** Timer for launching queued tests, and whether it is scheduled. */
+static tor_timer_t *reachability_dispatch_timer = NULL;
+static int reachability_dispatch_scheduled = 0;
+/** How many tests per second we launch, as a token bucket that holds
+ * thousandths of a test, and gains <b>rate</b> of them every millisecond. */
+static token_bucket_cfg_t reachability_bucket_cfg;
+static token_bucket_raw_t reachability_bucket;
+/** When did we last refill reachability_bucket, in msec on the monotonic
+ * clock? */
+static uint64_t reachability_bucket_refilled_msec = 0;
+
+/** Upper bounds, in msec, on the test latencies that we count in each
+ * bucket of reachability_latency_hist.  The last bucket gets the rest. */
+static const uint32_t reachability_latency_bounds[] = {
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000,
+};
+#define N_LATENCY_BUCKETS (ARRAY_LENGTH(reachability_latency_bounds) + 1)
+/** How many tests have we finished in each latency bucket? */
+static uint64_t reachability_latency_hist[N_LATENCY_BUCKETS];
+/** How many tests have we launched, and how many of those did we fold into
+ * an OR connection that we were already opening? */
+static uint64_t reachability_n_launched = 0;
+static uint64_t reachability_n_reused = 0;
+/** How many tests timed out? */
+static uint64_t reachability_n_timed_out = 0;
+
 /** Called when a TLS handshake has completed successfully with a
  * router listening at <b>address</b>:<b>or_port</b>, and has yielded
  * a certificate with digest <b>digest_rcvd</b>.
@@ -90,6 +159,7 @@ dirserv_orconn_tls_done(const tor_addr_t *addr,
         /* No rephist for IPv6.  */
         node->last_reachable6 = now;
       }
+      reachability_test_done(digest_rcvd, monotime_absolute_msec());
     }
   }
 }
@@ -119,11 +189,11 @@ dirserv_should_launch_reachability_test(const routerinfo_t *ri,
   return 0;
 }
 
-/** Helper function for dirserv_test_reachability(). Start a TLS
- * connection to <b>router</b>, and annotate it with when we started
- * the test. */
-void
-dirserv_single_reachability_test(time_t now, routerinfo_t *router)
+/** Start a TLS connection to <b>router</b>, and annotate it with when we
+ * started the test.  Call reachability_launch() instead of this, so that
+ * we keep track of the test. */
+MOCK_IMPL(void,
+dirserv_single_reachability_test,(time_t now, routerinfo_t *router))
 {
   const or_options_t *options = get_options();
   channel_t *chan = NULL;
@@ -168,15 +238,240 @@ dirserv_single_reachability_test(time_t now, routerinfo_t *router)
   }
 }
 
+/** Return true iff we are in the middle of opening an OR connection to
+ * <b>router</b> at its IPv4 address, so that finishing its handshake will
+ * tell us whether <b>router</b> is reachable. */
+static int
+reachability_connection_in_progress(const routerinfo_t *router)
+{
+  tor_addr_t addr;
+  channel_t *chan;
+  tor_addr_from_ipv4h(&addr, router->addr);
+  for (chan = channel_find_by_remote_identity(
+                                     router->cache_info.identity_digest, NULL);
+       chan; chan = channel_next_with_rsa_identity(chan)) {
+    if (CHANNEL_IS_OPENING(chan) && channel_is_outgoing(chan) &&
+        channel_matches_target_addr_for_extend(chan, &addr))
+      return 1;
+  }
+  return 0;
+}
+
+/** Launch the test <b>test</b>, which we have taken off the queue, and
+ * remember that it is in flight as of <b>now_msec</b>.  Return 0 on
+ * success, or -1 if there is no longer anything to test. */
+static int
+reachability_launch(reachability_test_t *test, uint64_t now_msec)
+{
+  routerinfo_t *router = router_get_mutable_by_digest(test->identity);
+  if (!router || router_is_me(router)) {
+    digestmap_remove(reachability_tests, test->identity);
+    tor_free(test);
+    return -1;
+  }
+
+  /* If we're already connecting to the relay, its handshake will answer
+   * our question; but we can only tell that for IPv4. */
+  const int wants_ipv6 = get_options()->AuthDirHasIPv6Connectivity == 1 &&
+    !tor_addr_is_null(&router->ipv6_addr);
+  if (!wants_ipv6 && reachability_connection_in_progress(router)) {
+    ++reachability_n_reused;
+  } else {
+    dirserv_single_reachability_test(approx_time(), router);
+  }
+  ++reachability_n_launched;
+
+  test->in_flight = 1;
+  test->launched_msec = now_msec;
+  TOR_TAILQ_INSERT_TAIL(&reachability_in_flight, test, link);
+  return 0;
+}
+
+/** Stop counting every test that was launched more than
+ * REACHABILITY_TEST_TIMEOUT_MSEC before <b>now_msec</b> as in flight. */
+static void
+reachability_expire_tests(uint64_t now_msec)
+{
+  reachability_test_t *test;
+  while ((test = TOR_TAILQ_FIRST(&reachability_in_flight)) &&
+         test->launched_msec + REACHABILITY_TEST_TIMEOUT_MSEC <= now_msec) {
+    TOR_TAILQ_REMOVE(&reachability_in_flight, test, link);
+    digestmap_remove(reachability_tests, test->identity);
+    tor_free(test);
+    ++reachability_n_timed_out;
+  }
+}
+
+/** We have heard back from the relay with identity <b>identity</b> at
+ * <b>now_msec</b>: if we were testing it, note how long that took. */
+STATIC void
+reachability_test_done(const char *identity, uint64_t now_msec)
+{
+  reachability_test_t *test;
+  if (!reachability_tests)
+    return;
+  test = digestmap_get(reachability_tests, identity);
+  if (!test || !test->in_flight)
+    return;
+
+  const uint64_t latency = now_msec > test->launched_msec ?
+    now_msec - test->launched_msec : 0;
+  unsigned i;
+  for (i = 0; i < N_LATENCY_BUCKETS - 1; ++i) {
+    if (latency <= reachability_latency_bounds[i])
+      break;
+  }
+  ++reachability_latency_hist[i];
+
+  TOR_TAILQ_REMOVE(&reachability_in_flight, test, link);
+  digestmap_remove(reachability_tests, identity);
+  tor_free(test);
+}
+
+/** Timer callback: launch more of the queued tests. */
+static void
+reachability_dispatch_cb(tor_timer_t *timer, void *arg,
+                         const struct monotime_t *now)
+{
+  (void) timer;
+  (void) arg;
+  (void) now;
+  reachability_dispatch_scheduled = 0;
+  reachability_dispatch(monotime_absolute_msec());
+}
+
+/** Launch as many queued tests as our rate limit allows as of
+ * <b>now_msec</b>.  If that leaves any tests in the queue, schedule another
+ * try. */
+STATIC void
+reachability_dispatch(uint64_t now_msec)
+{
+  const int32_t cost = 1000;
+  reachability_test_t *test;
+
+  reachability_expire_tests(now_msec);
+
+  if (reachability_pacing_enabled) {
+    if (now_msec > reachability_bucket_refilled_msec) {
+      const uint64_t elapsed = now_msec - reachability_bucket_refilled_msec;
+      token_bucket_raw_refill_steps(&reachability_bucket,
+                                    &reachability_bucket_cfg,
+                                    (uint32_t) MIN(elapsed, UINT32_MAX));
+      reachability_bucket_refilled_msec = now_msec;
+    }
+  }
+
+  while ((test = TOR_TAILQ_FIRST(&reachability_queue))) {
+    if (reachability_pacing_enabled &&
+        reachability_bucket.bucket < cost)
+      break;
+    TOR_TAILQ_REMOVE(&reachability_queue, test, link);
+    if (reachability_launch(test, now_msec) == 0 &&
+        reachability_pacing_enabled)
+      token_bucket_raw_dec(&reachability_bucket, cost);
+  }
+
+  if (reachability_pacing_enabled && TOR_TAILQ_FIRST(&reachability_queue)) {
+    const struct timeval delay = { 0, REACHABILITY_DISPATCH_MSEC * 1000 };
+    if (!reachability_dispatch_timer)
+      reachability_dispatch_timer =
+        timer_new(reachability_dispatch_cb, NULL);
+    if (!reachability_dispatch_scheduled) {
+      timer_schedule(reachability_dispatch_timer, &delay);
+      reachability_dispatch_scheduled = 1;
+    }
+  }
+}
+
+/** Launch at most <b>tests_per_sec</b> reachability tests per second from
+ * now on. */
+STATIC void
+reachability_set_rate(uint32_t tests_per_sec)
+{
+  if (tests_per_sec == 0)
+    tests_per_sec = 1;
+  if (reachability_bucket_cfg.rate == tests_per_sec)
+    return;
+  /* We allow a burst of a second's worth of tests. */
+  token_bucket_cfg_init(&reachability_bucket_cfg, tests_per_sec,
+                        tests_per_sec * 1000);
+  if (reachability_bucket_refilled_msec == 0) {
+    token_bucket_raw_reset(&reachability_bucket, &reachability_bucket_cfg);
+    reachability_bucket_refilled_msec = monotime_absolute_msec();
+  } else {
+    token_bucket_raw_adjust(&reachability_bucket, &reachability_bucket_cfg);
+  }
+}
+
+/** Add <b>router</b> to the queue of relays to test for reachability, at
+ * the front if <b>urgent</b> is true, and at the back otherwise.  If we're
+ * already testing it, do nothing, unless <b>urgent</b> is true: then the
+ * test in flight may be about an address or a state that the relay has
+ * left behind, so forget about it and queue a fresh one. */
+static void
+reachability_enqueue(const routerinfo_t *router, int urgent)
+{
+  const char *id = router->cache_info.identity_digest;
+  reachability_test_t *test;
+
+  if (!reachability_tests)
+    reachability_tests = digestmap_new();
+  test = digestmap_get(reachability_tests, id);
+  if (test) {
+    if (urgent) {
+      if (test->in_flight) {
+        TOR_TAILQ_REMOVE(&reachability_in_flight, test, link);
+        test->in_flight = 0;
+      } else {
+        TOR_TAILQ_REMOVE(&reachability_queue, test, link);
+      }
+      TOR_TAILQ_INSERT_HEAD(&reachability_queue, test, link);
+    }
+    return;
+  }
+
+  test = tor_malloc_zero(sizeof(reachability_test_t));
+  memcpy(test->identity, id, DIGEST_LEN);
+  digestmap_set(reachability_tests, test->identity, test);
+  if (urgent)
+    TOR_TAILQ_INSERT_HEAD(&reachability_queue, test, link);
+  else
+    TOR_TAILQ_INSERT_TAIL(&reachability_queue, test, link);
+}
+
+/** Test <b>router</b> for reachability as soon as our rate limit allows,
+ * ahead of the relays that we test in the usual rotation.  We use this
+ * for relays that have just come up, or moved. */
+void
+dirserv_test_reachability_soon(routerinfo_t *router)
+{
+  tor_assert(router);
+  reachability_enqueue(router, 1);
+  reachability_dispatch(monotime_absolute_msec());
+}
+
+/** Called once the main loop is running: from now on, spread our
+ * reachability tests out in time, rather than launching each batch at
+ * once. */
+void
+dirserv_reachability_enable_pacing(void)
+{
+  reachability_pacing_enabled = 1;
+  if (!reachability_bucket_cfg.rate)
+    reachability_set_rate(REACHABILITY_MIN_TESTS_PER_SEC);
+}
+
 /** Auth dir server only: load balance such that we only
  * try a few connections per call.
  *
  * The load balancing is such that if we get called once every ten
  * seconds, we will cycle through all the tests in
- * REACHABILITY_TEST_CYCLE_PERIOD seconds (a bit over 20 minutes).
+ * REACHABILITY_TEST_CYCLE_PERIOD seconds (a bit over 20 minutes).  We
+ * queue the tests for each call, and then launch them at an even pace
+ * until the next call, rather than all at once.
  */
 void
-dirserv_test_reachability(time_t now)
+dirserv_test_reachability(void)
 {
   /* XXX decide what to do here; see or-talk thread "purging old router
    * information, revocation." -NM
@@ -200,8 +495,75 @@ dirserv_test_reachability(time_t now)
 //    if (router->cache_info.published_on > cutoff)
 //      continue;
     if ((((uint8_t)id_digest[0]) % REACHABILITY_MODULO_PER_TEST) == ctr) {
-      dirserv_single_reachability_test(now, router);
+      reachability_enqueue(router, 0);
     }
   } SMARTLIST_FOREACH_END(router);
   ctr = (ctr + 1) % REACHABILITY_MODULO_PER_TEST; /* increment ctr */
+
+  /* Aim to get through each batch well before the next one, with room to
+   * spare for the relays we test out of turn. */
+  const int n_routers = smartlist_len(rl->routers);
+  const int per_sec = 2 * CEIL_DIV(n_routers, REACHABILITY_TEST_CYCLE_PERIOD);
+  reachability_set_rate(MAX(per_sec, REACHABILITY_MIN_TESTS_PER_SEC));
+  reachability_dispatch(monotime_absolute_msec());
+}
+
+/** Log how many reachability tests we have run since startup, and how
+ * long the relays took to answer them. */
+void
+dirserv_reachability_log_heartbeat(void)
+{
+  uint64_t n_done = 0, seen = 0;
+  uint32_t pct_msec[3] = { 0, 0, 0 };
+  static const int pcts[3] = { 50, 90, 99 };
+  unsigned i, p = 0;
+
+  if (!reachability_n_launched)
+    return;
+
+  for (i = 0; i < N_LATENCY_BUCKETS; ++i)
+    n_done += reachability_latency_hist[i];
+  /* Report each percentile as the upper bound of the bucket it falls in. */
+  for (i = 0; i < N_LATENCY_BUCKETS && p < 3; ++i) {
+    seen += reachability_latency_hist[i];
+    while (p < 3 && n_done && seen * 100 >= n_done * pcts[p]) {
+      pct_msec[p++] = (i < N_LATENCY_BUCKETS - 1) ?
+        reachability_latency_bounds[i] : REACHABILITY_TEST_TIMEOUT_MSEC;
+    }
+  }
+
+  log_notice(LD_HEARTBEAT,
+             "Reachability tests since startup: %"PRIu64" launched "
+             "(%"PRIu64" using a connection we were already opening), "
+             "%"PRIu64" answered, %"PRIu64" unanswered after %d seconds. "
+             "Relays answered 50%%/90%%/99%% of tests within "
+             "%u/%u/%u msec. %d tests queued or in flight.",
+             reachability_n_launched, reachability_n_reused, n_done,
+             reachability_n_timed_out, REACHABILITY_TEST_TIMEOUT_MSEC / 1000,
+             pct_msec[0], pct_msec[1], pct_msec[2],
+             reachability_tests ? digestmap_size(reachability_tests) : 0);
+}
+
+/** Release all storage held for reachability testing. */
+void
+dirserv_reachability_free_all(void)
+{
+  reachability_test_t *test;
+  while ((test = TOR_TAILQ_FIRST(&reachability_queue))) {
+    TOR_TAILQ_REMOVE(&reachability_queue, test, link);
+    tor_free(test);
+  }
+  while ((test = TOR_TAILQ_FIRST(&reachability_in_flight))) {
+    TOR_TAILQ_REMOVE(&reachability_in_flight, test, link);
+    tor_free(test);
+  }
+  digestmap_free(reachability_tests, NULL);
+  timer_free(reachability_dispatch_timer);
+  reachability_dispatch_scheduled = 0;
+  reachability_pacing_enabled = 0;
+  memset(&reachability_bucket_cfg, 0, sizeof(reachability_bucket_cfg));
+  reachability_bucket_refilled_msec = 0;
+  memset(reachability_latency_hist, 0, sizeof(reachability_latency_hist));
+  reachability_n_launched = reachability_n_reused = 0;
+  reachability_n_timed_out = 0;
 }
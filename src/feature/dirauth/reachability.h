@@ -30,7 +30,18 @@ void dirserv_orconn_tls_done(const tor_addr_t *addr,
                              const struct ed25519_public_key_t *ed_id_rcvd);
 int dirserv_should_launch_reachability_test(const routerinfo_t *ri,
                                             const routerinfo_t *ri_old);
-void dirserv_single_reachability_test(time_t now, routerinfo_t *router);
-void dirserv_test_reachability(time_t now);
+MOCK_DECL(void, dirserv_single_reachability_test,
+          (time_t now, routerinfo_t *router));
+void dirserv_test_reachability(void);
+void dirserv_test_reachability_soon(routerinfo_t *router);
+void dirserv_reachability_enable_pacing(void);
+void dirserv_reachability_log_heartbeat(void);
+void dirserv_reachability_free_all(void);
+
+#ifdef REACHABILITY_PRIVATE
+STATIC void reachability_test_done(const char *identity, uint64_t now_msec);
+STATIC void reachability_dispatch(uint64_t now_msec);
+STATIC void reachability_set_rate(uint32_t tests_per_sec);
+#endif
 
 #endif
@@ -21,6 +21,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -234,10 +235,11 @@ router_counts_toward_thresholds(const node_t *node, time_t now,
 void
 dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
 {
-  int n_active, n_active_nonexit, n_familiar;
+  int n_nodes, n_active, n_active_nonexit, n_familiar;
   uint32_t *uptimes, *bandwidths_kb, *bandwidths_excluding_exits_kb;
-  long *tks;
+  long *tks, *tks_to_select;
   double *mtbfs, *wfus;
+  const char **ids;
   smartlist_t *nodelist;
   time_t now = time(NULL);
   const or_options_t *options = get_options();
@@ -258,23 +260,27 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
 
   nodelist_assert_ok();
   nodelist = nodelist_get_list();
+  n_nodes = smartlist_len(nodelist);
 
-  /* Initialize arrays that will hold values for each router.  We'll
-   * sort them and use that to compute thresholds. */
+  /* Initialize arrays that will hold values for each router: one column per
+   * value, filled in a single pass over the nodelist.  We'll select the
+   * thresholds from them in place. */
   n_active = n_active_nonexit = 0;
   /* Uptime for every active router. */
-  uptimes = tor_calloc(smartlist_len(nodelist), sizeof(uint32_t));
+  uptimes = tor_calloc(n_nodes, sizeof(uint32_t));
   /* Bandwidth for every active router. */
-  bandwidths_kb = tor_calloc(smartlist_len(nodelist), sizeof(uint32_t));
+  bandwidths_kb = tor_calloc(n_nodes, sizeof(uint32_t));
   /* Bandwidth for every active non-exit router. */
-  bandwidths_excluding_exits_kb =
-    tor_calloc(smartlist_len(nodelist), sizeof(uint32_t));
+  bandwidths_excluding_exits_kb = tor_calloc(n_nodes, sizeof(uint32_t));
   /* Weighted mean time between failure for each active router. */
-  mtbfs = tor_calloc(smartlist_len(nodelist), sizeof(double));
-  /* Time-known for each active router. */
-  tks = tor_calloc(smartlist_len(nodelist), sizeof(long));
-  /* Weighted fractional uptime for each active router. */
-  wfus = tor_calloc(smartlist_len(nodelist), sizeof(double));
+  mtbfs = tor_calloc(n_nodes, sizeof(double));
+  /* Time-known for each active router, and a copy that we can reorder. */
+  tks = tor_calloc(n_nodes, sizeof(long));
+  tks_to_select = tor_calloc(n_nodes, sizeof(long));
+  /* Identity of each active router. */
+  ids = tor_calloc(n_nodes, sizeof(const char *));
+  /* Weighted fractional uptime for each familiar active router. */
+  wfus = tor_calloc(n_nodes, sizeof(double));
 
   /* Now, fill in the arrays. */
   SMARTLIST_FOREACH_BEGIN(nodelist, node_t *, node) {
@@ -297,6 +303,7 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
       /* resolve spurious clang shallow analysis null pointer errors */
       tor_assert(ri);
 
+      ids[n_active] = id;
       uptimes[n_active] = (uint32_t)real_uptime(ri, now);
       mtbfs[n_active] = rep_hist_get_stability(id, now);
       tks  [n_active] = rep_hist_get_weighted_time_known(id, now);
@@ -308,21 +315,32 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
       ++n_active;
     }
   } SMARTLIST_FOREACH_END(node);
+  /* We may have changed some Exit flags above. */
+  node_select_nodelist_changed();
+  memcpy(tks_to_select, tks, n_active * sizeof(long));
 
-  /* Now, compute thresholds. */
+  /* Now, compute thresholds.  Each select_nth_*() call leaves its array
+   * partitioned around the element it found, so that we can find the next
+   * higher threshold by looking only at the elements above it. */
   if (n_active) {
+    const int eighth = n_active/8, quarter = n_active/4;
+    uint32_t quarter_bandwidth_kb;
     /* The median uptime is stable. */
-    stable_uptime = median_uint32(uptimes, n_active);
+    stable_uptime = select_nth_uint32(uptimes, n_active, (n_active-1)/2);
     /* The median mtbf is stable, if we have enough mtbf info */
-    stable_mtbf = median_double(mtbfs, n_active);
+    stable_mtbf = select_nth_double(mtbfs, n_active, (n_active-1)/2);
     /* The 12.5th percentile bandwidth is fast. */
-    fast_bandwidth_kb = find_nth_uint32(bandwidths_kb, n_active, n_active/8);
-    /* (Now bandwidths is sorted.) */
+    fast_bandwidth_kb = select_nth_uint32(bandwidths_kb, n_active, eighth);
+    quarter_bandwidth_kb = select_nth_uint32(bandwidths_kb + eighth,
+                                             n_active - eighth,
+                                             quarter - eighth);
     if (fast_bandwidth_kb < RELAY_REQUIRED_MIN_BANDWIDTH/(2 * 1000))
-      fast_bandwidth_kb = bandwidths_kb[n_active/4];
+      fast_bandwidth_kb = quarter_bandwidth_kb;
+    /* The third quartile bandwidth is enough for a guard. */
     guard_bandwidth_including_exits_kb =
-      third_quartile_uint32(bandwidths_kb, n_active);
-    guard_tk = find_nth_long(tks, n_active, n_active/8);
+      select_nth_uint32(bandwidths_kb + quarter, n_active - quarter,
+                        (n_active*3)/4 - quarter);
+    guard_tk = select_nth_long(tks_to_select, n_active, eighth);
   }
 
   if (guard_tk > TIME_KNOWN_TO_GUARANTEE_FAMILIAR)
@@ -358,20 +376,13 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
   /* Now that we have a time-known that 7/8 routers are known longer than,
    * fill wfus with the wfu of every such "familiar" router. */
   n_familiar = 0;
-
-  SMARTLIST_FOREACH_BEGIN(nodelist, node_t *, node) {
-      if (router_counts_toward_thresholds(node, now,
-                                          omit_as_sybil, require_mbw)) {
-        routerinfo_t *ri = node->ri;
-        const char *id = ri->cache_info.identity_digest;
-        long tk = rep_hist_get_weighted_time_known(id, now);
-        if (tk < guard_tk)
-          continue;
-        wfus[n_familiar++] = rep_hist_get_weighted_fractional_uptime(id, now);
-      }
-  } SMARTLIST_FOREACH_END(node);
+  for (int i = 0; i < n_active; ++i) {
+    if (tks[i] < guard_tk)
+      continue;
+    wfus[n_familiar++] = rep_hist_get_weighted_fractional_uptime(ids[i], now);
+  }
   if (n_familiar)
-    guard_wfu = median_double(wfus, n_familiar);
+    guard_wfu = select_nth_double(wfus, n_familiar, (n_familiar-1)/2);
   if (guard_wfu > WFU_TO_GUARANTEE_GUARD)
     guard_wfu = WFU_TO_GUARANTEE_GUARD;
 
@@ -379,8 +390,8 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
 
   if (n_active_nonexit) {
     guard_bandwidth_excluding_exits_kb =
-      find_nth_uint32(bandwidths_excluding_exits_kb,
-                      n_active_nonexit, n_active_nonexit*3/4);
+      select_nth_uint32(bandwidths_excluding_exits_kb,
+                        n_active_nonexit, n_active_nonexit*3/4);
   }
 
   log_info(LD_DIRSERV,
@@ -403,6 +414,8 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
   tor_free(bandwidths_kb);
   tor_free(bandwidths_excluding_exits_kb);
   tor_free(tks);
+  tor_free(tks_to_select);
+  tor_free(ids);
   tor_free(wfus);
 }
 
@@ -529,6 +542,7 @@ dirserv_set_router_is_running(routerinfo_t *router, time_t now)
   }
 
   node->is_running = answer;
+  node_select_node_flags_changed(node);
 }
 
 /** Extract status information from <b>ri</b> and from other authority
@@ -437,6 +437,34 @@ consensus_cache_entry_get_body(const consensus_cache_entry_t *ent,
   return 0;
 }
 
+/**
+ * Open the file that holds <b>ent</b> for reading.  On success, set
+ * *<b>fd_out</b> to the new file descriptor, *<b>offset_out</b> to the
+ * offset of the body within the file, and return 0.  The caller must close
+ * the file.  On failure return -1.
+ */
+int
+consensus_cache_entry_open_body(const consensus_cache_entry_t *ent,
+                                int *fd_out, off_t *offset_out)
+{
+  const uint8_t *body;
+  size_t bodylen;
+
+  /* We need the mapping to find out where the body starts. */
+  if (consensus_cache_entry_get_body(ent, &body, &bodylen) < 0)
+    return -1;
+  if (! ent->in_cache)
+    return -1;
+
+  int fd = storage_dir_open(ent->in_cache->dir, ent->fname);
+  if (fd < 0)
+    return -1;
+
+  *fd_out = fd;
+  *offset_out = (off_t) (body - (const uint8_t *)ent->map->data);
+  return 0;
+}
+
 /**
  * Unmap every mmap'd element of <b>cache</b> that has been unused
  * since <b>cutoff</b>.
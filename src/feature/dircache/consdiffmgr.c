@@ -25,6 +25,8 @@
 #include "lib/evloop/workqueue.h"
 #include "lib/compress/compress.h"
 #include "lib/encoding/confline.h"
+#include "lib/lock/compat_mutex.h"
+#include "lib/time/compat_time.h"
 
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
@@ -64,6 +66,9 @@
 #define LABEL_FROM_VALID_AFTER "from-valid-after"
 /* What kind of compression was used? */
 #define LABEL_COMPRESSION_TYPE "compression"
+/* Diff only: if the diff was made by composing two other diffs, the SHA3
+ * digest-in-full of the consensus between them. */
+#define LABEL_COMPOSED_VIA_SHA3_DIGEST "composed-via-sha3-digest"
 /** @} */
 
 #define DOCTYPE_CONSENSUS "consensus"
@@ -177,6 +182,24 @@ typedef struct cdm_diff_t {
 /** Hashtable mapping flavor and source consensus digest to status. */
 static HT_HEAD(cdm_diff_ht, cdm_diff_t) cdm_diff_ht = HT_INITIALIZER();
 
+/**
+ * How much work have our workers done making diffs to a single consensus?
+ */
+typedef struct cdm_diff_stats_t {
+  /** SHA3-256 digest of the consensus that the diffs are _to. */
+  uint8_t target_sha3[DIGEST256_LEN];
+  /** How many diffs have we computed by comparing two consensuses? */
+  unsigned n_direct;
+  /** How many diffs have we made by composing two other diffs? */
+  unsigned n_composed;
+  /** How many microseconds have workers spent making these diffs and
+   * compressing them? */
+  uint64_t usec;
+} cdm_diff_stats_t;
+
+/** Work done on diffs to the latest consensus of each flavor. */
+static cdm_diff_stats_t cdm_diff_stats[N_CONSENSUS_FLAVORS];
+
 /**
  * Configuration for this module
  */
@@ -190,8 +213,14 @@ static consdiff_cfg_t consdiff_cfg = {
 static int consdiffmgr_ensure_space_for_files(int n);
 static int consensus_queue_compression_work(const char *consensus,
                                             const networkstatus_t *as_parsed);
+typedef struct cdm_diff_target_t cdm_diff_target_t;
+static cdm_diff_target_t *cdm_diff_target_new(consensus_cache_entry_t *ent);
+static void cdm_diff_target_decref(cdm_diff_target_t *target);
 static int consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                                          consensus_cache_entry_t *diff_to);
+                                          cdm_diff_target_t *diff_to,
+                                       consensus_cache_entry_t *compose_diff1,
+                                       consensus_cache_entry_t *compose_diff2,
+                                          int rescan_when_done);
 static void consdiffmgr_set_cache_flags(void);
 
 /* =====
@@ -286,6 +315,74 @@ cdm_diff_ht_check_and_note_pending(consensus_flavor_t flav,
   return result;
 }
 
+/**
+ * Log how much work we did making diffs to the latest consensus of flavor
+ * <b>flav</b>.
+ */
+static void
+cdm_diff_stats_log(consensus_flavor_t flav)
+{
+  const cdm_diff_stats_t *st = &cdm_diff_stats[flav];
+  if (st->n_direct + st->n_composed == 0)
+    return;
+  char hex[HEX_DIGEST256_LEN+1];
+  base16_encode(hex, sizeof(hex), (const char *)st->target_sha3,
+                DIGEST256_LEN);
+  log_info(LD_DIRSERV, "Made %u %s consensus diffs to %s (%u by composing "
+           "other diffs), using %"PRIu64" msec of worker time.",
+           st->n_direct + st->n_composed,
+           networkstatus_get_flavor_name(flav), hex, st->n_composed,
+           st->usec / 1000);
+}
+
+/**
+ * Note that a worker spent <b>usec</b> microseconds making or compressing a
+ * diff of type <b>flav</b> to the consensus with the SHA3-256 digest
+ * <b>target_sha3</b>.  If it made a new diff, <b>made</b> is 1 if it
+ * compared two consensuses, and 2 if it composed two other diffs.
+ */
+static void
+cdm_diff_stats_note(consensus_flavor_t flav, const uint8_t *target_sha3,
+                    int made, int64_t usec)
+{
+  cdm_diff_stats_t *st = &cdm_diff_stats[flav];
+  if (fast_memneq(st->target_sha3, target_sha3, DIGEST256_LEN)) {
+    /* This is the first diff to a new consensus: the ones to the last
+     * consensus are done. */
+    cdm_diff_stats_log(flav);
+    memset(st, 0, sizeof(*st));
+    memcpy(st->target_sha3, target_sha3, DIGEST256_LEN);
+  }
+  if (made == 1)
+    ++st->n_direct;
+  else if (made == 2)
+    ++st->n_composed;
+  if (usec > 0)
+    st->usec += usec;
+}
+
+/**
+ * Return the status of the diff of type <b>flav</b> between consensuses with
+ * the two provided SHA3-256 digests, compressed with <b>method</b>, or -1 if
+ * we know nothing about that diff.
+ */
+static int
+cdm_diff_ht_get_status(consensus_flavor_t flav,
+                       const uint8_t *from_sha3,
+                       const uint8_t *target_sha3,
+                       compress_method_t method)
+{
+  struct cdm_diff_t search, *ent;
+  memset(&search, 0, sizeof(cdm_diff_t));
+  search.flavor = flav;
+  search.compress_method = method;
+  memcpy(search.from_sha3, from_sha3, DIGEST256_LEN);
+  ent = HT_FIND(cdm_diff_ht, &cdm_diff_ht, &search);
+  if (!ent || fast_memneq(ent->target_sha3, target_sha3, DIGEST256_LEN))
+    return -1;
+  return ent->cdm_diff_status;
+}
+
 /**
  * Update the status of the diff of type <b>flav</b> between consensuses with
  * the two provided SHA3-256 digests, so that its status becomes
@@ -577,6 +674,56 @@ sort_and_find_most_recent(smartlist_t *lst)
   }
 }
 
+/**
+ * Helper: Given a list <b>lst</b> sorted by LABEL_VALID_AFTER, return the
+ * most recent entry whose valid-after time is earlier than that of the last
+ * entry.  Return NULL if there is no such entry.
+ */
+static consensus_cache_entry_t *
+find_previous_in_sorted(const smartlist_t *lst)
+{
+  const int n = smartlist_len(lst);
+  if (n == 0)
+    return NULL;
+  const char *latest_va =
+    consensus_cache_entry_get_value(smartlist_get(lst, n - 1),
+                                    LABEL_VALID_AFTER);
+  for (int i = n - 2; i >= 0; --i) {
+    consensus_cache_entry_t *ent = smartlist_get(lst, i);
+    if (strcmp_opt(consensus_cache_entry_get_value(ent, LABEL_VALID_AFTER),
+                   latest_va))
+      return ent;
+  }
+  return NULL;
+}
+
+/**
+ * Helper: Return the uncompressed diff of flavor <b>flavname</b> from the
+ * consensus whose hex-encoded SHA3 digest-as-signed is <b>from_hex</b> to
+ * the consensus whose hex-encoded SHA3 digest is <b>to_hex</b>, or NULL if
+ * we have no such diff.
+ */
+static consensus_cache_entry_t *
+find_uncompressed_diff(const char *flavname,
+                       const char *from_hex, const char *to_hex)
+{
+  consensus_cache_entry_t *result = NULL;
+  smartlist_t *diffs = smartlist_new();
+  consensus_cache_find_all(diffs, cdm_cache_get(),
+                           LABEL_FROM_SHA3_DIGEST, from_hex);
+  consensus_cache_filter_list(diffs, LABEL_TARGET_SHA3_DIGEST, to_hex);
+  consensus_cache_filter_list(diffs, LABEL_DOCTYPE, DOCTYPE_CONSENSUS_DIFF);
+  consensus_cache_filter_list(diffs, LABEL_FLAVOR, flavname);
+  SMARTLIST_FOREACH_BEGIN(diffs, consensus_cache_entry_t *, diff) {
+    if (!consensus_cache_entry_get_value(diff, LABEL_COMPRESSION_TYPE)) {
+      result = diff;
+      break;
+    }
+  } SMARTLIST_FOREACH_END(diff);
+  smartlist_free(diffs);
+  return result;
+}
+
 /** Return i such that compress_consensus_with[i] == method. Return
  * -1 if no such i exists. */
 static int
@@ -727,7 +874,8 @@ consdiffmgr_cleanup(void)
   } SMARTLIST_FOREACH_END(ent);
 
   // 2. Delete all diffs that lead to a consensus whose valid-after is not the
-  // latest.
+  // latest.  If we compose diffs, keep the uncompressed ones that lead to
+  // the consensus before the latest: we'll compose new diffs from them.
   for (int flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
     const char *flavname = networkstatus_get_flavor_name(flav);
     /* Determine the most recent consensus of this flavor */
@@ -743,6 +891,13 @@ consdiffmgr_cleanup(void)
                                       LABEL_SHA3_DIGEST_UNCOMPRESSED);
     if (BUG(most_recent_sha3 == NULL))
       continue; // LCOV_EXCL_LINE
+    const char *previous_sha3 = NULL;
+    if (get_options()->ComposeConsensusDiffs) {
+      consensus_cache_entry_t *previous = find_previous_in_sorted(consensuses);
+      if (previous)
+        previous_sha3 = consensus_cache_entry_get_value(previous,
+                                               LABEL_SHA3_DIGEST_UNCOMPRESSED);
+    }
 
     /* consider all such-flavored diffs, and look to see if they match. */
     consensus_cache_find_all(diffs, cdm_cache_get(),
@@ -754,6 +909,10 @@ consdiffmgr_cleanup(void)
       if (!this_diff_target_sha3)
         continue;
       if (strcmp(this_diff_target_sha3, most_recent_sha3)) {
+        if (previous_sha3 &&
+            !strcmp(this_diff_target_sha3, previous_sha3) &&
+            !consensus_cache_entry_get_value(diff, LABEL_COMPRESSION_TYPE))
+          continue;
         consensus_cache_entry_mark_for_removal(diff);
         ++n_to_delete;
       }
@@ -894,6 +1053,7 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   smartlist_t *diffs = NULL;
   smartlist_t *compute_diffs_from = NULL;
   strmap_t *have_diff_from = NULL;
+  cdm_diff_target_t *target = NULL;
 
   // look for the most recent consensus, and for all previous in-range
   // consensuses.  Do they all have diffs to it?
@@ -974,7 +1134,48 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   //    target consensuses.
   cdm_diff_ht_purge(flavor, most_recent_sha3);
 
-  // 5. Actually launch the requests.
+  // 5. If we compose diffs, find the consensus before the most recent one,
+  //    and the diff from it to the most recent one.  Until that diff is
+  //    done, we hold off on the others: we'll come back for them when it is.
+  consensus_cache_entry_t *previous = NULL;
+  consensus_cache_entry_t *diff_from_previous = NULL;
+  const char *previous_sha3_hex = NULL;
+  int await_diff_from_previous = 0;
+  if (get_options()->ComposeConsensusDiffs && smartlist_len(matches)) {
+    previous = smartlist_get(matches, 0);
+    uint8_t previous_sha3[DIGEST256_LEN];
+    const char *most_recent_sha3_hex =
+      consensus_cache_entry_get_value(most_recent,
+                                      LABEL_SHA3_DIGEST_UNCOMPRESSED);
+    previous_sha3_hex =
+      consensus_cache_entry_get_value(previous,
+                                      LABEL_SHA3_DIGEST_UNCOMPRESSED);
+    if (previous_sha3_hex &&
+        cdm_entry_get_sha3_value(previous_sha3, previous,
+                                 LABEL_SHA3_DIGEST_AS_SIGNED) == 0) {
+      const char *previous_as_signed_hex =
+        consensus_cache_entry_get_value(previous,
+                                        LABEL_SHA3_DIGEST_AS_SIGNED);
+      diff_from_previous = find_uncompressed_diff(flavname,
+                                                  previous_as_signed_hex,
+                                                  most_recent_sha3_hex);
+      if (!diff_from_previous) {
+        const int status = cdm_diff_ht_get_status(flavor, previous_sha3,
+                                                  most_recent_sha3,
+                                                  NO_METHOD);
+        await_diff_from_previous =
+          (status == CDM_DIFF_IN_PROGRESS ||
+           (status == -1 && smartlist_contains(compute_diffs_from,
+                                               previous)));
+      }
+    } else {
+      previous = NULL;
+    }
+  }
+
+  // 6. Actually launch the requests.  They all share a single copy of the
+  //    most recent consensus, which the first of them to run will prepare.
+  target = cdm_diff_target_new(most_recent);
   SMARTLIST_FOREACH_BEGIN(compute_diffs_from, consensus_cache_entry_t *, c) {
     if (BUG(c == most_recent))
       continue; // LCOV_EXCL_LINE
@@ -986,15 +1187,34 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
       // with stale files from before the #22143 fixes.
       continue;
     }
+    consensus_cache_entry_t *diff_to_previous = NULL;
+    if (previous && c != previous) {
+      if (await_diff_from_previous)
+        continue;
+      if (diff_from_previous) {
+        diff_to_previous = find_uncompressed_diff(flavname,
+                      consensus_cache_entry_get_value(c,
+                                               LABEL_SHA3_DIGEST_AS_SIGNED),
+                      previous_sha3_hex);
+      }
+    }
     if (cdm_diff_ht_check_and_note_pending(flavor,
                                            this_sha3, most_recent_sha3)) {
       // This is already pending, or we encountered an error.
       continue;
     }
-    consensus_diff_queue_diff_work(c, most_recent);
+    if (diff_to_previous) {
+      consensus_diff_queue_diff_work(c, target,
+                                     diff_to_previous, diff_from_previous, 0);
+    } else if (consensus_diff_queue_diff_work(c, target, NULL, NULL,
+                                              c == previous) < 0 &&
+               c == previous) {
+      await_diff_from_previous = 0;
+    }
   } SMARTLIST_FOREACH_END(c);
 
  done:
+  cdm_diff_target_decref(target);
   smartlist_free(matches);
   smartlist_free(diffs);
   smartlist_free(compute_diffs_from);
@@ -1251,6 +1471,7 @@ consdiffmgr_free_all(void)
     }
   }
   memset(latest_consensus, 0, sizeof(latest_consensus));
+  memset(cdm_diff_stats, 0, sizeof(cdm_diff_stats));
   consensus_cache_free(cons_diff_cache);
   cons_diff_cache = NULL;
   mainloop_event_free(consdiffmgr_rescan_ev);
@@ -1364,28 +1585,6 @@ store_multiple(consensus_cache_entry_handle_t **handles_out,
   return status;
 }
 
-/**
- * An object passed to a worker thread that will try to produce a consensus
- * diff.
- */
-typedef struct consensus_diff_worker_job_t {
-  /**
-   * Input: The consensus to compute the diff from.  Holds a reference to the
-   * cache entry, which must not be released until the job is passed back to
-   * the main thread. The body must be mapped into memory in the main thread.
-   */
-  consensus_cache_entry_t *diff_from;
-  /**
-   * Input: The consensus to compute the diff to.  Holds a reference to the
-   * cache entry, which must not be released until the job is passed back to
-   * the main thread. The body must be mapped into memory in the main thread.
-   */
-  consensus_cache_entry_t *diff_to;
-
-  /** Output: labels and bodies */
-  compressed_result_t out[ARRAY_LENGTH(compress_diffs_with)];
-} consensus_diff_worker_job_t;
-
 /** Given a consensus_cache_entry_t, check whether it has a label claiming
  * that it was compressed.  If so, uncompress its contents into <b>out</b> and
  * set <b>outlen</b> to hold their size.  If not, just copy the body into
@@ -1414,6 +1613,134 @@ uncompress_or_copy(char **out, size_t *outlen,
                         method, 1, LOG_WARN);
 }
 
+/**
+ * A consensus that we are computing one or more diffs to.  It is shared by
+ * all the diff jobs to that consensus, so that only one of them needs to
+ * uncompress it and split it into lines.
+ */
+struct cdm_diff_target_t {
+  /**
+   * Number of diff jobs (and other callers) holding this object.  Only
+   * modified in the main thread.
+   */
+  int refcnt;
+  /**
+   * The consensus to compute diffs to.  Holds a reference to the cache
+   * entry, which is released in the main thread when this object is freed.
+   * The body must be mapped into memory in the main thread.
+   */
+  consensus_cache_entry_t *ent;
+  /** Lock to protect <b>prepared</b> and <b>target</b>. */
+  tor_mutex_t lock;
+  /** True iff some worker thread has tried to set <b>target</b>. */
+  int prepared;
+  /** The consensus, ready to compute diffs to, or NULL if we couldn't
+   * prepare it. */
+  consensus_diff_target_t *target;
+};
+
+/**
+ * Return a new cdm_diff_target_t for the consensus in <b>ent</b>, with a
+ * single reference.
+ */
+static cdm_diff_target_t *
+cdm_diff_target_new(consensus_cache_entry_t *ent)
+{
+  tor_assert(in_main_thread());
+
+  cdm_diff_target_t *target = tor_malloc_zero(sizeof(*target));
+  target->refcnt = 1;
+  target->ent = ent;
+  consensus_cache_entry_incref(ent);
+  tor_mutex_init_nonrecursive(&target->lock);
+  return target;
+}
+
+/**
+ * Release a reference to <b>target</b>, freeing it if that was the last
+ * one.
+ */
+static void
+cdm_diff_target_decref(cdm_diff_target_t *target)
+{
+  if (!target)
+    return;
+  tor_assert(in_main_thread());
+  if (--target->refcnt > 0)
+    return;
+
+  consensus_diff_target_free(target->target);
+  tor_mutex_uninit(&target->lock);
+  consensus_cache_entry_decref(target->ent);
+  tor_free(target);
+}
+
+/**
+ * Worker function: return the consensus in <b>target</b>, ready to compute
+ * diffs to.  The first worker thread to call this function prepares it;
+ * the others wait for it, and then share the result.  Return NULL if the
+ * consensus could not be prepared.
+ */
+static const consensus_diff_target_t *
+cdm_diff_target_get_prepared(cdm_diff_target_t *target)
+{
+  const consensus_diff_target_t *result;
+
+  tor_mutex_acquire(&target->lock);
+  if (!target->prepared) {
+    char *body = NULL;
+    size_t bodylen;
+    if (uncompress_or_copy(&body, &bodylen, target->ent) == 0) {
+      tor_assert(body);
+      target->target = consensus_diff_target_new(body);
+    }
+    target->prepared = 1;
+  }
+  result = target->target;
+  tor_mutex_release(&target->lock);
+
+  return result;
+}
+
+/**
+ * An object passed to a worker thread that will try to produce a consensus
+ * diff.
+ */
+typedef struct consensus_diff_worker_job_t {
+  /**
+   * Input: The consensus to compute the diff from.  Holds a reference to the
+   * cache entry, which must not be released until the job is passed back to
+   * the main thread. The body must be mapped into memory in the main thread.
+   */
+  consensus_cache_entry_t *diff_from;
+  /**
+   * Input: The consensus to compute the diff to, shared with every other
+   * job computing a diff to the same consensus.  Holds a reference, which
+   * must not be released until the job is passed back to the main thread.
+   */
+  cdm_diff_target_t *diff_to;
+  /**
+   * Input: If set, uncompressed diffs from <b>diff_from</b> to some other
+   * consensus, and from that consensus to <b>diff_to</b>, that we should try
+   * to compose before comparing the two consensuses.  Holds references, as
+   * for <b>diff_from</b>.
+   */
+  consensus_cache_entry_t *compose_diff1;
+  consensus_cache_entry_t *compose_diff2;
+  /** Input: If true, rescan the cache once this diff is done. */
+  int rescan_when_done;
+
+  /** Output: labels and body of the uncompressed diff */
+  compressed_result_t out;
+  /** Output: labels to use as a basis for every compressed form of the
+   * diff. */
+  config_line_t *common_labels;
+  /** Output: true iff we made the diff by composing two other diffs. */
+  int composed;
+  /** Output: how many microseconds we spent making the diff. */
+  int64_t usec;
+} consensus_diff_worker_job_t;
+
 /**
  * Worker function. This function runs inside a worker thread and receives
  * a consensus_diff_worker_job_t as its input.
@@ -1423,26 +1750,28 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
 {
   (void)state_;
   consensus_diff_worker_job_t *job = work_;
-  const uint8_t *diff_from, *diff_to;
+  consensus_cache_entry_t *diff_to = job->diff_to->ent;
+  const uint8_t *diff_from_body, *diff_to_body;
   size_t len_from, len_to;
   int r;
   /* We need to have the body already mapped into RAM here.
    */
-  r = consensus_cache_entry_get_body(job->diff_from, &diff_from, &len_from);
+  r = consensus_cache_entry_get_body(job->diff_from, &diff_from_body,
+                                     &len_from);
   if (BUG(r < 0))
     return WQ_RPL_REPLY; // LCOV_EXCL_LINE
-  r = consensus_cache_entry_get_body(job->diff_to, &diff_to, &len_to);
+  r = consensus_cache_entry_get_body(diff_to, &diff_to_body, &len_to);
   if (BUG(r < 0))
     return WQ_RPL_REPLY; // LCOV_EXCL_LINE
 
   const char *lv_to_valid_after =
-    consensus_cache_entry_get_value(job->diff_to, LABEL_VALID_AFTER);
+    consensus_cache_entry_get_value(diff_to, LABEL_VALID_AFTER);
   const char *lv_to_fresh_until =
-    consensus_cache_entry_get_value(job->diff_to, LABEL_FRESH_UNTIL);
+    consensus_cache_entry_get_value(diff_to, LABEL_FRESH_UNTIL);
   const char *lv_to_valid_until =
-    consensus_cache_entry_get_value(job->diff_to, LABEL_VALID_UNTIL);
+    consensus_cache_entry_get_value(diff_to, LABEL_VALID_UNTIL);
   const char *lv_to_signatories =
-    consensus_cache_entry_get_value(job->diff_to, LABEL_SIGNATORIES);
+    consensus_cache_entry_get_value(diff_to, LABEL_SIGNATORIES);
   const char *lv_from_valid_after =
     consensus_cache_entry_get_value(job->diff_from, LABEL_VALID_AFTER);
   const char *lv_from_digest =
@@ -1451,9 +1780,9 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
   const char *lv_from_flavor =
     consensus_cache_entry_get_value(job->diff_from, LABEL_FLAVOR);
   const char *lv_to_flavor =
-    consensus_cache_entry_get_value(job->diff_to, LABEL_FLAVOR);
+    consensus_cache_entry_get_value(diff_to, LABEL_FLAVOR);
   const char *lv_to_digest =
-    consensus_cache_entry_get_value(job->diff_to,
+    consensus_cache_entry_get_value(diff_to,
                                     LABEL_SHA3_DIGEST_UNCOMPRESSED);
 
   if (! lv_from_digest) {
@@ -1476,40 +1805,64 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     return WQ_RPL_REPLY; // LCOV_EXCL_LINE
   }
 
-  char *consensus_diff;
+  char *consensus_diff = NULL;
+  monotime_t start, end;
+  monotime_get(&start);
   {
-    char *diff_from_nt = NULL, *diff_to_nt = NULL;
-    size_t diff_from_nt_len, diff_to_nt_len;
+    const consensus_diff_target_t *target;
+    char *diff_from_nt = NULL;
+    size_t diff_from_nt_len;
 
-    if (uncompress_or_copy(&diff_from_nt, &diff_from_nt_len,
-                           job->diff_from) < 0) {
+    target = cdm_diff_target_get_prepared(job->diff_to);
+    if (!target) {
       return WQ_RPL_REPLY;
     }
-    if (uncompress_or_copy(&diff_to_nt, &diff_to_nt_len,
-                           job->diff_to) < 0) {
-      tor_free(diff_from_nt);
+    if (uncompress_or_copy(&diff_from_nt, &diff_from_nt_len,
+                           job->diff_from) < 0) {
       return WQ_RPL_REPLY;
     }
     tor_assert(diff_from_nt);
-    tor_assert(diff_to_nt);
 
-    // XXXX ugh; this is going to calculate the SHA3 of both its
-    // XXXX inputs again, even though we already have that. Maybe it's time
-    // XXXX to change the API here?
-    consensus_diff = consensus_diff_generate(diff_from_nt, diff_to_nt);
+    if (job->compose_diff1 && job->compose_diff2) {
+      char *diff1_nt = NULL, *diff2_nt = NULL;
+      size_t diff1_nt_len, diff2_nt_len;
+      if (uncompress_or_copy(&diff1_nt, &diff1_nt_len,
+                             job->compose_diff1) == 0 &&
+          uncompress_or_copy(&diff2_nt, &diff2_nt_len,
+                             job->compose_diff2) == 0) {
+        consensus_diff = consensus_diff_compose_to_target(diff_from_nt,
+                                                          diff1_nt, diff2_nt,
+                                                          target);
+      }
+      /* Composing two diffs should never give us anything bigger than the
+       * two of them together.  If it does, comparing the consensuses will
+       * do better. */
+      if (consensus_diff &&
+          strlen(consensus_diff) > diff1_nt_len + diff2_nt_len) {
+        tor_free(consensus_diff);
+      }
+      tor_free(diff1_nt);
+      tor_free(diff2_nt);
+      job->composed = (consensus_diff != NULL);
+    }
+    if (!consensus_diff)
+      consensus_diff = consensus_diff_generate_to_target(diff_from_nt,
+                                                         target);
     tor_free(diff_from_nt);
-    tor_free(diff_to_nt);
   }
+  monotime_get(&end);
+  job->usec = monotime_diff_usec(&start, &end);
   if (!consensus_diff) {
     /* Couldn't generate consensus; we'll leave the reply blank. */
     return WQ_RPL_REPLY;
   }
 
-  /* Compress the results and send the reply */
+  /* Send the uncompressed result back: the main thread will queue the work
+   * of compressing it with each method separately. */
   tor_assert(compress_diffs_with[0] == NO_METHOD);
   size_t difflen = strlen(consensus_diff);
-  job->out[0].body = (uint8_t *) consensus_diff;
-  job->out[0].bodylen = difflen;
+  job->out.body = (uint8_t *) consensus_diff;
+  job->out.bodylen = difflen;
 
   config_line_t *common_labels = NULL;
   if (lv_to_valid_until)
@@ -1520,8 +1873,8 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     config_line_prepend(&common_labels, LABEL_SIGNATORIES, lv_to_signatories);
   cdm_labels_prepend_sha3(&common_labels,
                           LABEL_SHA3_DIGEST_UNCOMPRESSED,
-                          job->out[0].body,
-                          job->out[0].bodylen);
+                          job->out.body,
+                          job->out.bodylen);
   config_line_prepend(&common_labels, LABEL_FROM_VALID_AFTER,
                       lv_from_valid_after);
   config_line_prepend(&common_labels, LABEL_VALID_AFTER,
@@ -1531,21 +1884,24 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
                       lv_from_digest);
   config_line_prepend(&common_labels, LABEL_TARGET_SHA3_DIGEST,
                       lv_to_digest);
+  if (job->composed) {
+    const char *lv_via_digest =
+      consensus_cache_entry_get_value(job->compose_diff1,
+                                      LABEL_TARGET_SHA3_DIGEST);
+    if (lv_via_digest)
+      config_line_prepend(&common_labels, LABEL_COMPOSED_VIA_SHA3_DIGEST,
+                          lv_via_digest);
+  }
   config_line_prepend(&common_labels, LABEL_DOCTYPE,
                       DOCTYPE_CONSENSUS_DIFF);
 
-  job->out[0].labels = config_lines_dup(common_labels);
-  cdm_labels_prepend_sha3(&job->out[0].labels,
+  job->out.labels = config_lines_dup(common_labels);
+  cdm_labels_prepend_sha3(&job->out.labels,
                           LABEL_SHA3_DIGEST,
-                          job->out[0].body,
-                          job->out[0].bodylen);
+                          job->out.body,
+                          job->out.bodylen);
+  job->common_labels = common_labels;
 
-  compress_multiple(job->out+1,
-                    n_diff_compression_methods()-1,
-                    compress_diffs_with+1,
-                    (const uint8_t*)consensus_diff, difflen, common_labels);
-
-  config_free_lines(common_labels);
   return WQ_RPL_REPLY;
 }
 
@@ -1561,16 +1917,183 @@ consensus_diff_worker_job_free_(consensus_diff_worker_job_t *job)
 {
   if (!job)
     return;
-  unsigned u;
-  for (u = 0; u < n_diff_compression_methods(); ++u) {
-    config_free_lines(job->out[u].labels);
-    tor_free(job->out[u].body);
-  }
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
+  config_free_lines(job->common_labels);
   consensus_cache_entry_decref(job->diff_from);
-  consensus_cache_entry_decref(job->diff_to);
+  consensus_cache_entry_decref(job->compose_diff1);
+  consensus_cache_entry_decref(job->compose_diff2);
+  cdm_diff_target_decref(job->diff_to);
   tor_free(job);
 }
 
+/**
+ * An object passed to a worker thread that will try to compress a consensus
+ * diff with a single compression method.
+ */
+typedef struct consensus_diff_compress_job_t {
+  /**
+   * Input: The uncompressed diff.  Holds a reference to the cache entry,
+   * which must not be released until the job is passed back to the main
+   * thread. The body must be mapped into memory in the main thread.
+   */
+  consensus_cache_entry_t *diff;
+  /** Input: The method to compress the diff with. */
+  compress_method_t method;
+  /** Input: The labels to use as a basis for those of the result. */
+  config_line_t *labels_in;
+  /** Input: The flavor of the diff, and the digests of the consensuses
+   * that it goes from and to. */
+  consensus_flavor_t flavor;
+  uint8_t from_sha3[DIGEST256_LEN];
+  uint8_t to_sha3[DIGEST256_LEN];
+
+  /** Output: labels and body */
+  compressed_result_t out;
+  /** Output: how many microseconds we spent compressing the diff. */
+  int64_t usec;
+} consensus_diff_compress_job_t;
+
+#define consensus_diff_compress_job_free(job)             \
+  FREE_AND_NULL(consensus_diff_compress_job_t,            \
+                consensus_diff_compress_job_free_, (job))
+
+/**
+ * Helper: release all storage held in <b>job</b>.
+ */
+static void
+consensus_diff_compress_job_free_(consensus_diff_compress_job_t *job)
+{
+  if (!job)
+    return;
+  config_free_lines(job->labels_in);
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
+  consensus_cache_entry_decref(job->diff);
+  tor_free(job);
+}
+
+/**
+ * Worker function. This function runs inside a worker thread and receives
+ * a consensus_diff_compress_job_t as its input.
+ */
+static workqueue_reply_t
+consensus_diff_compress_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  consensus_diff_compress_job_t *job = work_;
+  const uint8_t *body;
+  size_t bodylen;
+
+  /* We need to have the body already mapped into RAM here. */
+  if (BUG(consensus_cache_entry_get_body(job->diff, &body, &bodylen) < 0))
+    return WQ_RPL_REPLY; // LCOV_EXCL_LINE
+
+  monotime_t start, end;
+  monotime_get(&start);
+  compress_multiple(&job->out, 1, &job->method,
+                    body, bodylen, job->labels_in);
+  monotime_get(&end);
+  job->usec = monotime_diff_usec(&start, &end);
+  return WQ_RPL_REPLY;
+}
+
+/**
+ * Worker function: This function runs in the main thread, and receives
+ * a consensus_diff_compress_job_t that the worker thread has already
+ * processed.
+ */
+static void
+consensus_diff_compress_replyfn(void *work_)
+{
+  tor_assert(in_main_thread());
+  tor_assert(work_);
+
+  consensus_diff_compress_job_t *job = work_;
+  const char *methodname = compression_method_get_name(job->method);
+
+  const char *lv_from_digest =
+    consensus_cache_entry_get_value(job->diff, LABEL_FROM_SHA3_DIGEST);
+  const char *lv_to_digest =
+    consensus_cache_entry_get_value(job->diff, LABEL_TARGET_SHA3_DIGEST);
+  if (BUG(lv_from_digest == NULL))
+    lv_from_digest = "???"; // LCOV_EXCL_LINE
+  if (BUG(lv_to_digest == NULL))
+    lv_to_digest = "???"; // LCOV_EXCL_LINE
+
+  char description[128];
+  tor_snprintf(description, sizeof(description),
+               "consensus diff from %s to %s",
+               lv_from_digest, lv_to_digest);
+
+  consensus_cache_entry_handle_t *handle = NULL;
+  int status = store_multiple(&handle, 1, &job->method, &job->out,
+                              description);
+  if (status != CDM_DIFF_PRESENT) {
+    log_warn(LD_DIRSERV,
+             "Worker was unable to compress consensus diff "
+             "from %s to %s with %s", lv_from_digest, lv_to_digest,
+             methodname);
+    status = CDM_DIFF_ERROR;
+  }
+
+  tor_assert_nonfatal(handle != NULL || status == CDM_DIFF_ERROR);
+  cdm_diff_ht_set_status(job->flavor, job->from_sha3, job->to_sha3,
+                         job->method, status, handle);
+  cdm_diff_stats_note(job->flavor, job->to_sha3, 0, job->usec);
+
+  consensus_diff_compress_job_free(job);
+}
+
+/**
+ * Queue the job of compressing the uncompressed consensus diff in
+ * <b>diff</b> with <b>method</b> in a worker thread.  The diff is of type
+ * <b>flavor</b>, and goes between the consensuses whose digests are
+ * <b>from_sha3</b> and <b>to_sha3</b>.  Use <b>labels_in</b> as a basis for
+ * the labels of the result.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int
+consensus_diff_queue_compress_work(consensus_cache_entry_t *diff,
+                                   compress_method_t method,
+                                   const config_line_t *labels_in,
+                                   consensus_flavor_t flavor,
+                                   const uint8_t *from_sha3,
+                                   const uint8_t *to_sha3)
+{
+  tor_assert(in_main_thread());
+
+  consensus_cache_entry_incref(diff);
+
+  consensus_diff_compress_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->diff = diff;
+  job->method = method;
+  job->labels_in = config_lines_dup(labels_in);
+  job->flavor = flavor;
+  memcpy(job->from_sha3, from_sha3, DIGEST256_LEN);
+  memcpy(job->to_sha3, to_sha3, DIGEST256_LEN);
+
+  /* Make sure body is mapped. */
+  const uint8_t *body;
+  size_t bodylen;
+  if (consensus_cache_entry_get_body(diff, &body, &bodylen) < 0)
+    goto err;
+
+  workqueue_entry_t *work;
+  work = cpuworker_queue_work(WQ_PRI_LOW,
+                              consensus_diff_compress_threadfn,
+                              consensus_diff_compress_replyfn,
+                              job);
+  if (!work)
+    goto err;
+
+  return 0;
+ err:
+  consensus_diff_compress_job_free(job); // includes decrefs.
+  return -1;
+}
+
 /**
  * Worker function: This function runs in the main thread, and receives
  * a consensus_diff_worker_job_t that the worker thread has already
@@ -1583,15 +2106,16 @@ consensus_diff_worker_replyfn(void *work_)
   tor_assert(work_);
 
   consensus_diff_worker_job_t *job = work_;
+  consensus_cache_entry_t *diff_to = job->diff_to->ent;
 
   const char *lv_from_digest =
     consensus_cache_entry_get_value(job->diff_from,
                                     LABEL_SHA3_DIGEST_AS_SIGNED);
   const char *lv_to_digest =
-    consensus_cache_entry_get_value(job->diff_to,
+    consensus_cache_entry_get_value(diff_to,
                                     LABEL_SHA3_DIGEST_UNCOMPRESSED);
   const char *lv_flavor =
-    consensus_cache_entry_get_value(job->diff_to, LABEL_FLAVOR);
+    consensus_cache_entry_get_value(diff_to, LABEL_FLAVOR);
   if (BUG(lv_from_digest == NULL))
     lv_from_digest = "???"; // LCOV_EXCL_LINE
   if (BUG(lv_to_digest == NULL))
@@ -1604,7 +2128,7 @@ consensus_diff_worker_replyfn(void *work_)
   if (BUG(cdm_entry_get_sha3_value(from_sha3, job->diff_from,
                                    LABEL_SHA3_DIGEST_AS_SIGNED) < 0))
     cache = 0;
-  if (BUG(cdm_entry_get_sha3_value(to_sha3, job->diff_to,
+  if (BUG(cdm_entry_get_sha3_value(to_sha3, diff_to,
                                    LABEL_SHA3_DIGEST_UNCOMPRESSED) < 0))
     cache = 0;
   if (BUG(lv_flavor == NULL)) {
@@ -1613,18 +2137,15 @@ consensus_diff_worker_replyfn(void *work_)
     cache = 0;
   }
 
-  consensus_cache_entry_handle_t *handles[ARRAY_LENGTH(compress_diffs_with)];
-  memset(handles, 0, sizeof(handles));
-
   char description[128];
   tor_snprintf(description, sizeof(description),
                "consensus diff from %s to %s",
                lv_from_digest, lv_to_digest);
 
-  int status = store_multiple(handles,
-                              n_diff_compression_methods(),
+  consensus_cache_entry_handle_t *handle = NULL;
+  int status = store_multiple(&handle, 1,
                               compress_diffs_with,
-                              job->out,
+                              &job->out,
                               description);
 
   if (status != CDM_DIFF_PRESENT) {
@@ -1636,49 +2157,89 @@ consensus_diff_worker_replyfn(void *work_)
     status = CDM_DIFF_ERROR;
   }
 
+  if (job->rescan_when_done)
+    mark_cdm_cache_dirty();
+
+  if (!cache) {
+    consensus_cache_entry_handle_free(handle);
+    consensus_diff_worker_job_free(job);
+    return;
+  }
+
+  cdm_diff_stats_note(flav, to_sha3,
+                      status != CDM_DIFF_PRESENT ? 0 : job->composed ? 2 : 1,
+                      job->usec);
+
+  /* Compress the diff with every other method in parallel.  Until each of
+   * those is done, its status stays CDM_DIFF_IN_PROGRESS. */
+  consensus_cache_entry_t *diff_ent = NULL;
+  if (handle)
+    diff_ent = consensus_cache_entry_handle_get(handle);
   unsigned u;
-  for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
+  for (u = 1; u < n_diff_compression_methods(); ++u) {
     compress_method_t method = compress_diffs_with[u];
-    if (cache) {
-      consensus_cache_entry_handle_t *h = handles[u];
-      int this_status = status;
-      if (h == NULL) {
-        this_status = CDM_DIFF_ERROR;
-      }
-      tor_assert_nonfatal(h != NULL || this_status == CDM_DIFF_ERROR);
-      cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method, this_status, h);
-    } else {
-      consensus_cache_entry_handle_free(handles[u]);
-    }
+    if (diff_ent &&
+        consensus_diff_queue_compress_work(diff_ent, method,
+                                           job->common_labels,
+                                           flav, from_sha3, to_sha3) == 0)
+      continue;
+    cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method,
+                           CDM_DIFF_ERROR, NULL);
   }
 
+  tor_assert_nonfatal(handle != NULL || status == CDM_DIFF_ERROR);
+  cdm_diff_ht_set_status(flav, from_sha3, to_sha3, compress_diffs_with[0],
+                         status, handle);
+
   consensus_diff_worker_job_free(job);
 }
 
 /**
  * Queue the job of computing the diff from <b>diff_from</b> to <b>diff_to</b>
- * in a worker thread.
+ * in a worker thread.  If <b>compose_diff1</b> and <b>compose_diff2</b> are
+ * set, they are uncompressed diffs from <b>diff_from</b> to some other
+ * consensus and from that consensus to <b>diff_to</b>: try to compose them
+ * first.  If <b>rescan_when_done</b> is true, rescan the cache once the job
+ * is done.
  */
 static int
 consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                               consensus_cache_entry_t *diff_to)
+                               cdm_diff_target_t *diff_to,
+                               consensus_cache_entry_t *compose_diff1,
+                               consensus_cache_entry_t *compose_diff2,
+                               int rescan_when_done)
 {
   tor_assert(in_main_thread());
 
   consensus_cache_entry_incref(diff_from);
-  consensus_cache_entry_incref(diff_to);
+  ++diff_to->refcnt;
 
   consensus_diff_worker_job_t *job = tor_malloc_zero(sizeof(*job));
   job->diff_from = diff_from;
   job->diff_to = diff_to;
+  job->rescan_when_done = rescan_when_done;
+  if (compose_diff1 && compose_diff2) {
+    consensus_cache_entry_incref(compose_diff1);
+    consensus_cache_entry_incref(compose_diff2);
+    job->compose_diff1 = compose_diff1;
+    job->compose_diff2 = compose_diff2;
+  }
 
   /* Make sure body is mapped. */
   const uint8_t *body;
   size_t bodylen;
   int r1 = consensus_cache_entry_get_body(diff_from, &body, &bodylen);
-  int r2 = consensus_cache_entry_get_body(diff_to, &body, &bodylen);
+  int r2 = consensus_cache_entry_get_body(diff_to->ent, &body, &bodylen);
   if (r1 < 0 || r2 < 0)
     goto err;
+  if (job->compose_diff1 &&
+      (consensus_cache_entry_get_body(compose_diff1, &body, &bodylen) < 0 ||
+       consensus_cache_entry_get_body(compose_diff2, &body, &bodylen) < 0)) {
+    /* We can still compare the consensuses. */
+    consensus_cache_entry_decref(job->compose_diff1);
+    consensus_cache_entry_decref(job->compose_diff2);
+    job->compose_diff1 = job->compose_diff2 = NULL;
+  }
 
   workqueue_entry_t *work;
   work = cpuworker_queue_work(WQ_PRI_LOW,
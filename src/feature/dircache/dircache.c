@@ -1107,7 +1107,8 @@ handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
                                compress_method,
                                MICRODESC_CACHE_LIFETIME);
 
-    if (compress_method != NO_METHOD)
+    if (compress_method != NO_METHOD &&
+        ! connection_dirserv_try_cached_response(conn, compress_method))
       conn->compress_state = tor_compress_new(1, compress_method,
                                       choose_compression_level(size_guess));
 
@@ -1202,7 +1203,8 @@ handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
         goto done;
       }
       write_http_response_header(conn, -1, compress_method, cache_lifetime);
-      if (compress_method != NO_METHOD)
+      if (compress_method != NO_METHOD &&
+          ! connection_dirserv_try_cached_response(conn, compress_method))
         conn->compress_state = tor_compress_new(1, compress_method,
                                         choose_compression_level(size_guess));
       clear_spool = 0;
@@ -8,10 +8,12 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "feature/dircache/conscache.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircommon/directory.h"
 #include "feature/dircache/dirserv.h"
+#include "feature/dircache/respcache.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/router.h"
@@ -26,6 +28,20 @@
 #include "feature/nodelist/routerlist_st.h"
 
 #include "lib/compress/compress.h"
+#include "lib/container/buffers.h"
+#include "lib/crypt_ops/crypto_digest.h"
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+/** Defined if we can send a file to a socket with Linux-style sendfile(). */
+#define USE_SENDFILE
+#endif
 
 /**
  * \file dirserv.c
@@ -38,7 +54,11 @@
  * connection_dirserv_flushed_some() and its kin.  In order to save RAM, this
  * module is responsible for spooling directory objects (in whole or in part)
  * onto buf_t instances, and then closing the dir_connection_t once the
- * objects are totally flushed.
+ * objects are totally flushed.  On unencrypted connections, where it can,
+ * it sends large objects from the consensus cache straight from their files
+ * to the socket instead.  Compressed responses for sets of descriptors are
+ * remembered in respcache.c, so that we can send them again without
+ * compressing them again.
  *
  * The directory.c module also delegates here for handling descriptor uploads
  * via dirserv_add_multiple_descriptors().
@@ -65,6 +85,12 @@ static cached_dir_t *spooled_resource_lookup_cached_dir(
                                    const spooled_resource_t *spooled,
                                    time_t *published_out);
 static cached_dir_t *lookup_cached_dir_by_fp(const uint8_t *fp);
+static int spooled_resource_can_send_file(const spooled_resource_t *spooled,
+                                          const dir_connection_t *conn);
+static void connection_dirserv_add_compressed(dir_connection_t *conn,
+                                              const char *data, size_t len,
+                                              int done);
+static void connection_dirserv_stop_recording(dir_connection_t *conn);
 
 /********************************************************************/
 
@@ -492,6 +518,16 @@ spooled_resource_free_(spooled_resource_t *spooled)
  * at least this much. */
 #define DIRSERV_CACHED_DIR_CHUNK_SIZE 8192
 
+/** We only send a consensus cache entry straight from its file if it is at
+ * least this long; smaller ones aren't worth opening the file for. */
+#define DIRSERV_SENDFILE_MIN_LEN 65536
+
+#ifdef USE_SENDFILE
+/** Set to true once sendfile() has failed in a way that means it will never
+ * work for us. */
+static int sendfile_is_broken = 0;
+#endif
+
 /** Return an compression ratio for compressing objects from <b>source</b>.
  */
 static double
@@ -577,11 +613,13 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
                                          connection_dir_is_encrypted(conn),
                                          &body, &bodylen, NULL);
     if (r == -1 || body == NULL || bodylen == 0) {
-      /* Absent objects count as "done". */
+      /* Absent objects count as "done". But this response no longer
+       * matches the request we computed its cache key from. */
+      connection_dirserv_stop_recording(conn);
       return SRFS_DONE;
     }
     if (conn->compress_state) {
-      connection_buf_add_compress((const char*)body, bodylen, conn, 0);
+      connection_dirserv_add_compressed(conn, (const char*)body, bodylen, 0);
     } else {
       connection_buf_add((const char*)body, bodylen, TO_CONN(conn));
     }
@@ -604,6 +642,30 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     if (BUG(!cached && !cce))
       return SRFS_DONE;
 
+    if (spooled->sending_file) {
+      if (connection_dirserv_sendfile_pending(conn))
+        return SRFS_MORE; /* Still sending straight from the file. */
+      /* Either we sent the whole body, or sendfile() failed and we have to
+       * copy the rest into the outbuf after all. */
+      spooled->sending_file = 0;
+      spooled->cached_dir_offset =
+        (off_t)(spooled->cce_len - conn->sendfile_remaining);
+      conn->sendfile_remaining = 0;
+      if (spooled->cached_dir_offset >= (off_t)spooled->cce_len)
+        return SRFS_DONE;
+    } else if (spooled_resource_can_send_file(spooled, conn)) {
+      int fd;
+      off_t offset;
+      if (consensus_cache_entry_open_body(cce, &fd, &offset) == 0) {
+        conn->sendfile_fd = fd;
+        conn->sendfile_offset = offset;
+        conn->sendfile_remaining = spooled->cce_len;
+        spooled->sending_file = 1;
+        connection_start_writing(TO_CONN(conn));
+        return SRFS_MORE;
+      }
+    }
+
     int64_t total_len;
     const char *ptr;
     if (cached) {
@@ -620,9 +682,9 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
       return SRFS_ERR;
     ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
     if (conn->compress_state) {
-      connection_buf_add_compress(
+      connection_dirserv_add_compressed(conn,
               ptr + spooled->cached_dir_offset,
-              bytes, conn, 0);
+              bytes, 0);
     } else {
       connection_buf_add(ptr + spooled->cached_dir_offset,
                               bytes, TO_CONN(conn));
@@ -636,6 +698,96 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
   }
 }
 
+/**
+ * Return true iff we can send the body of <b>spooled</b> to <b>conn</b>
+ * straight from the file that holds it, without copying it into the
+ * outbuf.
+ */
+static int
+spooled_resource_can_send_file(const spooled_resource_t *spooled,
+                               const dir_connection_t *conn)
+{
+#ifdef USE_SENDFILE
+  return !sendfile_is_broken &&
+    spooled->consensus_cache_entry != NULL &&
+    spooled->cached_dir_offset == 0 &&
+    spooled->cce_len >= DIRSERV_SENDFILE_MIN_LEN &&
+    conn->compress_state == NULL &&
+    !connection_dirserv_sendfile_pending(conn) &&
+    !conn->base_.linked &&
+    !connection_dir_is_encrypted(conn);
+#else
+  (void)spooled;
+  (void)conn;
+  return 0;
+#endif /* defined(USE_SENDFILE) */
+}
+
+/** Return true iff <b>conn</b> has bytes to send straight from a file once
+ * its outbuf is empty. */
+int
+connection_dirserv_sendfile_pending(const dir_connection_t *conn)
+{
+  return conn->sendfile_remaining > 0 && conn->sendfile_fd >= 0;
+}
+
+/** Stop sending from a file on <b>conn</b>, and close the file.  Leave
+ * sendfile_remaining alone, so that we know how much we didn't send. */
+static void
+connection_dirserv_sendfile_close(dir_connection_t *conn)
+{
+  close(conn->sendfile_fd);
+  conn->sendfile_fd = -1;
+}
+
+/**
+ * Called when <b>conn</b>'s outbuf is empty, and
+ * connection_dirserv_sendfile_pending() is true: send up to
+ * <b>max_bytes</b> bytes straight from the file to the socket.  Return the
+ * number of bytes sent, or -1 if the connection is dead.
+ */
+ssize_t
+connection_dirserv_sendfile(dir_connection_t *conn, size_t max_bytes)
+{
+  if (BUG(!connection_dirserv_sendfile_pending(conn)))
+    return 0; // LCOV_EXCL_LINE
+
+#ifdef USE_SENDFILE
+  const size_t n = MIN(max_bytes, conn->sendfile_remaining);
+  ssize_t r = sendfile(conn->base_.s, conn->sendfile_fd,
+                       &conn->sendfile_offset, n);
+  if (r < 0) {
+    const int e = errno;
+    if (ERRNO_IS_EAGAIN(e) || e == EINTR)
+      return 0;
+    if (e == EINVAL || e == ENOSYS) {
+      /* This kernel or filesystem can't do it: copy the rest of the body
+       * into the outbuf after all. */
+      log_info(LD_DIRSERV, "sendfile() failed: %s. Spooling through "
+               "buffers instead.", strerror(e));
+      sendfile_is_broken = 1;
+      connection_dirserv_sendfile_close(conn);
+      return connection_dirserv_flushed_some(conn) < 0 ? -1 : 0;
+    }
+    log_info(LD_DIRSERV, "sendfile() failed: %s", strerror(e));
+    return -1;
+  } else if (r == 0 && n > 0) {
+    /* The file ended early. */
+    log_warn(LD_BUG, "Consensus cache file was shorter than its body.");
+    connection_dirserv_sendfile_close(conn);
+    return -1;
+  }
+
+  conn->sendfile_remaining -= r;
+  if (conn->sendfile_remaining == 0)
+    connection_dirserv_sendfile_close(conn);
+  return r;
+#else
+  (void)max_bytes;
+  return -1;
+#endif /* defined(USE_SENDFILE) */
+}
+
 /** Helper: find the cached_dir_t for a spooled_resource_t, for
  * sending it to <b>conn</b>. Set *<b>published_out</b>, if provided,
  * to the published time of the cached_dir_t.
@@ -889,10 +1041,157 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
   if (conn->compress_state) {
     /* Flush the compression state: there could be more bytes pending in there,
      * and we don't want to omit bytes. */
-    connection_buf_add_compress("", 0, conn, 1);
+    connection_dirserv_add_compressed(conn, "", 0, 1);
     tor_compress_free(conn->compress_state);
     conn->compress_state = NULL;
   }
+  if (conn->respcache_buf) {
+    size_t len;
+    char *body = buf_extract(conn->respcache_buf, &len);
+    respcache_add(conn->respcache_key, body, len);
+    buf_free(conn->respcache_buf);
+    conn->respcache_buf = NULL;
+  }
+  return 0;
+}
+
+/** Add <b>len</b> bytes from <b>data</b> to the outbuf of <b>conn</b>,
+ * through its compression state, as connection_buf_add_compress() does.
+ * If we are recording the response for the response cache, also copy the
+ * compressed bytes into the recording. */
+static void
+connection_dirserv_add_compressed(dir_connection_t *conn,
+                                  const char *data, size_t len, int done)
+{
+  if (!conn->respcache_buf) {
+    connection_buf_add_compress(data, len, conn, done);
+    return;
+  }
+
+  buf_t *compressed = buf_new();
+  if (buf_add_compress(compressed, conn->compress_state,
+                       data, len, done) < 0) {
+    log_warn(LD_DIRSERV, "Compression failed. Closing connection (fd %d).",
+             (int)TO_CONN(conn)->s);
+    connection_dirserv_stop_recording(conn);
+    connection_mark_for_close(TO_CONN(conn));
+    buf_free(compressed);
+    return;
+  }
+  buf_t *copy = buf_copy(compressed);
+  buf_move_all(conn->respcache_buf, copy);
+  buf_free(copy);
+  connection_buf_add_buf(TO_CONN(conn), compressed);
+  buf_free(compressed);
+
+  if (buf_datalen(conn->respcache_buf) > respcache_max_entry_size()) {
+    /* Too big to keep; don't bother copying the rest. */
+    connection_dirserv_stop_recording(conn);
+  }
+}
+
+/** Stop recording the compressed response on <b>conn</b> for the response
+ * cache, if we were doing so. */
+static void
+connection_dirserv_stop_recording(dir_connection_t *conn)
+{
+  buf_free(conn->respcache_buf);
+  conn->respcache_buf = NULL;
+}
+
+/**
+ * Compute into <b>key_out</b> the response cache key for sending the spool
+ * of <b>conn</b> compressed with <b>method</b>.  The key covers the identity
+ * of every object that the response will contain, in order, so a response
+ * stored under it is still correct for as long as the key can be computed
+ * again.  Return 0 on success, or -1 if we can't cache this response.
+ */
+static int
+dirserv_spool_compute_respcache_key(const dir_connection_t *conn,
+                                    compress_method_t method,
+                                    uint8_t *key_out)
+{
+  const uint8_t header[2] = {
+    (uint8_t) method,
+    (uint8_t) connection_dir_is_encrypted(conn),
+  };
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA3_256);
+  crypto_digest_add_bytes(d, "tor-respcache", strlen("tor-respcache"));
+  crypto_digest_add_bytes(d, (const char *)header, sizeof(header));
+
+  SMARTLIST_FOREACH_BEGIN(conn->spool, const spooled_resource_t *, spooled) {
+    const uint8_t source = spooled->spool_source;
+    const signed_descriptor_t *sd = NULL;
+    crypto_digest_add_bytes(d, (const char *)&source, 1);
+    switch (spooled->spool_source) {
+      case DIR_SPOOL_MICRODESC:
+      case DIR_SPOOL_SERVER_BY_DIGEST:
+      case DIR_SPOOL_EXTRA_BY_DIGEST:
+        /* These objects can't change without changing their digests. */
+        crypto_digest_add_bytes(d, (const char *)spooled->digest,
+                                sizeof(spooled->digest));
+        break;
+      case DIR_SPOOL_SERVER_BY_FP:
+      case DIR_SPOOL_EXTRA_BY_FP:
+        /* Use the digest of the descriptor we would send now. */
+        sd = get_signed_descriptor_by_fp(spooled->digest,
+                          spooled->spool_source == DIR_SPOOL_EXTRA_BY_FP);
+        if (!sd)
+          goto fail;
+        crypto_digest_add_bytes(d, sd->signed_descriptor_digest, DIGEST_LEN);
+        break;
+      case DIR_SPOOL_NETWORKSTATUS:
+      case DIR_SPOOL_CONSENSUS_CACHE_ENTRY:
+      default:
+        /* These are compressed ahead of time already. */
+        goto fail;
+    }
+  } SMARTLIST_FOREACH_END(spooled);
+
+  crypto_digest_get_digest(d, (char *)key_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+  return 0;
+ fail:
+  crypto_digest_free(d);
+  return -1;
+}
+
+/**
+ * We're about to send the spool of <b>conn</b>, compressed with
+ * <b>method</b>.  If we have that response in the response cache already,
+ * replace the spool with the cached response and return 1: the caller
+ * should not set up a compression state.  Otherwise, arrange to record the
+ * response as it is compressed, and return 0.
+ */
+int
+connection_dirserv_try_cached_response(dir_connection_t *conn,
+                                       compress_method_t method)
+{
+  tor_assert(conn->spool);
+  tor_assert(! conn->compress_state);
+  if (method == NO_METHOD || respcache_max_entry_size() == 0)
+    return 0;
+
+  uint8_t key[DIGEST256_LEN];
+  if (dirserv_spool_compute_respcache_key(conn, method, key) < 0)
+    return 0;
+
+  cached_dir_t *response = respcache_lookup(key);
+  if (response) {
+    spooled_resource_t *spooled = spooled_resource_new(
+                                   DIR_SPOOL_NETWORKSTATUS, NULL, 0);
+    /* We already hold the reference that the spool will release. */
+    spooled->cached_dir_ref = response;
+    SMARTLIST_FOREACH(conn->spool, spooled_resource_t *, s,
+                      spooled_resource_free(s));
+    smartlist_clear(conn->spool);
+    smartlist_add(conn->spool, spooled);
+    return 1;
+  }
+
+  connection_dirserv_stop_recording(conn);
+  conn->respcache_buf = buf_new();
+  memcpy(conn->respcache_key, key, DIGEST256_LEN);
   return 0;
 }
 
@@ -901,7 +1200,14 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
 void
 dir_conn_clear_spool(dir_connection_t *conn)
 {
-  if (!conn || ! conn->spool)
+  if (!conn)
+    return;
+  if (connection_dirserv_sendfile_pending(conn)) {
+    connection_dirserv_sendfile_close(conn);
+    conn->sendfile_remaining = 0;
+  }
+  connection_dirserv_stop_recording(conn);
+  if (! conn->spool)
     return;
   SMARTLIST_FOREACH(conn->spool, spooled_resource_t *, s,
                     spooled_resource_free(s));
@@ -915,4 +1221,5 @@ dirserv_free_all(void)
 {
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  respcache_free_all();
 }
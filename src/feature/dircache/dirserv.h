@@ -45,6 +45,11 @@ typedef struct spooled_resource_t {
    * we spool the object a few K at a time.
    */
   unsigned spool_eagerly : 1;
+  /**
+   * If true, we're sending the body of consensus_cache_entry straight from
+   * its file, and the connection's sendfile_* fields track our progress.
+   */
+  unsigned sending_file : 1;
   /**
    * Tells us what kind of object to get, and how to look it up.
    */
@@ -72,6 +77,11 @@ typedef struct spooled_resource_t {
 } spooled_resource_t;
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+int connection_dirserv_sendfile_pending(const dir_connection_t *conn);
+ssize_t connection_dirserv_sendfile(dir_connection_t *conn, size_t max_bytes);
+enum compress_method_t;
+int connection_dirserv_try_cached_response(dir_connection_t *conn,
+                                   enum compress_method_t method);
 
 int directory_fetches_from_authorities(const or_options_t *options);
 int directory_fetches_dir_info_early(const or_options_t *options);
@@ -0,0 +1,230 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file respcache.c
+ * \brief Remember compressed descriptor and microdescriptor responses.
+ *
+ * Directory caches answer requests for sets of descriptors by spooling
+ * each descriptor through a compressor that belongs to the connection.
+ * Many clients ask for exactly the same sets (for example, every
+ * microdescriptor that is new in the latest consensus), so we keep the
+ * compressed output of recent responses, keyed by a digest of the set of
+ * objects and the compression method that was used (see
+ * connection_dirserv_try_cached_response()), and evict the least recently
+ * used responses once they hold more than CompressedResponseCacheSize
+ * bytes.
+ *
+ * The responses are stored as cached_dir_t objects, so that connections
+ * can spool them without copying.
+ **/
+
+#define RESPCACHE_PRIVATE
+
+#include "core/or/or.h"
+
+#include "app/config/config.h"
+#include "feature/dircache/dirserv.h"
+#include "feature/dircache/respcache.h"
+
+#include "feature/dircache/cached_dir_st.h"
+
+#include "tor_queue.h"
+
+/** An entry in the response cache. */
+typedef struct respcache_entry_t {
+  /** The digest of the request that produced this response. */
+  uint8_t key[DIGEST256_LEN];
+  /** The compressed response. We hold one reference to it. */
+  cached_dir_t *response;
+  /** Position in the LRU list. */
+  TOR_TAILQ_ENTRY(respcache_entry_t) lru_link;
+} respcache_entry_t;
+
+/** How many bytes do we count for an entry, beyond its body? */
+#define RESPCACHE_ENTRY_OVERHEAD \
+  (sizeof(respcache_entry_t) + sizeof(cached_dir_t))
+
+/** Map from request key to respcache_entry_t. */
+static digest256map_t *respcache_map = NULL;
+/** Every respcache_entry_t, least recently used first. */
+static TOR_TAILQ_HEAD(respcache_lru_t, respcache_entry_t) respcache_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(respcache_lru);
+/** Total number of bytes charged to the entries in the cache. */
+static size_t respcache_total_bytes = 0;
+
+/** How many lookups have found a response? */
+static uint64_t respcache_n_hits = 0;
+/** How many lookups have not found a response? */
+static uint64_t respcache_n_misses = 0;
+/** How many compressed bytes have we handed out from the cache? */
+static uint64_t respcache_bytes_served = 0;
+/** How many responses have we discarded to make room for others? */
+static uint64_t respcache_n_evicted = 0;
+
+/** Return the number of bytes we charge for <b>ent</b>. */
+static size_t
+respcache_entry_size(const respcache_entry_t *ent)
+{
+  return ent->response->dir_compressed_len + RESPCACHE_ENTRY_OVERHEAD;
+}
+
+/** Remove <b>ent</b> from the cache and free it. */
+static void
+respcache_entry_remove(respcache_entry_t *ent)
+{
+  digest256map_remove(respcache_map, ent->key);
+  TOR_TAILQ_REMOVE(&respcache_lru, ent, lru_link);
+  respcache_total_bytes -= respcache_entry_size(ent);
+  cached_dir_decref(ent->response);
+  tor_free(ent);
+}
+
+/** Remove least recently used entries from the cache until it holds no
+ * more than <b>max_bytes</b>. */
+static void
+respcache_shrink_to(size_t max_bytes)
+{
+  respcache_entry_t *ent;
+  while (respcache_total_bytes > max_bytes &&
+         (ent = TOR_TAILQ_FIRST(&respcache_lru))) {
+    respcache_entry_remove(ent);
+    ++respcache_n_evicted;
+  }
+}
+
+/** Return the configured size limit for the cache. */
+static size_t
+respcache_get_max_bytes(void)
+{
+  uint64_t max = get_options()->CompressedResponseCacheSize;
+  return (max > SIZE_MAX) ? SIZE_MAX : (size_t) max;
+}
+
+/**
+ * Return the largest response body that we would add to the cache, or 0 if
+ * the cache is disabled.  We don't keep any response that would take more
+ * than a quarter of the cache, so that one huge response can't push out
+ * everything else.
+ */
+size_t
+respcache_max_entry_size(void)
+{
+  size_t max = respcache_get_max_bytes() / 4;
+  if (max <= RESPCACHE_ENTRY_OVERHEAD)
+    return 0;
+  return max - RESPCACHE_ENTRY_OVERHEAD;
+}
+
+/**
+ * Look up the compressed response for the request whose digest is
+ * <b>key</b>. Return a new reference to it on success, or NULL if we don't
+ * have it.
+ */
+cached_dir_t *
+respcache_lookup(const uint8_t *key)
+{
+  const size_t max_bytes = respcache_get_max_bytes();
+  if (max_bytes == 0) {
+    /* The cache has been turned off; let go of whatever it held. */
+    respcache_shrink_to(0);
+    return NULL;
+  }
+  respcache_entry_t *ent = NULL;
+  if (respcache_map)
+    ent = digest256map_get(respcache_map, key);
+  if (!ent) {
+    ++respcache_n_misses;
+    return NULL;
+  }
+
+  ++respcache_n_hits;
+  respcache_bytes_served += ent->response->dir_compressed_len;
+  TOR_TAILQ_REMOVE(&respcache_lru, ent, lru_link);
+  TOR_TAILQ_INSERT_TAIL(&respcache_lru, ent, lru_link);
+  ++ent->response->refcnt;
+  return ent->response;
+}
+
+/**
+ * Add <b>body</b>, a compressed response of <b>len</b> bytes, to the cache,
+ * for the request whose digest is <b>key</b>. Takes ownership of
+ * <b>body</b>.
+ */
+void
+respcache_add(const uint8_t *key, char *body, size_t len)
+{
+  if (len == 0 || len > respcache_max_entry_size()) {
+    tor_free(body);
+    return;
+  }
+  if (!respcache_map)
+    respcache_map = digest256map_new();
+  if (digest256map_get(respcache_map, key)) {
+    /* Two connections compressed the same response at once. */
+    tor_free(body);
+    return;
+  }
+
+  respcache_entry_t *ent = tor_malloc_zero(sizeof(respcache_entry_t));
+  memcpy(ent->key, key, DIGEST256_LEN);
+  ent->response = tor_malloc_zero(sizeof(cached_dir_t));
+  ent->response->refcnt = 1;
+  ent->response->dir_compressed = body;
+  ent->response->dir_compressed_len = len;
+  ent->response->published = TIME_MAX;
+
+  const size_t max_bytes = respcache_get_max_bytes();
+  respcache_shrink_to(max_bytes - respcache_entry_size(ent));
+
+  digest256map_set(respcache_map, ent->key, ent);
+  TOR_TAILQ_INSERT_TAIL(&respcache_lru, ent, lru_link);
+  respcache_total_bytes += respcache_entry_size(ent);
+}
+
+/** Log how well the response cache has worked since we started. */
+void
+respcache_log_heartbeat(void)
+{
+  const uint64_t n_lookups = respcache_n_hits + respcache_n_misses;
+  if (n_lookups == 0)
+    return;
+
+  log_notice(LD_HEARTBEAT,
+             "Compressed response cache since startup: "
+             "%"PRIu64" hits and %"PRIu64" misses (%.1f%% hit rate), "
+             "%"PRIu64" KB sent from the cache, %"PRIu64" responses "
+             "evicted. Currently holding %d responses in %"PRIu64" KB.",
+             respcache_n_hits, respcache_n_misses,
+             100.0 * (double)respcache_n_hits / (double)n_lookups,
+             respcache_bytes_served / 1024, respcache_n_evicted,
+             respcache_map ? digest256map_size(respcache_map) : 0,
+             (uint64_t)(respcache_total_bytes / 1024));
+}
+
+/** Release all storage held by the response cache, and reset its
+ * statistics. */
+void
+respcache_free_all(void)
+{
+  respcache_shrink_to(0);
+  digest256map_free(respcache_map, NULL);
+  respcache_n_hits = respcache_n_misses = 0;
+  respcache_bytes_served = respcache_n_evicted = 0;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of bytes currently charged to the cache. */
+STATIC size_t
+respcache_get_total_bytes(void)
+{
+  return respcache_total_bytes;
+}
+
+/** Return the number of responses currently in the cache. */
+STATIC int
+respcache_get_n_entries(void)
+{
+  return respcache_map ? digest256map_size(respcache_map) : 0;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,27 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file respcache.h
+ * \brief Header file for respcache.c.
+ **/
+
+#ifndef TOR_RESPCACHE_H
+#define TOR_RESPCACHE_H
+
+struct cached_dir_t;
+
+size_t respcache_max_entry_size(void);
+struct cached_dir_t *respcache_lookup(const uint8_t *key);
+void respcache_add(const uint8_t *key, char *body, size_t len);
+void respcache_log_heartbeat(void);
+void respcache_free_all(void);
+
+#ifdef RESPCACHE_PRIVATE
+#ifdef TOR_UNIT_TESTS
+STATIC size_t respcache_get_total_bytes(void);
+STATIC int respcache_get_n_entries(void);
+#endif
+#endif
+
+#endif /* !defined(TOR_RESPCACHE_H) */
@@ -29,6 +29,10 @@
  * time near-linear. This is explained in more detail in the gen_ed_diff
  * comments.
  *
+ * When a pair of slices is large, gen_ed_diff first interns their lines with
+ * intern_lines, so that calc_changes and its helpers can compare two lines by
+ * comparing two integers instead of their contents.
+ *
  * The allocation strategy tries to save time and memory by avoiding needless
  * copies.  Instead of actually splitting the inputs into separate strings, we
  * allocate cdline_t objects, each of which represents a line in the original
@@ -42,6 +46,8 @@
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
 #include "feature/dirparse/ns_parse.h"
+#include "ht.h"
+#include "siphash.h"
 
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
@@ -151,9 +157,116 @@ smartlist_slice(const smartlist_t *list, int start, int end)
   slice->list = list;
   slice->offset = start;
   slice->len = end - start;
+  slice->ids = NULL;
   return slice;
 }
 
+/** Create (allocate) a new slice from the smartlist under <b>slice</b>,
+ * sharing its line identifiers, if any. The start and end indexes are
+ * positions in the whole smartlist, as for smartlist_slice().
+ */
+static smartlist_slice_t *
+smartlist_subslice(const smartlist_slice_t *slice, int start, int end)
+{
+  smartlist_slice_t *result = smartlist_slice(slice->list, start, end);
+  result->ids = slice->ids;
+  return result;
+}
+
+/** Return true iff the element at position <b>i1</b> of the smartlist under
+ * <b>slice1</b> has the same contents as the element at position <b>i2</b>
+ * of the smartlist under <b>slice2</b>. */
+static inline int
+slice_lines_eq(const smartlist_slice_t *slice1, int i1,
+               const smartlist_slice_t *slice2, int i2)
+{
+  if (slice1->ids && slice2->ids)
+    return slice1->ids[i1] == slice2->ids[i2];
+  return lines_eq(smartlist_get(slice1->list, i1),
+                  smartlist_get(slice2->list, i2));
+}
+
+/** Entry in the table that intern_lines uses to map line contents to line
+ * identifiers. */
+typedef struct cdline_id_ent_t {
+  HT_ENTRY(cdline_id_ent_t) node;
+  /** The first line we saw with these contents. */
+  const cdline_t *line;
+  /** The identifier for all lines with these contents. */
+  uint32_t id;
+} cdline_id_ent_t;
+
+/** Helper: hash the contents of a cdline_id_ent_t's line. */
+static inline unsigned
+cdline_id_ent_hash(const cdline_id_ent_t *ent)
+{
+  return (unsigned) siphash24g(ent->line->s, ent->line->len);
+}
+
+/** Helper: return true iff two cdline_id_ent_t have the same contents. */
+static inline int
+cdline_id_ents_eq(const cdline_id_ent_t *a, const cdline_id_ent_t *b)
+{
+  return lines_eq(a->line, b->line);
+}
+
+HT_HEAD(cdline_id_map, cdline_id_ent_t);
+HT_PROTOTYPE(cdline_id_map, cdline_id_ent_t, node, cdline_id_ent_hash,
+             cdline_id_ents_eq)
+HT_GENERATE2(cdline_id_map, cdline_id_ent_t, node, cdline_id_ent_hash,
+             cdline_id_ents_eq, 0.6, tor_reallocarray_, tor_free_)
+
+/** Helper for intern_lines: store an identifier for each line of
+ * <b>slice</b> in <b>ids</b>, at the same position as in the whole list,
+ * adding any new contents to <b>map</b>.  <b>ents</b> is storage for new map
+ * entries, of which *<b>n_ents</b> are already in use. */
+static void
+intern_slice_lines(struct cdline_id_map *map, const smartlist_slice_t *slice,
+                   cdline_id_ent_t *ents, uint32_t *n_ents, uint32_t *ids)
+{
+  const int end = slice->offset + slice->len;
+  for (int i = slice->offset; i < end; ++i) {
+    cdline_id_ent_t *ent = &ents[*n_ents];
+    cdline_id_ent_t *found;
+    ent->line = smartlist_get(slice->list, i);
+    found = HT_FIND(cdline_id_map, map, ent);
+    if (!found) {
+      ent->id = (*n_ents)++;
+      HT_INSERT(cdline_id_map, map, ent);
+      found = ent;
+    }
+    ids[i] = found->id;
+  }
+}
+
+/** Assign an identifier to every line in <b>slice1</b> and <b>slice2</b>,
+ * such that two lines have the same identifier iff they have the same
+ * contents.  Store the identifiers in <b>ids1</b> and <b>ids2</b>, which
+ * must be as long as the whole lists under the slices, and make the slices
+ * use them.
+ *
+ * This lets calc_changes compare lines in constant time, which pays off
+ * when it has to compare every line of one slice to every line of the
+ * other.
+ */
+STATIC void
+intern_lines(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+             uint32_t *ids1, uint32_t *ids2)
+{
+  struct cdline_id_map map = HT_INITIALIZER();
+  cdline_id_ent_t *ents = tor_calloc(slice1->len + slice2->len + 1,
+                                     sizeof(*ents));
+  uint32_t n_ents = 0;
+
+  intern_slice_lines(&map, slice1, ents, &n_ents, ids1);
+  intern_slice_lines(&map, slice2, ents, &n_ents, ids2);
+  slice1->ids = ids1;
+  slice2->ids = ids2;
+
+  HT_CLEAR(cdline_id_map, &map);
+  tor_free(ents);
+}
+
 /** Helper: Compute the longest common subsequence lengths for the two slices.
  * Used as part of the diff generation to find the column at which to split
  * slice2 while still having the optimal solution.
@@ -169,8 +282,9 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
 
   /* Resulting lcs lengths. */
   int *result = tor_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
-  int *prev = tor_malloc(a_size);
+  /* The lcs lengths from the last iteration. Since result[0] and prev[0]
+   * are never written, we can swap the two arrays instead of copying. */
+  int *prev = tor_malloc_zero(a_size);
 
   tor_assert(direction == 1 || direction == -1);
 
@@ -181,19 +295,34 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
 
   for (int i = 0; i < slice1->len; ++i, si+=direction) {
 
-    const cdline_t *line1 = smartlist_get(slice1->list, si);
     /* Store the last results. */
-    memcpy(prev, result, a_size);
+    int *tmp = prev;
+    prev = result;
+    result = tmp;
 
     int sj = slice2->offset;
     if (direction == -1) {
       sj += (slice2->len-1);
     }
 
+    if (slice1->ids && slice2->ids) {
+      /* Same as below, but comparing line identifiers: this is the inner
+       * loop for large slices. */
+      const uint32_t id1 = slice1->ids[si];
+      const uint32_t *ids2 = slice2->ids;
+      for (int j = 0; j < slice2->len; ++j, sj+=direction) {
+        if (ids2[sj] == id1) {
+          result[j + 1] = prev[j] + 1;
+        } else {
+          result[j + 1] = MAX(result[j], prev[j + 1]);
+        }
+      }
+      continue;
+    }
+
     for (int j = 0; j < slice2->len; ++j, sj+=direction) {
 
-      const cdline_t *line2 = smartlist_get(slice2->list, sj);
-      if (lines_eq(line1, line2)) {
+      if (slice_lines_eq(slice1, si, slice2, sj)) {
         /* If the lines are equal, the lcs is one line longer. */
         result[j + 1] = prev[j] + 1;
       } else {
@@ -213,9 +342,7 @@ STATIC void
 trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
 {
   while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, slice1->offset);
-    const cdline_t *line2 = smartlist_get(slice2->list, slice2->offset);
-    if (!lines_eq(line1, line2)) {
+    if (!slice_lines_eq(slice1, slice1->offset, slice2, slice2->offset)) {
       break;
     }
     slice1->offset++; slice1->len--;
@@ -226,9 +353,7 @@ trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2)
   int i2 = (slice2->offset+slice2->len)-1;
 
   while (slice1->len>0 && slice2->len>0) {
-    const cdline_t *line1 = smartlist_get(slice1->list, i1);
-    const cdline_t *line2 = smartlist_get(slice2->list, i2);
-    if (!lines_eq(line1, line2)) {
+    if (!slice_lines_eq(slice1, i1, slice2, i2)) {
       break;
     }
     i1--;
@@ -267,7 +392,19 @@ set_changed(bitarray_t *changed1, bitarray_t *changed2,
   int toskip = -1;
   tor_assert(slice1->len == 0 || slice1->len == 1);
 
-  if (slice1->len == 1) {
+  if (slice1->len == 1 && slice1->ids && slice2->ids) {
+    const uint32_t id_common = slice1->ids[slice1->offset];
+    int end = slice2->offset + slice2->len;
+    for (int i = slice2->offset; i < end; ++i) {
+      if (slice2->ids[i] == id_common) {
+        toskip = i;
+        break;
+      }
+    }
+    if (toskip == -1) {
+      bitarray_set(changed1, slice1->offset);
+    }
+  } else if (slice1->len == 1) {
     const cdline_t *line_common = smartlist_get(slice1->list, slice1->offset);
     toskip = smartlist_slice_string_pos(slice2, line_common);
     if (toskip == -1) {
@@ -342,14 +479,14 @@ calc_changes(smartlist_slice_t *slice1,
 
     /* Split the first slice in half. */
     int mid = slice1->len/2;
-    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid);
-    bot = smartlist_slice(slice1->list, slice1->offset+mid,
+    top = smartlist_subslice(slice1, slice1->offset, slice1->offset+mid);
+    bot = smartlist_subslice(slice1, slice1->offset+mid,
         slice1->offset+slice1->len);
 
     /* Split the second slice by the optimal column. */
     int mid2 = optimal_column_to_split(top, bot, slice2);
-    left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+mid2);
-    right = smartlist_slice(slice2->list, slice2->offset+mid2,
+    left = smartlist_subslice(slice2, slice2->offset, slice2->offset+mid2);
+    right = smartlist_subslice(slice2, slice2->offset+mid2,
         slice2->offset+slice2->len);
 
     calc_changes(top, left, changed1, changed2);
@@ -599,6 +736,136 @@ preprocess_consensus(memarea_t *area,
   }
 }
 
+/** The largest number of lines that we will compare at once, in each of two
+ * slices. */
+#define MAX_LINE_COUNT (10000)
+/** If the product of the lengths of two slices to compare is at least this
+ * large, intern their lines before comparing them. */
+#define MIN_LINES_PRODUCT_TO_INTERN (1024)
+
+/** Helper for gen_ed_diff() and gen_ed_diff_composed(): calculate the
+ * changes between lines <b>start1</b> up to <b>end1</b> of <b>cons1</b> and
+ * lines <b>start2</b> up to <b>end2</b> of <b>cons2</b> (not including the
+ * end lines), and set the bits of the changed lines in <b>changed1</b> and
+ * <b>changed2</b>.
+ *
+ * *<b>ids1_p</b> and *<b>ids2_p</b> hold line identifiers for use by
+ * intern_lines(); if they are NULL and we need them, allocate them.  The
+ * caller must free them.
+ */
+static void
+calc_chunk_changes(const smartlist_t *cons1, int start1, int end1,
+                   const smartlist_t *cons2, int start2, int end2,
+                   bitarray_t *changed1, bitarray_t *changed2,
+                   uint32_t **ids1_p, uint32_t **ids2_p)
+{
+  smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, end1);
+  smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, end2);
+  /* Most pairs of slices are a few lines long, and differ in a line or
+   * two.  For the rare large ones, calc_changes compares every line of one
+   * slice to every line of the other, so it is worth hashing the lines
+   * once and comparing identifiers instead. */
+  trim_slices(cons1_sl, cons2_sl);
+  if ((uint64_t)cons1_sl->len * cons2_sl->len >=
+      MIN_LINES_PRODUCT_TO_INTERN) {
+    if (!*ids1_p) {
+      *ids1_p = tor_calloc(smartlist_len(cons1) + 1, sizeof(uint32_t));
+      *ids2_p = tor_calloc(smartlist_len(cons2) + 1, sizeof(uint32_t));
+    }
+    intern_lines(cons1_sl, cons2_sl, *ids1_p, *ids2_p);
+  }
+  calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+  tor_free(cons1_sl);
+  tor_free(cons2_sl);
+}
+
+/** Helper for gen_ed_diff() and gen_ed_diff_composed(): given a consensus
+ * of <b>len1</b> lines, a consensus <b>cons2</b>, and the bitarrays
+ * <b>changed1</b> and <b>changed2</b> of the lines that differ between
+ * them, add to <b>result</b> the ed commands to turn the first into the
+ * second, allocating new lines in <b>area</b>.  Return 0 on success, -1 on
+ * failure.
+ */
+static int
+add_ed_commands_for_changes(smartlist_t *result,
+                            int len1, const smartlist_t *cons2,
+                            bitarray_t *changed1,
+                            bitarray_t *changed2,
+                            memarea_t *area)
+{
+  int len2 = smartlist_len(cons2);
+
+  /* Navigate the changes in reverse order and generate one ed command for
+   * each chunk of changes.
+   */
+  int i1=len1-1, i2=len2-1;
+  char buf[128];
+  while (i1 >= 0 || i2 >= 0) {
+
+    int start1x, start2x, end1, end2, added, deleted;
+
+    /* We are at a point were no changed bools are true, so just keep going. */
+    if (!(i1 >= 0 && bitarray_is_set(changed1, i1)) &&
+        !(i2 >= 0 && bitarray_is_set(changed2, i2))) {
+      if (i1 >= 0) {
+        i1--;
+      }
+      if (i2 >= 0) {
+        i2--;
+      }
+      continue;
+    }
+
+    end1 = i1, end2 = i2;
+
+    /* Grab all contiguous changed lines */
+    while (i1 >= 0 && bitarray_is_set(changed1, i1)) {
+      i1--;
+    }
+    while (i2 >= 0 && bitarray_is_set(changed2, i2)) {
+      i2--;
+    }
+
+    start1x = i1+1, start2x = i2+1;
+    added = end2-i2, deleted = end1-i1;
+
+    if (added == 0) {
+      if (deleted == 1) {
+        tor_snprintf(buf, sizeof(buf), "%id", start1x+1);
+        smartlist_add_linecpy(result, area, buf);
+      } else {
+        tor_snprintf(buf, sizeof(buf), "%i,%id", start1x+1, start1x+deleted);
+        smartlist_add_linecpy(result, area, buf);
+      }
+    } else {
+      int i;
+      if (deleted == 0) {
+        tor_snprintf(buf, sizeof(buf), "%ia", start1x);
+        smartlist_add_linecpy(result, area, buf);
+      } else if (deleted == 1) {
+        tor_snprintf(buf, sizeof(buf), "%ic", start1x+1);
+        smartlist_add_linecpy(result, area, buf);
+      } else {
+        tor_snprintf(buf, sizeof(buf), "%i,%ic", start1x+1, start1x+deleted);
+        smartlist_add_linecpy(result, area, buf);
+      }
+
+      for (i = start2x; i <= end2; ++i) {
+        cdline_t *line = smartlist_get(cons2, i);
+        if (line_str_eq(line, ".")) {
+          log_warn(LD_CONSDIFF, "Cannot generate consensus diff because "
+              "one of the lines to be added is \".\".");
+          return -1;
+        }
+        smartlist_add(result, line);
+      }
+      smartlist_add_linecpy(result, area, ".");
+    }
+  }
+
+  return 0;
+}
+
 /** Generate an ed diff as a smartlist from two consensuses, also given as
  * smartlists. Will return NULL if the diff could not be generated, which can
  * happen if any lines the script had to add matched "." or if the routers
@@ -644,6 +911,9 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   int i1=-1, i2=-1;
   int start1=0, start2=0;
 
+  /* Line identifiers for the slices that we intern; see below. */
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+
   /* To check that hashes are ordered properly */
   router_id_iterator_t iter1 = ROUTER_ID_ITERATOR_INIT;
   router_id_iterator_t iter2 = ROUTER_ID_ITERATOR_INIT;
@@ -726,92 +996,27 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
      * never happen with any pair of real consensuses. Feeding more than 10K
      * lines to calc_changes would be very slow anyway.
      */
-#define MAX_LINE_COUNT (10000)
     if (i1-start1 > MAX_LINE_COUNT || i2-start2 > MAX_LINE_COUNT) {
       log_warn(LD_CONSDIFF, "Refusing to generate consensus diff because "
           "we found too few common router ids.");
       goto error_cleanup;
     }
 
-    smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
-    smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
-    tor_free(cons1_sl);
-    tor_free(cons2_sl);
+    calc_chunk_changes(cons1, start1, i1, cons2, start2, i2,
+                       changed1, changed2, &ids1, &ids2);
     start1 = i1, start2 = i2;
   }
 
-  /* Navigate the changes in reverse order and generate one ed command for
-   * each chunk of changes.
-   */
-  i1=len1-1, i2=len2-1;
-  char buf[128];
-  while (i1 >= 0 || i2 >= 0) {
-
-    int start1x, start2x, end1, end2, added, deleted;
-
-    /* We are at a point were no changed bools are true, so just keep going. */
-    if (!(i1 >= 0 && bitarray_is_set(changed1, i1)) &&
-        !(i2 >= 0 && bitarray_is_set(changed2, i2))) {
-      if (i1 >= 0) {
-        i1--;
-      }
-      if (i2 >= 0) {
-        i2--;
-      }
-      continue;
-    }
-
-    end1 = i1, end2 = i2;
-
-    /* Grab all contiguous changed lines */
-    while (i1 >= 0 && bitarray_is_set(changed1, i1)) {
-      i1--;
-    }
-    while (i2 >= 0 && bitarray_is_set(changed2, i2)) {
-      i2--;
-    }
-
-    start1x = i1+1, start2x = i2+1;
-    added = end2-i2, deleted = end1-i1;
-
-    if (added == 0) {
-      if (deleted == 1) {
-        tor_snprintf(buf, sizeof(buf), "%id", start1x+1);
-        smartlist_add_linecpy(result, area, buf);
-      } else {
-        tor_snprintf(buf, sizeof(buf), "%i,%id", start1x+1, start1x+deleted);
-        smartlist_add_linecpy(result, area, buf);
-      }
-    } else {
-      int i;
-      if (deleted == 0) {
-        tor_snprintf(buf, sizeof(buf), "%ia", start1x);
-        smartlist_add_linecpy(result, area, buf);
-      } else if (deleted == 1) {
-        tor_snprintf(buf, sizeof(buf), "%ic", start1x+1);
-        smartlist_add_linecpy(result, area, buf);
-      } else {
-        tor_snprintf(buf, sizeof(buf), "%i,%ic", start1x+1, start1x+deleted);
-        smartlist_add_linecpy(result, area, buf);
-      }
-
-      for (i = start2x; i <= end2; ++i) {
-        cdline_t *line = smartlist_get(cons2, i);
-        if (line_str_eq(line, ".")) {
-          log_warn(LD_CONSDIFF, "Cannot generate consensus diff because "
-              "one of the lines to be added is \".\".");
-          goto error_cleanup;
-        }
-        smartlist_add(result, line);
-      }
-      smartlist_add_linecpy(result, area, ".");
-    }
+  if (add_ed_commands_for_changes(result, len1, cons2,
+                                  changed1, changed2, area) < 0) {
+    goto error_cleanup;
   }
 
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  tor_free(ids1);
+  tor_free(ids2);
 
   return result;
 
@@ -820,12 +1025,151 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   smartlist_free(cons1);
   bitarray_free(changed1);
   bitarray_free(changed2);
+  tor_free(ids1);
+  tor_free(ids2);
 
   smartlist_free(result);
 
   return NULL;
 }
 
+/** Generate an ed diff as a smartlist from the consensus <b>cons1_orig</b>
+ * to the consensus <b>cons3</b>, given the consensus diffs <b>diff12</b>
+ * from <b>cons1_orig</b> to some intermediate consensus, and <b>diff23</b>
+ * from that intermediate consensus to <b>cons3</b>.  All of them are given
+ * as smartlists.  Return NULL if the diff could not be generated this way,
+ * in which case the caller should generate it with gen_ed_diff().
+ *
+ * All cdline_t objects in the resulting object are either references to lines
+ * in one of the inputs, or are newly allocated lines in the provided memarea.
+ *
+ * Applying both diffs to <b>cons1_orig</b> tells us which of its lines
+ * survive into <b>cons3</b>: those lines are a common subsequence of the two
+ * consensuses, found in linear time.  Lines that changed in the first diff
+ * and changed back in the second are not in that subsequence, so we compare
+ * each pair of chunks between two surviving lines with calc_changes(), as
+ * gen_ed_diff() would.  If any such pair of chunks is too large to compare,
+ * give up, since the resulting diff would be much larger than one generated
+ * with gen_ed_diff().
+ */
+STATIC smartlist_t *
+gen_ed_diff_composed(const smartlist_t *cons1_orig,
+                     const smartlist_t *diff12,
+                     const smartlist_t *diff23,
+                     const smartlist_t *cons3,
+                     memarea_t *area)
+{
+  smartlist_t *cons1 = smartlist_new();
+  smartlist_t *tagged1 = smartlist_new();
+  smartlist_t *tagged2 = NULL, *tagged3 = NULL;
+  smartlist_t *result = NULL;
+  bitarray_t *changed1 = NULL, *changed3 = NULL;
+  uint32_t *ids1 = NULL, *ids3 = NULL;
+  cdline_t *lines1 = NULL;
+  int n_lines1 = smartlist_len(cons1_orig);
+  int ok = 0;
+
+  /* Copy the lines of cons1 into an array, so that we can tell whether a
+   * line of the result came from cons1, and which one it was. */
+  lines1 = tor_calloc(n_lines1 + 1, sizeof(cdline_t));
+  SMARTLIST_FOREACH_BEGIN(cons1_orig, const cdline_t *, line) {
+    lines1[line_sl_idx] = *line;
+    smartlist_add(tagged1, &lines1[line_sl_idx]);
+  } SMARTLIST_FOREACH_END(line);
+
+  tagged2 = apply_ed_diff(tagged1, diff12, 2);
+  if (!tagged2)
+    goto done;
+  tagged3 = apply_ed_diff(tagged2, diff23, 2);
+  if (!tagged3)
+    goto done;
+
+  int len3 = smartlist_len(cons3);
+  if (smartlist_len(tagged3) != len3)
+    goto done;
+
+  smartlist_add_all(cons1, cons1_orig);
+  cdline_t *remove_trailer = preprocess_consensus(area, cons1);
+  int len1 = smartlist_len(cons1);
+
+  result = smartlist_new();
+  if (remove_trailer) {
+    /* There's a delete-the-trailer line at the end, so add it here. */
+    smartlist_add(result, remove_trailer);
+  }
+
+  /* Start out with every line changed, and then clear the bits of the
+   * lines that survive from cons1 into cons3. */
+  changed1 = bitarray_init_zero(len1);
+  changed3 = bitarray_init_zero(len3);
+  int i, k;
+  for (i = 0; i < len1; ++i)
+    bitarray_set(changed1, i);
+  for (k = 0; k < len3; ++k)
+    bitarray_set(changed3, k);
+
+  int prev1 = -1, prev3 = -1;
+  for (k = 0; k <= len3; ++k) {
+    if (k < len3) {
+      const cdline_t *line = smartlist_get(tagged3, k);
+      if (! lines_eq(line, smartlist_get(cons3, k)))
+        goto done;
+      uintptr_t offset = (uintptr_t)line - (uintptr_t)lines1;
+      if (offset >= (uintptr_t)n_lines1 * sizeof(cdline_t))
+        continue; /* Not a line from cons1. */
+      i = (int)(offset / sizeof(cdline_t));
+      if (BUG(i <= prev1) || i >= len1)
+        continue; // LCOV_EXCL_LINE
+      bitarray_clear(changed1, i);
+      bitarray_clear(changed3, k);
+    } else {
+      i = len1;
+    }
+
+    /* Compare the lines that changed between this surviving line and the
+     * last one. */
+    if (i - prev1 > 1 && k - prev3 > 1) {
+      int j;
+      if (i - prev1 - 1 > MAX_LINE_COUNT || k - prev3 - 1 > MAX_LINE_COUNT) {
+        log_info(LD_CONSDIFF, "Not composing consensus diffs, since they "
+                 "have too few lines in common.");
+        goto done;
+      }
+      for (j = prev1 + 1; j < i; ++j)
+        bitarray_clear(changed1, j);
+      for (j = prev3 + 1; j < k; ++j)
+        bitarray_clear(changed3, j);
+      calc_chunk_changes(cons1, prev1 + 1, i, cons3, prev3 + 1, k,
+                         changed1, changed3, &ids1, &ids3);
+    }
+    prev1 = i;
+    prev3 = k;
+  }
+
+  if (add_ed_commands_for_changes(result, len1, cons3,
+                                  changed1, changed3, area) < 0) {
+    goto done;
+  }
+  ok = 1;
+
+ done:
+  if (!ok) {
+    smartlist_free(result);
+    result = NULL;
+  }
+  smartlist_free(cons1);
+  smartlist_free(tagged1);
+  smartlist_free(tagged2);
+  smartlist_free(tagged3);
+  bitarray_free(changed1);
+  bitarray_free(changed3);
+  tor_free(ids1);
+  tor_free(ids3);
+  tor_free(lines1);
+
+  return result;
+}
+
 /* Helper: Read a base-10 number between 0 and INT32_MAX from <b>s</b> and
  * store it in <b>num_out</b>.  Advance <b>s</b> to the characer immediately
  * after the number.  Return 0 on success, -1 on failure. */
@@ -1015,24 +1359,20 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
   return NULL;
 }
 
-/** Generate a consensus diff as a smartlist from two given consensuses, also
- * as smartlists. Will return NULL if the consensus diff could not be
- * generated. Neither of the two consensuses are modified in any way, so it's
- * up to the caller to free their resources.
+/** Helper for consdiff_gen_diff() and consdiff_gen_composed_diff(): check
+ * that the ed diff <b>ed_diff</b> turns <b>cons1</b> into <b>cons2</b>, and
+ * return a consensus diff made from it and the digests of the two
+ * consensuses.  Take ownership of <b>ed_diff</b>.  Return NULL if the check
+ * fails.
  */
-smartlist_t *
-consdiff_gen_diff(const smartlist_t *cons1,
-                  const smartlist_t *cons2,
-                  const consensus_digest_t *digests1,
-                  const consensus_digest_t *digests2,
-                  memarea_t *area)
+static smartlist_t *
+consdiff_finish_diff(const smartlist_t *cons1,
+                     const smartlist_t *cons2,
+                     smartlist_t *ed_diff,
+                     const consensus_digest_t *digests1,
+                     const consensus_digest_t *digests2,
+                     memarea_t *area)
 {
-  smartlist_t *ed_diff = gen_ed_diff(cons1, cons2, area);
-  /* ed diff could not be generated - reason already logged by gen_ed_diff. */
-  if (!ed_diff) {
-    goto error_cleanup;
-  }
-
   /* See that the script actually produces what we want. */
   smartlist_t *ed_cons2 = apply_ed_diff(cons1, ed_diff, 0);
   if (!ed_cons2) {
@@ -1087,15 +1427,56 @@ consdiff_gen_diff(const smartlist_t *cons1,
 
  error_cleanup:
 
-  if (ed_diff) {
-    /* LCOV_EXCL_START -- ed_diff is NULL except in unreachable cases above */
-    smartlist_free(ed_diff);
-    /* LCOV_EXCL_STOP */
-  }
+  smartlist_free(ed_diff);
 
   return NULL;
 }
 
+/** Generate a consensus diff as a smartlist from two given consensuses, also
+ * as smartlists. Will return NULL if the consensus diff could not be
+ * generated. Neither of the two consensuses are modified in any way, so it's
+ * up to the caller to free their resources.
+ */
+smartlist_t *
+consdiff_gen_diff(const smartlist_t *cons1,
+                  const smartlist_t *cons2,
+                  const consensus_digest_t *digests1,
+                  const consensus_digest_t *digests2,
+                  memarea_t *area)
+{
+  smartlist_t *ed_diff = gen_ed_diff(cons1, cons2, area);
+  /* ed diff could not be generated - reason already logged by gen_ed_diff. */
+  if (!ed_diff) {
+    return NULL;
+  }
+  return consdiff_finish_diff(cons1, cons2, ed_diff, digests1, digests2,
+                              area);
+}
+
+/** Generate a consensus diff as a smartlist from the consensus <b>cons1</b>
+ * to the consensus <b>cons3</b>, by composing the consensus diffs
+ * <b>diff12</b> and <b>diff23</b>, as for gen_ed_diff_composed().  All are
+ * given as smartlists.  Will return NULL if the consensus diff could not be
+ * generated this way.  None of the inputs are modified in any way.
+ */
+STATIC smartlist_t *
+consdiff_gen_composed_diff(const smartlist_t *cons1,
+                           const smartlist_t *diff12,
+                           const smartlist_t *diff23,
+                           const smartlist_t *cons3,
+                           const consensus_digest_t *digests1,
+                           const consensus_digest_t *digests3,
+                           memarea_t *area)
+{
+  smartlist_t *ed_diff = gen_ed_diff_composed(cons1, diff12, diff23, cons3,
+                                              area);
+  if (!ed_diff) {
+    return NULL;
+  }
+  return consdiff_finish_diff(cons1, cons3, ed_diff, digests1, digests3,
+                              area);
+}
+
 /** Fetch the digest of the base consensus in the consensus diff, encoded in
  * base16 as found in the diff itself. digest1_out and digest2_out must be of
  * length DIGEST256_LEN or larger if not NULL.
@@ -1330,6 +1711,88 @@ consensus_join_lines(const smartlist_t *inp)
   return result;
 }
 
+/** A consensus that we are generating diffs to.  Once it is constructed,
+ * it is never modified, so it can be shared by several threads at once. */
+struct consensus_diff_target_t {
+  /** The text of the consensus, which <b>lines</b> point into. */
+  char *body;
+  /** Memory area holding the cdline_t entries in <b>lines</b>. */
+  memarea_t *area;
+  /** The consensus, split into lines. */
+  smartlist_t *lines;
+  /** The digest of the whole consensus. */
+  consensus_digest_t digest;
+};
+
+/** Take ownership of the NUL-terminated consensus document <b>cons</b>, and
+ * return a newly allocated consensus_diff_target_t holding it, digested and
+ * split into lines.  On failure, free <b>cons</b> and return NULL. */
+consensus_diff_target_t *
+consensus_diff_target_new(char *cons)
+{
+  consensus_diff_target_t *target = tor_malloc_zero(sizeof(*target));
+  target->body = cons;
+  target->area = memarea_new();
+  target->lines = smartlist_new();
+
+  if (BUG(consensus_compute_digest(cons, &target->digest) < 0))
+    goto err; // LCOV_EXCL_LINE
+  if (consensus_split_lines(target->lines, cons, target->area) < 0)
+    goto err;
+
+  return target;
+ err:
+  consensus_diff_target_free(target);
+  return NULL;
+}
+
+/** Release all storage held by <b>target</b>. */
+void
+consensus_diff_target_free_(consensus_diff_target_t *target)
+{
+  if (!target)
+    return;
+  smartlist_free(target->lines);
+  memarea_drop_all(target->area);
+  tor_free(target->body);
+  tor_free(target);
+}
+
+/** Helper: try to compute a diff from <b>cons1</b> to the consensus whose
+ * lines are <b>lines2</b> and whose digest is <b>d2</b>.  On success, return
+ * a newly allocated string containing that diff.  On failure, return
+ * NULL. */
+static char *
+consensus_diff_generate_to_lines(const char *cons1,
+                                 const smartlist_t *lines2,
+                                 const consensus_digest_t *d2)
+{
+  consensus_digest_t d1;
+  smartlist_t *lines1 = NULL, *result_lines = NULL;
+  char *result = NULL;
+
+  if (BUG(consensus_compute_digest_as_signed(cons1, &d1) < 0))
+    return NULL; // LCOV_EXCL_LINE
+
+  memarea_t *area = memarea_new();
+  lines1 = smartlist_new();
+  if (consensus_split_lines(lines1, cons1, area) < 0)
+    goto done;
+
+  result_lines = consdiff_gen_diff(lines1, lines2, &d1, d2, area);
+
+ done:
+  if (result_lines) {
+    result = consensus_join_lines(result_lines);
+    smartlist_free(result_lines);
+  }
+
+  memarea_drop_all(area);
+  smartlist_free(lines1);
+
+  return result;
+}
+
 /** Given two consensus documents, try to compute a diff between them.  On
  * success, retun a newly allocated string containing that diff.  On failure,
  * return NULL. */
@@ -1337,25 +1800,90 @@ char *
 consensus_diff_generate(const char *cons1,
                         const char *cons2)
 {
-  consensus_digest_t d1, d2;
-  smartlist_t *lines1 = NULL, *lines2 = NULL, *result_lines = NULL;
-  int r1, r2;
+  consensus_digest_t d2;
+  smartlist_t *lines2 = NULL;
   char *result = NULL;
 
-  r1 = consensus_compute_digest_as_signed(cons1, &d1);
-  r2 = consensus_compute_digest(cons2, &d2);
-  if (BUG(r1 < 0 || r2 < 0))
+  if (BUG(consensus_compute_digest(cons2, &d2) < 0))
     return NULL; // LCOV_EXCL_LINE
 
   memarea_t *area = memarea_new();
-  lines1 = smartlist_new();
   lines2 = smartlist_new();
-  if (consensus_split_lines(lines1, cons1, area) < 0)
+  if (consensus_split_lines(lines2, cons2, area) == 0)
+    result = consensus_diff_generate_to_lines(cons1, lines2, &d2);
+
+  memarea_drop_all(area);
+  smartlist_free(lines2);
+
+  return result;
+}
+
+/** Given a consensus document <b>cons1</b>, try to compute a diff from it to
+ * <b>target</b>.  On success, return a newly allocated string containing that
+ * diff.  On failure, return NULL.
+ *
+ * This function does not modify <b>target</b>, and so may be called from
+ * several threads at once with the same <b>target</b>. */
+char *
+consensus_diff_generate_to_target(const char *cons1,
+                                  const consensus_diff_target_t *target)
+{
+  tor_assert(target);
+  return consensus_diff_generate_to_lines(cons1, target->lines,
+                                          &target->digest);
+}
+
+/** Given a consensus document <b>cons1</b>, a consensus diff <b>diff12</b>
+ * from it to some intermediate consensus, and a consensus diff <b>diff23</b>
+ * from that intermediate consensus to <b>target</b>, try to compute a diff
+ * from <b>cons1</b> to <b>target</b> by composing the two diffs.  This is
+ * much faster than consensus_diff_generate_to_target(), but not always
+ * possible.  On success, return a newly allocated string containing that
+ * diff.  On failure, return NULL.
+ *
+ * As with consensus_diff_generate_to_target(), this function may be called
+ * from several threads at once with the same <b>target</b>. */
+char *
+consensus_diff_compose_to_target(const char *cons1,
+                                 const char *diff12,
+                                 const char *diff23,
+                                 const consensus_diff_target_t *target)
+{
+  consensus_digest_t d1;
+  char from_digest[DIGEST256_LEN], to_digest[DIGEST256_LEN];
+  smartlist_t *lines1 = NULL, *lines12 = NULL, *lines23 = NULL;
+  smartlist_t *result_lines = NULL;
+  char *result = NULL;
+
+  tor_assert(target);
+  if (BUG(consensus_compute_digest_as_signed(cons1, &d1) < 0))
+    return NULL; // LCOV_EXCL_LINE
+
+  memarea_t *area = memarea_new();
+  lines1 = smartlist_new();
+  lines12 = smartlist_new();
+  lines23 = smartlist_new();
+  if (consensus_split_lines(lines1, cons1, area) < 0 ||
+      consensus_split_lines(lines12, diff12, area) < 0 ||
+      consensus_split_lines(lines23, diff23, area) < 0)
+    goto done;
+
+  /* The diffs must start and end at the right consensuses.  (If they don't
+   * meet in the middle, consdiff_gen_composed_diff() will notice.) */
+  if (consdiff_get_digests(lines12, from_digest, NULL) < 0 ||
+      consdiff_get_digests(lines23, NULL, to_digest) < 0)
     goto done;
-  if (consensus_split_lines(lines2, cons2, area) < 0)
+  if (!consensus_digest_eq((const uint8_t*)from_digest, d1.sha3_256) ||
+      !consensus_digest_eq((const uint8_t*)to_digest,
+                           target->digest.sha3_256)) {
+    log_info(LD_CONSDIFF, "Not composing consensus diffs, since they do not "
+             "lead from the base consensus to the target consensus.");
     goto done;
+  }
 
-  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area);
+  result_lines = consdiff_gen_composed_diff(lines1, lines12, lines23,
+                                            target->lines,
+                                            &d1, &target->digest, area);
 
  done:
   if (result_lines) {
@@ -1365,7 +1893,8 @@ consensus_diff_generate(const char *cons1,
 
   memarea_drop_all(area);
   smartlist_free(lines1);
-  smartlist_free(lines2);
+  smartlist_free(lines12);
+  smartlist_free(lines23);
 
   return result;
 }
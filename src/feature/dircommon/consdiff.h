@@ -7,8 +7,23 @@
 
 #include "core/or/or.h"
 
+/** A consensus that has been split into lines and digested, so that we can
+ * generate several diffs to it without repeating that work. */
+typedef struct consensus_diff_target_t consensus_diff_target_t;
+
 char *consensus_diff_generate(const char *cons1,
                               const char *cons2);
+consensus_diff_target_t *consensus_diff_target_new(char *cons);
+void consensus_diff_target_free_(consensus_diff_target_t *target);
+#define consensus_diff_target_free(target) \
+  FREE_AND_NULL(consensus_diff_target_t, consensus_diff_target_free_, \
+                (target))
+char *consensus_diff_generate_to_target(const char *cons1,
+                                  const consensus_diff_target_t *target);
+char *consensus_diff_compose_to_target(const char *cons1,
+                                       const char *diff12,
+                                       const char *diff23,
+                                       const consensus_diff_target_t *target);
 char *consensus_diff_apply(const char *consensus,
                            const char *diff);
 
@@ -36,6 +51,13 @@ STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
                                       struct memarea_t *area);
+STATIC smartlist_t *consdiff_gen_composed_diff(const smartlist_t *cons1,
+                                         const smartlist_t *diff12,
+                                         const smartlist_t *diff23,
+                                         const smartlist_t *cons3,
+                                         const consensus_digest_t *digests1,
+                                         const consensus_digest_t *digests3,
+                                         struct memarea_t *area);
 STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
                                  const smartlist_t *diff,
                                  const consensus_digest_t *digests1);
@@ -54,10 +76,22 @@ typedef struct smartlist_slice_t {
   int offset;
   /** Length of the slice, i.e. the number of elements it holds. */
   int len;
+  /**
+   * If not NULL, an identifier for each line in <b>list</b>, indexed like
+   * <b>list</b>, such that two lines have equal contents iff they have equal
+   * identifiers.  Slices are only compared by identifier when both of them
+   * have identifiers from the same call to intern_lines().
+   */
+  const uint32_t *ids;
 } smartlist_slice_t;
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
                                 const smartlist_t *cons2,
                                 struct memarea_t *area);
+STATIC smartlist_t *gen_ed_diff_composed(const smartlist_t *cons1,
+                                         const smartlist_t *diff12,
+                                         const smartlist_t *diff23,
+                                         const smartlist_t *cons3,
+                                         struct memarea_t *area);
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
@@ -70,6 +104,8 @@ STATIC int *lcs_lengths(const smartlist_slice_t *slice1,
                         const smartlist_slice_t *slice2,
                         int direction);
 STATIC void trim_slices(smartlist_slice_t *slice1, smartlist_slice_t *slice2);
+STATIC void intern_lines(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+                         uint32_t *ids1, uint32_t *ids2);
 STATIC int base64cmp(const cdline_t *hash1, const cdline_t *hash2);
 STATIC int get_id_hash(const cdline_t *line, cdline_t *hash_out);
 STATIC int is_valid_router_entry(const cdline_t *line);
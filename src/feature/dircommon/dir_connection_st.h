@@ -34,6 +34,21 @@ struct dir_connection_t {
   smartlist_t *spool;
   /** The compression object doing on-the-fly compression for spooled data. */
   struct tor_compress_state_t *compress_state;
+  /** If this is not -1, a file holding the body of the last resource in
+   * <b>spool</b>.  Once the outbuf is empty, we send the body straight from
+   * this file to the socket, without copying it into the outbuf. */
+  int sendfile_fd;
+  /** The offset within <b>sendfile_fd</b> of the next byte to send. */
+  off_t sendfile_offset;
+  /** How many bytes are left to send from <b>sendfile_fd</b>. */
+  size_t sendfile_remaining;
+  /** If this is not NULL, a copy of everything that <b>compress_state</b>
+   * has produced so far, to be stored in the response cache under
+   * <b>respcache_key</b> once the spool is done. */
+  struct buf_t *respcache_buf;
+  /** The response cache key for the request we're answering; only
+   * meaningful when <b>respcache_buf</b> is set. */
+  uint8_t respcache_key[DIGEST256_LEN];
 
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
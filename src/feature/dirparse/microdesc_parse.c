@@ -91,12 +91,97 @@ find_start_of_next_microdesc(const char *s, const char *eos)
 #undef NEXT_LINE
 }
 
+/** Helper: set the fields of <b>md</b> from <b>tokens</b>, the tokens of
+ * its body.  Return 0 on success, -1 on failure.  On failure, <b>md</b> may
+ * hold some of its fields; microdesc_free() releases them. */
+static int
+microdesc_extract_fields(microdesc_t *md, smartlist_t *tokens)
+{
+  directory_token_t *tok;
+
+  tok = find_by_keyword(tokens, K_ONION_KEY);
+  if (!crypto_pk_public_exponent_ok(tok->key)) {
+    log_warn(LD_DIR,
+             "Relay's onion key had invalid exponent.");
+    return -1;
+  }
+  router_set_rsa_onion_pkey(tok->key, &md->onion_pkey,
+                            &md->onion_pkey_len);
+  crypto_pk_free(tok->key);
+
+  if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
+    curve25519_public_key_t k;
+    tor_assert(tok->n_args >= 1);
+    if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
+      log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
+      return -1;
+    }
+    md->onion_curve25519_pkey =
+      tor_memdup(&k, sizeof(curve25519_public_key_t));
+  }
+
+  smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
+  if (id_lines) {
+    SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
+      tor_assert(t->n_args >= 2);
+      if (!strcmp(t->args[0], "ed25519")) {
+        if (md->ed25519_identity_pkey) {
+          log_warn(LD_DIR, "Extra ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          return -1;
+        }
+        ed25519_public_key_t k;
+        if (ed25519_public_from_base64(&k, t->args[1])<0) {
+          log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          return -1;
+        }
+        md->ed25519_identity_pkey = tor_memdup(&k, sizeof(k));
+      }
+    } SMARTLIST_FOREACH_END(t);
+    smartlist_free(id_lines);
+  }
+
+  {
+    smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
+    if (a_lines) {
+      find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
+      smartlist_free(a_lines);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
+    int i;
+    md->family = smartlist_new();
+    for (i=0;i<tok->n_args;++i) {
+      if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
+        log_warn(LD_DIR, "Illegal nickname %s in family line",
+                 escaped(tok->args[i]));
+        return -1;
+      }
+      smartlist_add_strdup(md->family, tok->args[i]);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_P))) {
+    md->exit_policy = parse_short_policy(tok->args[0]);
+  }
+  if ((tok = find_opt_by_keyword(tokens, K_P6))) {
+    md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
+  }
+
+  return 0;
+}
+
 /** Parse as many microdescriptors as are found from the string starting at
  * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
  * annotations we recognize and ignore ones we don't.
  *
  * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
- * descriptor in the body field of each microdesc_t.
+ * descriptor in the body field of each microdesc_t.  If it is
+ * SAVED_IN_CACHE, only read the annotations of each microdescriptor, and
+ * set its body_is_unparsed flag: the caller must call
+ * microdesc_parse_body() before using any of its other fields.
  *
  * Return all newly parsed microdescriptors in a newly allocated
  * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
@@ -113,9 +198,10 @@ microdescs_parse_from_string(const char *s, const char *eos,
   microdesc_t *md = NULL;
   memarea_t *area;
   const char *start = s;
-  const char *start_of_next_microdesc;
+  const char *start_of_next_microdesc, *body_start;
   int flags = allow_annotations ? TS_ANNOTATIONS_OK : 0;
   const int copy_body = (where != SAVED_IN_CACHE);
+  const int parse_lazily = (where == SAVED_IN_CACHE);
 
   directory_token_t *tok;
 
@@ -142,6 +228,7 @@ microdescs_parse_from_string(const char *s, const char *eos,
       if (no_onion_key) {
         cp = s; /* So that we have *some* junk to put in the body */
       }
+      body_start = cp;
 
       md->bodylen = start_of_next_microdesc - cp;
       md->saved_location = where;
@@ -157,8 +244,24 @@ microdescs_parse_from_string(const char *s, const char *eos,
       }
     }
 
-    if (tokenize_string(area, s, start_of_next_microdesc, tokens,
-                        microdesc_token_table, flags)) {
+    if (parse_lazily) {
+      /* We wrote this microdescriptor to the cache ourselves, and we might
+       * never use it.  Read its annotations now, and leave the rest of it
+       * for microdesc_parse_body(). */
+      if (s < body_start &&
+          tokenize_string(area, s, body_start, tokens,
+                          microdesc_token_table, TS_NOCHECK)) {
+        log_warn(LD_DIR, "Unparseable microdescriptor annotations");
+        goto next;
+      }
+      SMARTLIST_FOREACH_BEGIN(tokens, const directory_token_t *, t) {
+        if (t->tp != A_LAST_LISTED && t->tp != A_UNKNOWN_) {
+          log_warn(LD_DIR, "Unparseable microdescriptor");
+          goto next;
+        }
+      } SMARTLIST_FOREACH_END(t);
+    } else if (tokenize_string(area, s, start_of_next_microdesc, tokens,
+                               microdesc_token_table, flags)) {
       log_warn(LD_DIR, "Unparseable microdescriptor");
       goto next;
     }
@@ -170,76 +273,11 @@ microdescs_parse_from_string(const char *s, const char *eos,
       }
     }
 
-    tok = find_by_keyword(tokens, K_ONION_KEY);
-    if (!crypto_pk_public_exponent_ok(tok->key)) {
-      log_warn(LD_DIR,
-               "Relay's onion key had invalid exponent.");
+    if (parse_lazily) {
+      md->body_is_unparsed = 1;
+    } else if (microdesc_extract_fields(md, tokens) < 0) {
       goto next;
     }
-    router_set_rsa_onion_pkey(tok->key, &md->onion_pkey,
-                              &md->onion_pkey_len);
-    crypto_pk_free(tok->key);
-
-    if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
-      curve25519_public_key_t k;
-      tor_assert(tok->n_args >= 1);
-      if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
-        log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
-        goto next;
-      }
-      md->onion_curve25519_pkey =
-        tor_memdup(&k, sizeof(curve25519_public_key_t));
-    }
-
-    smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
-    if (id_lines) {
-      SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
-        tor_assert(t->n_args >= 2);
-        if (!strcmp(t->args[0], "ed25519")) {
-          if (md->ed25519_identity_pkey) {
-            log_warn(LD_DIR, "Extra ed25519 key in microdesc");
-            smartlist_free(id_lines);
-            goto next;
-          }
-          ed25519_public_key_t k;
-          if (ed25519_public_from_base64(&k, t->args[1])<0) {
-            log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
-            smartlist_free(id_lines);
-            goto next;
-          }
-          md->ed25519_identity_pkey = tor_memdup(&k, sizeof(k));
-        }
-      } SMARTLIST_FOREACH_END(t);
-      smartlist_free(id_lines);
-    }
-
-    {
-      smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
-      if (a_lines) {
-        find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
-        smartlist_free(a_lines);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
-      int i;
-      md->family = smartlist_new();
-      for (i=0;i<tok->n_args;++i) {
-        if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
-          log_warn(LD_DIR, "Illegal nickname %s in family line",
-                   escaped(tok->args[i]));
-          goto next;
-        }
-        smartlist_add_strdup(md->family, tok->args[i]);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_P))) {
-      md->exit_policy = parse_short_policy(tok->args[0]);
-    }
-    if ((tok = find_opt_by_keyword(tokens, K_P6))) {
-      md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
-    }
 
     smartlist_add(result, md);
     okay = 1;
@@ -265,3 +303,33 @@ microdescs_parse_from_string(const char *s, const char *eos,
 
   return result;
 }
+
+/** Parse the fields of <b>md</b> from its body, if
+ * microdescs_parse_from_string() left them unparsed.  Return 0 on success,
+ * and -1 if the body is not a well-formed microdescriptor. */
+int
+microdesc_parse_body(microdesc_t *md)
+{
+  memarea_t *area;
+  smartlist_t *tokens;
+  int r = -1;
+
+  if (!md->body_is_unparsed)
+    return 0;
+  md->body_is_unparsed = 0;
+
+  area = memarea_new();
+  tokens = smartlist_new();
+  if (tokenize_string(area, md->body, md->body + md->bodylen, tokens,
+                      microdesc_token_table, 0)) {
+    log_warn(LD_DIR, "Unparseable microdescriptor");
+    goto done;
+  }
+  r = microdesc_extract_fields(md, tokens);
+
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  return r;
+}
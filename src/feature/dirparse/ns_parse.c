@@ -13,6 +13,7 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
 #include "feature/dirauth/dirvote.h"
@@ -27,8 +28,10 @@
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/ns_snapshot.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/memarea/memarea.h"
+#include "lib/thread/threads.h"
 
 #include "feature/dirauth/vote_microdesc_hash_st.h"
 #include "feature/nodelist/authority_cert_st.h"
@@ -286,14 +289,20 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * If <b>quiet</b> is true, don't log or dump anything: instead, return NULL
+ * for any entry that would need a message, so that the caller can parse it
+ * again with <b>quiet</b> false.  (The helpers we use for messages are not
+ * safe to call from more than one thread at a time.)
  **/
-STATIC routerstatus_t *
-routerstatus_parse_entry_from_string(memarea_t *area,
-                                     const char **s, smartlist_t *tokens,
-                                     networkstatus_t *vote,
-                                     vote_routerstatus_t *vote_rs,
-                                     int consensus_method,
-                                     consensus_flavor_t flav)
+static routerstatus_t *
+routerstatus_parse_entry_impl(memarea_t *area,
+                              const char **s, smartlist_t *tokens,
+                              networkstatus_t *vote,
+                              vote_routerstatus_t *vote_rs,
+                              int consensus_method,
+                              consensus_flavor_t flav,
+                              int quiet)
 {
   const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
@@ -310,19 +319,23 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   eos = find_start_of_next_routerstatus(*s);
 
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
-    log_warn(LD_DIR, "Error tokenizing router status");
+  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,
+                      quiet ? TS_QUIET : 0)) {
+    if (!quiet)
+      log_warn(LD_DIR, "Error tokenizing router status");
     goto err;
   }
   if (smartlist_len(tokens) < 1) {
-    log_warn(LD_DIR, "Impossibly short router status");
+    if (!quiet)
+      log_warn(LD_DIR, "Impossibly short router status");
     goto err;
   }
   tok = find_by_keyword(tokens, K_R);
   tor_assert(tok->n_args >= 7); /* guaranteed by GE(7) in K_R setup */
   if (flav == FLAV_NS) {
     if (tok->n_args < 8) {
-      log_warn(LD_DIR, "Too few arguments to r");
+      if (!quiet)
+        log_warn(LD_DIR, "Too few arguments to r");
       goto err;
     }
   } else if (flav == FLAV_MICRODESC) {
@@ -336,23 +349,26 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   }
 
   if (!is_legal_nickname(tok->args[0])) {
-    log_warn(LD_DIR,
-             "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+    if (!quiet)
+      log_warn(LD_DIR,
+               "Invalid nickname %s in router status; skipping.",
+               escaped(tok->args[0]));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
-    log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+    if (!quiet)
+      log_warn(LD_DIR, "Error decoding identity digest %s",
+               escaped(tok->args[1]));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
-      log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+      if (!quiet)
+        log_warn(LD_DIR, "Error decoding descriptor digest %s",
+                 escaped(tok->args[2]));
       goto err;
     }
   }
@@ -360,15 +376,17 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (tor_snprintf(timebuf, sizeof(timebuf), "%s %s",
                    tok->args[3+offset], tok->args[4+offset]) < 0 ||
       parse_iso_time(timebuf, &rs->published_on)<0) {
-    log_warn(LD_DIR, "Error parsing time '%s %s' [%d %d]",
-             tok->args[3+offset], tok->args[4+offset],
-             offset, (int)flav);
+    if (!quiet)
+      log_warn(LD_DIR, "Error parsing time '%s %s' [%d %d]",
+               tok->args[3+offset], tok->args[4+offset],
+               offset, (int)flav);
     goto err;
   }
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
-    log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+    if (!quiet)
+      log_warn(LD_DIR, "Error parsing router address in network-status %s",
+               escaped(tok->args[5+offset]));
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -395,8 +413,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       if (p >= 0) {
         vote_rs->flags |= (UINT64_C(1)<<p);
       } else {
-        log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+        if (!quiet)
+          log_warn(LD_DIR, "Flags line had a flag %s not listed in "
+                   "known_flags.", escaped(tok->args[i]));
         goto err;
       }
     }
@@ -451,6 +470,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       }
     }
 
+    if (quiet && summarize_protover_flags_would_warn(protocols))
+      goto err; /* protover.c would warn about this one. */
     summarize_protover_flags(&rs->pv, protocols, version);
   }
 
@@ -465,7 +486,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                     10, 0, UINT32_MAX,
                                     &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          if (!quiet)
+            log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -475,8 +497,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
             (uint32_t)tor_parse_ulong(strchr(tok->args[i], '=')+1,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+          if (!quiet)
+            log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
+                     escaped(tok->args[i]));
           goto err;
         }
         vote_rs->has_measured_bw = 1;
@@ -484,6 +507,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       } else if (!strcmpstart(tok->args[i], "Unmeasured=1")) {
         rs->bw_is_unmeasured = 1;
       } else if (!strcmpstart(tok->args[i], "GuardFraction=")) {
+        if (quiet)
+          goto err; /* This one logs as it goes. */
         if (routerstatus_parse_guardfraction(tok->args[i],
                                              vote, vote_rs, rs) < 0) {
           goto err;
@@ -497,8 +522,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     tor_assert(tok->n_args == 1);
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
-      log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+      if (!quiet)
+        log_warn(LD_DIR, "Unknown exit policy summary type %s.",
+                 escaped(tok->args[0]));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -525,7 +551,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
           if (strcmp(t->args[1], "none") &&
               digest256_from_base64((char*)vote_rs->ed25519_id,
                                     t->args[1])<0) {
-            log_warn(LD_DIR, "Bogus ed25519 key in networkstatus vote");
+            if (!quiet)
+              log_warn(LD_DIR, "Bogus ed25519 key in networkstatus vote");
             goto err;
           }
         }
@@ -540,11 +567,14 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (tok) {
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
-        log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+        if (!quiet)
+          log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
+                   escaped(tok->args[0]));
         goto err;
       }
     } else {
+      if (quiet)
+        goto err;
       log_info(LD_BUG, "Found an entry in networkstatus with no "
                "microdescriptor digest. (Router %s ($%s) at %s:%d.)",
                rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
@@ -557,7 +587,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  if (!quiet)
+    dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
@@ -573,6 +604,173 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** As routerstatus_parse_entry_impl(), but always log problems. */
+STATIC routerstatus_t *
+routerstatus_parse_entry_from_string(memarea_t *area,
+                                     const char **s, smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
+  return routerstatus_parse_entry_impl(area, s, tokens, vote, vote_rs,
+                                       consensus_method, flav, 0);
+}
+
+/** If a consensus has at least this many routerstatus entries, and we have
+ * a threadpool, we parse the entries in parallel. */
+#define NS_PARSE_PARALLEL_MIN_ENTRIES 1024
+/** How many routerstatus entries do we put in each chunk when we parse them
+ * in parallel? */
+#define NS_PARSE_CHUNK_ENTRIES 256
+
+/** Current values for NS_PARSE_PARALLEL_MIN_ENTRIES and
+ * NS_PARSE_CHUNK_ENTRIES; tests may change them. */
+STATIC int ns_parse_parallel_min_entries = NS_PARSE_PARALLEL_MIN_ENTRIES;
+STATIC int ns_parse_chunk_entries = NS_PARSE_CHUNK_ENTRIES;
+
+/** A run of consecutive routerstatus entries from a consensus, to be parsed
+ * by a single thread. */
+typedef struct rs_parse_chunk_t {
+  /** The start of the first entry in this chunk. */
+  const char *start;
+  /** The end of the last entry in this chunk. */
+  const char *end;
+  /** The routerstatus_t for each entry in the chunk, in order, or NULL for
+   * each entry that we have to parse again on the main thread. */
+  smartlist_t *routerstatuses;
+  /** The start of each entry that we have to parse again, in order. */
+  smartlist_t *retry;
+} rs_parse_chunk_t;
+
+/** What the main thread and the cpuworkers need to parse the routerstatus
+ * entries of a single consensus. */
+typedef struct rs_parse_job_t {
+  /** The consensus method and flavor of the consensus. */
+  int consensus_method;
+  consensus_flavor_t flav;
+  /** The chunks to parse. */
+  int n_chunks;
+  rs_parse_chunk_t *chunks;
+} rs_parse_job_t;
+
+/** Parse every routerstatus entry in <b>chunk</b>, without logging.  May
+ * run in any thread. */
+static void
+rs_parse_chunk_run(const rs_parse_job_t *job, rs_parse_chunk_t *chunk)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  const char *s = chunk->start;
+  chunk->routerstatuses = smartlist_new();
+  chunk->retry = smartlist_new();
+
+  while (s < chunk->end) {
+    const char *entry = s;
+    routerstatus_t *rs = routerstatus_parse_entry_impl(area, &s, tokens,
+                                                       NULL, NULL,
+                                                       job->consensus_method,
+                                                       job->flav, 1);
+    smartlist_add(chunk->routerstatuses, rs);
+    if (!rs)
+      smartlist_add(chunk->retry, (void *)entry);
+  }
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Batch function for cpuworker_run_parallel(): parse the chunks of the
+ * rs_parse_job_t in <b>arg</b> from <b>lo</b> through <b>hi</b>-1. */
+static void
+rs_parse_job_run_chunks(void *arg, int lo, int hi)
+{
+  rs_parse_job_t *job = arg;
+  int i;
+  for (i = lo; i < hi; ++i)
+    rs_parse_chunk_run(job, &job->chunks[i]);
+}
+
+/**
+ * Try to parse the routerstatus entries of the consensus <b>ns</b>, of
+ * flavor <b>flav</b>, starting at *<b>s</b>, by splitting them into chunks
+ * and sharing the chunks between this thread and the cpuworkers.  The
+ * result is the same as from parsing the entries one by one.
+ *
+ * On success, add the entries to ns-&gt;routerstatus_list, advance *<b>s</b>
+ * past them, and return 0.  Return -1, changing nothing, if there are too
+ * few entries to be worth it, or no threads to help.
+ */
+STATIC int
+consensus_parse_routerstatuses_parallel(networkstatus_t *ns,
+                                        consensus_flavor_t flav,
+                                        const char **s)
+{
+  if (!in_main_thread() || cpuworker_get_n_threads() <= 0)
+    return -1;
+
+  /* Find the chunk boundaries, stepping from entry to entry just as
+   * routerstatus_parse_entry_from_string() does. */
+  smartlist_t *starts = smartlist_new();
+  const char *cp = *s;
+  int n_entries = 0;
+  while (!strcmpstart(cp, "r ")) {
+    if (n_entries % ns_parse_chunk_entries == 0)
+      smartlist_add(starts, (void *)cp);
+    cp = find_start_of_next_routerstatus(cp);
+    ++n_entries;
+  }
+  if (n_entries < ns_parse_parallel_min_entries) {
+    smartlist_free(starts);
+    return -1;
+  }
+
+  rs_parse_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.consensus_method = ns->consensus_method;
+  job.flav = flav;
+  job.n_chunks = smartlist_len(starts);
+  job.chunks = tor_calloc(job.n_chunks, sizeof(rs_parse_chunk_t));
+  SMARTLIST_FOREACH_BEGIN(starts, const char *, start) {
+    job.chunks[start_sl_idx].start = start;
+    job.chunks[start_sl_idx].end =
+      (start_sl_idx + 1 < job.n_chunks) ?
+      smartlist_get(starts, start_sl_idx + 1) : cp;
+  } SMARTLIST_FOREACH_END(start);
+  smartlist_free(starts);
+
+  cpuworker_run_parallel(job.n_chunks, 1, rs_parse_job_run_chunks, &job);
+
+  /* Collect the results in order, parsing every entry that the workers
+   * couldn't handle quietly once more, so that we log about it here. */
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  int i;
+  for (i = 0; i < job.n_chunks; ++i) {
+    rs_parse_chunk_t *chunk = &job.chunks[i];
+    int retry_idx = 0;
+    SMARTLIST_FOREACH_BEGIN(chunk->routerstatuses, routerstatus_t *, rs) {
+      if (!rs) {
+        const char *entry = smartlist_get(chunk->retry, retry_idx++);
+        rs = routerstatus_parse_entry_from_string(area, &entry, tokens,
+                                                  NULL, NULL,
+                                                  ns->consensus_method,
+                                                  flav);
+      }
+      if (rs)
+        smartlist_add(ns->routerstatus_list, rs);
+    } SMARTLIST_FOREACH_END(rs);
+    smartlist_free(chunk->routerstatuses);
+    smartlist_free(chunk->retry);
+  }
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(job.chunks);
+
+  *s = cp;
+  return 0;
+}
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -1048,11 +1246,30 @@ extract_shared_random_srvs(networkstatus_t *ns, smartlist_t *tokens)
   }
 }
 
+/** Helper: given a string <b>s</b> at or before the directory footer of a
+ * consensus, return the start of the footer, or of the first directory
+ * signature if there is no footer.  Return NULL if there is neither. */
+static const char *
+find_start_of_footer(const char *s)
+{
+  const char *footer = strstr(s, "\ndirectory-footer");
+  if (footer)
+    return footer + 1;
+  const char *sig = strstr(s, "\ndirectory-signature");
+  return sig ? sig + 1 : NULL;
+}
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
-                                     networkstatus_type_t ns_type)
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure.
+ *
+ * If <b>snap</b> is provided, and <b>s</b> is the consensus it was taken
+ * from, use the routerstatus entries from <b>snap</b> rather than parsing
+ * them again, and set *<b>used_snapshot_out</b> to true. */
+static networkstatus_t *
+networkstatus_parse_vote_impl(const char *s, const char **eos_out,
+                              networkstatus_type_t ns_type,
+                              const ns_snapshot_t *snap,
+                              int *used_snapshot_out)
 {
   smartlist_t *tokens = smartlist_new();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -1424,6 +1641,20 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
+  if (snap && ns->type == NS_TYPE_CONSENSUS) {
+    const char *footer = find_start_of_footer(s);
+    if (footer &&
+        ns_snapshot_get_routerstatuses(snap, sha3_as_signed,
+                                       ns->routerstatus_list) == 0) {
+      s = footer;
+      if (used_snapshot_out)
+        *used_snapshot_out = 1;
+    }
+  }
+  if (ns->type == NS_TYPE_CONSENSUS) {
+    /* If this works, it leaves s after the last entry. */
+    consensus_parse_routerstatuses_parallel(ns, flav, &s);
+  }
   while (!strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
@@ -1683,3 +1914,26 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
 
   return ns;
 }
+
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_impl(s, eos_out, ns_type, NULL, NULL);
+}
+
+/** Parse the consensus in <b>s</b>, as networkstatus_parse_vote_from_string()
+ * does.  If <b>snap</b> is a snapshot of this consensus, take the
+ * routerstatus entries from it instead of parsing them, and set
+ * *<b>used_snapshot_out</b> to true; otherwise set it to false. */
+networkstatus_t *
+networkstatus_parse_consensus_with_snapshot(const char *s,
+                                            const ns_snapshot_t *snap,
+                                            int *used_snapshot_out)
+{
+  *used_snapshot_out = 0;
+  return networkstatus_parse_vote_impl(s, NULL, NS_TYPE_CONSENSUS, snap,
+                                       used_snapshot_out);
+}
@@ -26,6 +26,10 @@ enum networkstatus_type_t;
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                            const char **eos_out,
                                            enum networkstatus_type_t ns_type);
+struct ns_snapshot_t;
+networkstatus_t *networkstatus_parse_consensus_with_snapshot(const char *s,
+                                           const struct ns_snapshot_t *snap,
+                                           int *used_snapshot_out);
 
 #ifdef NS_PARSE_PRIVATE
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
@@ -40,6 +44,13 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+STATIC int consensus_parse_routerstatuses_parallel(networkstatus_t *ns,
+                                                   consensus_flavor_t flav,
+                                                   const char **s);
+#ifdef TOR_UNIT_TESTS
+extern int ns_parse_parallel_min_entries;
+extern int ns_parse_chunk_entries;
+#endif
 #endif
 
 #endif
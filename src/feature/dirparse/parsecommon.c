@@ -9,6 +9,7 @@
 #include "feature/dirparse/parsecommon.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
+#include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/container/smartlist.h"
 #include "lib/string/util_string.h"
@@ -46,7 +47,8 @@ token_clear(directory_token_t *tok)
 /** Read all tokens from a string between <b>start</b> and <b>end</b>, and add
  * them to <b>out</b>.  Parse according to the token rules in <b>table</b>.
  * Caller must free tokens in <b>out</b>.  If <b>end</b> is NULL, use the
- * entire string.
+ * entire string.  If <b>flags</b> includes TS_QUIET, don't log about parse
+ * errors.
  */
 int
 tokenize_string(memarea_t *area,
@@ -59,6 +61,7 @@ tokenize_string(memarea_t *area,
   int i;
   int first_nonannotation;
   int prev_len = smartlist_len(out);
+  const int quiet = (flags & TS_QUIET);
   tor_assert(area);
 
   s = &start;
@@ -67,7 +70,8 @@ tokenize_string(memarea_t *area,
   } else {
     /* it's only meaningful to check for nuls if we got an end-of-string ptr */
     if (memchr(start, '\0', end-start)) {
-      log_warn(LD_DIR, "parse error: internal NUL character.");
+      if (!quiet)
+        log_warn(LD_DIR, "parse error: internal NUL character.");
       return -1;
     }
   }
@@ -79,7 +83,8 @@ tokenize_string(memarea_t *area,
   while (*s < end && (!tok || tok->tp != EOF_)) {
     tok = get_next_token(area, s, end, table);
     if (tok->tp == ERR_) {
-      log_warn(LD_DIR, "parse error: %s", tok->error);
+      if (!quiet)
+        log_warn(LD_DIR, "parse error: %s", tok->error);
       token_clear(tok);
       return -1;
     }
@@ -101,19 +106,22 @@ tokenize_string(memarea_t *area,
       }
     }
     if (first_nonannotation < 0) {
-      log_warn(LD_DIR, "parse error: item contains only annotations");
+      if (!quiet)
+        log_warn(LD_DIR, "parse error: item contains only annotations");
       return -1;
     }
     for (i=first_nonannotation;  i < smartlist_len(out); ++i) {
       tok = smartlist_get(out, i);
       if (tok->tp >= MIN_ANNOTATION && tok->tp <= MAX_ANNOTATION) {
-        log_warn(LD_DIR, "parse error: Annotations mixed with keywords");
+        if (!quiet)
+          log_warn(LD_DIR, "parse error: Annotations mixed with keywords");
         return -1;
       }
     }
     if ((flags & TS_NO_NEW_ANNOTATIONS)) {
       if (first_nonannotation != prev_len) {
-        log_warn(LD_DIR, "parse error: Unexpected annotations.");
+        if (!quiet)
+          log_warn(LD_DIR, "parse error: Unexpected annotations.");
         return -1;
       }
     }
@@ -121,7 +129,8 @@ tokenize_string(memarea_t *area,
     for (i=0;  i < smartlist_len(out); ++i) {
       tok = smartlist_get(out, i);
       if (tok->tp >= MIN_ANNOTATION && tok->tp <= MAX_ANNOTATION) {
-        log_warn(LD_DIR, "parse error: no annotations allowed.");
+        if (!quiet)
+          log_warn(LD_DIR, "parse error: no annotations allowed.");
         return -1;
       }
     }
@@ -129,24 +138,28 @@ tokenize_string(memarea_t *area,
   }
   for (i = 0; table[i].t; ++i) {
     if (counts[table[i].v] < table[i].min_cnt) {
-      log_warn(LD_DIR, "Parse error: missing %s element.", table[i].t);
+      if (!quiet)
+        log_warn(LD_DIR, "Parse error: missing %s element.", table[i].t);
       return -1;
     }
     if (counts[table[i].v] > table[i].max_cnt) {
-      log_warn(LD_DIR, "Parse error: too many %s elements.", table[i].t);
+      if (!quiet)
+        log_warn(LD_DIR, "Parse error: too many %s elements.", table[i].t);
       return -1;
     }
     if (table[i].pos & AT_START) {
       if (smartlist_len(out) < 1 ||
           (tok = smartlist_get(out, first_nonannotation))->tp != table[i].v) {
-        log_warn(LD_DIR, "Parse error: first item is not %s.", table[i].t);
+        if (!quiet)
+          log_warn(LD_DIR, "Parse error: first item is not %s.", table[i].t);
         return -1;
       }
     }
     if (table[i].pos & AT_END) {
       if (smartlist_len(out) < 1 ||
           (tok = smartlist_get(out, smartlist_len(out)-1))->tp != table[i].v) {
-        log_warn(LD_DIR, "Parse error: last item is not %s.", table[i].t);
+        if (!quiet)
+          log_warn(LD_DIR, "Parse error: last item is not %s.", table[i].t);
         return -1;
       }
     }
@@ -267,7 +280,7 @@ get_next_token(memarea_t *area,
 #define MAX_LINE_LENGTH (128*1024)
 
   const char *next, *eol, *obstart;
-  size_t obname_len;
+  size_t obname_len, kwd_len;
   int i;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
@@ -290,18 +303,22 @@ get_next_token(memarea_t *area,
 
   next = find_whitespace_eos(*s, eol);
 
-  if (!strcmp_len(*s, "opt", next-*s)) {
+  if (next - *s == 3 && fast_memeq(*s, "opt", 3)) {
     /* Skip past an "opt" at the start of the line. */
     *s = eat_whitespace_eos_no_nl(next, eol);
     next = find_whitespace_eos(*s, eol);
   } else if (*s == eos) {  /* If no "opt", and end-of-line, line is invalid */
     RET_ERR("Unexpected EOF");
   }
+  kwd_len = next - *s;
 
   /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+   * instead, but it wasn't any faster.)  Comparing the precomputed keyword
+   * lengths first means that we almost never need to look at the keywords
+   * themselves. */
   for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
+    if (table[i].t_len == kwd_len &&
+        fast_memeq(*s, table[i].t, kwd_len)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -348,8 +365,12 @@ get_next_token(memarea_t *area,
   /* Check whether there's an object present */
   *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  /* Most items have no object, so look at the start of the next line before
+   * we scan for its end: otherwise we would scan every line twice. */
+  if (eos-*s < 11 || !fast_memeq(*s, "-----BEGIN ", 11)) /* No object. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
-  if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
+  if (!eol) /* No object. */
     goto check_object;
 
   obstart = *s; /* Set obstart to start of object spec */
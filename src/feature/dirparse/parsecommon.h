@@ -230,6 +230,7 @@ typedef enum {
 #define TS_ANNOTATIONS_OK 1
 #define TS_NOCHECK 2
 #define TS_NO_NEW_ANNOTATIONS 4
+#define TS_QUIET 8
 
 /**
  * @name macros for defining token rules
@@ -240,24 +241,27 @@ typedef enum {
  */
 /**@{*/
 
+/** Helper: expand to a keyword and its length.  Keywords must be string
+ * literals, so that we can compute their lengths at compile time. */
+#define KWD_(s) s, (sizeof("" s "") - 1)
 /** Appears to indicate the end of a table. */
-#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
+#define END_OF_TABLE { NULL, 0, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
 /** An item with no restrictions: used for obsolete document types */
-#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T(s,t,a,o)    { KWD_(s), t, a, o, 0, INT_MAX, 0, 0 }
 /** An item with no restrictions on multiplicity or location. */
-#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T0N(s,t,a,o)  { KWD_(s), t, a, o, 0, INT_MAX, 0, 0 }
 /** An item that must appear exactly once */
-#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0 }
+#define T1(s,t,a,o)   { KWD_(s), t, a, o, 1, 1, 0, 0 }
 /** An item that must appear exactly once, at the start of the document */
-#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0 }
+#define T1_START(s,t,a,o)   { KWD_(s), t, a, o, 1, 1, AT_START, 0 }
 /** An item that must appear exactly once, at the end of the document */
-#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0 }
+#define T1_END(s,t,a,o)   { KWD_(s), t, a, o, 1, 1, AT_END, 0 }
 /** An item that must appear one or more times */
-#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0 }
+#define T1N(s,t,a,o)  { KWD_(s), t, a, o, 1, INT_MAX, 0, 0 }
 /** An item that must appear no more than once */
-#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0 }
+#define T01(s,t,a,o)  { KWD_(s), t, a, o, 0, 1, 0, 0 }
 /** An annotation that must appear no more than once */
-#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1 }
+#define A01(s,t,a,o)  { KWD_(s), t, a, o, 0, 1, 0, 1 }
 
 /** Argument multiplicity: any number of arguments. */
 #define ARGS        0,INT_MAX,0
@@ -275,6 +279,9 @@ typedef enum {
 typedef struct token_rule_t {
   /** The string value of the keyword identifying the type of item. */
   const char *t;
+  /** The length of <b>t</b>, so that we can reject most keywords without
+   * looking at them. */
+  size_t t_len;
   /** The corresponding directory_keyword enum. */
   directory_keyword v;
   /** Minimum number of arguments for this item */
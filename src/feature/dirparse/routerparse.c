@@ -227,6 +227,126 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+static int router_parse_list_impl(const char **s, const char *eos,
+                                  smartlist_t *dest,
+                                  saved_location_t saved_location,
+                                  int want_extrainfo,
+                                  int allow_annotations,
+                                  const char *prepend_annotations,
+                                  smartlist_t *invalid_digests_out,
+                                  smartlist_t *sigchecks_out);
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                           int cache_copy,
+                                           int allow_annotations,
+                                           const char *prepend_annotations,
+                                           int *can_dl_again_out,
+                                           router_sigcheck_t **sigcheck_out);
+
+/** The signatures on a router descriptor, with everything we need to check
+ * them after the descriptor has been parsed.  Unlike the descriptor, this
+ * refers to no global state, so we can check it in any thread. */
+struct router_sigcheck_t {
+  /** True iff the descriptor has ed25519 certificates. */
+  unsigned int has_ed25519 : 1;
+  /** The signatures on the ed25519 signing key certificate, on the
+   * ntor-onion-key-crosscert, and on the descriptor itself.  Their keys
+   * point into <b>ed25519_keys</b>, and their messages into
+   * <b>ed25519_msgs</b>. */
+  ed25519_checkable_t ed25519_checks[3];
+  ed25519_public_key_t ed25519_keys[3];
+  uint8_t *ed25519_msgs[3];
+  /** The ed25519 master identity key. */
+  ed25519_public_key_t master_key;
+  /** The onion-key-crosscert, and the TAP onion key that should have
+   * signed it. */
+  uint8_t *tap_crosscert;
+  int tap_crosscert_len;
+  crypto_pk_t *tap_onion_pkey;
+
+  /** The RSA identity key, and the digest of its public part. */
+  crypto_pk_t *identity_pkey;
+  uint8_t identity_digest[DIGEST_LEN];
+  /** The digest of the descriptor, and the RSA signature on it. */
+  char digest[DIGEST_LEN];
+  char *rsa_sig;
+  size_t rsa_sig_len;
+};
+
+/** Release all storage held by <b>sc</b>. */
+void
+router_sigcheck_free_(router_sigcheck_t *sc)
+{
+  if (!sc)
+    return;
+  int i;
+  for (i = 0; i < 3; ++i)
+    tor_free(sc->ed25519_msgs[i]);
+  tor_free(sc->tap_crosscert);
+  crypto_pk_free(sc->tap_onion_pkey);
+  crypto_pk_free(sc->identity_pkey);
+  tor_free(sc->rsa_sig);
+  tor_free(sc);
+}
+
+/** Make the <b>idx</b>th ed25519 signature in <b>sc</b> refer to a copy of
+ * its key and message, so that it outlives the certificate that it came
+ * from. */
+static void
+router_sigcheck_keep_ed25519(router_sigcheck_t *sc, int idx)
+{
+  ed25519_checkable_t *check = &sc->ed25519_checks[idx];
+  memcpy(&sc->ed25519_keys[idx], check->pubkey, sizeof(ed25519_public_key_t));
+  check->pubkey = &sc->ed25519_keys[idx];
+  sc->ed25519_msgs[idx] = tor_memdup(check->msg, check->len);
+  check->msg = sc->ed25519_msgs[idx];
+}
+
+/** Check the ed25519 signatures and the TAP cross-certificate in <b>sc</b>,
+ * if it has any.  Return 0 if they are good, and -1 otherwise. */
+static int
+router_sigcheck_run_ed25519(const router_sigcheck_t *sc)
+{
+  int check_ok[3];
+  if (!sc->has_ed25519)
+    return 0;
+
+  if (ed25519_checksig_batch(check_ok, sc->ed25519_checks, 3) < 0) {
+    log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+    return -1;
+  }
+
+  if (check_tap_onion_key_crosscert(sc->tap_crosscert,
+                                    sc->tap_crosscert_len,
+                                    sc->tap_onion_pkey,
+                                    &sc->master_key,
+                                    sc->identity_digest)<0) {
+    log_warn(LD_DIR, "Incorrect TAP cross-verification");
+    return -1;
+  }
+  return 0;
+}
+
+/** Check the RSA signature in <b>sc</b>.  Return 0 if it is good, and -1
+ * otherwise. */
+static int
+router_sigcheck_run_rsa(const router_sigcheck_t *sc)
+{
+  return check_signature_bytes(sc->digest, DIGEST_LEN,
+                               sc->rsa_sig, sc->rsa_sig_len,
+                               sc->identity_pkey, "router descriptor");
+}
+
+/** Check every signature in <b>sc</b>, logging about any that is bad.
+ * Return 0 if they are all good, and -1 otherwise.  May run in any
+ * thread. */
+int
+router_sigcheck_run(const router_sigcheck_t *sc)
+{
+  if (router_sigcheck_run_ed25519(sc) < 0)
+    return -1;
+  return router_sigcheck_run_rsa(sc);
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descriptors (or extra-info documents if <b>want_extrainfo</b> is set),
  * parses them and stores the result in <b>dest</b>. All routers are marked
@@ -249,10 +369,56 @@ router_parse_list_from_string(const char **s, const char *eos,
                               int allow_annotations,
                               const char *prepend_annotations,
                               smartlist_t *invalid_digests_out)
+{
+  return router_parse_list_impl(s, eos, dest, saved_location,
+                                want_extrainfo, allow_annotations,
+                                prepend_annotations, invalid_digests_out,
+                                NULL);
+}
+
+/**
+ * As router_parse_list_from_string() for router descriptors, but do not
+ * check the signatures on them.  Instead, for each routerinfo_t that we add
+ * to <b>dest</b>, add a router_sigcheck_t to <b>sigchecks_out</b>, in the
+ * same order.  The caller must not use any routerinfo_t until
+ * router_sigcheck_run() has accepted its signatures, and must free the
+ * router_sigcheck_t objects.
+ *
+ * This lets a caller with many descriptors to check (such as a directory
+ * authority handling an upload) do the public key operations in bulk, and
+ * in other threads.
+ */
+int
+router_parse_list_deferring_sigs(const char **s, const char *eos,
+                                 smartlist_t *dest,
+                                 saved_location_t saved_location,
+                                 int allow_annotations,
+                                 const char *prepend_annotations,
+                                 smartlist_t *sigchecks_out)
+{
+  tor_assert(sigchecks_out);
+  return router_parse_list_impl(s, eos, dest, saved_location, 0,
+                                allow_annotations, prepend_annotations,
+                                NULL, sigchecks_out);
+}
+
+/** Helper: as router_parse_list_from_string().  If <b>sigchecks_out</b> is
+ * set, defer the signature checks on router descriptors as described in
+ * router_parse_list_deferring_sigs(). */
+static int
+router_parse_list_impl(const char **s, const char *eos,
+                       smartlist_t *dest,
+                       saved_location_t saved_location,
+                       int want_extrainfo,
+                       int allow_annotations,
+                       const char *prepend_annotations,
+                       smartlist_t *invalid_digests_out,
+                       smartlist_t *sigchecks_out)
 {
   routerinfo_t *router;
   extrainfo_t *extrainfo;
   signed_descriptor_t *signed_desc = NULL;
+  router_sigcheck_t *sigcheck;
   void *elt;
   const char *end, *start;
   int have_extrainfo;
@@ -284,6 +450,7 @@ router_parse_list_from_string(const char **s, const char *eos,
       break;
 
     elt = NULL;
+    sigcheck = NULL;
 
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
@@ -297,10 +464,11 @@ router_parse_list_from_string(const char **s, const char *eos,
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       sigchecks_out ? &sigcheck : NULL);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -323,6 +491,8 @@ router_parse_list_from_string(const char **s, const char *eos,
     }
     *s = end;
     smartlist_add(dest, elt);
+    if (sigchecks_out)
+      smartlist_add(sigchecks_out, sigcheck);
   }
 
   return 0;
@@ -391,6 +561,21 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out,
+                                 NULL);
+}
+
+/** Helper: as router_parse_entry_from_string().  If <b>sigcheck_out</b> is
+ * set, do not check any signatures: instead, on success, set
+ * *<b>sigcheck_out</b> to a new router_sigcheck_t that will check them. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        router_sigcheck_t **sigcheck_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -405,7 +590,16 @@ router_parse_entry_from_string(const char *s, const char *end,
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
-  crypto_pk_t *rsa_pubkey = NULL;
+  /* The signatures to check.  If we check them here, they can borrow from
+   * the descriptor; otherwise, they need their own copies. */
+  router_sigcheck_t local_sigcheck;
+  router_sigcheck_t *sigcheck;
+  if (sigcheck_out) {
+    sigcheck = tor_malloc_zero(sizeof(router_sigcheck_t));
+  } else {
+    memset(&local_sigcheck, 0, sizeof(local_sigcheck));
+    sigcheck = &local_sigcheck;
+  }
 
   tor_assert(!allow_annotations || !prepend_annotations);
 
@@ -735,8 +929,7 @@ router_parse_entry_from_string(const char *s, const char *end,
       crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
       crypto_digest_free(d);
 
-      ed25519_checkable_t check[3];
-      int check_ok[3];
+      ed25519_checkable_t *check = sigcheck->ed25519_checks;
       time_t expires = TIME_MAX;
       if (tor_cert_get_checkable_sig(&check[0], cert, NULL, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for cert.");
@@ -756,23 +949,28 @@ router_parse_entry_from_string(const char *s, const char *end,
       check[2].pubkey = &cert->signed_key;
       check[2].msg = d256;
       check[2].len = DIGEST256_LEN;
-
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
-        log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
-        goto err;
+      if (sigcheck_out) {
+        router_sigcheck_keep_ed25519(sigcheck, 0);
+        router_sigcheck_keep_ed25519(sigcheck, 1);
+        router_sigcheck_keep_ed25519(sigcheck, 2);
+        sigcheck->tap_crosscert = tor_memdup(cc_tap_tok->object_body,
+                                             cc_tap_tok->object_size);
+      } else {
+        sigcheck->tap_crosscert = (uint8_t *) cc_tap_tok->object_body;
       }
 
-      rsa_pubkey = router_get_rsa_onion_pkey(router->onion_pkey,
-                                             router->onion_pkey_len);
-      if (check_tap_onion_key_crosscert(
-                      (const uint8_t*)cc_tap_tok->object_body,
-                      (int)cc_tap_tok->object_size,
-                      rsa_pubkey,
-                      &cert->signing_key,
-                      (const uint8_t*)router->cache_info.identity_digest)<0) {
-        log_warn(LD_DIR, "Incorrect TAP cross-verification");
+      memcpy(&sigcheck->master_key, &cert->signing_key,
+             sizeof(ed25519_public_key_t));
+      sigcheck->tap_crosscert_len = (int)cc_tap_tok->object_size;
+      sigcheck->tap_onion_pkey =
+        router_get_rsa_onion_pkey(router->onion_pkey,
+                                  router->onion_pkey_len);
+      memcpy(sigcheck->identity_digest, router->cache_info.identity_digest,
+             DIGEST_LEN);
+      sigcheck->has_ed25519 = 1;
+
+      if (!sigcheck_out && router_sigcheck_run_ed25519(sigcheck) < 0)
         goto err;
-      }
 
       /* We check this before adding it to the routerlist. */
       router->cert_expiration_time = expires;
@@ -913,13 +1111,29 @@ router_parse_entry_from_string(const char *s, const char *end,
 
   /* We've checked everything that's covered by the hash. */
   can_dl_again = 1;
-  if (check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
-                            "router descriptor") < 0)
+  if (strcmp(tok->object_type, "SIGNATURE")) {
+    log_warn(LD_DIR, "Bad object type on router descriptor signature");
+    goto err;
+  }
+  memcpy(sigcheck->digest, digest, DIGEST_LEN);
+  if (sigcheck_out) {
+    sigcheck->rsa_sig = tor_memdup(tok->object_body, tok->object_size);
+    sigcheck->identity_pkey = crypto_pk_dup_key(router->identity_pkey);
+  } else {
+    sigcheck->rsa_sig = tok->object_body;
+    sigcheck->identity_pkey = router->identity_pkey;
+  }
+  sigcheck->rsa_sig_len = tok->object_size;
+  if (!sigcheck_out && router_sigcheck_run_rsa(sigcheck) < 0)
     goto err;
 
   if (!router->platform) {
     router->platform = tor_strdup("<unknown>");
   }
+  if (sigcheck_out) {
+    *sigcheck_out = sigcheck;
+    sigcheck = NULL;
+  }
   goto done;
 
  err:
@@ -927,7 +1141,10 @@ router_parse_entry_from_string(const char *s, const char *end,
   routerinfo_free(router);
   router = NULL;
  done:
-  crypto_pk_free(rsa_pubkey);
+  if (sigcheck == &local_sigcheck)
+    crypto_pk_free(local_sigcheck.tap_onion_pkey);
+  else
+    router_sigcheck_free(sigcheck);
   tor_cert_free(ntor_cc_cert);
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
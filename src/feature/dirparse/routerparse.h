@@ -23,6 +23,18 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   const char *prepend_annotations,
                                   smartlist_t *invalid_digests_out);
 
+typedef struct router_sigcheck_t router_sigcheck_t;
+int router_parse_list_deferring_sigs(const char **s, const char *eos,
+                                     smartlist_t *dest,
+                                     saved_location_t saved_location,
+                                     int allow_annotations,
+                                     const char *prepend_annotations,
+                                     smartlist_t *sigchecks_out);
+int router_sigcheck_run(const router_sigcheck_t *sc);
+void router_sigcheck_free_(router_sigcheck_t *sc);
+#define router_sigcheck_free(sc) \
+  FREE_AND_NULL(router_sigcheck_t, router_sigcheck_free_, (sc))
+
 routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,
                                              int cache_copy,
                                              int allow_annotations,
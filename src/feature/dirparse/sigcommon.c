@@ -147,8 +147,6 @@ check_signature_token(const char *digest,
                       int flags,
                       const char *doctype)
 {
-  char *signed_digest;
-  size_t keysize;
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
   tor_assert(pkey);
@@ -163,10 +161,34 @@ check_signature_token(const char *digest,
     }
   }
 
+  return check_signature_bytes(digest, digest_len,
+                               tok->object_body, tok->object_size,
+                               pkey, doctype);
+}
+
+/** As check_signature_token(), but check the <b>sig_len</b>-byte signature
+ * in <b>sig</b>, which need not come from a token.  Does not use any
+ * global state, so it may run in any thread. */
+int
+check_signature_bytes(const char *digest,
+                      ssize_t digest_len,
+                      const char *sig,
+                      size_t sig_len,
+                      const crypto_pk_t *pkey,
+                      const char *doctype)
+{
+  char *signed_digest;
+  size_t keysize;
+
+  tor_assert(pkey);
+  tor_assert(sig);
+  tor_assert(digest);
+  tor_assert(doctype);
+
   keysize = crypto_pk_keysize(pkey);
   signed_digest = tor_malloc(keysize);
   if (crypto_pk_public_checksig(pkey, signed_digest, keysize,
-                                tok->object_body, tok->object_size)
+                                sig, sig_len)
       < digest_len) {
     log_warn(LD_DIR, "Error reading %s: invalid signature.", doctype);
     tor_free(signed_digest);
@@ -26,6 +26,12 @@ int check_signature_token(const char *digest,
                           crypto_pk_t *pkey,
                           int flags,
                           const char *doctype);
+int check_signature_bytes(const char *digest,
+                          ssize_t digest_len,
+                          const char *sig,
+                          size_t sig_len,
+                          const crypto_pk_t *pkey,
+                          const char *doctype);
 
 int router_get_hash_impl_helper(const char *s, size_t s_len,
                             const char *start_str,
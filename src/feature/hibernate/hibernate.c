@@ -863,6 +863,11 @@ hibernate_begin(hibernate_state_t new_state, time_t now)
   hibernate_state = new_state;
   accounting_record_bandwidth_usage(now, get_or_state());
 
+  /* Let idle OR connections notice that they can close now. */
+  SMARTLIST_FOREACH(get_connection_array_by_type(CONN_TYPE_OR),
+                    connection_t *, conn,
+                    connection_reschedule_housekeeping(conn));
+
   or_state_mark_dirty(get_or_state(),
                       get_options()->AvoidDiskWrites ? now+600 : 0);
 }
@@ -34,6 +34,20 @@ struct desc_store_t {
   /** Total bytes dropped since last rebuild: this is space currently
    * used in the cache and the journal that could be freed by a rebuild. */
   size_t bytes_dropped;
+
+  /** If we're rebuilding this store in the background, the job that's
+   * doing it. */
+  struct store_rebuild_job_t *rebuild_job;
+  /** While we fix up the descriptors after a background rebuild, a mmap for
+   * the store file that we replaced.  Descriptors that we haven't fixed yet
+   * still point into it. */
+  tor_mmap_t *old_mmap;
+  /** Event to fix up some more descriptors after a background rebuild. */
+  struct mainloop_event_t *fixup_event;
+  /** Flips every time a background rebuild replaces mmap.  A descriptor
+   * saved in the cache points into mmap if its store_parity matches this,
+   * and into old_mmap otherwise. */
+  unsigned int mmap_parity : 1;
 };
 
 #endif
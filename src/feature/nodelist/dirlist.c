@@ -33,6 +33,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -189,8 +190,10 @@ mark_all_dirservers_up(smartlist_t *server_list)
       node_t *node;
       dir->is_running = 1;
       node = node_get_mutable_by_id(dir->digest);
-      if (node)
+      if (node) {
         node->is_running = 1;
+        node_select_node_flags_changed(node);
+      }
       rs = router_get_mutable_consensus_status_by_id(dir->digest);
       if (rs) {
         rs->last_dir_503_at = 0;
@@ -97,11 +97,17 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  /* We don't use fmt_addr32() or fmt_addrport() here: authorities format
+   * consensus entries from more than one thread at once. */
+  char addr[INET_NTOA_BUF_LEN];
+  struct in_addr in;
   smartlist_t *chunks = smartlist_new();
 
   format_iso_time(published, rs->published_on);
   digest_to_base64(identity64, rs->identity_digest);
   digest_to_base64(digest64, rs->descriptor_digest);
+  in.s_addr = htonl(rs->addr);
+  tor_inet_ntoa(&in, addr, sizeof(addr));
 
   smartlist_add_asprintf(chunks,
                    "r %s %s %s%s%s %s %d %d\n",
@@ -110,7 +116,7 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":digest64,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":" ",
                    published,
-                   fmt_addr32(rs->addr),
+                   addr,
                    (int)rs->or_port,
                    (int)rs->dir_port);
 
@@ -127,8 +133,11 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    char ipv6[TOR_ADDR_BUF_LEN];
+    if (!tor_addr_to_str(ipv6, &rs->ipv6_addr, sizeof(ipv6), 1))
+      strlcpy(ipv6, "???", sizeof(ipv6));
+    smartlist_add_asprintf(chunks, "a %s:%u\n", ipv6,
+                           (unsigned) rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS || format == NS_V3_CONSENSUS_MICRODESC)
@@ -66,6 +66,11 @@ struct microdesc_cache_t {
 
   /** True iff we have loaded this cache from disk ever. */
   int is_loaded;
+
+  /** Microdescriptors that we removed from the map because we could not
+   * parse their bodies.  Callers may still hold pointers to them, so we only
+   * free them when we clear the cache. */
+  smartlist_t *unparseable;
 };
 
 static microdesc_cache_t *get_microdesc_cache_noload(void);
@@ -463,6 +468,11 @@ microdesc_cache_clear(microdesc_cache_t *cache)
     microdesc_free(md);
   }
   HT_CLEAR(microdesc_map, &cache->map);
+  if (cache->unparseable) {
+    SMARTLIST_FOREACH(cache->unparseable, microdesc_t *, md,
+                      microdesc_free(md));
+    smartlist_free(cache->unparseable);
+  }
   if (cache->cache_content) {
     int res = tor_munmap_file(cache->cache_content);
     if (res != 0) {
@@ -922,6 +932,36 @@ microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
   return md;
 }
 
+/** Make sure that we have parsed the fields of <b>md</b>, which must be in
+ * the microdescriptor cache, from its body.  Return 0 on success.  If the
+ * body turns out not to be a well-formed microdescriptor, remove <b>md</b>
+ * from the cache so that we will download it again, and return -1.
+ *
+ * We don't parse microdescriptors when we load them from the cache file,
+ * since many of them may never be listed in a consensus again: instead, we
+ * call this function before giving one to a node. */
+int
+microdesc_ensure_parsed(microdesc_t *md)
+{
+  if (PREDICT_LIKELY(!md->body_is_unparsed))
+    return 0;
+  if (microdesc_parse_body(md) == 0)
+    return 0;
+
+  log_warn(LD_DIR, "Discarding an unparseable microdescriptor from the "
+           "cache.");
+  microdesc_cache_t *cache = get_microdesc_cache_noload();
+  if (md->held_in_map) {
+    HT_REMOVE(microdesc_map, &cache->map, md);
+    md->held_in_map = 0;
+  }
+  md->no_save = 1;
+  if (!cache->unparseable)
+    cache->unparseable = smartlist_new();
+  smartlist_add(cache->unparseable, md);
+  return -1;
+}
+
 /** Return a smartlist of all the sha256 digest of the microdescriptors that
  * are listed in <b>ns</b> but not present in <b>cache</b>. Returns pointers
  * to internals of <b>ns</b>; you should not free the members of the resulting
@@ -32,6 +32,9 @@ struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, we loaded this microdesc from our cache file and have not yet
+   * parsed the fields below from its body: see microdesc_parse_body(). */
+  unsigned int body_is_unparsed : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -51,7 +54,8 @@ struct microdesc_t {
   /** A SHA256-digest of the microdescriptor. */
   char digest[DIGEST256_LEN];
 
-  /* Fields in the microdescriptor. */
+  /* Fields in the microdescriptor.  These are unset while body_is_unparsed
+   * is true. */
 
   /**
    * Public RSA TAP key for onions, ASN.1 encoded.  We store this
@@ -74,6 +74,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/ns_snapshot.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
@@ -1864,6 +1865,7 @@ networkstatus_set_current_consensus(const char *consensus,
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
   int checked_protocols_already = 0;
+  int used_snapshot = 0;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1872,7 +1874,15 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  if (from_cache && !was_waiting_for_certs && options->ConsensusSnapshot) {
+    ns_snapshot_t *snap = ns_snapshot_open(flav);
+    c = networkstatus_parse_consensus_with_snapshot(consensus, snap,
+                                                    &used_snapshot);
+    ns_snapshot_free(snap);
+  } else {
+    c = networkstatus_parse_vote_from_string(consensus, NULL,
+                                             NS_TYPE_CONSENSUS);
+  }
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -2123,6 +2133,9 @@ networkstatus_set_current_consensus(const char *consensus,
   if (!from_cache) {
     write_str_to_file(consensus_fname, consensus, 0);
   }
+  if (options->ConsensusSnapshot && !used_snapshot) {
+    ns_snapshot_write(c);
+  }
 
   warn_early_consensus(c, flavor, now);
 
@@ -30,6 +30,7 @@
 #include "feature/nodelist/routerset.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
+#include "lib/container/bitarray.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/math/fp.h"
 
@@ -540,49 +541,21 @@ bridge_get_advertised_bandwidth_bounded(routerinfo_t *router)
   return result;
 }
 
-/** Given a list of routers and a weighting rule as in
- * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
- * values for each node and store them in a freshly allocated
- * *<b>bandwidths_out</b> of the same length as <b>sl</b>, and holding results
- * as doubles. If <b>total_bandwidth_out</b> is non-NULL, set it to the total
- * of all the bandwidths.
- * Return 0 on success, -1 on failure. */
-static int
-compute_weighted_bandwidths(const smartlist_t *sl,
-                            bandwidth_weight_rule_t rule,
-                            double **bandwidths_out,
-                            double *total_bandwidth_out)
+/** The consensus bandwidth weights that apply to one
+ * bandwidth_weight_rule_t, already divided by the weight scale. */
+typedef struct node_bw_weights_t {
+  double Wg, Wm, We, Wd;
+  double Wgb, Wmb, Web, Wdb;
+} node_bw_weights_t;
+
+/** Look up the bandwidth weights that our consensus gives for <b>rule</b>,
+ * and store them in <b>w</b>. */
+static void
+node_bw_weights_for_rule(bandwidth_weight_rule_t rule, node_bw_weights_t *w)
 {
   int64_t weight_scale;
   double Wg = -1, Wm = -1, We = -1, Wd = -1;
   double Wgb = -1, Wmb = -1, Web = -1, Wdb = -1;
-  guardfraction_bandwidth_t guardfraction_bw;
-  double *bandwidths = NULL;
-  double total_bandwidth = 0.0;
-
-  tor_assert(sl);
-  tor_assert(bandwidths_out);
-
-  /* Can't choose exit and guard at same time */
-  tor_assert(rule == NO_WEIGHTING ||
-             rule == WEIGHT_FOR_EXIT ||
-             rule == WEIGHT_FOR_GUARD ||
-             rule == WEIGHT_FOR_MID ||
-             rule == WEIGHT_FOR_DIR);
-
-  *bandwidths_out = NULL;
-
-  if (total_bandwidth_out) {
-    *total_bandwidth_out = 0.0;
-  }
-
-  if (smartlist_len(sl) == 0) {
-    log_info(LD_CIRC,
-             "Empty routerlist passed in to consensus weight node "
-             "selection for rule %s",
-             bandwidth_weight_rule_to_string(rule));
-    return -1;
-  }
 
   weight_scale = networkstatus_get_weight_scale_param(NULL);
 
@@ -639,112 +612,568 @@ compute_weighted_bandwidths(const smartlist_t *sl,
     Wgb = Wmb = Web = Wdb = weight_scale;
   }
 
-  Wg /= weight_scale;
-  Wm /= weight_scale;
-  We /= weight_scale;
-  Wd /= weight_scale;
+  w->Wg = Wg / weight_scale;
+  w->Wm = Wm / weight_scale;
+  w->We = We / weight_scale;
+  w->Wd = Wd / weight_scale;
 
-  Wgb /= weight_scale;
-  Wmb /= weight_scale;
-  Web /= weight_scale;
-  Wdb /= weight_scale;
+  w->Wgb = Wgb / weight_scale;
+  w->Wmb = Wmb / weight_scale;
+  w->Web = Web / weight_scale;
+  w->Wdb = Wdb / weight_scale;
 
-  bandwidths = tor_calloc(smartlist_len(sl), sizeof(double));
+  log_debug(LD_CIRC, "Using bandwidth weights for rule %s: "
+            "Wg=%f Wm=%f We=%f Wd=%f",
+            bandwidth_weight_rule_to_string(rule),
+            w->Wg, w->Wm, w->We, w->Wd);
+}
 
-  // Cycle through smartlist and total the bandwidth.
+/** Return the weighted bandwidth of <b>node</b> when choosing a node
+ * according to <b>rule</b>, using the bandwidth weights in <b>w</b>.
+ * Return 0.0 for nodes we can't weight at all. */
+static double
+node_compute_weighted_bandwidth(const node_t *node,
+                                bandwidth_weight_rule_t rule,
+                                const node_bw_weights_t *w)
+{
   static int warned_missing_bw = 0;
-  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
-    int is_exit = 0, is_guard = 0, is_dir = 0, this_bw = 0;
-    double weight = 1;
-    double weight_without_guard_flag = 0; /* Used for guardfraction */
-    double final_weight = 0;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
-    if (node->rs) {
-      if (!node->rs->has_bandwidth) {
-        /* This should never happen, unless all the authorities downgrade
-         * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
-        if (! warned_missing_bw) {
-          log_warn(LD_BUG,
-                 "Consensus is missing some bandwidths. Using a naive "
-                 "router selection algorithm");
-          warned_missing_bw = 1;
-        }
-        this_bw = 30000; /* Chosen arbitrarily */
-      } else {
-        this_bw = kb_to_bytes(node->rs->bandwidth_kb);
+  guardfraction_bandwidth_t guardfraction_bw;
+  int is_exit = 0, is_guard = 0, is_dir = 0, this_bw = 0;
+  double weight = 1;
+  double weight_without_guard_flag = 0; /* Used for guardfraction */
+  double final_weight = 0;
+
+  is_exit = node->is_exit && ! node->is_bad_exit;
+  is_guard = node->is_possible_guard;
+  is_dir = node_is_dir(node);
+  if (node->rs) {
+    if (!node->rs->has_bandwidth) {
+      /* This should never happen, unless all the authorities downgrade
+       * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
+      if (! warned_missing_bw) {
+        log_warn(LD_BUG,
+               "Consensus is missing some bandwidths. Using a naive "
+               "router selection algorithm");
+        warned_missing_bw = 1;
       }
-    } else if (node->ri) {
-      /* bridge or other descriptor not in our consensus */
-      this_bw = bridge_get_advertised_bandwidth_bounded(node->ri);
+      this_bw = 30000; /* Chosen arbitrarily */
     } else {
-      /* We can't use this one. */
-      continue;
+      this_bw = kb_to_bytes(node->rs->bandwidth_kb);
     }
+  } else if (node->ri) {
+    /* bridge or other descriptor not in our consensus */
+    this_bw = bridge_get_advertised_bandwidth_bounded(node->ri);
+  } else {
+    /* We can't use this one. */
+    return 0.0;
+  }
+
+  if (is_guard && is_exit) {
+    weight = (is_dir ? w->Wdb*w->Wd : w->Wd);
+    weight_without_guard_flag = (is_dir ? w->Web*w->We : w->We);
+  } else if (is_guard) {
+    weight = (is_dir ? w->Wgb*w->Wg : w->Wg);
+    weight_without_guard_flag = (is_dir ? w->Wmb*w->Wm : w->Wm);
+  } else if (is_exit) {
+    weight = (is_dir ? w->Web*w->We : w->We);
+  } else { // middle
+    weight = (is_dir ? w->Wmb*w->Wm : w->Wm);
+  }
+  /* These should be impossible; but overflows here would be bad, so let's
+   * make sure. */
+  if (this_bw < 0)
+    this_bw = 0;
+  if (weight < 0.0)
+    weight = 0.0;
+  if (weight_without_guard_flag < 0.0)
+    weight_without_guard_flag = 0.0;
+
+  /* If guardfraction information is available in the consensus, we
+   * want to calculate this router's bandwidth according to its
+   * guardfraction. Quoting from proposal236:
+   *
+   *    Let Wpf denote the weight from the 'bandwidth-weights' line a
+   *    client would apply to N for position p if it had the guard
+   *    flag, Wpn the weight if it did not have the guard flag, and B the
+   *    measured bandwidth of N in the consensus.  Then instead of choosing
+   *    N for position p proportionally to Wpf*B or Wpn*B, clients should
+   *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
+   */
+  if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
+    /* XXX The assert should actually check for is_guard. However,
+     * that crashes dirauths because of #13297. This should be
+     * equivalent: */
+    tor_assert(node->rs->is_possible_guard);
+
+    guard_get_guardfraction_bandwidth(&guardfraction_bw,
+                                      this_bw,
+                                      node->rs->guardfraction_percentage);
+
+    /* Calculate final_weight = F*Wpf*B + (1-F)*Wpn*B */
+    final_weight =
+      guardfraction_bw.guard_bw * weight +
+      guardfraction_bw.non_guard_bw * weight_without_guard_flag;
+
+    log_debug(LD_GENERAL, "%s: Guardfraction weight %f instead of %f (%s)",
+              node->rs->nickname, final_weight, weight*this_bw,
+              bandwidth_weight_rule_to_string(rule));
+  } else { /* no guardfraction information. calculate the weight normally. */
+    final_weight = weight*this_bw;
+  }
+
+  return final_weight;
+}
+
+/** A weighted sampling table for one bandwidth_weight_rule_t: the weighted
+ * bandwidth of every node in the nodelist, in nodelist order, along with
+ * running totals of those bandwidths so that we can choose among all of
+ * them in O(log n) time.
+ *
+ * These tables depend only on the consensus and on our descriptors, so we
+ * build them lazily and throw them away in node_select_nodelist_changed(). */
+typedef struct node_weight_table_t {
+  /** The nodelist that we built this table from, and its length at the
+   * time. */
+  const smartlist_t *nodes;
+  int n_nodes;
+  /** The weighted bandwidth of each node, as computed by
+   * node_compute_weighted_bandwidth(). */
+  double *weights;
+  /** cumulative[i] is the sum of the weights of nodes 0 through i, scaled
+   * to uint64_t as in scale_array_elements_to_u64(). */
+  uint64_t *cumulative;
+} node_weight_table_t;
+
+/** How many bandwidth_weight_rule_t values are there? */
+#define N_WEIGHT_RULES (WEIGHT_FOR_DIR + 1)
+
+/** Our cached weighted sampling table for each bandwidth_weight_rule_t, or
+ * NULL if we haven't built one since the last change. */
+static node_weight_table_t *weight_tables[N_WEIGHT_RULES];
+
+/** Release all storage held in <b>table</b>. */
+static void
+node_weight_table_free_(node_weight_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->weights);
+  tor_free(table->cumulative);
+  tor_free(table);
+}
+#define node_weight_table_free(t) \
+  FREE_AND_NULL(node_weight_table_t, node_weight_table_free_, (t))
+
+/** Return the weighted sampling table for <b>rule</b> over the current
+ * nodelist, building it if we don't have a current one. */
+static const node_weight_table_t *
+node_weight_table_get(bandwidth_weight_rule_t rule)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  node_weight_table_t *table = weight_tables[rule];
+  node_bw_weights_t w;
+  uint64_t total = 0;
+  int i;
 
-    if (is_guard && is_exit) {
-      weight = (is_dir ? Wdb*Wd : Wd);
-      weight_without_guard_flag = (is_dir ? Web*We : We);
-    } else if (is_guard) {
-      weight = (is_dir ? Wgb*Wg : Wg);
-      weight_without_guard_flag = (is_dir ? Wmb*Wm : Wm);
-    } else if (is_exit) {
-      weight = (is_dir ? Web*We : We);
-    } else { // middle
-      weight = (is_dir ? Wmb*Wm : Wm);
+  /* Can't choose exit and guard at same time */
+  tor_assert(rule == NO_WEIGHTING ||
+             rule == WEIGHT_FOR_EXIT ||
+             rule == WEIGHT_FOR_GUARD ||
+             rule == WEIGHT_FOR_MID ||
+             rule == WEIGHT_FOR_DIR);
+
+  if (table && table->nodes == nodes &&
+      table->n_nodes == smartlist_len(nodes))
+    return table;
+
+  node_weight_table_free(weight_tables[rule]);
+  table = tor_malloc_zero(sizeof(node_weight_table_t));
+  table->nodes = nodes;
+  table->n_nodes = smartlist_len(nodes);
+  table->weights = tor_calloc(table->n_nodes + 1, sizeof(double));
+  table->cumulative = tor_calloc(table->n_nodes + 1, sizeof(uint64_t));
+
+  node_bw_weights_for_rule(rule, &w);
+  SMARTLIST_FOREACH(nodes, const node_t *, node,
+    table->weights[node_sl_idx] =
+      node_compute_weighted_bandwidth(node, rule, &w));
+
+  scale_array_elements_to_u64(table->cumulative, table->weights,
+                              table->n_nodes, NULL);
+  for (i = 0; i < table->n_nodes; ++i) {
+    total += table->cumulative[i];
+    table->cumulative[i] = total;
+  }
+
+  log_info(LD_CIRC, "Built a weighted sampling table of %d nodes for rule %s",
+           table->n_nodes, bandwidth_weight_rule_to_string(rule));
+
+  weight_tables[rule] = table;
+  return table;
+}
+
+/** If <b>node</b> is the entry at its nodelist_idx in the nodelist that
+ * <b>table</b> covers, return that index.  Otherwise return -1. */
+static inline int
+node_weight_table_idx(const node_weight_table_t *table, const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  if (idx < 0 || idx >= table->n_nodes ||
+      smartlist_get(table->nodes, idx) != node)
+    return -1;
+  return idx;
+}
+
+/** Given a nondecreasing array of <b>n_entries</b> running totals in
+ * <b>cumulative</b>, and a <b>rand_val</b> less than the last of them,
+ * return the index of the first entry greater than <b>rand_val</b>.
+ *
+ * This is a binary search, but it always takes the same number of steps for
+ * a given <b>n_entries</b>, whichever element it picks. */
+STATIC int
+choose_cumulative_index(const uint64_t *cumulative, int n_entries,
+                        uint64_t rand_val)
+{
+  int base = 0, len = n_entries;
+
+  tor_assert(n_entries > 0);
+
+  while (len > 1) {
+    const int half = len / 2;
+    base += (cumulative[base + half - 1] <= rand_val) ? half : 0;
+    len -= half;
+  }
+  return base;
+}
+
+/** The node flags that router_choose_random_node() filters on, as indices
+ * into node_flag_index_t.bits. */
+typedef enum node_flag_bit_t {
+  NODE_BIT_RUNNING,
+  NODE_BIT_VALID,
+  NODE_BIT_STABLE,
+  NODE_BIT_FAST,
+  NODE_BIT_GUARD,
+} node_flag_bit_t;
+#define N_NODE_FLAG_BITS (NODE_BIT_GUARD + 1)
+
+/** For each flag in node_flag_bit_t, a bit for every node in the nodelist,
+ * in nodelist order, set iff that node has that flag.  We use these to
+ * narrow down the candidates for a circuit a word at a time.
+ *
+ * Like the weighted sampling tables, we build this lazily and throw it away
+ * in node_select_nodelist_changed().  When a single node's flags change,
+ * node_select_node_flags_changed() updates its bits in place. */
+typedef struct node_flag_index_t {
+  /** The nodelist that we built this index from, and its length at the
+   * time. */
+  const smartlist_t *nodes;
+  int n_nodes;
+  /** One bitarray of n_nodes bits per node_flag_bit_t. */
+  bitarray_t *bits[N_NODE_FLAG_BITS];
+} node_flag_index_t;
+
+/** Our cached node flag index, or NULL if we haven't built one since the
+ * last change. */
+static node_flag_index_t *flag_index = NULL;
+
+/** Release all storage held in <b>idx</b>. */
+static void
+node_flag_index_free_(node_flag_index_t *idx)
+{
+  int i;
+  if (!idx)
+    return;
+  for (i = 0; i < N_NODE_FLAG_BITS; ++i)
+    bitarray_free(idx->bits[i]);
+  tor_free(idx);
+}
+#define node_flag_index_free(idx) \
+  FREE_AND_NULL(node_flag_index_t, node_flag_index_free_, (idx))
+
+/** Set or clear bit <b>i</b> of <b>ba</b>, depending on <b>val</b>. */
+static inline void
+bitarray_set_to(bitarray_t *ba, int i, int val)
+{
+  if (val)
+    bitarray_set(ba, i);
+  else
+    bitarray_clear(ba, i);
+}
+
+/** Make the bits for the node at index <b>i</b> in <b>idx</b> match the
+ * flags of <b>node</b>. */
+static void
+node_flag_index_set_node(node_flag_index_t *idx, int i, const node_t *node)
+{
+  bitarray_set_to(idx->bits[NODE_BIT_RUNNING], i, node->is_running);
+  bitarray_set_to(idx->bits[NODE_BIT_VALID], i, node->is_valid);
+  bitarray_set_to(idx->bits[NODE_BIT_STABLE], i, node->is_stable);
+  bitarray_set_to(idx->bits[NODE_BIT_FAST], i, node->is_fast);
+  bitarray_set_to(idx->bits[NODE_BIT_GUARD], i, node->is_possible_guard);
+}
+
+/** Return the node flag index for the current nodelist, building it if we
+ * don't have a current one. */
+static const node_flag_index_t *
+node_flag_index_get(void)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  int i;
+
+  if (flag_index && flag_index->nodes == nodes &&
+      flag_index->n_nodes == smartlist_len(nodes))
+    return flag_index;
+
+  node_flag_index_free(flag_index);
+  flag_index = tor_malloc_zero(sizeof(node_flag_index_t));
+  flag_index->nodes = nodes;
+  flag_index->n_nodes = smartlist_len(nodes);
+  for (i = 0; i < N_NODE_FLAG_BITS; ++i)
+    flag_index->bits[i] = bitarray_init_zero(flag_index->n_nodes);
+
+  SMARTLIST_FOREACH(nodes, const node_t *, node,
+                    node_flag_index_set_node(flag_index, node_sl_idx, node));
+
+  return flag_index;
+}
+
+/** If <b>node</b> is the entry at its nodelist_idx in the nodelist that
+ * <b>idx</b> covers, return that index.  Otherwise return -1. */
+static inline int
+node_flag_index_idx(const node_flag_index_t *idx, const node_t *node)
+{
+  const int i = node->nodelist_idx;
+  if (i < 0 || i >= idx->n_nodes || smartlist_get(idx->nodes, i) != node)
+    return -1;
+  return i;
+}
+
+/** The nodes that one call to router_choose_random_node() must not pick,
+ * apart from those that match a routerset. */
+typedef struct node_exclusions_t {
+  /** A bit for every node in the node flag index, set iff that node is
+   * excluded. */
+  bitarray_t *bits;
+  /** Excluded nodes that aren't where the node flag index expects them, if
+   * any.  We have to check for these one by one. */
+  smartlist_t *unindexed;
+} node_exclusions_t;
+
+/** Add every node in <b>excluded</b> to <b>ex</b>, using the positions in
+ * <b>idx</b>. */
+static void
+node_exclusions_add(node_exclusions_t *ex, const node_flag_index_t *idx,
+                    const smartlist_t *excluded)
+{
+  if (!excluded)
+    return;
+  SMARTLIST_FOREACH_BEGIN(excluded, const node_t *, node) {
+    const int i = node_flag_index_idx(idx, node);
+    if (i >= 0) {
+      bitarray_set(ex->bits, i);
+    } else {
+      if (!ex->unindexed)
+        ex->unindexed = smartlist_new();
+      smartlist_add(ex->unindexed, (void *)node);
     }
-    /* These should be impossible; but overflows here would be bad, so let's
-     * make sure. */
-    if (this_bw < 0)
-      this_bw = 0;
-    if (weight < 0.0)
-      weight = 0.0;
-    if (weight_without_guard_flag < 0.0)
-      weight_without_guard_flag = 0.0;
-
-    /* If guardfraction information is available in the consensus, we
-     * want to calculate this router's bandwidth according to its
-     * guardfraction. Quoting from proposal236:
-     *
-     *    Let Wpf denote the weight from the 'bandwidth-weights' line a
-     *    client would apply to N for position p if it had the guard
-     *    flag, Wpn the weight if it did not have the guard flag, and B the
-     *    measured bandwidth of N in the consensus.  Then instead of choosing
-     *    N for position p proportionally to Wpf*B or Wpn*B, clients should
-     *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
-     */
-    if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
-      /* XXX The assert should actually check for is_guard. However,
-       * that crashes dirauths because of #13297. This should be
-       * equivalent: */
-      tor_assert(node->rs->is_possible_guard);
-
-      guard_get_guardfraction_bandwidth(&guardfraction_bw,
-                                        this_bw,
-                                        node->rs->guardfraction_percentage);
-
-      /* Calculate final_weight = F*Wpf*B + (1-F)*Wpn*B */
-      final_weight =
-        guardfraction_bw.guard_bw * weight +
-        guardfraction_bw.non_guard_bw * weight_without_guard_flag;
-
-      log_debug(LD_GENERAL, "%s: Guardfraction weight %f instead of %f (%s)",
-                node->rs->nickname, final_weight, weight*this_bw,
-                bandwidth_weight_rule_to_string(rule));
-    } else { /* no guardfraction information. calculate the weight normally. */
-      final_weight = weight*this_bw;
+  } SMARTLIST_FOREACH_END(node);
+}
+
+/** Initialize <b>ex</b> to hold the nodes in <b>excludednodes</b> and in
+ * <b>excludedsmartlist</b>, either of which may be NULL.  This takes time
+ * proportional to the number of excluded nodes, plus a word's worth of
+ * work for every 32 or 64 nodes in <b>idx</b>. */
+static void
+node_exclusions_init(node_exclusions_t *ex, const node_flag_index_t *idx,
+                     const smartlist_t *excludednodes,
+                     const smartlist_t *excludedsmartlist)
+{
+  ex->bits = bitarray_init_zero(idx->n_nodes);
+  ex->unindexed = NULL;
+  node_exclusions_add(ex, idx, excludednodes);
+  node_exclusions_add(ex, idx, excludedsmartlist);
+}
+
+/** Return true iff <b>ex</b> excludes <b>node</b>, which is at position
+ * <b>i</b> in the node flag index, or -1 if it isn't there. */
+static inline int
+node_exclusions_contains(const node_exclusions_t *ex, int i,
+                         const node_t *node)
+{
+  if (i >= 0 && bitarray_is_set(ex->bits, i))
+    return 1;
+  return ex->unindexed && smartlist_contains(ex->unindexed, node);
+}
+
+/** Release the storage held in <b>ex</b>. */
+static void
+node_exclusions_clear(node_exclusions_t *ex)
+{
+  bitarray_free(ex->bits);
+  smartlist_free(ex->unindexed);
+}
+
+/** Add to <b>sl</b> every node that router_add_running_nodes_to_smartlist()
+ * would add for the restrictions in <b>flags</b>, except for those in
+ * <b>excludednodes</b> or <b>excludedsmartlist</b>, those that match
+ * <b>excludedset</b>, and those that router_choose_random_node() never
+ * picks.
+ *
+ * Rather than building a list of all the running nodes and subtracting
+ * the excluded ones from it, we AND together the bits for the flags we
+ * need, mask out the excluded nodes, and only look at the nodes that are
+ * left. */
+STATIC void
+router_add_candidate_nodes_to_smartlist(smartlist_t *sl,
+                                        const smartlist_t *excludednodes,
+                                        const smartlist_t *excludedsmartlist,
+                                        const routerset_t *excludedset,
+                                        router_crn_flags_t flags)
+{
+  const int need_uptime = (flags & CRN_NEED_UPTIME) != 0;
+  const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
+  const int need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const int need_desc = (flags & CRN_NEED_DESC) != 0;
+  const int pref_addr = (flags & CRN_PREF_ADDR) != 0;
+  const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
+  const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
+  const int check_reach = !router_skip_or_reachability(get_options(),
+                                                       pref_addr);
+  const node_flag_index_t *idx = node_flag_index_get();
+  const int n_words = (idx->n_nodes + BITARRAY_MASK) >> BITARRAY_SHIFT;
+  const bitarray_t *need[N_NODE_FLAG_BITS];
+  node_exclusions_t ex;
+  int n_need = 0, w, i;
+
+  need[n_need++] = idx->bits[NODE_BIT_VALID];
+  if (need_uptime)
+    need[n_need++] = idx->bits[NODE_BIT_STABLE];
+  if (need_capacity)
+    need[n_need++] = idx->bits[NODE_BIT_FAST];
+  if (need_guard)
+    need[n_need++] = idx->bits[NODE_BIT_GUARD];
+
+  node_exclusions_init(&ex, idx, excludednodes, excludedsmartlist);
+
+  for (w = 0; w < n_words; ++w) {
+    unsigned int word = idx->bits[NODE_BIT_RUNNING][w] & ~ex.bits[w];
+    for (i = 0; i < n_need; ++i)
+      word &= need[i][w];
+    for (i = w << BITARRAY_SHIFT; word; ++i, word >>= 1) {
+      const node_t *node;
+      if (!(word & 1))
+        continue;
+      node = smartlist_get(idx->nodes, i);
+      if (!router_node_is_usable_for_circuit(node, need_uptime, need_capacity,
+                                             need_guard, need_desc, pref_addr,
+                                             direct_conn, check_reach))
+        continue;
+      /* Exclude relays that allow single hop exit circuits. This is an
+       * obsolete option since 0.2.9.2-alpha and done by default in
+       * 0.3.1.0-alpha. */
+      if (node_allows_single_hop_exits(node))
+        continue;
+      /* Exclude relays that do not support to rendezvous for a hidden
+       * service version 3. */
+      if (rendezvous_v3 && !node_supports_v3_rendezvous_point(node))
+        continue;
+      if (excludedset && routerset_contains_node(excludedset, node))
+        continue;
+      if (ex.unindexed && smartlist_contains(ex.unindexed, node))
+        continue;
+      smartlist_add(sl, (void *)node);
+    }
+  }
+
+  node_exclusions_clear(&ex);
+}
+
+/** Forget all of our weighted sampling tables and our node flag index,
+ * since the consensus or our descriptors have changed. */
+void
+node_select_nodelist_changed(void)
+{
+  int i;
+  for (i = 0; i < N_WEIGHT_RULES; ++i)
+    node_weight_table_free(weight_tables[i]);
+  node_flag_index_free(flag_index);
+}
+
+/** Update our node flag index, if we have one, after the Running, Valid,
+ * Stable, Fast, or Guard flag of <b>node</b> has changed. */
+void
+node_select_node_flags_changed(const node_t *node)
+{
+  int i;
+  if (!flag_index)
+    return;
+  i = node_flag_index_idx(flag_index, node);
+  if (i >= 0)
+    node_flag_index_set_node(flag_index, i, node);
+}
+
+/** Given a list of routers and a weighting rule as in
+ * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
+ * values for each node and store them in a freshly allocated
+ * *<b>bandwidths_out</b> of the same length as <b>sl</b>, and holding results
+ * as doubles. If <b>total_bandwidth_out</b> is non-NULL, set it to the total
+ * of all the bandwidths.
+ * Return 0 on success, -1 on failure. */
+static int
+compute_weighted_bandwidths(const smartlist_t *sl,
+                            bandwidth_weight_rule_t rule,
+                            double **bandwidths_out,
+                            double *total_bandwidth_out)
+{
+  const node_weight_table_t *table;
+  node_bw_weights_t w;
+  int have_weights = 0;
+  double *bandwidths = NULL;
+  double total_bandwidth = 0.0;
+
+  tor_assert(sl);
+  tor_assert(bandwidths_out);
+
+  *bandwidths_out = NULL;
+
+  if (total_bandwidth_out) {
+    *total_bandwidth_out = 0.0;
+  }
+
+  if (smartlist_len(sl) == 0) {
+    log_info(LD_CIRC,
+             "Empty routerlist passed in to consensus weight node "
+             "selection for rule %s",
+             bandwidth_weight_rule_to_string(rule));
+    return -1;
+  }
+
+  table = node_weight_table_get(rule);
+  bandwidths = tor_calloc(smartlist_len(sl), sizeof(double));
+
+  // Cycle through smartlist and total the bandwidth.
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    const int idx = node_weight_table_idx(table, node);
+    double final_weight;
+    if (idx >= 0) {
+      final_weight = table->weights[idx];
+    } else {
+      /* Not in the nodelist: weight it the slow way. */
+      if (!have_weights) {
+        node_bw_weights_for_rule(rule, &w);
+        have_weights = 1;
+      }
+      final_weight = node_compute_weighted_bandwidth(node, rule, &w);
     }
 
     bandwidths[node_sl_idx] = final_weight;
     total_bandwidth += final_weight;
   } SMARTLIST_FOREACH_END(node);
 
-  log_debug(LD_CIRC, "Generated weighted bandwidths for rule %s based "
-            "on weights "
-            "Wg=%f Wm=%f We=%f Wd=%f with total bw %f",
-            bandwidth_weight_rule_to_string(rule),
-            Wg, Wm, We, Wd, total_bandwidth);
+  log_debug(LD_CIRC, "Generated weighted bandwidths for rule %s "
+            "with total bw %f",
+            bandwidth_weight_rule_to_string(rule), total_bandwidth);
 
   *bandwidths_out = bandwidths;
 
@@ -825,6 +1254,83 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
   nodelist_add_node_and_family(sl, node);
 }
 
+/** How many nodes should router_choose_random_node_from_table() draw
+ * before it gives up and lets its caller build a candidate list? */
+#define CRN_TABLE_MAX_DRAWS 32
+
+/** Helper for router_choose_random_node(): draw a node from the weighted
+ * sampling table for <b>rule</b>, which covers the whole nodelist, and
+ * return it if it meets the restrictions in <b>flags</b> and isn't in
+ * <b>excludednodes</b>, <b>excludedsmartlist</b>, or <b>excludedset</b>.
+ * Otherwise, draw again.
+ *
+ * Since every draw is weighted over the whole nodelist, the node we return
+ * is chosen with the same probability as if we had listed the suitable
+ * nodes and weighted only those.  Return NULL if there is nothing to draw,
+ * or if we draw CRN_TABLE_MAX_DRAWS unsuitable nodes in a row. */
+static const node_t *
+router_choose_random_node_from_table(bandwidth_weight_rule_t rule,
+                                     const smartlist_t *excludednodes,
+                                     const smartlist_t *excludedsmartlist,
+                                     const routerset_t *excludedset,
+                                     router_crn_flags_t flags)
+{
+  const int need_uptime = (flags & CRN_NEED_UPTIME) != 0;
+  const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
+  const int need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const int need_desc = (flags & CRN_NEED_DESC) != 0;
+  const int pref_addr = (flags & CRN_PREF_ADDR) != 0;
+  const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
+  const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
+  const int check_reach = !router_skip_or_reachability(get_options(),
+                                                       pref_addr);
+  const node_weight_table_t *table = node_weight_table_get(rule);
+  const node_flag_index_t *idx;
+  node_exclusions_t ex;
+  const node_t *choice = NULL;
+  uint64_t total;
+  int i;
+
+  if (table->n_nodes == 0)
+    return NULL;
+  total = table->cumulative[table->n_nodes - 1];
+  if (total == 0)
+    return NULL;
+
+  idx = node_flag_index_get();
+  node_exclusions_init(&ex, idx, excludednodes, excludedsmartlist);
+
+  for (i = 0; i < CRN_TABLE_MAX_DRAWS; ++i) {
+    const int table_idx = choose_cumulative_index(table->cumulative,
+                                                  table->n_nodes,
+                                                  crypto_rand_uint64(total));
+    const node_t *node = smartlist_get(table->nodes, table_idx);
+
+    if (!router_node_is_usable_for_circuit(node, need_uptime, need_capacity,
+                                           need_guard, need_desc, pref_addr,
+                                           direct_conn, check_reach))
+      continue;
+    if (node_allows_single_hop_exits(node))
+      continue;
+    if (rendezvous_v3 && !node_supports_v3_rendezvous_point(node))
+      continue;
+    if (node_exclusions_contains(&ex, node_flag_index_idx(idx, node), node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+
+    choice = node;
+    break;
+  }
+
+  node_exclusions_clear(&ex);
+  if (!choice)
+    log_debug(LD_CIRC, "Drew %d unsuitable nodes for rule %s; building a "
+              "list of candidates instead.", CRN_TABLE_MAX_DRAWS,
+              bandwidth_weight_rule_to_string(rule));
+  return choice;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -854,10 +1360,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
   const int need_guard = (flags & CRN_NEED_GUARD) != 0;
   const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
-  const int need_desc = (flags & CRN_NEED_DESC) != 0;
   const int pref_addr = (flags & CRN_PREF_ADDR) != 0;
-  const int direct_conn = (flags & CRN_DIRECT_CONN) != 0;
-  const int rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
 
   smartlist_t *sl=smartlist_new(),
     *excludednodes=smartlist_new();
@@ -869,53 +1372,30 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
-  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), node_t *, node) {
-    if (node_allows_single_hop_exits(node)) {
-      /* Exclude relays that allow single hop exit circuits. This is an
-       * obsolete option since 0.2.9.2-alpha and done by default in
-       * 0.3.1.0-alpha. */
-      smartlist_add(excludednodes, node);
-    } else if (rendezvous_v3 &&
-               !node_supports_v3_rendezvous_point(node)) {
-      /* Exclude relays that do not support to rendezvous for a hidden service
-       * version 3. */
-      smartlist_add(excludednodes, node);
-    }
-  } SMARTLIST_FOREACH_END(node);
-
   /* If the node_t is not found we won't be to exclude ourself but we
    * won't be able to pick ourself in router_choose_random_node() so
    * this is fine to at least try with our routerinfo_t object. */
   if ((r = router_get_my_routerinfo()))
     routerlist_add_node_and_family(excludednodes, r);
 
-  router_add_running_nodes_to_smartlist(sl, need_uptime, need_capacity,
-                                        need_guard, need_desc, pref_addr,
-                                        direct_conn);
-  log_debug(LD_CIRC,
-           "We found %d running nodes.",
-            smartlist_len(sl));
+  /* Usually, a few draws from the whole nodelist will find us a suitable
+   * node without looking at any of the others. */
+  choice = router_choose_random_node_from_table(rule, excludednodes,
+                                                excludedsmartlist,
+                                                excludedset, flags);
+  if (choice) {
+    smartlist_free(sl);
+    smartlist_free(excludednodes);
+    return choice;
+  }
 
-  smartlist_subtract(sl,excludednodes);
+  router_add_candidate_nodes_to_smartlist(sl, excludednodes,
+                                          excludedsmartlist, excludedset,
+                                          flags);
   log_debug(LD_CIRC,
-            "We removed %d excludednodes, leaving %d nodes.",
-            smartlist_len(excludednodes),
+            "We found %d candidate nodes.",
             smartlist_len(sl));
 
-  if (excludedsmartlist) {
-    smartlist_subtract(sl,excludedsmartlist);
-    log_debug(LD_CIRC,
-              "We removed %d excludedsmartlist, leaving %d nodes.",
-              smartlist_len(excludedsmartlist),
-              smartlist_len(sl));
-  }
-  if (excludedset) {
-    routerset_subtract_nodes(sl,excludedset);
-    log_debug(LD_CIRC,
-              "We removed excludedset, leaving %d nodes.",
-              smartlist_len(sl));
-  }
-
   // Always weight by bandwidth
   choice = node_sl_choose_by_bandwidth(sl, rule);
 
@@ -79,6 +79,8 @@ double frac_nodes_with_descriptors(const smartlist_t *sl,
 const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
+void node_select_nodelist_changed(void);
+void node_select_node_flags_changed(const node_t *node);
 
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
@@ -92,6 +94,13 @@ STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
                                         const double *entries_in,
                                         int n_entries,
                                         uint64_t *total_out);
+STATIC int choose_cumulative_index(const uint64_t *cumulative, int n_entries,
+                                   uint64_t rand_val);
+STATIC void router_add_candidate_nodes_to_smartlist(smartlist_t *sl,
+                                     const smartlist_t *excludednodes,
+                                     const smartlist_t *excludedsmartlist,
+                                     const struct routerset_t *excludedset,
+                                     router_crn_flags_t flags);
 STATIC const routerstatus_t *router_pick_directory_server_impl(
                                            dirinfo_type_t auth, int flags,
                                            int *n_busy_out);
@@ -112,6 +112,27 @@ static void update_router_have_minimum_dir_info(void);
 static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
 static void node_add_to_address_set(const node_t *node);
+static void nodelist_family_index_changed(void);
+
+/** An index of the declared families in the nodelist, so that we can check
+ * family membership without comparing nicknames and hex digests every time
+ * we build a path.
+ *
+ * Two nodes are in the same declared family when each one lists the other
+ * in its family line.  That relation isn't transitive, so instead of family
+ * IDs we keep, for every node, the sorted nodelist indices of the nodes it
+ * is mutually declared with.
+ */
+typedef struct node_family_index_t {
+  /** The number of nodes in the nodelist when we built this index. */
+  int n_nodes;
+  /** The family members of the node at index i are members[offsets[i]]
+   * through members[offsets[i+1]-1]. This array has n_nodes+1 entries. */
+  int *offsets;
+  /** The nodelist indices of every node's family members, sorted within
+   * each node's span. */
+  int *members;
+} node_family_index_t;
 
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
@@ -138,6 +159,10 @@ typedef struct nodelist_t {
    * nodelist.  We use this to detect outdated nodelists that need to be
    * rebuilt using a newer consensus. */
   time_t live_consensus_valid_after;
+
+  /* Index of mutually declared families, or NULL if we haven't built one
+   * since the nodes or their descriptors last changed. */
+  node_family_index_t *family_index;
 } nodelist_t;
 
 static inline unsigned int
@@ -535,6 +560,8 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
   }
 
   node_add_to_address_set(node);
+  node_select_nodelist_changed();
+  nodelist_family_index_changed();
 
   return node;
 }
@@ -563,6 +590,8 @@ nodelist_add_microdesc(microdesc_t *md)
   node = node_get_mutable_by_id(rs->identity_digest);
   if (node == NULL)
     return NULL;
+  if (microdesc_ensure_parsed(md) < 0)
+    return NULL;
 
   node_remove_from_ed25519_map(node);
   if (node->md)
@@ -578,6 +607,7 @@ nodelist_add_microdesc(microdesc_t *md)
   }
   node_add_to_ed25519_map(node);
   node_add_to_address_set(node);
+  nodelist_family_index_changed();
 
   return node;
 }
@@ -628,6 +658,8 @@ nodelist_set_consensus(networkstatus_t *ns)
           node->md->held_by_nodes--;
         node->md = microdesc_cache_lookup_by_digest256(NULL,
                                                        rs->descriptor_digest);
+        if (node->md && microdesc_ensure_parsed(node->md) < 0)
+          node->md = NULL;
         if (node->md)
           node->md->held_by_nodes++;
         node_add_to_ed25519_map(node);
@@ -683,6 +715,9 @@ nodelist_set_consensus(networkstatus_t *ns)
     } SMARTLIST_FOREACH_END(node);
   }
 
+  node_select_nodelist_changed();
+  nodelist_family_index_changed();
+
   /* If the consensus is live, note down the consensus valid-after that formed
    * the nodelist. */
   if (networkstatus_is_live(ns, approx_time())) {
@@ -718,6 +753,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
+    nodelist_family_index_changed();
   }
 }
 
@@ -728,6 +764,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    node_select_nodelist_changed();
+    nodelist_family_index_changed();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -758,6 +796,8 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  node_select_nodelist_changed();
+  nodelist_family_index_changed();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -839,8 +879,10 @@ nodelist_free_all(void)
 
   address_set_free(the_nodelist->node_addrs);
   the_nodelist->node_addrs = NULL;
+  nodelist_family_index_changed();
 
   tor_free(the_nodelist);
+  node_select_nodelist_changed();
 }
 
 /** Check that the nodelist is internally consistent, and consistent with
@@ -1905,6 +1947,215 @@ node_in_nickname_smartlist(const smartlist_t *lst, const node_t *node)
   return 0;
 }
 
+/** Release all storage held by <b>fi</b>. */
+static void
+node_family_index_free_(node_family_index_t *fi)
+{
+  if (!fi)
+    return;
+  tor_free(fi->offsets);
+  tor_free(fi->members);
+  tor_free(fi);
+}
+#define node_family_index_free(fi) \
+  FREE_AND_NULL(node_family_index_t, node_family_index_free_, (fi))
+
+/** Called when the set of nodes, or the descriptors that give their
+ * nicknames and families, may have changed: forget our family index, so
+ * that the next lookup rebuilds it. */
+static void
+nodelist_family_index_changed(void)
+{
+  if (the_nodelist)
+    node_family_index_free(the_nodelist->family_index);
+}
+
+/** Helper for sorting nodes by nickname, case-insensitively. */
+static int
+compare_nodes_by_nickname_(const void **a, const void **b)
+{
+  return strcasecmp(node_get_nickname(*a), node_get_nickname(*b));
+}
+
+/** Helper for searching a list of nodes sorted by nickname. */
+static int
+compare_nickname_to_node_(const void *key, const void **member)
+{
+  return strcasecmp(key, node_get_nickname(*member));
+}
+
+/** Helper for sorting the packed (from, to) edges of a family graph. */
+static int
+compare_family_edges_(const void *a, const void *b)
+{
+  const uint64_t ea = *(const uint64_t *)a, eb = *(const uint64_t *)b;
+  if (ea < eb)
+    return -1;
+  else if (ea > eb)
+    return 1;
+  else
+    return 0;
+}
+
+/** A growable array of packed family-graph edges; see FAMILY_EDGE(). */
+typedef struct family_edges_t {
+  uint64_t *edges;
+  size_t n_edges;
+  size_t capacity;
+} family_edges_t;
+
+/** Pack an edge from the node at <b>from</b> to the node at <b>to</b>, so
+ * that sorting edges groups them by <b>from</b> and then by <b>to</b>. */
+#define FAMILY_EDGE(from, to) \
+  ((((uint64_t)(uint32_t)(from)) << 32) | (uint32_t)(to))
+
+/** Append an edge from <b>from</b> to <b>to</b> to <b>fe</b>. */
+static void
+family_edges_add(family_edges_t *fe, const node_t *from, const node_t *to)
+{
+  if (fe->n_edges == fe->capacity) {
+    fe->capacity = fe->capacity ? fe->capacity * 2 : 1024;
+    fe->edges = tor_reallocarray(fe->edges, fe->capacity, sizeof(uint64_t));
+  }
+  fe->edges[fe->n_edges++] = FAMILY_EDGE(from->nodelist_idx,
+                                         to->nodelist_idx);
+}
+
+/** Add to <b>fe</b> an edge from <b>node</b> to every node that
+ * node_nickname_matches() says is named by <b>name</b>.
+ * <b>by_nickname</b> holds every nickname-bearing node in the nodelist,
+ * sorted with compare_nodes_by_nickname_(). */
+static void
+family_edges_add_for_name(family_edges_t *fe, const smartlist_t *by_nickname,
+                          const node_t *node, const char *name)
+{
+  char digest[DIGEST_LEN];
+  char nn_char = '\0';
+  char nn_buf[MAX_NICKNAME_LEN+1];
+
+  if (name[0] != '$') {
+    int found, i;
+    i = smartlist_bsearch_idx(by_nickname, name,
+                              compare_nickname_to_node_, &found);
+    if (found) {
+      /* There may be several nodes with this nickname; find the first. */
+      while (i > 0 && !strcasecmp(name, node_get_nickname(
+                                          smartlist_get(by_nickname, i-1))))
+        --i;
+      for (; i < smartlist_len(by_nickname); ++i) {
+        const node_t *node2 = smartlist_get(by_nickname, i);
+        if (strcasecmp(name, node_get_nickname(node2)))
+          break;
+        family_edges_add(fe, node, node2);
+      }
+    }
+  }
+
+  if (hex_digest_nickname_decode(name, digest, &nn_char, nn_buf) == 0) {
+    const node_t *node2 = node_get_by_id(digest);
+    if (node2 && node_nickname_matches(node2, name))
+      family_edges_add(fe, node, node2);
+  }
+}
+
+/** Build and return a new family index for the current nodelist.
+ *
+ * We resolve every name in every node's declared family into a directed
+ * edge, then keep each edge whose reverse edge also exists.  This gives
+ * the same answers as checking node_in_nickname_smartlist() in both
+ * directions, for O(E log E) work in total. */
+static node_family_index_t *
+node_family_index_build(void)
+{
+  const smartlist_t *nodes = the_nodelist->nodes;
+  const int n_nodes = smartlist_len(nodes);
+  node_family_index_t *fi = tor_malloc_zero(sizeof(node_family_index_t));
+  smartlist_t *by_nickname = smartlist_new();
+  family_edges_t fe = { NULL, 0, 0 };
+  size_t i, n_members = 0;
+
+  SMARTLIST_FOREACH(nodes, const node_t *, node,
+                    if (node_get_nickname(node))
+                      smartlist_add(by_nickname, (void *)node));
+  smartlist_sort(by_nickname, compare_nodes_by_nickname_);
+
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    const smartlist_t *family = node_get_declared_family(node);
+    if (!family)
+      continue;
+    SMARTLIST_FOREACH(family, const char *, name,
+                      family_edges_add_for_name(&fe, by_nickname,
+                                                node, name));
+  } SMARTLIST_FOREACH_END(node);
+
+  if (fe.n_edges)
+    qsort(fe.edges, fe.n_edges, sizeof(uint64_t), compare_family_edges_);
+
+  fi->n_nodes = n_nodes;
+  fi->offsets = tor_calloc(n_nodes + 1, sizeof(int));
+  fi->members = tor_calloc(fe.n_edges ? fe.n_edges : 1, sizeof(int));
+
+  for (i = 0; i < fe.n_edges; ++i) {
+    const uint64_t edge = fe.edges[i];
+    const int from = (int)(edge >> 32), to = (int)(edge & UINT32_MAX);
+    const uint64_t reverse = FAMILY_EDGE(to, from);
+    if (i > 0 && fe.edges[i-1] == edge)
+      continue; /* A node may name another in more than one way. */
+    if (!bsearch(&reverse, fe.edges, fe.n_edges, sizeof(uint64_t),
+                 compare_family_edges_))
+      continue;
+    fi->members[n_members++] = to;
+    fi->offsets[from+1]++;
+  }
+  for (i = 0; i < (size_t)n_nodes; ++i)
+    fi->offsets[i+1] += fi->offsets[i];
+
+  tor_free(fe.edges);
+  smartlist_free(by_nickname);
+  return fi;
+}
+
+/** Return the family index for the current nodelist, building it if we
+ * have none, or NULL if there is no nodelist. */
+static const node_family_index_t *
+nodelist_get_family_index(void)
+{
+  if (PREDICT_UNLIKELY(the_nodelist == NULL))
+    return NULL;
+  if (!the_nodelist->family_index)
+    the_nodelist->family_index = node_family_index_build();
+  return the_nodelist->family_index;
+}
+
+/** Return true iff <b>node</b> is in the nodelist that <b>fi</b> was built
+ * from, so that we can look it up by its nodelist index. */
+static inline int
+node_is_in_family_index(const node_family_index_t *fi, const node_t *node)
+{
+  return node->nodelist_idx >= 0 && node->nodelist_idx < fi->n_nodes &&
+    smartlist_get(the_nodelist->nodes, node->nodelist_idx) == node;
+}
+
+/** Return true iff the nodes at nodelist indices <b>idx1</b> and
+ * <b>idx2</b> have declared each other as family members, according to
+ * <b>fi</b>. */
+static int
+node_family_index_contains(const node_family_index_t *fi,
+                           int idx1, int idx2)
+{
+  int lo = fi->offsets[idx1], hi = fi->offsets[idx1+1];
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (fi->members[mid] < idx2)
+      lo = mid + 1;
+    else if (fi->members[mid] > idx2)
+      hi = mid;
+    else
+      return 1;
+  }
+  return 0;
+}
+
 /** Return true iff r1 and r2 are in the same family, but not the same
  * router. */
 int
@@ -1923,13 +2174,21 @@ nodes_in_same_family(const node_t *node1, const node_t *node2)
 
   /* Are they in the same family because the agree they are? */
   {
-    const smartlist_t *f1, *f2;
-    f1 = node_get_declared_family(node1);
-    f2 = node_get_declared_family(node2);
-    if (f1 && f2 &&
-        node_in_nickname_smartlist(f1, node2) &&
-        node_in_nickname_smartlist(f2, node1))
-      return 1;
+    const node_family_index_t *fi = nodelist_get_family_index();
+    if (fi && node_is_in_family_index(fi, node1) &&
+        node_is_in_family_index(fi, node2)) {
+      if (node_family_index_contains(fi, node1->nodelist_idx,
+                                     node2->nodelist_idx))
+        return 1;
+    } else {
+      const smartlist_t *f1, *f2;
+      f1 = node_get_declared_family(node1);
+      f2 = node_get_declared_family(node2);
+      if (f1 && f2 &&
+          node_in_nickname_smartlist(f1, node2) &&
+          node_in_nickname_smartlist(f2, node1))
+        return 1;
+    }
   }
 
   /* Are they in the same option because the user says they are? */
@@ -1958,6 +2217,7 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 {
   const smartlist_t *all_nodes = nodelist_get_list();
   const smartlist_t *declared_family;
+  const node_family_index_t *family_index;
   const or_options_t *options = get_options();
 
   tor_assert(node);
@@ -1986,7 +2246,15 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 
   /* Now, add all nodes in the declared_family of this node, if they
    * also declare this node to be in their family. */
-  if (declared_family) {
+  family_index = nodelist_get_family_index();
+  if (family_index && node_is_in_family_index(family_index, node)) {
+    const int idx = node->nodelist_idx;
+    int i;
+    for (i = family_index->offsets[idx];
+         i < family_index->offsets[idx+1]; ++i) {
+      smartlist_add(sl, smartlist_get(all_nodes, family_index->members[i]));
+    }
+  } else if (declared_family) {
     /* Add every r such that router declares familyness with node, and node
      * declares familyhood with router. */
     SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
@@ -2118,6 +2386,7 @@ router_set_status(const char *digest, int up)
       router_dir_info_changed();
 
     node->is_running = up;
+    node_select_node_flags_changed(node);
   }
 }
 
@@ -0,0 +1,427 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ns_snapshot.c
+ * \brief Keep a binary snapshot of the routerstatus entries in a consensus.
+ *
+ * When we start up, we read our cached consensus from disk and parse it
+ * again, just as if we had downloaded it.  Most of that time goes to the
+ * thousands of routerstatus entries.  If ConsensusSnapshot is set, then
+ * whenever we accept a consensus, we also write its routerstatus entries to
+ * disk as an array of fixed-size records followed by a pool of strings.  On
+ * the next start, networkstatus_parse_consensus_with_snapshot() parses the
+ * header and footer of the cached consensus as usual, and takes the entries
+ * from the snapshot instead of from the text.
+ *
+ * A snapshot records the SHA3-256 digest of the signed part of the
+ * consensus it came from, and we use it only with that exact document.  It
+ * also records which version of Tor wrote it, since the protocol summary
+ * flags that we keep depend on the code that computed them.
+ *
+ * The snapshot file starts with a header:
+ * <pre>
+ *    magic      [16 bytes]  "tor-ns-snapshot\n"
+ *    format     [4 bytes]   NS_SNAPSHOT_FORMAT
+ *    flavor     [4 bytes]   consensus_flavor_t
+ *    doc_digest [32 bytes]  SHA3-256 of the consensus, as signed
+ *    version    [32 bytes]  SHA256 of get_version()
+ *    n_records  [4 bytes]
+ *    record_len [4 bytes]   NS_SNAPSHOT_RECORD_LEN
+ *    pool_len   [4 bytes]
+ *    body_digest [32 bytes] SHA256 of the records and the pool
+ * </pre>
+ * All integers are in network order.  The records follow, laid out as the
+ * REC_* offsets below describe, and then the NUL-terminated strings of the
+ * pool.
+ **/
+
+#define NS_SNAPSHOT_PRIVATE
+
+#include "core/or/or.h"
+
+#include "app/config/config.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/ns_snapshot.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/fs/mmap.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+/** The magic string at the start of every snapshot file. */
+#define NS_SNAPSHOT_MAGIC "tor-ns-snapshot\n"
+#define NS_SNAPSHOT_MAGIC_LEN 16
+/** The format of the snapshots that we write. */
+#define NS_SNAPSHOT_FORMAT 1
+
+/* Offsets of the fields in the header. */
+#define HDR_FORMAT        16
+#define HDR_FLAVOR        20
+#define HDR_DOC_DIGEST    24
+#define HDR_VERSION       56
+#define HDR_N_RECORDS     88
+#define HDR_RECORD_LEN    92
+#define HDR_POOL_LEN      96
+#define HDR_BODY_DIGEST   100
+/** Length of the header. */
+#define NS_SNAPSHOT_HEADER_LEN 132
+
+/* Offsets of the fields in each routerstatus record. */
+#define REC_PUBLISHED     0
+#define REC_NICKNAME      8
+#define REC_IDENTITY      (REC_NICKNAME + MAX_NICKNAME_LEN + 1)
+#define REC_DESC_DIGEST   (REC_IDENTITY + DIGEST_LEN)
+#define REC_ADDR          (REC_DESC_DIGEST + DIGEST256_LEN)
+#define REC_OR_PORT       (REC_ADDR + 4)
+#define REC_DIR_PORT      (REC_OR_PORT + 2)
+#define REC_IPV6_ADDR     (REC_DIR_PORT + 2)
+#define REC_IPV6_ORPORT   (REC_IPV6_ADDR + 16)
+#define REC_FLAGS         (REC_IPV6_ORPORT + 2)
+#define REC_BANDWIDTH     (REC_FLAGS + 4)
+#define REC_GUARDFRACTION (REC_BANDWIDTH + 4)
+#define REC_EXITSUMMARY   (REC_GUARDFRACTION + 4)
+/** Length of each routerstatus record. */
+#define NS_SNAPSHOT_RECORD_LEN (REC_EXITSUMMARY + 4)
+
+/** Value for a record's exit summary offset when it has none. */
+#define NO_STRING UINT32_MAX
+
+/** Every one-bit field of routerstatus_t that we keep in a snapshot, with
+ * its position in the flags word of a record.  Never renumber these without
+ * changing NS_SNAPSHOT_FORMAT. */
+#define NS_SNAPSHOT_FOREACH_FLAG(F)                     \
+  F(0, is_authority)                                    \
+  F(1, is_exit)                                         \
+  F(2, is_stable)                                       \
+  F(3, is_fast)                                         \
+  F(4, is_flagged_running)                              \
+  F(5, is_named)                                        \
+  F(6, is_unnamed)                                      \
+  F(7, is_valid)                                        \
+  F(8, is_possible_guard)                               \
+  F(9, is_bad_exit)                                     \
+  F(10, is_hs_dir)                                      \
+  F(11, is_v2_dir)                                      \
+  F(12, has_bandwidth)                                  \
+  F(13, has_exitsummary)                                \
+  F(14, bw_is_unmeasured)                               \
+  F(15, has_guardfraction)                              \
+  F(16, pv.protocols_known)                             \
+  F(17, pv.supports_extend2_cells)                      \
+  F(18, pv.supports_ed25519_link_handshake_compat)      \
+  F(19, pv.supports_ed25519_link_handshake_any)         \
+  F(20, pv.supports_ed25519_hs_intro)                   \
+  F(21, pv.supports_v3_hsdir)                           \
+  F(22, pv.supports_v3_rendezvous_point)
+/** Flag bit set when a record has an IPv6 address. */
+#define FLAG_HAS_IPV6 (UINT32_C(1)<<23)
+
+/** An open snapshot file. */
+struct ns_snapshot_t {
+  /** The flavor of consensus that this snapshot belongs to. */
+  consensus_flavor_t flavor;
+  /** The mapped file. */
+  tor_mmap_t *map;
+  /** The number of records in the file. */
+  uint32_t n_records;
+  /** The length of the string pool. */
+  uint32_t pool_len;
+};
+
+/** Return a newly allocated string holding the filename of the snapshot
+ * for consensuses of flavor <b>flav</b>. */
+STATIC char *
+ns_snapshot_get_fname(consensus_flavor_t flav)
+{
+  if (flav == FLAV_MICRODESC)
+    return get_cachedir_fname("cached-microdesc-consensus-snapshot");
+  else
+    return get_cachedir_fname("cached-consensus-snapshot");
+}
+
+/** Set <b>out</b> to the SHA256 digest of the version of Tor we're
+ * running. */
+static void
+ns_snapshot_get_version_digest(uint8_t *out)
+{
+  const char *version = get_version();
+  crypto_digest256((char *)out, version, strlen(version), DIGEST_SHA256);
+}
+
+/** Encode <b>rs</b> into the NS_SNAPSHOT_RECORD_LEN bytes at <b>rec</b>.
+ * Use <b>exitsummary_off</b> as the offset of its exit summary in the
+ * string pool. */
+static void
+ns_snapshot_encode_routerstatus(uint8_t *rec, const routerstatus_t *rs,
+                                uint32_t exitsummary_off)
+{
+  uint32_t flags = 0;
+#define F(bit, field) \
+  if (rs->field) flags |= (UINT32_C(1)<<(bit));
+  NS_SNAPSHOT_FOREACH_FLAG(F)
+#undef F
+
+  memset(rec, 0, NS_SNAPSHOT_RECORD_LEN);
+  set_uint64(rec + REC_PUBLISHED, tor_htonll((uint64_t)rs->published_on));
+  strlcpy((char *)rec + REC_NICKNAME, rs->nickname, MAX_NICKNAME_LEN + 1);
+  memcpy(rec + REC_IDENTITY, rs->identity_digest, DIGEST_LEN);
+  memcpy(rec + REC_DESC_DIGEST, rs->descriptor_digest, DIGEST256_LEN);
+  set_uint32(rec + REC_ADDR, htonl(rs->addr));
+  set_uint16(rec + REC_OR_PORT, htons(rs->or_port));
+  set_uint16(rec + REC_DIR_PORT, htons(rs->dir_port));
+  if (tor_addr_family(&rs->ipv6_addr) == AF_INET6) {
+    flags |= FLAG_HAS_IPV6;
+    memcpy(rec + REC_IPV6_ADDR, tor_addr_to_in6_addr8(&rs->ipv6_addr), 16);
+  }
+  set_uint16(rec + REC_IPV6_ORPORT, htons(rs->ipv6_orport));
+  set_uint32(rec + REC_FLAGS, htonl(flags));
+  set_uint32(rec + REC_BANDWIDTH, htonl(rs->bandwidth_kb));
+  set_uint32(rec + REC_GUARDFRACTION, htonl(rs->guardfraction_percentage));
+  set_uint32(rec + REC_EXITSUMMARY, htonl(exitsummary_off));
+}
+
+/** Return a newly allocated routerstatus_t decoded from the record at
+ * <b>rec</b>, or NULL if the record is malformed.  <b>pool</b> is the
+ * string pool, of length <b>pool_len</b>; it ends with a NUL. */
+static routerstatus_t *
+ns_snapshot_decode_routerstatus(const uint8_t *rec,
+                                const char *pool, uint32_t pool_len)
+{
+  const uint32_t flags = ntohl(get_uint32(rec + REC_FLAGS));
+  const uint32_t exitsummary_off = ntohl(get_uint32(rec + REC_EXITSUMMARY));
+  if (exitsummary_off != NO_STRING && exitsummary_off >= pool_len)
+    return NULL;
+
+  routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+#define F(bit, field) \
+  rs->field = !!(flags & (UINT32_C(1)<<(bit)));
+  NS_SNAPSHOT_FOREACH_FLAG(F)
+#undef F
+
+  rs->published_on = (time_t)tor_ntohll(get_uint64(rec + REC_PUBLISHED));
+  memcpy(rs->nickname, rec + REC_NICKNAME, MAX_NICKNAME_LEN);
+  rs->nickname[MAX_NICKNAME_LEN] = '\0';
+  memcpy(rs->identity_digest, rec + REC_IDENTITY, DIGEST_LEN);
+  memcpy(rs->descriptor_digest, rec + REC_DESC_DIGEST, DIGEST256_LEN);
+  rs->addr = ntohl(get_uint32(rec + REC_ADDR));
+  rs->or_port = ntohs(get_uint16(rec + REC_OR_PORT));
+  rs->dir_port = ntohs(get_uint16(rec + REC_DIR_PORT));
+  if (flags & FLAG_HAS_IPV6)
+    tor_addr_from_ipv6_bytes(&rs->ipv6_addr,
+                             (const char *)rec + REC_IPV6_ADDR);
+  rs->ipv6_orport = ntohs(get_uint16(rec + REC_IPV6_ORPORT));
+  rs->bandwidth_kb = ntohl(get_uint32(rec + REC_BANDWIDTH));
+  rs->guardfraction_percentage = ntohl(get_uint32(rec + REC_GUARDFRACTION));
+  if (exitsummary_off != NO_STRING)
+    rs->exitsummary = tor_strdup(pool + exitsummary_off);
+  return rs;
+}
+
+/** Return a newly allocated snapshot of the routerstatus entries in the
+ * consensus <b>ns</b>, and set *<b>len_out</b> to its length.  Exit
+ * summaries are shared by many relays, so we store each one only once. */
+STATIC char *
+ns_snapshot_encode(const networkstatus_t *ns, size_t *len_out)
+{
+  const int n_records = smartlist_len(ns->routerstatus_list);
+  uint8_t *records = tor_calloc(MAX(n_records, 1), NS_SNAPSHOT_RECORD_LEN);
+  smartlist_t *pool = smartlist_new();
+  strmap_t *pool_offsets = strmap_new();
+  size_t pool_len = 0;
+
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *,
+                          rs) {
+    uint32_t off = NO_STRING;
+    if (rs->exitsummary) {
+      /* We store offset+1, so that we can tell a missing entry from 0. */
+      void *found = strmap_get(pool_offsets, rs->exitsummary);
+      if (found) {
+        off = (uint32_t)((uintptr_t)found - 1);
+      } else {
+        off = (uint32_t) pool_len;
+        strmap_set(pool_offsets, rs->exitsummary, (void *)(uintptr_t)(off+1));
+        smartlist_add(pool, rs->exitsummary);
+        pool_len += strlen(rs->exitsummary) + 1;
+      }
+    }
+    ns_snapshot_encode_routerstatus(
+                    records + rs_sl_idx * NS_SNAPSHOT_RECORD_LEN, rs, off);
+  } SMARTLIST_FOREACH_END(rs);
+
+  const size_t records_len = (size_t)n_records * NS_SNAPSHOT_RECORD_LEN;
+  const size_t len = NS_SNAPSHOT_HEADER_LEN + records_len + pool_len;
+  char *result = tor_malloc_zero(len);
+  uint8_t *hdr = (uint8_t *)result;
+  char *cp = result + NS_SNAPSHOT_HEADER_LEN;
+
+  memcpy(cp, records, records_len);
+  cp += records_len;
+  SMARTLIST_FOREACH_BEGIN(pool, const char *, s) {
+    const size_t slen = strlen(s) + 1;
+    memcpy(cp, s, slen);
+    cp += slen;
+  } SMARTLIST_FOREACH_END(s);
+  tor_assert(cp == result + len);
+
+  memcpy(hdr, NS_SNAPSHOT_MAGIC, NS_SNAPSHOT_MAGIC_LEN);
+  set_uint32(hdr + HDR_FORMAT, htonl(NS_SNAPSHOT_FORMAT));
+  set_uint32(hdr + HDR_FLAVOR, htonl(ns->flavor));
+  memcpy(hdr + HDR_DOC_DIGEST, ns->digest_sha3_as_signed, DIGEST256_LEN);
+  ns_snapshot_get_version_digest(hdr + HDR_VERSION);
+  set_uint32(hdr + HDR_N_RECORDS, htonl(n_records));
+  set_uint32(hdr + HDR_RECORD_LEN, htonl(NS_SNAPSHOT_RECORD_LEN));
+  set_uint32(hdr + HDR_POOL_LEN, htonl((uint32_t)pool_len));
+  crypto_digest256((char *)hdr + HDR_BODY_DIGEST,
+                   result + NS_SNAPSHOT_HEADER_LEN,
+                   len - NS_SNAPSHOT_HEADER_LEN, DIGEST_SHA256);
+
+  tor_free(records);
+  smartlist_free(pool);
+  strmap_free(pool_offsets, NULL);
+  *len_out = len;
+  return result;
+}
+
+/** Write a snapshot of the routerstatus entries in the consensus <b>ns</b>
+ * to disk, replacing any older snapshot for its flavor.  Return 0 on
+ * success, -1 on failure. */
+int
+ns_snapshot_write(const networkstatus_t *ns)
+{
+  tor_assert(ns->type == NS_TYPE_CONSENSUS);
+  size_t len = 0;
+  char *body = ns_snapshot_encode(ns, &len);
+  char *fname = ns_snapshot_get_fname(ns->flavor);
+  int r = write_bytes_to_file(fname, body, len, 1);
+  if (r < 0) {
+    log_warn(LD_FS, "Couldn't write consensus snapshot to %s",
+             escaped(fname));
+  } else {
+    log_info(LD_DIR, "Wrote a snapshot of %d routerstatus entries to %s",
+             smartlist_len(ns->routerstatus_list), escaped(fname));
+  }
+  tor_free(fname);
+  tor_free(body);
+  return r;
+}
+
+/** Open and map the snapshot for consensuses of flavor <b>flav</b>, and
+ * check that its header is sound.  Return the snapshot on success, or NULL
+ * if there is no usable snapshot. */
+ns_snapshot_t *
+ns_snapshot_open(consensus_flavor_t flav)
+{
+  char *fname = ns_snapshot_get_fname(flav);
+  tor_mmap_t *map = tor_mmap_file(fname);
+  ns_snapshot_t *snap = NULL;
+  const char *problem = NULL;
+  uint8_t version_digest[DIGEST256_LEN];
+
+  if (!map)
+    goto done;
+
+  const uint8_t *hdr = (const uint8_t *)map->data;
+  if (map->size < NS_SNAPSHOT_HEADER_LEN ||
+      fast_memneq(hdr, NS_SNAPSHOT_MAGIC, NS_SNAPSHOT_MAGIC_LEN)) {
+    problem = "not a snapshot";
+    goto done;
+  }
+  if (ntohl(get_uint32(hdr + HDR_FORMAT)) != NS_SNAPSHOT_FORMAT ||
+      ntohl(get_uint32(hdr + HDR_RECORD_LEN)) != NS_SNAPSHOT_RECORD_LEN) {
+    problem = "unrecognized format";
+    goto done;
+  }
+  if (ntohl(get_uint32(hdr + HDR_FLAVOR)) != (uint32_t)flav) {
+    problem = "wrong flavor";
+    goto done;
+  }
+  ns_snapshot_get_version_digest(version_digest);
+  if (fast_memneq(hdr + HDR_VERSION, version_digest, DIGEST256_LEN)) {
+    problem = "written by another version of Tor";
+    goto done;
+  }
+  const uint32_t n_records = ntohl(get_uint32(hdr + HDR_N_RECORDS));
+  const uint32_t pool_len = ntohl(get_uint32(hdr + HDR_POOL_LEN));
+  if ((uint64_t)n_records * NS_SNAPSHOT_RECORD_LEN + pool_len !=
+      map->size - NS_SNAPSHOT_HEADER_LEN) {
+    problem = "wrong length";
+    goto done;
+  }
+  if (pool_len && map->data[map->size - 1] != '\0') {
+    problem = "unterminated string pool";
+    goto done;
+  }
+
+  snap = tor_malloc_zero(sizeof(ns_snapshot_t));
+  snap->flavor = flav;
+  snap->map = map;
+  snap->n_records = n_records;
+  snap->pool_len = pool_len;
+  map = NULL;
+
+ done:
+  if (problem)
+    log_info(LD_DIR, "Ignoring consensus snapshot %s: %s",
+             escaped(fname), problem);
+  if (map)
+    tor_munmap_file(map);
+  tor_free(fname);
+  return snap;
+}
+
+/** Release all storage held by <b>snap</b>. */
+void
+ns_snapshot_free_(ns_snapshot_t *snap)
+{
+  if (!snap)
+    return;
+  tor_munmap_file(snap->map);
+  tor_free(snap);
+}
+
+/** If <b>snap</b> was taken from the consensus whose signed part has the
+ * SHA3-256 digest <b>sha3_as_signed</b>, decode its routerstatus entries,
+ * append them to <b>routerstatuses_out</b>, and return 0.  Otherwise, or if
+ * the snapshot is damaged, return -1 and change nothing. */
+int
+ns_snapshot_get_routerstatuses(const ns_snapshot_t *snap,
+                               const uint8_t *sha3_as_signed,
+                               smartlist_t *routerstatuses_out)
+{
+  const uint8_t *hdr = (const uint8_t *)snap->map->data;
+  const uint8_t *records = hdr + NS_SNAPSHOT_HEADER_LEN;
+  const char *pool = (const char *)records +
+    (size_t)snap->n_records * NS_SNAPSHOT_RECORD_LEN;
+  uint8_t body_digest[DIGEST256_LEN];
+  uint32_t i;
+
+  if (fast_memneq(hdr + HDR_DOC_DIGEST, sha3_as_signed, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus snapshot belongs to a different consensus; "
+             "ignoring it.");
+    return -1;
+  }
+  crypto_digest256((char *)body_digest, (const char *)records,
+                   snap->map->size - NS_SNAPSHOT_HEADER_LEN, DIGEST_SHA256);
+  if (fast_memneq(hdr + HDR_BODY_DIGEST, body_digest, DIGEST256_LEN)) {
+    log_warn(LD_DIR, "Consensus snapshot is corrupt; ignoring it.");
+    return -1;
+  }
+
+  smartlist_t *decoded = smartlist_new();
+  for (i = 0; i < snap->n_records; ++i) {
+    routerstatus_t *rs = ns_snapshot_decode_routerstatus(
+                        records + (size_t)i * NS_SNAPSHOT_RECORD_LEN,
+                        pool, snap->pool_len);
+    if (!rs) {
+      log_warn(LD_DIR, "Malformed entry in consensus snapshot; ignoring it.");
+      SMARTLIST_FOREACH(decoded, routerstatus_t *, r, routerstatus_free(r));
+      smartlist_free(decoded);
+      return -1;
+    }
+    smartlist_add(decoded, rs);
+  }
+  smartlist_add_all(routerstatuses_out, decoded);
+  smartlist_free(decoded);
+  return 0;
+}
@@ -0,0 +1,28 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ns_snapshot.h
+ * \brief Header file for ns_snapshot.c.
+ **/
+
+#ifndef TOR_NS_SNAPSHOT_H
+#define TOR_NS_SNAPSHOT_H
+
+typedef struct ns_snapshot_t ns_snapshot_t;
+
+int ns_snapshot_write(const networkstatus_t *ns);
+ns_snapshot_t *ns_snapshot_open(consensus_flavor_t flav);
+void ns_snapshot_free_(ns_snapshot_t *snap);
+#define ns_snapshot_free(snap) \
+  FREE_AND_NULL(ns_snapshot_t, ns_snapshot_free_, (snap))
+int ns_snapshot_get_routerstatuses(const ns_snapshot_t *snap,
+                                   const uint8_t *sha3_as_signed,
+                                   smartlist_t *routerstatuses_out);
+
+#ifdef NS_SNAPSHOT_PRIVATE
+STATIC char *ns_snapshot_get_fname(consensus_flavor_t flav);
+STATIC char *ns_snapshot_encode(const networkstatus_t *ns, size_t *len_out);
+#endif
+
+#endif /* !defined(TOR_NS_SNAPSHOT_H) */
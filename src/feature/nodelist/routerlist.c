@@ -64,6 +64,7 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/policies.h"
 #include "feature/client/bridges.h"
@@ -104,6 +105,9 @@
 #include "feature/nodelist/vote_routerstatus_st.h"
 
 #include "lib/crypt_ops/digestset.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -223,16 +227,397 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
-#define RRS_FORCE 1
-#define RRS_DONT_REMOVE_OLD 2
+/** How many descriptors do we fix up at a time, after rebuilding a store in
+ * the background? */
+#define STORE_REBUILD_FIXUP_SLICE 1024
+
+/** A rebuild of a desc_store_t that is writing the new store file from a
+ * cpuworker thread.
+ *
+ * To rebuild a store in the background, we take note of every descriptor
+ * that belongs in it, move the journal aside so that descriptors arriving in
+ * the meantime start a new one, and have a worker write the new store file.
+ * The worker reads each body from the old store's mmap, or from a copy that
+ * we made for it.  Once the file is written, the main thread swaps it in,
+ * keeping the old mmap until every descriptor that pointed into it has been
+ * moved to the new one, a slice at a time. */
+typedef struct store_rebuild_job_t {
+  /** The store that we're rebuilding, or NULL if we gave up on this job
+   * while the worker still had it. */
+  desc_store_t *store;
+  /** The pending work, while the worker has it. */
+  workqueue_entry_t *work;
+  /** Where the worker writes the new store. */
+  char *fname_tmp;
+  /** A sized_chunk_t for each descriptor to write, in order. */
+  smartlist_t *chunks;
+  /** The signed_descriptor_digest of each descriptor in <b>chunks</b>. */
+  char *digests;
+  /** Copies of the bodies that weren't in the old store's mmap. */
+  smartlist_t *copied_bodies;
+  /** Length of the new store. */
+  size_t total_len;
+  /** Length of the journal that we moved aside. */
+  size_t journal_len;
+  /** The store's bytes_dropped when we started. */
+  size_t bytes_dropped;
+  /** If we gave up on this job: the old store's mmap, which the worker
+   * might still be reading. */
+  tor_mmap_t *orphaned_mmap;
+  /** Set by the worker if it couldn't write the new store. */
+  int write_failed;
+  /** Once the new store is in place: the index of the next descriptor to
+   * fix up, and its offset in the new store. */
+  int next_fixup;
+  size_t fixup_offset;
+} store_rebuild_job_t;
+
+/** Release all storage held by <b>job</b>. */
+static void
+store_rebuild_job_free(store_rebuild_job_t *job)
+{
+  if (!job)
+    return;
+  if (job->orphaned_mmap)
+    tor_munmap_file(job->orphaned_mmap);
+  SMARTLIST_FOREACH(job->chunks, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(job->chunks);
+  if (job->copied_bodies) {
+    SMARTLIST_FOREACH(job->copied_bodies, char *, cp, tor_free(cp));
+    smartlist_free(job->copied_bodies);
+  }
+  tor_free(job->digests);
+  tor_free(job->fname_tmp);
+  tor_free(job);
+}
+
+/** Return the name of the file that holds the journal of <b>store</b> while
+ * a background rebuild folds it into the new store. */
+static char *
+desc_store_get_rebuilding_journal_fname(const desc_store_t *store)
+{
+  return get_cachedir_fname_suffix(store->fname_base, ".new.rebuilding");
+}
+
+/** Return the signed_descriptor_t in <b>store</b> whose digest is
+ * <b>digest</b>, or NULL if we don't have it. */
+static signed_descriptor_t *
+desc_store_find_by_digest(const desc_store_t *store, const char *digest)
+{
+  if (store->type == EXTRAINFO_STORE) {
+    extrainfo_t *ei = eimap_get(routerlist->extra_info_map, digest);
+    return ei ? &ei->cache_info : NULL;
+  } else {
+    return sdmap_get(routerlist->desc_digest_map, digest);
+  }
+}
+
+/** After a background rebuild of <b>store</b>, point up to <b>max</b> more
+ * descriptors into the new store.  Once every descriptor is done, let go of
+ * the old store's mmap.  Return the number of descriptors left to fix up. */
+STATIC int
+desc_store_run_fixups(desc_store_t *store, int max)
+{
+  store_rebuild_job_t *job = store->rebuild_job;
+  tor_assert(job && !job->work);
+  const int n = smartlist_len(job->chunks);
+
+  while (job->next_fixup < n && max-- > 0) {
+    const int i = job->next_fixup++;
+    const sized_chunk_t *c = smartlist_get(job->chunks, i);
+    signed_descriptor_t *sd =
+      desc_store_find_by_digest(store, job->digests + i*DIGEST_LEN);
+    /* Descriptors that we dropped while the worker wrote the store stay in
+     * the file until the next rebuild. */
+    if (sd && !sd->do_not_cache &&
+        sd->signed_descriptor_len + sd->annotations_len == c->len) {
+      tor_free(sd->signed_descriptor_body); // sets it to null
+      sd->saved_location = SAVED_IN_CACHE;
+      sd->saved_offset = job->fixup_offset;
+      sd->store_parity = store->mmap_parity;
+      signed_descriptor_get_body(sd); /* reconstruct and assert */
+    }
+    job->fixup_offset += c->len;
+  }
+  if (job->next_fixup < n)
+    return n - job->next_fixup;
+
+  log_info(LD_DIR, "Done moving %s into the rebuilt cache",
+           store->description);
+  if (store->old_mmap) {
+    if (tor_munmap_file(store->old_mmap) != 0)
+      log_warn(LD_FS, "Unable to munmap old %s store", store->description);
+    store->old_mmap = NULL;
+  }
+  store->rebuild_job = NULL;
+  store_rebuild_job_free(job);
+  return 0;
+}
+
+/** Mainloop callback: fix up another slice of descriptors after a background
+ * rebuild of the store in <b>arg</b>. */
+static void
+desc_store_fixup_cb(mainloop_event_t *ev, void *arg)
+{
+  desc_store_t *store = arg;
+  if (store->rebuild_job && !store->rebuild_job->work &&
+      desc_store_run_fixups(store, STORE_REBUILD_FIXUP_SLICE) > 0)
+    mainloop_event_activate(ev);
+}
+
+/** Worker thread function: write the new store for the
+ * store_rebuild_job_t in <b>arg</b>. */
+static workqueue_reply_t
+store_rebuild_job_threadfn(void *state_, void *arg)
+{
+  (void) state_;
+  store_rebuild_job_t *job = arg;
+  if (write_chunks_to_file(job->fname_tmp, job->chunks, 1, 1) < 0)
+    job->write_failed = 1;
+  return WQ_RPL_REPLY;
+}
+
+/** Give up on the background rebuild in <b>job</b>: put the length of the
+ * journal that we moved aside back into <b>store</b>'s accounting, and free
+ * the job.  The moved-aside journal stays on disk until a rebuild in the
+ * main thread replaces it. */
+static void
+desc_store_rebuild_failed(desc_store_t *store, store_rebuild_job_t *job)
+{
+  store->journal_len += job->journal_len;
+  store->bytes_dropped += job->bytes_dropped;
+  store->rebuild_job = NULL;
+  tor_unlink(job->fname_tmp);
+  store_rebuild_job_free(job);
+}
+
+/** Main thread function: the worker is done with the store_rebuild_job_t in
+ * <b>arg</b>.  Replace the store file with the new one, and start fixing up
+ * pointers. */
+static void
+store_rebuild_job_replyfn(void *arg)
+{
+  store_rebuild_job_t *job = arg;
+  desc_store_t *store = job->store;
+  char *fname = NULL;
+  tor_mmap_t *map = NULL;
+
+  job->work = NULL;
+  if (!store) {
+    /* We gave up on this job already. */
+    tor_unlink(job->fname_tmp);
+    store_rebuild_job_free(job);
+    return;
+  }
+  tor_assert(store->rebuild_job == job);
+
+  if (job->write_failed) {
+    log_warn(LD_FS, "Error writing router store to disk.");
+    desc_store_rebuild_failed(store, job);
+    return;
+  }
+
+  fname = get_cachedir_fname(store->fname_base);
+  if (replace_file(job->fname_tmp, fname)<0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    desc_store_rebuild_failed(store, job);
+    goto done;
+  }
+  if (job->total_len) {
+    map = tor_mmap_file(fname);
+    if (!map) {
+      /* The descriptors still point into the old mmap, and the journal that
+       * we moved aside is still around, so the next rebuild will fix the
+       * store. */
+      log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.",fname);
+      desc_store_rebuild_failed(store, job);
+      goto done;
+    }
+  }
+
+  char *journal_fname = desc_store_get_rebuilding_journal_fname(store);
+  tor_unlink(journal_fname);
+  tor_free(journal_fname);
+
+  store->old_mmap = store->mmap;
+  store->mmap = map;
+  store->mmap_parity = !store->mmap_parity;
+  store->store_len = job->total_len;
+  SMARTLIST_FOREACH(job->copied_bodies, char *, cp, tor_free(cp));
+  smartlist_free(job->copied_bodies);
+
+  log_info(LD_DIR, "Rebuilt %s cache; moving %d descriptors into it",
+           store->description, smartlist_len(job->chunks));
+  if (!store->fixup_event)
+    store->fixup_event = mainloop_event_new(desc_store_fixup_cb, store);
+  mainloop_event_activate(store->fixup_event);
+
+ done:
+  tor_free(fname);
+}
+
+/** If <b>store</b> is being rebuilt in the background, stop: finish any
+ * pointer fixups now, or give up on the job if the worker still has it. */
+static void
+desc_store_abandon_rebuild(desc_store_t *store)
+{
+  store_rebuild_job_t *job = store->rebuild_job;
+  if (!job)
+    return;
+  if (!job->work) {
+    desc_store_run_fixups(store, INT_MAX);
+    return;
+  }
+
+  if (workqueue_entry_cancel(job->work)) {
+    desc_store_rebuild_failed(store, job);
+    return;
+  }
+  /* The worker is reading from our mmap right now.  Let it keep that mmap,
+   * and map the (unchanged) store file again for ourselves. */
+  store->journal_len += job->journal_len;
+  store->bytes_dropped += job->bytes_dropped;
+  store->rebuild_job = NULL;
+  job->store = NULL;
+  if (store->mmap) {
+    char *fname = get_cachedir_fname(store->fname_base);
+    job->orphaned_mmap = store->mmap;
+    store->mmap = tor_mmap_file(fname);
+    tor_free(fname);
+  }
+}
+
+/** Stop any background rebuild of <b>store</b>, without touching its
+ * descriptors, since we're about to free them. */
+static void
+desc_store_clear_rebuild(desc_store_t *store)
+{
+  store_rebuild_job_t *job = store->rebuild_job;
+  store->rebuild_job = NULL;
+  if (job && job->work && !workqueue_entry_cancel(job->work)) {
+    /* The worker is still reading from our mmap; it's the job's now. */
+    job->store = NULL;
+    job->orphaned_mmap = store->mmap;
+    store->mmap = NULL;
+  } else if (job) {
+    if (job->work)
+      tor_unlink(job->fname_tmp);
+    store_rebuild_job_free(job);
+  }
+  if (store->old_mmap) {
+    tor_munmap_file(store->old_mmap);
+    store->old_mmap = NULL;
+  }
+  mainloop_event_free(store->fixup_event);
+}
+
+/** Return true iff we should rebuild <b>store</b> on a cpuworker thread. */
+static int
+desc_store_can_rebuild_in_background(const desc_store_t *store)
+{
+#ifdef _WIN32
+  /* We can't replace a file while we have it mapped. */
+  (void) store;
+  return 0;
+#else
+  if (!in_main_thread() || cpuworker_get_n_threads() <= 0)
+    return 0;
+  /* If an earlier background rebuild failed, let the main thread clean up
+   * the journal that it left behind. */
+  char *journal_fname = desc_store_get_rebuilding_journal_fname(store);
+  int r = file_status(journal_fname) == FN_NOENT;
+  tor_free(journal_fname);
+  return r;
+#endif /* defined(_WIN32) */
+}
+
+/** Start rebuilding <b>store</b> from the descriptors in
+ * <b>signed_descriptors</b> on a cpuworker thread.  Return 0 on success,
+ * and -1 if we couldn't start. */
+static int
+desc_store_start_rebuild(desc_store_t *store,
+                         const smartlist_t *signed_descriptors)
+{
+  store_rebuild_job_t *job = tor_malloc_zero(sizeof(store_rebuild_job_t));
+  char *journal_fname = NULL, *journal_fname_rebuilding = NULL;
+  int i = 0, r = -1;
+
+  job->store = store;
+  job->fname_tmp = get_cachedir_fname_suffix(store->fname_base,
+                                             ".compact.tmp");
+  job->chunks = smartlist_new();
+  job->copied_bodies = smartlist_new();
+  job->digests =
+    tor_malloc(DIGEST_LEN * (smartlist_len(signed_descriptors)+1));
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    sized_chunk_t *c;
+    const char *body = signed_descriptor_get_body_impl(sd, 1);
+    if (!body) {
+      log_warn(LD_BUG, "No descriptor available for router.");
+      goto done;
+    }
+    if (sd->do_not_cache)
+      continue;
+    c = tor_malloc(sizeof(sized_chunk_t));
+    c->len = sd->signed_descriptor_len + sd->annotations_len;
+    if (sd->saved_location == SAVED_IN_CACHE && store->mmap) {
+      c->bytes = body;
+    } else {
+      /* This body belongs to the descriptor, which we might free before the
+       * worker is done with it. */
+      char *copy = tor_memdup(body, c->len);
+      smartlist_add(job->copied_bodies, copy);
+      c->bytes = copy;
+    }
+    memcpy(job->digests + i++*DIGEST_LEN, sd->signed_descriptor_digest,
+           DIGEST_LEN);
+    job->total_len += c->len;
+    smartlist_add(job->chunks, c);
+  } SMARTLIST_FOREACH_END(sd);
+
+  /* Descriptors that arrive from now on go into a new journal. */
+  journal_fname = get_cachedir_fname_suffix(store->fname_base, ".new");
+  journal_fname_rebuilding = desc_store_get_rebuilding_journal_fname(store);
+  if (file_status(journal_fname) == FN_FILE &&
+      tor_rename(journal_fname, journal_fname_rebuilding) < 0) {
+    log_warn(LD_FS, "Couldn't move %s aside: %s", journal_fname,
+             strerror(errno));
+    goto done;
+  }
+
+  job->work = cpuworker_queue_work(WQ_PRI_LOW, store_rebuild_job_threadfn,
+                                   store_rebuild_job_replyfn, job);
+  if (!job->work) {
+    tor_rename(journal_fname_rebuilding, journal_fname);
+    goto done;
+  }
+
+  job->journal_len = store->journal_len;
+  job->bytes_dropped = store->bytes_dropped;
+  store->journal_len = 0;
+  store->bytes_dropped = 0;
+  store->rebuild_job = job;
+  job = NULL;
+  r = 0;
+
+ done:
+  store_rebuild_job_free(job);
+  tor_free(journal_fname);
+  tor_free(journal_fname_rebuilding);
+  return r;
+}
 
 /** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
  * <b>flags</b>, then atomically replace the saved router store with the
  * routers currently in our routerlist, and clear the journal.  Unless
  * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
  * rebuilding the store.  Return 0 on success, -1 on failure.
+ *
+ * Unless RRS_FORCE is set, we write the new store on a cpuworker thread
+ * when we can, and replace the old one once the worker is done.
  */
-static int
+STATIC int
 router_rebuild_store(int flags, desc_store_t *store)
 {
   smartlist_t *chunk_list = NULL;
@@ -245,6 +630,13 @@ router_rebuild_store(int flags, desc_store_t *store)
   int had_any;
   int force = flags & RRS_FORCE;
 
+  if (force) {
+    desc_store_abandon_rebuild(store);
+  } else if (store->rebuild_job) {
+    /* We're already rebuilding this store. */
+    r = 0;
+    goto done;
+  }
   if (!force && !router_should_rebuild_store(store)) {
     r = 0;
     goto done;
@@ -263,6 +655,11 @@ router_rebuild_store(int flags, desc_store_t *store)
   /* Don't save deadweight. */
   if (!(flags & RRS_DONT_REMOVE_OLD))
     routerlist_remove_old_routers();
+  if (!force && store->rebuild_job) {
+    /* Removing the old routers started a rebuild. */
+    r = 0;
+    goto done;
+  }
 
   log_info(LD_DIR, "Rebuilding %s cache", store->description);
 
@@ -292,6 +689,12 @@ router_rebuild_store(int flags, desc_store_t *store)
 
   smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
 
+  if (!force && desc_store_can_rebuild_in_background(store)) {
+    r = desc_store_start_rebuild(store, signed_descriptors);
+    if (r == 0)
+      goto done;
+  }
+
   /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
       sized_chunk_t *c;
@@ -355,6 +758,7 @@ router_rebuild_store(int flags, desc_store_t *store)
       if (sd->do_not_cache)
         continue;
       sd->saved_location = SAVED_IN_CACHE;
+      sd->store_parity = store->mmap_parity;
       if (store->mmap) {
         tor_free(sd->signed_descriptor_body); // sets it to null
         sd->saved_offset = offset;
@@ -366,6 +770,10 @@ router_rebuild_store(int flags, desc_store_t *store)
   tor_free(fname);
   fname = get_cachedir_fname_suffix(store->fname_base, ".new");
   write_str_to_file(fname, "", 1);
+  tor_free(fname);
+  fname = desc_store_get_rebuilding_journal_fname(store);
+  if (file_status(fname) == FN_FILE)
+    tor_unlink(fname);
 
   r = 0;
   store->store_len = (size_t) offset;
@@ -392,7 +800,10 @@ router_reload_router_list_impl(desc_store_t *store)
   char *fname = NULL, *contents = NULL;
   struct stat st;
   int extrainfo = (store->type == EXTRAINFO_STORE);
+
+  desc_store_abandon_rebuild(store);
   store->journal_len = store->store_len = 0;
+  store->mmap_parity = 0;
 
   fname = get_cachedir_fname(store->fname_base);
 
@@ -420,20 +831,27 @@ router_reload_router_list_impl(desc_store_t *store)
                                       SAVED_IN_CACHE, NULL, 0, NULL);
   }
 
-  tor_free(fname);
-  fname = get_cachedir_fname_suffix(store->fname_base, ".new");
-  /* don't load empty files - we wouldn't get any data, even if we tried */
-  if (file_status(fname) == FN_FILE)
-    contents = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
-  if (contents) {
-    if (extrainfo)
-      router_load_extrainfo_from_string(contents, NULL,SAVED_IN_JOURNAL,
-                                        NULL, 0);
+  /* If we were rebuilding the store in the background when we last ran,
+   * the older part of the journal is in its own file. */
+  for (int rebuilding = 1; rebuilding >= 0; --rebuilding) {
+    tor_free(fname);
+    if (rebuilding)
+      fname = desc_store_get_rebuilding_journal_fname(store);
     else
-      router_load_routers_from_string(contents, NULL, SAVED_IN_JOURNAL,
-                                      NULL, 0, NULL);
-    store->journal_len = (size_t) st.st_size;
-    tor_free(contents);
+      fname = get_cachedir_fname_suffix(store->fname_base, ".new");
+    /* don't load empty files - we wouldn't get any data, even if we tried */
+    if (file_status(fname) == FN_FILE)
+      contents = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+    if (contents) {
+      if (extrainfo)
+        router_load_extrainfo_from_string(contents, NULL,SAVED_IN_JOURNAL,
+                                          NULL, 0);
+      else
+        router_load_routers_from_string(contents, NULL, SAVED_IN_JOURNAL,
+                                        NULL, 0, NULL);
+      store->journal_len += (size_t) st.st_size;
+      tor_free(contents);
+    }
   }
 
   tor_free(fname);
@@ -497,6 +915,40 @@ routers_have_same_or_addrs(const routerinfo_t *r1, const routerinfo_t *r2)
     r1->ipv6_orport == r2->ipv6_orport;
 }
 
+/** Return true iff <b>node</b> is one that
+ * router_add_running_nodes_to_smartlist() would add for the given
+ * restrictions.  <b>check_reach</b> should be the negation of
+ * router_skip_or_reachability() for our options and <b>pref_addr</b>. */
+int
+router_node_is_usable_for_circuit(const node_t *node, int need_uptime,
+                                  int need_capacity, int need_guard,
+                                  int need_desc, int pref_addr,
+                                  int direct_conn, int check_reach)
+{
+  if (!node->is_running || !node->is_valid)
+    return 0;
+  if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
+    return 0;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    return 0;
+  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
+    return 0;
+  /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
+  if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
+    return 0;
+  /* Don't choose nodes if we are certain they can't do ntor. */
+  if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
+    return 0;
+  /* Choose a node with an OR address that matches the firewall rules */
+  if (direct_conn && check_reach &&
+      !fascist_firewall_allows_node(node,
+                                    FIREWALL_OR_CONNECTION,
+                                    pref_addr))
+    return 0;
+
+  return 1;
+}
+
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
  * we can pick a node for a circuit.
  */
@@ -510,28 +962,10 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int need_uptime,
                                                        pref_addr);
   /* XXXX MOVE */
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running || !node->is_valid)
-      continue;
-    if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
-    /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
-    if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
-      continue;
-    /* Don't choose nodes if we are certain they can't do ntor. */
-    if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
-      continue;
-    /* Choose a node with an OR address that matches the firewall rules */
-    if (direct_conn && check_reach &&
-        !fascist_firewall_allows_node(node,
-                                      FIREWALL_OR_CONNECTION,
-                                      pref_addr))
-      continue;
-
-    smartlist_add(sl, (void *)node);
+    if (router_node_is_usable_for_circuit(node, need_uptime, need_capacity,
+                                          need_guard, need_desc, pref_addr,
+                                          direct_conn, check_reach))
+      smartlist_add(sl, (void *)node);
   } SMARTLIST_FOREACH_END(node);
 }
 
@@ -756,9 +1190,14 @@ signed_descriptor_get_body_impl(const signed_descriptor_t *desc,
   tor_assert(len > 32);
   if (desc->saved_location == SAVED_IN_CACHE && routerlist) {
     desc_store_t *store = desc_get_store(router_get_routerlist(), desc);
-    if (store && store->mmap) {
-      tor_assert(desc->saved_offset + len <= store->mmap->size);
-      r = store->mmap->data + offset;
+    tor_mmap_t *map = store ? store->mmap : NULL;
+    /* Right after a background rebuild, some descriptors still point into
+     * the store that it replaced. */
+    if (store && store->old_mmap && desc->store_parity != store->mmap_parity)
+      map = store->old_mmap;
+    if (map) {
+      tor_assert(desc->saved_offset + len <= map->size);
+      r = map->data + offset;
     } else if (store) {
       log_err(LD_DIR, "We couldn't read a descriptor that is supposedly "
               "mmaped in our cache.  Is another process running in our data "
@@ -943,6 +1382,8 @@ routerlist_free_(routerlist_t *rl)
 {
   if (!rl)
     return;
+  desc_store_clear_rebuild(&rl->desc_store);
+  desc_store_clear_rebuild(&rl->extrainfo_store);
   rimap_free(rl->identity_map, NULL);
   sdmap_free(rl->desc_digest_map, NULL);
   sdmap_free(rl->desc_by_eid_map, NULL);
@@ -1933,7 +2374,7 @@ routerlist_descriptors_added(smartlist_t *sl, int from_cache)
       learned_bridge_descriptor(ri, from_cache);
     if (ri->needs_retest_if_added) {
       ri->needs_retest_if_added = 0;
-      dirserv_single_reachability_test(approx_time(), ri);
+      dirserv_test_reachability_soon(ri);
     }
   } SMARTLIST_FOREACH_END(ri);
 }
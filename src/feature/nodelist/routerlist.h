@@ -51,6 +51,10 @@ int router_skip_or_reachability(const or_options_t *options, int try_ip_pref);
 int router_skip_dir_reachability(const or_options_t *options, int try_ip_pref);
 void router_reset_status_download_failures(void);
 int routers_have_same_or_addrs(const routerinfo_t *r1, const routerinfo_t *r2);
+int router_node_is_usable_for_circuit(const node_t *node, int need_uptime,
+                                      int need_capacity, int need_guard,
+                                      int need_desc, int pref_addr,
+                                      int direct_conn, int check_reach);
 void router_add_running_nodes_to_smartlist(smartlist_t *sl, int need_uptime,
                                            int need_capacity, int need_guard,
                                            int need_desc, int pref_addr,
@@ -193,6 +197,14 @@ int hex_digest_nickname_matches(const char *hexdigest,
                                 const char *nickname);
 
 #ifdef ROUTERLIST_PRIVATE
+/** Flags for router_rebuild_store(): rebuild even if the journal is short,
+ * in the main thread. */
+#define RRS_FORCE 1
+/** Flags for router_rebuild_store(): don't remove expired routers first. */
+#define RRS_DONT_REMOVE_OLD 2
+STATIC int router_rebuild_store(int flags, desc_store_t *store);
+STATIC int desc_store_run_fixups(desc_store_t *store, int max);
+
 MOCK_DECL(int, router_descriptor_is_older_than, (const routerinfo_t *router,
                                                  int seconds));
 MOCK_DECL(STATIC was_router_added_t, extrainfo_insert,
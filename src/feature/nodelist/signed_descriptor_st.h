@@ -55,6 +55,9 @@ struct signed_descriptor_t {
   unsigned int extrainfo_is_bogus : 1;
   /* If true, we are willing to transmit this item unencrypted. */
   unsigned int send_unencrypted : 1;
+  /* If saved_location is SAVED_IN_CACHE: the mmap_parity of the store when
+   * we last pointed this item into its mmap. */
+  unsigned int store_parity : 1;
 };
 
 #endif
@@ -88,7 +88,7 @@ connection_ext_or_transition(or_connection_t *conn)
 {
   tor_assert(conn->base_.type == CONN_TYPE_EXT_OR);
 
-  conn->base_.type = CONN_TYPE_OR;
+  connection_set_type(TO_CONN(conn), CONN_TYPE_OR);
   TO_CONN(conn)->state = 0; // set the state to a neutral value
   control_event_or_conn_status(conn, OR_CONN_EVENT_NEW, 0);
   connection_tls_start_handshake(conn, 1);
@@ -36,6 +36,8 @@
 
 #include "core/or/or_circuit_st.h"
 
+#include "tor_queue.h"
+
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
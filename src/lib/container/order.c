@@ -46,3 +46,80 @@ IMPLEMENT_ORDER_FUNC(find_nth_double, double)
 IMPLEMENT_ORDER_FUNC(find_nth_uint32, uint32_t)
 IMPLEMENT_ORDER_FUNC(find_nth_int32, int32_t)
 IMPLEMENT_ORDER_FUNC(find_nth_long, long)
+
+/** Ranges of at most this many elements get insertion-sorted by the
+ * select_nth_FOO functions, rather than partitioned again. */
+#define SELECT_INSERTION_SORT_MAX 16
+
+/** Declare a function called <b>funcname</b> that acts as a select_nth_FOO
+ * function for an array of type <b>elt_t</b>*.  It uses the comparison
+ * function that IMPLEMENT_ORDER_FUNC declared for <b>elt_t</b>.
+ *
+ * This is an introselect: a quickselect with median-of-three pivots, which
+ * takes O(n) time on nearly every input.  If the partitions keep coming out
+ * lopsided, it gives up and sorts whatever range it has left, so that the
+ * worst case is O(n log n) rather than O(n^2). */
+#define IMPLEMENT_SELECT_FUNC(funcname, elt_t)                  \
+  elt_t                                                         \
+  funcname(elt_t *array, int n_elements, int nth)               \
+  {                                                             \
+    int lo = 0, hi = n_elements - 1, budget = 0, k;             \
+    elt_t tmp, pivot;                                           \
+    tor_assert(nth >= 0);                                       \
+    tor_assert(nth < n_elements);                               \
+    for (k = n_elements; k > 1; k >>= 1)                        \
+      budget += 2;                                              \
+    while (hi - lo >= SELECT_INSERTION_SORT_MAX) {              \
+      if (budget-- == 0) {                                      \
+        qsort(array + lo, hi - lo + 1, sizeof(elt_t),           \
+              _cmp_ ## elt_t);                                  \
+        return array[nth];                                      \
+      }                                                         \
+      int mid = lo + (hi - lo) / 2, i = lo, j = hi;             \
+      /* Sort array[lo], array[mid], and array[hi], so that the \
+       * partition loops below can't run off either end. */     \
+      if (array[mid] < array[lo]) {                             \
+        tmp = array[mid]; array[mid] = array[lo]; array[lo] = tmp; \
+      }                                                         \
+      if (array[hi] < array[lo]) {                              \
+        tmp = array[hi]; array[hi] = array[lo]; array[lo] = tmp; \
+      }                                                         \
+      if (array[hi] < array[mid]) {                             \
+        tmp = array[hi]; array[hi] = array[mid]; array[mid] = tmp; \
+      }                                                         \
+      pivot = array[mid];                                       \
+      while (i <= j) {                                          \
+        while (array[i] < pivot)                                \
+          ++i;                                                  \
+        while (pivot < array[j])                                \
+          --j;                                                  \
+        if (i <= j) {                                           \
+          tmp = array[i]; array[i] = array[j]; array[j] = tmp;  \
+          ++i;                                                  \
+          --j;                                                  \
+        }                                                       \
+      }                                                         \
+      /* Now array[lo..j] <= pivot <= array[i..hi], and anything \
+       * between j and i is equal to the pivot. */              \
+      if (nth <= j)                                             \
+        hi = j;                                                 \
+      else if (nth >= i)                                        \
+        lo = i;                                                 \
+      else                                                      \
+        return array[nth];                                      \
+    }                                                           \
+    for (int i = lo + 1; i <= hi; ++i) {                        \
+      tmp = array[i];                                           \
+      for (k = i; k > lo && tmp < array[k-1]; --k)              \
+        array[k] = array[k-1];                                  \
+      array[k] = tmp;                                           \
+    }                                                           \
+    return array[nth];                                          \
+  }
+
+IMPLEMENT_SELECT_FUNC(select_nth_int, int)
+IMPLEMENT_SELECT_FUNC(select_nth_time, time_t)
+IMPLEMENT_SELECT_FUNC(select_nth_double, double)
+IMPLEMENT_SELECT_FUNC(select_nth_uint32, uint32_t)
+IMPLEMENT_SELECT_FUNC(select_nth_int32, int32_t)
+IMPLEMENT_SELECT_FUNC(select_nth_long, long)
@@ -25,6 +25,21 @@ double find_nth_double(double *array, int n_elements, int nth);
 int32_t find_nth_int32(int32_t *array, int n_elements, int nth);
 uint32_t find_nth_uint32(uint32_t *array, int n_elements, int nth);
 long find_nth_long(long *array, int n_elements, int nth);
+
+/* These functions also return the <b>nth</b> lowest element of
+ * <b>array</b>, but instead of sorting the array, they only partition it:
+ * afterwards, array[nth] holds the element they returned, every element
+ * before it is no higher, and every element after it is no lower.  They run
+ * in linear time on nearly every input, so use them rather than find_nth_FOO
+ * on large arrays.  To find several order statistics of one array, find
+ * them from lowest to highest, passing only the part of the array above the
+ * last one that you found. */
+int select_nth_int(int *array, int n_elements, int nth);
+time_t select_nth_time(time_t *array, int n_elements, int nth);
+double select_nth_double(double *array, int n_elements, int nth);
+int32_t select_nth_int32(int32_t *array, int n_elements, int nth);
+uint32_t select_nth_uint32(uint32_t *array, int n_elements, int nth);
+long select_nth_long(long *array, int n_elements, int nth);
 static inline int
 median_int(int *array, int n_elements)
 {
@@ -793,6 +793,17 @@ smartlist_pqueue_remove(smartlist_t *sl,
     sl->list[idx] = sl->list[sl->num_used];
     sl->list[sl->num_used] = NULL;
     UPDATE_IDX(idx);
+    /* The item we moved came from another subtree, so it may be smaller
+     * than its new parent as well as greater than its new children. */
+    while (idx && compare(sl->list[idx], sl->list[PARENT(idx)]) < 0) {
+      int parent = PARENT(idx);
+      void *tmp = sl->list[parent];
+      sl->list[parent] = sl->list[idx];
+      sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
+      idx = parent;
+    }
     smartlist_heapify(sl, compare, idx_field_offset, idx);
   }
 }
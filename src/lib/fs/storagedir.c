@@ -37,6 +37,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -224,6 +227,23 @@ storage_dir_map(storage_dir_t *d, const char *fname)
   return result;
 }
 
+/** Open a specified file within <b>d</b> for reading, and return a file
+ * descriptor for it.
+ *
+ * On failure, return -1 and set errno as for open(). */
+int
+storage_dir_open(storage_dir_t *d, const char *fname)
+{
+  char *path = NULL;
+  tor_asprintf(&path, "%s/%s", d->directory, fname);
+  int fd = tor_open_cloexec(path, O_RDONLY, 0);
+  int errval = errno;
+  tor_free(path);
+  if (fd < 0)
+    errno = errval;
+  return fd;
+}
+
 /** Read a file within <b>d</b> into a newly allocated buffer.  Set
  * *<b>sz_out</b> to its size. */
 uint8_t *
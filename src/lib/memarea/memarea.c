@@ -271,11 +271,12 @@ memarea_strdup(memarea_t *area, const char *s)
 char *
 memarea_strndup(memarea_t *area, const char *s, size_t n)
 {
-  size_t ln = 0;
+  size_t ln;
   char *result;
   tor_assert(n < SIZE_T_CEILING);
-  for (ln = 0; ln < n && s[ln]; ++ln)
-    ;
+  /* memchr() is usually much faster than a byte-at-a-time loop. */
+  const char *nul = memchr(s, '\0', n);
+  ln = nul ? (size_t)(nul - s) : n;
   result = memarea_alloc(area, ln+1);
   memcpy(result, s, ln);
   result[ln]='\0';
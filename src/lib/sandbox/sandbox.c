@@ -216,6 +216,9 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
     SCMP_SYS(sched_yield),
+#endif
+#ifdef __NR_sendfile
+    SCMP_SYS(sendfile),
 #endif
     SCMP_SYS(sendmsg),
     SCMP_SYS(set_robust_list),
@@ -10,6 +10,7 @@
 
 #include "orconfig.h"
 
+#define TOR_CHANNEL_INTERNAL_
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
@@ -22,22 +23,60 @@
 #include <openssl/obj_mac.h>
 #endif
 
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/relay.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "feature/dirauth/bwauth.h"
+#include "feature/dirauth/dirvote.h"
 #include "feature/dircommon/consdiff.h"
+#include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/routerparse.h"
+#include "feature/dirparse/signing.h"
+#include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/compress/compress.h"
+#include "lib/container/buffers.h"
+#include "lib/container/order.h"
+#include "lib/fs/files.h"
+#include "lib/net/buffers_net.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/dirauth/vote_microdesc_hash_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/networkstatus_voter_info_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/vote_routerstatus_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
 static inline uint64_t
@@ -551,6 +590,1064 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Run circuit ID lookup benchmarks: replay cells that arrive interleaved
+ * across many circuits on a handful of channels. */
+static void
+bench_circid_lookup(void)
+{
+  const int n_chans = 8;
+  const int circs_per_chan = 512;
+  const int n_cells = 1<<16;
+  const int iters = 64;
+  channel_t **chans = tor_calloc(n_chans, sizeof(channel_t *));
+  or_circuit_t **circs = tor_calloc(n_chans * circs_per_chan,
+                                    sizeof(or_circuit_t *));
+  int *schedule = tor_calloc(n_cells, sizeof(int));
+  uint64_t start, end, hits = 0, misses = 0;
+  int i, j, n = 0;
+
+  for (i = 0; i < n_chans; ++i) {
+    chans[i] = tor_malloc_zero(sizeof(channel_t));
+    channel_init(chans[i]);
+    chans[i]->cmux = circuitmux_alloc();
+    circuitmux_set_policy(chans[i]->cmux, &ewma_policy);
+    for (j = 0; j < circs_per_chan; ++j) {
+      circid_t id;
+      do {
+        id = 1 + crypto_rand_int(0x7ffffffe);
+      } while (circuit_id_in_use_on_channel(id, chans[i]));
+      circs[i*circs_per_chan + j] = or_circuit_new(id, chans[i]);
+    }
+  }
+
+  /* Cells tend to arrive in short bursts on the same circuit. */
+  for (i = 0; i < n_cells; ) {
+    int which = crypto_rand_int(n_chans * circs_per_chan);
+    int burst = 1 + crypto_rand_int(4);
+    for (j = 0; j < burst && i < n_cells; ++j)
+      schedule[i++] = which;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    for (j = 0; j < n_cells; ++j) {
+      or_circuit_t *c = circs[schedule[j]];
+      n += circuit_get_by_circid_channel(c->p_circ_id, c->p_chan) != NULL;
+    }
+  }
+  end = perftime();
+
+  for (i = 0; i < n_chans; ++i) {
+    hits += chans[i]->n_circid_cache_hits;
+    misses += chans[i]->n_circid_cache_misses;
+  }
+  printf("circuit_get_by_circid_channel: %.2f ns per cell "
+         "(%d circuits on %d channels)\n",
+         NANOCOUNT(start, end, iters*n_cells),
+         n_chans*circs_per_chan, n_chans);
+  printf("Cache hit rate: %.2f%%\n",
+         100.0 * hits / (double)(hits + misses));
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Found == %d\n", n);
+
+  circuit_free_all();
+  for (i = 0; i < n_chans; ++i) {
+    circuitmux_free(chans[i]->cmux);
+    tor_free(chans[i]);
+  }
+  tor_free(chans);
+  tor_free(circs);
+  tor_free(schedule);
+}
+
+static void
+bench_cell_queue(void)
+{
+  const int bursts[] = { 1, 8, 64, 512 };
+  const int cells_per_size = 1<<18;
+  cell_queue_t queue;
+  cell_t cell;
+  uint64_t start, end;
+  unsigned b;
+  int i, j, n = 0;
+
+  memset(&cell, 0, sizeof(cell));
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+  cell_queue_init(&queue);
+
+  for (b = 0; b < ARRAY_LENGTH(bursts); ++b) {
+    const int burst = bursts[b];
+    const int iters = cells_per_size / burst;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (j = 0; j < burst; ++j)
+        cell_queue_append_packed_copy(NULL, &queue, 0, &cell, 1, 0);
+      while (queue.n) {
+        n += cell_queue_peek(&queue)->body[5];
+        cell_queue_drop_first(&queue);
+      }
+    }
+    end = perftime();
+    printf("Queue and flush bursts of %d cells: %.2f ns per cell\n",
+           burst, NANOCOUNT(start, end, iters*burst));
+  }
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Sum == %d\n", n);
+
+  cell_queue_clear(&queue);
+}
+
+/** Helper for bench_consdiff: sort 20-byte identities. */
+static int
+compare_ids_(const void **a, const void **b)
+{
+  return fast_memcmp(*a, *b, DIGEST_LEN);
+}
+
+/** An identity digest for the authority that signed our fake consensuses. */
+#define BENCH_HEX_ID "0123456789ABCDEF0123456789ABCDEF01234567"
+
+/** Helper for bench_consdiff: return a newly allocated fake consensus body
+ * with one router entry for each identity in <b>ids</b>.  About a fifth of
+ * the entries get a bandwidth that depends on <b>version</b>. */
+static char *
+bench_fake_consensus(const smartlist_t *ids, int version)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+
+  smartlist_add_strdup(chunks, "network-status-version 3\n"
+                       "vote-status consensus\n"
+                       "consensus-method 28\n"
+                       "valid-after 2018-11-22 06:00:00\n"
+                       "fresh-until 2018-11-22 07:00:00\n"
+                       "valid-until 2018-11-22 09:00:00\n"
+                       "voting-delay 300 300\n"
+                       "known-flags Fast Guard Running Stable V2Dir Valid\n"
+                       "dir-source auth " BENCH_HEX_ID " 192.0.2.1 "
+                       "192.0.2.1 80 443\n"
+                       "contact auth@example.com\n"
+                       "vote-digest " BENCH_HEX_ID "\n");
+  SMARTLIST_FOREACH_BEGIN(ids, const uint8_t *, id) {
+    char id_b64[BASE64_DIGEST_LEN+1];
+    digest_to_base64(id_b64, (const char *)id);
+    smartlist_add_asprintf(chunks,
+        "r relay%02x%02x %s AAAAAAAAAAAAAAAAAAAAAAAAAAA 2018-11-22 06:00:00 "
+        "10.0.%d.%d 9001 0\n"
+        "s Fast Guard Running Stable V2Dir Valid\n"
+        "v Tor 0.3.4.9\n"
+        "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 "
+        "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+        "w Bandwidth=%d\n"
+        "p reject 1-65535\n",
+        id[0], id[1], id_b64, id[2], id[3],
+        1000 + id[4] + (id[5] < 51 ? version * 17 : 0));
+  } SMARTLIST_FOREACH_END(id);
+  smartlist_add_strdup(chunks, "directory-footer\n"
+                       "directory-signature " BENCH_HEX_ID " "
+                       BENCH_HEX_ID "\n"
+                       "-----BEGIN SIGNATURE-----\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "-----END SIGNATURE-----\n");
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Helper for bench_consdiff: time diffs between two fake consensuses with
+ * <b>n_routers</b> routers each.  The second consensus drops
+ * <b>pct_replaced</b> percent of the routers and adds about as many new
+ * ones, and changes the bandwidth of a fifth of them. */
+static void
+bench_consdiff_pair(int n_routers, int pct_replaced, int iters)
+{
+  smartlist_t *ids1 = smartlist_new(), *ids2 = smartlist_new();
+  smartlist_t *new_ids = smartlist_new();
+  char *cons1, *cons2, *diff = NULL;
+  uint64_t start, end;
+  int i;
+
+  for (i = 0; i < n_routers; ++i) {
+    char *id = tor_malloc(DIGEST_LEN);
+    crypto_rand(id, DIGEST_LEN);
+    smartlist_add(ids1, id);
+    if (crypto_rand_int(100) >= pct_replaced) {
+      smartlist_add(ids2, id);
+    } else {
+      id = tor_malloc(DIGEST_LEN);
+      crypto_rand(id, DIGEST_LEN);
+      smartlist_add(ids2, id);
+      smartlist_add(new_ids, id);
+    }
+  }
+  smartlist_sort(ids1, compare_ids_);
+  smartlist_sort(ids2, compare_ids_);
+  cons1 = bench_fake_consensus(ids1, 1);
+  cons2 = bench_fake_consensus(ids2, 2);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(diff);
+    diff = consensus_diff_generate(cons1, cons2);
+  }
+  end = perftime();
+  printf("Diff consensuses with %d routers, %d%% replaced: "
+         "%.2f msec per diff (%d bytes)\n",
+         n_routers, pct_replaced, NANOCOUNT(start, end, iters) / 1e6,
+         diff ? (int)strlen(diff) : -1);
+
+  tor_free(diff);
+  tor_free(cons1);
+  tor_free(cons2);
+  SMARTLIST_FOREACH(ids1, char *, id, tor_free(id));
+  SMARTLIST_FOREACH(new_ids, char *, id, tor_free(id));
+  smartlist_free(ids1);
+  smartlist_free(ids2);
+  smartlist_free(new_ids);
+}
+
+/** Helper for bench_consdiff: time diffs across three fake consensuses with
+ * <b>n_routers</b> routers each, replacing <b>pct_replaced</b> percent of
+ * the routers from each to the next, when computed directly and when
+ * composed from the diffs between consecutive consensuses. */
+static void
+bench_consdiff_compose(int n_routers, int pct_replaced, int iters)
+{
+  smartlist_t *ids[3];
+  smartlist_t *all_ids = smartlist_new();
+  char *cons[3], *diff12, *diff23, *diff = NULL;
+  consensus_diff_target_t *target;
+  uint64_t start, end;
+  int i, v;
+
+  for (v = 0; v < 3; ++v) {
+    ids[v] = smartlist_new();
+    for (i = 0; i < n_routers; ++i) {
+      char *id;
+      if (v == 0 || crypto_rand_int(100) < pct_replaced) {
+        id = tor_malloc(DIGEST_LEN);
+        crypto_rand(id, DIGEST_LEN);
+        smartlist_add(all_ids, id);
+      } else {
+        id = smartlist_get(ids[v-1], i);
+      }
+      smartlist_add(ids[v], id);
+    }
+  }
+  for (v = 0; v < 3; ++v) {
+    smartlist_t *sorted = smartlist_new();
+    smartlist_add_all(sorted, ids[v]);
+    smartlist_sort(sorted, compare_ids_);
+    cons[v] = bench_fake_consensus(sorted, v + 1);
+    smartlist_free(sorted);
+  }
+  diff12 = consensus_diff_generate(cons[0], cons[1]);
+  diff23 = consensus_diff_generate(cons[1], cons[2]);
+  target = consensus_diff_target_new(tor_strdup(cons[2]));
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(diff);
+    diff = consensus_diff_generate_to_target(cons[0], target);
+  }
+  end = perftime();
+  printf("Diff across 3 consensuses with %d routers, %d%% replaced each: "
+         "%.2f msec per direct diff (%d bytes)\n",
+         n_routers, pct_replaced, NANOCOUNT(start, end, iters) / 1e6,
+         diff ? (int)strlen(diff) : -1);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(diff);
+    diff = consensus_diff_compose_to_target(cons[0], diff12, diff23, target);
+  }
+  end = perftime();
+  printf("Diff across 3 consensuses with %d routers, %d%% replaced each: "
+         "%.2f msec per composed diff (%d bytes)\n",
+         n_routers, pct_replaced, NANOCOUNT(start, end, iters) / 1e6,
+         diff ? (int)strlen(diff) : -1);
+
+  tor_free(diff);
+  tor_free(diff12);
+  tor_free(diff23);
+  consensus_diff_target_free(target);
+  for (v = 0; v < 3; ++v) {
+    tor_free(cons[v]);
+    smartlist_free(ids[v]);
+  }
+  SMARTLIST_FOREACH(all_ids, char *, id, tor_free(id));
+  smartlist_free(all_ids);
+}
+
+static void
+bench_consdiff(void)
+{
+  /* A typical hour-to-hour change. */
+  bench_consdiff_pair(7000, 2, 10);
+  /* No router identities in common, so the whole consensus is one big
+   * slice for calc_changes. */
+  bench_consdiff_pair(1000, 100, 1);
+  /* Two typical hour-to-hour changes in a row. */
+  bench_consdiff_compose(7000, 2, 10);
+}
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+/** Send <b>len</b> bytes of <b>body</b> to <b>sock</b> the way a directory
+ * cache spools a consensus cache entry: a chunk at a time, through
+ * <b>buf</b>. */
+static void
+bench_spool_via_buf(tor_socket_t sock, buf_t *buf,
+                    const char *body, size_t len)
+{
+  size_t off = 0, flushlen = 0;
+  while (off < len || buf_datalen(buf)) {
+    while (off < len && buf_datalen(buf) < 16384) {
+      size_t n = MIN(8192, len - off);
+      buf_add(buf, body + off, n);
+      flushlen += n;
+      off += n;
+    }
+    if (buf_flush_to_socket(buf, sock, buf_datalen(buf), &flushlen) < 0)
+      tor_assert_unreached();
+  }
+}
+
+/** Send <b>len</b> bytes from the start of <b>fd</b> to <b>sock</b> with
+ * sendfile(). */
+static void
+bench_spool_via_sendfile(tor_socket_t sock, int fd, size_t len)
+{
+  off_t off = 0;
+  while ((size_t)off < len) {
+    if (sendfile(sock, fd, &off, len - (size_t)off) <= 0)
+      tor_assert_unreached();
+  }
+}
+
+/** Serve a consensus-sized object <b>iters</b> times over a local socket
+ * to a client that discards it, by copying it through a buffer and by
+ * sending it straight from its file. */
+static void
+bench_dirserv_spool_impl(size_t len, int iters)
+{
+  char fname[] = "/tmp/tor-bench-spool-XXXXXX";
+  tor_socket_t fds[2];
+  char *body = tor_malloc(len);
+  buf_t *buf = buf_new();
+  monotime_t mstart, mend;
+  uint64_t start, end;
+  int fd, i;
+  pid_t pid;
+
+  crypto_rand(body, len);
+  fd = mkstemp(fname);
+  tor_assert(fd >= 0);
+  unlink(fname);
+  tor_assert(write_all_to_fd(fd, body, len) == (ssize_t)len);
+
+  tor_assert(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  pid = fork();
+  tor_assert(pid >= 0);
+  if (pid == 0) {
+    /* The client: read everything, and throw it away. */
+    char tmp[65536];
+    tor_close_socket(fds[0]);
+    while (tor_socket_recv(fds[1], tmp, sizeof(tmp), 0) > 0)
+      ;
+    _exit(0);
+  }
+  tor_close_socket(fds[1]);
+
+  reset_perftime();
+  monotime_get(&mstart);
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    bench_spool_via_buf(fds[0], buf, body, len);
+  end = perftime();
+  monotime_get(&mend);
+  printf("Serve %d x %d KB via buffers: %.2f msec CPU per fetch, "
+         "%.1f MB/sec\n", iters, (int)(len >> 10),
+         NANOCOUNT(start, end, iters) / 1e6,
+         ((double)len) * iters / monotime_diff_usec(&mstart, &mend));
+
+  reset_perftime();
+  monotime_get(&mstart);
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    bench_spool_via_sendfile(fds[0], fd, len);
+  end = perftime();
+  monotime_get(&mend);
+  printf("Serve %d x %d KB via sendfile: %.2f msec CPU per fetch, "
+         "%.1f MB/sec\n", iters, (int)(len >> 10),
+         NANOCOUNT(start, end, iters) / 1e6,
+         ((double)len) * iters / monotime_diff_usec(&mstart, &mend));
+
+  tor_close_socket(fds[0]);
+  waitpid(pid, NULL, 0);
+  close(fd);
+  buf_free(buf);
+  tor_free(body);
+}
+#endif /* defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) */
+
+static void
+bench_dirserv_spool(void)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  /* About the size of a compressed consensus, then of an uncompressed
+   * one. */
+  bench_dirserv_spool_impl(600 * 1024, 1000);
+  bench_dirserv_spool_impl(2500 * 1024, 1000);
+#else
+  puts("sendfile() is not available.");
+#endif
+}
+
+/** Helper for bench_dirparse: return a newly allocated string holding
+ * <b>n</b> router descriptors, all signed by <b>identity_key</b>. */
+static char *
+bench_fake_routerdescs(int n, crypto_pk_t *identity_key,
+                       const char *identity_pem, const char *onion_pem)
+{
+  smartlist_t *chunks = smartlist_new();
+  char fp[HEX_DIGEST_LEN+1];
+  char *result;
+  int i;
+
+  base16_encode(fp, sizeof(fp), "0123456789abcdefghij", DIGEST_LEN);
+  for (i = 0; i < n; ++i) {
+    char digest[DIGEST_LEN];
+    char *body;
+    size_t len;
+    tor_asprintf(&body,
+        "router relay%d 10.0.%d.%d 9001 0 0\n"
+        "platform Tor 0.3.5.5-alpha on Linux\n"
+        "proto Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 "
+        "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+        "published 2018-11-22 05:%02d:00\n"
+        "uptime %d\n"
+        "bandwidth 1073741824 1073741824 %d\n"
+        "extra-info-digest %s\n"
+        "onion-key\n%s"
+        "signing-key\n%s"
+        "family $%s\n"
+        "hidden-service-dir\n"
+        "contact relay operator <nobody at example dot com>\n"
+        "ntor-onion-key Rhh4f+TMsgAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=\n"
+        "reject *:25\n"
+        "reject *:119\n"
+        "accept *:*\n"
+        "tunnelled-dir-server\n"
+        "router-signature\n",
+        i, (i >> 8) & 255, i & 255, i % 60, 1000 + i, 5000 + i, fp,
+        onion_pem, identity_pem, fp);
+    /* Leave room for the signature. */
+    len = strlen(body) + 256;
+    body = tor_realloc(body, len);
+    if (router_get_router_hash(body, strlen(body), digest) < 0 ||
+        router_append_dirobj_signature(body, len, digest, DIGEST_LEN,
+                                       identity_key) < 0) {
+      puts("Couldn't sign router descriptor");
+    }
+    smartlist_add(chunks, body);
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Helper for bench_dirparse: return a newly allocated string holding
+ * <b>n</b> microdescriptors. */
+static char *
+bench_fake_microdescs(int n, const char *onion_pem)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < n; ++i) {
+    smartlist_add_asprintf(chunks,
+        "onion-key\n%s"
+        "ntor-onion-key Rhh4f+TMsg%04dAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=\n"
+        "family $0123456789ABCDEF0123456789ABCDEF01234567\n"
+        "p accept 80,443\n"
+        "id ed25519 %04dAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n",
+        onion_pem, i % 10000, i % 10000);
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+bench_dirparse(void)
+{
+  const int n_routers = 7000, n_mds = 1000, n_descs = 200;
+  crypto_pk_t *identity_key = crypto_pk_new();
+  crypto_pk_t *onion_key = crypto_pk_new();
+  smartlist_t *ids = smartlist_new();
+  smartlist_t *parsed = smartlist_new();
+  char *identity_pem = NULL, *onion_pem = NULL;
+  char *consensus = NULL, *mds = NULL, *descs = NULL;
+  size_t pem_len;
+  uint64_t start, end;
+  int i, iters, n_ok = 0;
+
+  if (crypto_pk_generate_key(identity_key) < 0 ||
+      crypto_pk_generate_key(onion_key) < 0 ||
+      crypto_pk_write_public_key_to_string(identity_key, &identity_pem,
+                                           &pem_len) < 0 ||
+      crypto_pk_write_public_key_to_string(onion_key, &onion_pem,
+                                           &pem_len) < 0) {
+    puts("Couldn't make keys");
+    goto done;
+  }
+
+  for (i = 0; i < n_routers; ++i) {
+    char *id = tor_malloc(DIGEST_LEN);
+    crypto_rand(id, DIGEST_LEN);
+    smartlist_add(ids, id);
+  }
+  smartlist_sort(ids, compare_ids_);
+  consensus = bench_fake_consensus(ids, 1);
+  mds = bench_fake_microdescs(n_mds, onion_pem);
+  descs = bench_fake_routerdescs(n_descs, identity_key,
+                                 identity_pem, onion_pem);
+
+  iters = 20;
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(consensus, NULL,
+                                           NS_TYPE_CONSENSUS);
+    if (ns && smartlist_len(ns->routerstatus_list) == n_routers)
+      ++n_ok;
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("Parse a consensus with %d routers: %.2f msec per consensus, "
+         "%.0f consensuses/sec (%d/%d ok)\n",
+         n_routers, NANOCOUNT(start, end, iters) / 1e6,
+         1e9 / NANOCOUNT(start, end, iters), n_ok, iters);
+
+  iters = 10;
+  n_ok = 0;
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    smartlist_t *lst = microdescs_parse_from_string(mds, NULL, 0,
+                                                    SAVED_NOWHERE, NULL);
+    n_ok += smartlist_len(lst);
+    SMARTLIST_FOREACH(lst, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(lst);
+  }
+  end = perftime();
+  printf("Parse %d microdescriptors: %.2f usec per microdescriptor, "
+         "%.0f microdescriptors/sec (%d/%d ok)\n",
+         n_mds, NANOCOUNT(start, end, iters * n_mds) / 1e3,
+         1e9 / NANOCOUNT(start, end, iters * n_mds), n_ok, iters * n_mds);
+
+  /* Loading the microdescriptor cache only finds the boundaries of each
+   * body; the bodies are parsed when a node first uses them. */
+  iters = 10;
+  n_ok = 0;
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    smartlist_t *lst = microdescs_parse_from_string(mds, NULL, 1,
+                                                    SAVED_IN_CACHE, NULL);
+    n_ok += smartlist_len(lst);
+    SMARTLIST_FOREACH(lst, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(lst);
+  }
+  end = perftime();
+  printf("Load %d cached microdescriptors: %.2f usec per microdescriptor, "
+         "%.0f microdescriptors/sec (%d/%d ok)\n",
+         n_mds, NANOCOUNT(start, end, iters * n_mds) / 1e3,
+         1e9 / NANOCOUNT(start, end, iters * n_mds), n_ok, iters * n_mds);
+
+  iters = 5;
+  n_ok = 0;
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const char *cp = descs;
+    router_parse_list_from_string(&cp, NULL, parsed, SAVED_NOWHERE,
+                                  0, 0, NULL, NULL);
+    n_ok += smartlist_len(parsed);
+    SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(parsed);
+  }
+  end = perftime();
+  printf("Parse %d router descriptors: %.2f usec per descriptor, "
+         "%.0f descriptors/sec (%d/%d ok)\n",
+         n_descs, NANOCOUNT(start, end, iters * n_descs) / 1e3,
+         1e9 / NANOCOUNT(start, end, iters * n_descs), n_ok,
+         iters * n_descs);
+
+ done:
+  tor_free(consensus);
+  tor_free(mds);
+  tor_free(descs);
+  tor_free(identity_pem);
+  tor_free(onion_pem);
+  crypto_pk_free(identity_key);
+  crypto_pk_free(onion_key);
+  SMARTLIST_FOREACH(ids, char *, id, tor_free(id));
+  smartlist_free(ids);
+  smartlist_free(parsed);
+}
+
+#ifdef HAVE_MODULE_DIRAUTH
+/** Helper for bench_dirvote: return a new vote from the authority whose
+ * identity digest is <b>auth_id</b>, listing one router for each identity
+ * in <b>ids</b>. Each authority gives slightly different bandwidths and
+ * versions for the routers, so that the consensus has something to
+ * compute. */
+static networkstatus_t *
+bench_fake_vote(const smartlist_t *ids, const char *auth_id, int auth_idx,
+                time_t now)
+{
+  networkstatus_t *vote = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_voter_info_t *voter;
+
+  vote->type = NS_TYPE_VOTE;
+  vote->published = now;
+  vote->valid_after = now+1000;
+  vote->fresh_until = now+2000;
+  vote->valid_until = now+3000;
+  vote->vote_seconds = 100;
+  vote->dist_seconds = 200;
+  vote->supported_methods = smartlist_new();
+  smartlist_split_string(vote->supported_methods, "25 26 27 28", NULL, 0, -1);
+  vote->client_versions = tor_strdup("0.3.4.9,0.3.5.5-alpha");
+  vote->server_versions = tor_strdup("0.3.4.9,0.3.5.5-alpha");
+  vote->known_flags = smartlist_new();
+  smartlist_split_string(vote->known_flags,
+                         "Exit Fast Guard Running Stable V2Dir Valid",
+                         NULL, 0, -1);
+  vote->net_params = smartlist_new();
+  smartlist_split_string(vote->net_params, "circwindow=1000", NULL, 0, -1);
+
+  voter = tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  tor_asprintf(&voter->nickname, "auth%d", auth_idx);
+  voter->address = tor_strdup("192.0.2.1");
+  voter->addr = 0xc0000201;
+  voter->dir_port = 80;
+  voter->or_port = 443;
+  voter->contact = tor_strdup("auth@example.com");
+  memcpy(voter->identity_digest, auth_id, DIGEST_LEN);
+  crypto_rand(voter->vote_digest, DIGEST_LEN);
+  vote->voters = smartlist_new();
+  smartlist_add(vote->voters, voter);
+
+  vote->routerstatus_list = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(ids, const uint8_t *, id) {
+    vote_routerstatus_t *vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    routerstatus_t *rs = &vrs->status;
+    char md_digest[DIGEST256_LEN];
+    char md_b64[BASE64_DIGEST256_LEN+1];
+
+    tor_snprintf(rs->nickname, sizeof(rs->nickname), "relay%02x%02x",
+                 id[0], id[1]);
+    memcpy(rs->identity_digest, id, DIGEST_LEN);
+    memcpy(rs->descriptor_digest, id, DIGEST_LEN);
+    rs->published_on = now - 600;
+    rs->addr = 0x0a000000 | (id[2] << 8) | id[3];
+    rs->or_port = 9001;
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 1000 + id[4] + auth_idx;
+    if (auth_idx == 0) {
+      vrs->has_measured_bw = 1;
+      vrs->measured_bw_kb = 2000 + id[4];
+    }
+    /* Fast Guard Running Stable V2Dir Valid, and Exit for about a fifth of
+     * the routers. */
+    vrs->flags = 0x7e | (id[5] < 51 ? 1 : 0);
+    vrs->version = tor_strdup(auth_idx & 1 ? "Tor 0.3.4.9" :
+                              "Tor 0.3.5.5-alpha");
+    vrs->protocols = tor_strdup("Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 "
+                                "HSIntro=3-4 HSRend=1-2 Link=1-5 "
+                                "LinkAuth=1,3 Microdesc=1-2 Relay=1-2");
+    rs->has_exitsummary = 1;
+    rs->exitsummary = tor_strdup(id[5] < 51 ? "accept 80,443" :
+                                 "reject 1-65535");
+    crypto_digest256(md_digest, (const char *)id, DIGEST_LEN, DIGEST_SHA256);
+    digest256_to_base64(md_b64, md_digest);
+    vrs->microdesc = tor_malloc_zero(sizeof(vote_microdesc_hash_t));
+    tor_asprintf(&vrs->microdesc->microdesc_hash_line,
+                 "25,26,27,28 sha256=%s", md_b64);
+    smartlist_add(vote->routerstatus_list, vrs);
+  } SMARTLIST_FOREACH_END(id);
+
+  return vote;
+}
+
+static void
+bench_dirvote(void)
+{
+  const int n_routers = 7000, n_votes = 9;
+  const time_t now = time(NULL);
+  crypto_pk_t *identity_key = crypto_pk_new();
+  crypto_pk_t *signing_key = crypto_pk_new();
+  smartlist_t *ids = smartlist_new();
+  smartlist_t *votes = smartlist_new();
+  uint64_t start, end;
+  int i, iters, n_ok;
+
+  if (crypto_pk_generate_key(identity_key) < 0 ||
+      crypto_pk_generate_key(signing_key) < 0) {
+    puts("Couldn't make keys");
+    goto done;
+  }
+
+  for (i = 0; i < n_routers; ++i) {
+    char *id = tor_malloc(DIGEST_LEN);
+    crypto_rand(id, DIGEST_LEN);
+    smartlist_add(ids, id);
+  }
+  smartlist_sort(ids, compare_ids_);
+  for (i = 0; i < n_votes; ++i) {
+    char auth_id[DIGEST_LEN];
+    if (i == 0)
+      crypto_pk_get_digest(identity_key, auth_id);
+    else
+      crypto_rand(auth_id, DIGEST_LEN);
+    smartlist_add(votes, bench_fake_vote(ids, auth_id, i, now));
+  }
+
+  for (int flav = FLAV_NS; flav <= FLAV_MICRODESC; ++flav) {
+    iters = 3;
+    n_ok = 0;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      char *consensus =
+        networkstatus_compute_consensus(votes, n_votes, identity_key,
+                                        signing_key, NULL, NULL, flav);
+      if (consensus)
+        ++n_ok;
+      tor_free(consensus);
+    }
+    end = perftime();
+    printf("Compute a %s consensus from %d votes on %d routers: "
+           "%.2f msec per consensus (%d/%d ok)\n",
+           networkstatus_get_flavor_name(flav), n_votes, n_routers,
+           NANOCOUNT(start, end, iters) / 1e6, n_ok, iters);
+  }
+
+ done:
+  SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+  smartlist_free(votes);
+  SMARTLIST_FOREACH(ids, char *, id, tor_free(id));
+  smartlist_free(ids);
+  crypto_pk_free(identity_key);
+  crypto_pk_free(signing_key);
+}
+
+/** Helper for bench_bwauth: write a bandwidth file to <b>fname</b> with
+ * one measurement for each identity in <b>ids</b>. */
+static int
+bench_write_bwfile(const char *fname, const smartlist_t *ids, int version)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *body;
+  int r;
+
+  smartlist_add_asprintf(chunks, "%ld\n"
+                         "version=1.2.0\n"
+                         "software=bench\n"
+                         "=====\n", (long)time(NULL));
+  SMARTLIST_FOREACH_BEGIN(ids, const uint8_t *, id) {
+    char hex[HEX_DIGEST_LEN+1];
+    base16_encode(hex, sizeof(hex), (const char *)id, DIGEST_LEN);
+    smartlist_add_asprintf(chunks,
+        "bw=%d node_id=$%s nick=relay%02x%02x master_key_ed25519="
+        "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA time=2018-11-22T06:00:00 "
+        "success=10 error_circ=0 error_stream=0 error_misc=0\n",
+        1000 + id[4] + (id[5] < 51 ? version * 17 : 0), hex, id[0], id[1]);
+  } SMARTLIST_FOREACH_END(id);
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+  r = write_str_to_file(fname, body, 0);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(body);
+  return r;
+}
+
+static void
+bench_bwauth(void)
+{
+  const int n_relays = 100000;
+  char fname[] = "/tmp/tor-bench-bwfile-XXXXXX";
+  smartlist_t *ids = smartlist_new();
+  smartlist_t *routerstatuses = smartlist_new();
+  smartlist_t *headers = smartlist_new();
+  uint64_t start, end;
+  int fd, i, version, r;
+
+  fd = mkstemp(fname);
+  if (fd < 0) {
+    puts("Couldn't make a temporary file");
+    goto done;
+  }
+  close(fd);
+
+  for (i = 0; i < n_relays; ++i) {
+    vote_routerstatus_t *vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    crypto_rand(vrs->status.identity_digest, DIGEST_LEN);
+    smartlist_add(ids, vrs->status.identity_digest);
+    smartlist_add(routerstatuses, vrs);
+  }
+
+  /* The first file fills the measured bandwidth cache; the second one
+   * changes about a fifth of the measurements. */
+  for (version = 1; version <= 2; ++version) {
+    if (bench_write_bwfile(fname, ids, version) < 0) {
+      puts("Couldn't write the bandwidth file");
+      break;
+    }
+    reset_perftime();
+    start = perftime();
+    r = dirserv_read_measured_bandwidths(fname, routerstatuses, headers);
+    end = perftime();
+    printf("Read a bandwidth file with %d relays (%s cache): "
+           "%.2f msec, %.2f usec per relay%s\n",
+           n_relays, version == 1 ? "empty" : "full",
+           NANOCOUNT(start, end, 1) / 1e6,
+           NANOCOUNT(start, end, n_relays) / 1e3,
+           r < 0 ? " (failed)" : "");
+    SMARTLIST_FOREACH(headers, char *, cp, tor_free(cp));
+    smartlist_clear(headers);
+  }
+
+ done:
+  if (fd >= 0)
+    unlink(fname);
+  dirserv_clear_measured_bw_cache();
+  SMARTLIST_FOREACH(routerstatuses, vote_routerstatus_t *, vrs,
+                    vote_routerstatus_free(vrs));
+  smartlist_free(routerstatuses);
+  smartlist_free(ids);
+  smartlist_free(headers);
+}
+#endif /* defined(HAVE_MODULE_DIRAUTH) */
+
+/** Columns of synthetic per-relay values, as collected by
+ * dirserv_compute_performance_thresholds(). */
+typedef struct bench_threshold_cols_t {
+  uint32_t *uptimes;
+  uint32_t *bandwidths_kb;
+  double *mtbfs;
+  long *tks;
+  double *wfus;
+} bench_threshold_cols_t;
+
+/** Copy the first <b>n</b> values of every column in <b>src</b> into
+ * <b>dst</b>. */
+static void
+bench_threshold_cols_copy(bench_threshold_cols_t *dst,
+                          const bench_threshold_cols_t *src, int n)
+{
+  memcpy(dst->uptimes, src->uptimes, n * sizeof(uint32_t));
+  memcpy(dst->bandwidths_kb, src->bandwidths_kb, n * sizeof(uint32_t));
+  memcpy(dst->mtbfs, src->mtbfs, n * sizeof(double));
+  memcpy(dst->tks, src->tks, n * sizeof(long));
+  memcpy(dst->wfus, src->wfus, n * sizeof(double));
+}
+
+static void
+bench_flag_thresholds(void)
+{
+  const int n_relays = 50000, iters = 20;
+  const int eighth = n_relays/8, quarter = n_relays/4;
+  bench_threshold_cols_t orig, cols;
+  uint64_t start, end;
+  uint32_t sum_sort = 0, sum_select = 0;
+  int i, which;
+
+  orig.uptimes = tor_calloc(n_relays, sizeof(uint32_t));
+  orig.bandwidths_kb = tor_calloc(n_relays, sizeof(uint32_t));
+  orig.mtbfs = tor_calloc(n_relays, sizeof(double));
+  orig.tks = tor_calloc(n_relays, sizeof(long));
+  orig.wfus = tor_calloc(n_relays, sizeof(double));
+  cols.uptimes = tor_calloc(n_relays, sizeof(uint32_t));
+  cols.bandwidths_kb = tor_calloc(n_relays, sizeof(uint32_t));
+  cols.mtbfs = tor_calloc(n_relays, sizeof(double));
+  cols.tks = tor_calloc(n_relays, sizeof(long));
+  cols.wfus = tor_calloc(n_relays, sizeof(double));
+
+  for (i = 0; i < n_relays; ++i) {
+    orig.uptimes[i] = crypto_rand_int(90*86400);
+    /* Most relays are slow; a few are very fast. */
+    orig.bandwidths_kb[i] =
+      (crypto_rand_int(1000) + 1) * (crypto_rand_int(8) ? 20 : 500);
+    orig.mtbfs[i] = crypto_rand_double() * 30*86400;
+    orig.tks[i] = crypto_rand_int(60*86400);
+    orig.wfus[i] = crypto_rand_double();
+  }
+
+  for (which = 0; which < 2; ++which) {
+    reset_perftime();
+    start = perftime();
+    for (int iter = 0; iter < iters; ++iter) {
+      uint32_t r = 0;
+      double mtbf, wfu;
+      bench_threshold_cols_copy(&cols, &orig, n_relays);
+      if (which == 0) {
+        /* What dirserv_compute_performance_thresholds() used to do. */
+        r += median_uint32(cols.uptimes, n_relays);
+        mtbf = median_double(cols.mtbfs, n_relays);
+        r += find_nth_uint32(cols.bandwidths_kb, n_relays, eighth);
+        r += cols.bandwidths_kb[quarter];
+        r += third_quartile_uint32(cols.bandwidths_kb, n_relays);
+        r += (uint32_t) find_nth_long(cols.tks, n_relays, eighth);
+        wfu = median_double(cols.wfus, n_relays);
+        sum_sort += r + (uint32_t)mtbf + (uint32_t)(wfu * 1e6);
+      } else {
+        r += select_nth_uint32(cols.uptimes, n_relays, (n_relays-1)/2);
+        mtbf = select_nth_double(cols.mtbfs, n_relays, (n_relays-1)/2);
+        r += select_nth_uint32(cols.bandwidths_kb, n_relays, eighth);
+        r += select_nth_uint32(cols.bandwidths_kb + eighth,
+                               n_relays - eighth, quarter - eighth);
+        r += select_nth_uint32(cols.bandwidths_kb + quarter,
+                               n_relays - quarter,
+                               (n_relays*3)/4 - quarter);
+        r += (uint32_t) select_nth_long(cols.tks, n_relays, eighth);
+        wfu = select_nth_double(cols.wfus, n_relays, (n_relays-1)/2);
+        sum_select += r + (uint32_t)mtbf + (uint32_t)(wfu * 1e6);
+      }
+    }
+    end = perftime();
+    printf("Flag thresholds for %d relays, %s: %.2f msec\n",
+           n_relays, which == 0 ? "sorting" : "selecting",
+           NANOCOUNT(start, end, iters) / 1e6);
+  }
+  if (sum_sort != sum_select)
+    puts("The two ways of computing thresholds disagree!");
+
+  tor_free(orig.uptimes);
+  tor_free(orig.bandwidths_kb);
+  tor_free(orig.mtbfs);
+  tor_free(orig.tks);
+  tor_free(orig.wfus);
+  tor_free(cols.uptimes);
+  tor_free(cols.bandwidths_kb);
+  tor_free(cols.mtbfs);
+  tor_free(cols.tks);
+  tor_free(cols.wfus);
+}
+
+/** Choose a guard, a middle and an exit from the nodelist, as
+ * choose_good_*_server() would, never choosing a node in
+ * <b>pre_excluded</b>.  If <b>reweight</b> is true, throw away our
+ * weighted sampling tables before each hop, as if we had to weight every
+ * node for every choice. */
+static int
+bench_choose_path(int reweight, const smartlist_t *pre_excluded)
+{
+  static const router_crn_flags_t hop_flags[] = {
+    CRN_NEED_GUARD|CRN_NEED_UPTIME|CRN_NEED_CAPACITY,
+    CRN_NEED_CAPACITY,
+    CRN_NEED_CAPACITY|CRN_WEIGHT_AS_EXIT,
+  };
+  smartlist_t *excluded = smartlist_new();
+  unsigned hop;
+  int ok = 1;
+
+  if (pre_excluded)
+    smartlist_add_all(excluded, pre_excluded);
+  for (hop = 0; hop < ARRAY_LENGTH(hop_flags); ++hop) {
+    const node_t *node;
+    if (reweight)
+      node_select_nodelist_changed();
+    node = router_choose_random_node(excluded, NULL, hop_flags[hop]);
+    if (!node) {
+      ok = 0;
+      break;
+    }
+    smartlist_add(excluded, (void *)node);
+  }
+  smartlist_free(excluded);
+  return ok;
+}
+
+static void
+bench_path_selection(void)
+{
+  const int n_relays = 7000, n_circs = 20000;
+  smartlist_t *routers = smartlist_new();
+  smartlist_t *most_nodes = smartlist_new();
+  uint64_t start, end;
+  int i, which;
+
+  /* We have no way to install a consensus here, so give every relay a
+   * descriptor, and set its flags as a consensus would have. */
+  for (i = 0; i < n_relays; ++i) {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    node_t *node;
+    crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+    ri->addr = 0x0a000000 + i;
+    ri->or_port = 9001;
+    ri->onion_curve25519_pkey =
+      tor_malloc_zero(sizeof(curve25519_public_key_t));
+    crypto_rand((char *)ri->onion_curve25519_pkey->public_key,
+                CURVE25519_PUBKEY_LEN);
+    /* Most relays are slow; a few are very fast. */
+    ri->bandwidthrate = ri->bandwidthcapacity =
+      (crypto_rand_int(1000) + 1) * (crypto_rand_int(8) ? 20 : 500);
+    smartlist_add(routers, ri);
+
+    node = nodelist_set_routerinfo(ri, NULL);
+    node->is_running = node->is_valid = node->is_fast = 1;
+    node->is_stable = (i % 2) == 0;
+    node->is_possible_guard = (i % 3) == 0;
+    node->is_exit = (i % 4) == 0;
+    if (i % 50)
+      smartlist_add(most_nodes, node);
+  }
+  node_select_nodelist_changed();
+
+  for (which = 0; which < 3; ++which) {
+    static const char *descriptions[] = {
+      "reweighting every hop", "cached tables", "excluding 98% of relays",
+    };
+    const int n = which == 1 ? n_circs : n_circs / 20;
+    int n_ok = 0;
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n; ++i)
+      n_ok += bench_choose_path(which == 0, which == 2 ? most_nodes : NULL);
+    end = perftime();
+    printf("Path selection over %d relays, %s: %.2f usec/circuit "
+           "(%.0f circuits/sec)\n", n_relays, descriptions[which],
+           NANOCOUNT(start, end, n) / 1e3,
+           1e9 / NANOCOUNT(start, end, n));
+    if (n_ok != n)
+      printf("  ... but only found %d paths!\n", n_ok);
+  }
+
+  nodelist_free_all();
+  SMARTLIST_FOREACH_BEGIN(routers, routerinfo_t *, ri) {
+    tor_free(ri->onion_curve25519_pkey);
+    tor_free(ri);
+  } SMARTLIST_FOREACH_END(ri);
+  smartlist_free(routers);
+  smartlist_free(most_nodes);
+}
+
 static void
 bench_dh(void)
 {
@@ -659,6 +1756,17 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(circid_lookup),
+  ENT(cell_queue),
+  ENT(consdiff),
+  ENT(dirserv_spool),
+  ENT(dirparse),
+#ifdef HAVE_MODULE_DIRAUTH
+  ENT(dirvote),
+  ENT(bwauth),
+#endif
+  ENT(flag_thresholds),
+  ENT(path_selection),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
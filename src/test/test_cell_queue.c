@@ -13,10 +13,35 @@
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 
+/** Append a cell to <b>cq</b> whose first body byte is <b>tag</b>. */
+static void
+cell_queue_append_tagged(cell_queue_t *cq, char tag)
+{
+  cell_t cell;
+  memset(&cell, 0, sizeof(cell));
+  /* With narrow circuit IDs, the high byte of the ID comes first. */
+  cell.circ_id = ((circid_t)(uint8_t)tag) << 8;
+  cell_queue_append_packed_copy(NULL, cq, 0, &cell, 0, 0);
+}
+
+/** Pop the first cell from <b>cq</b>, and return its tag, or -1 if there
+ * was no cell. */
+static int
+cell_queue_pop_tag(cell_queue_t *cq)
+{
+  packed_cell_t *pc = cell_queue_pop(cq);
+  int tag;
+  if (!pc)
+    return -1;
+  tag = pc->body[0];
+  packed_cell_free(pc);
+  return tag;
+}
+
 static void
 test_cq_manip(void *arg)
 {
-  packed_cell_t *pc1=NULL, *pc2=NULL, *pc3=NULL, *pc4=NULL, *pc_tmp=NULL;
+  packed_cell_t *pc_tmp=NULL;
   cell_queue_t cq;
   cell_t cell;
   (void) arg;
@@ -24,30 +49,28 @@ test_cq_manip(void *arg)
   cell_queue_init(&cq);
   tt_int_op(cq.n, OP_EQ, 0);
 
-  pc1 = packed_cell_new();
-  pc2 = packed_cell_new();
-  pc3 = packed_cell_new();
-  pc4 = packed_cell_new();
-  tt_assert(pc1 && pc2 && pc3 && pc4);
-
   tt_ptr_op(NULL, OP_EQ, cell_queue_pop(&cq));
+  tt_ptr_op(NULL, OP_EQ, cell_queue_peek(&cq));
 
-  /* Add and remove a singleton. */
-  cell_queue_append(&cq, pc1);
+  /* Add and remove a singleton.  The queue keeps its own copy of each cell
+   * we give it. */
+  cell_queue_append_tagged(&cq, 1);
   tt_int_op(cq.n, OP_EQ, 1);
-  tt_ptr_op(pc1, OP_EQ, cell_queue_pop(&cq));
+  tt_int_op(cell_queue_peek(&cq)->body[0], OP_EQ, 1);
+  tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, 1);
   tt_int_op(cq.n, OP_EQ, 0);
+  tt_ptr_op(NULL, OP_EQ, cell_queue_peek(&cq));
 
   /* Add and remove four items */
-  cell_queue_append(&cq, pc4);
-  cell_queue_append(&cq, pc3);
-  cell_queue_append(&cq, pc2);
-  cell_queue_append(&cq, pc1);
+  cell_queue_append_tagged(&cq, 4);
+  cell_queue_append_tagged(&cq, 3);
+  cell_queue_append_tagged(&cq, 2);
+  cell_queue_append_tagged(&cq, 1);
   tt_int_op(cq.n, OP_EQ, 4);
-  tt_ptr_op(pc4, OP_EQ, cell_queue_pop(&cq));
-  tt_ptr_op(pc3, OP_EQ, cell_queue_pop(&cq));
-  tt_ptr_op(pc2, OP_EQ, cell_queue_pop(&cq));
-  tt_ptr_op(pc1, OP_EQ, cell_queue_pop(&cq));
+  tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, 4);
+  tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, 3);
+  tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, 2);
+  tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, 1);
   tt_int_op(cq.n, OP_EQ, 0);
   tt_ptr_op(NULL, OP_EQ, cell_queue_pop(&cq));
 
@@ -85,53 +108,106 @@ test_cq_manip(void *arg)
   tt_ptr_op(NULL, OP_EQ, cell_queue_pop(&cq));
 
   /* Now make sure cell_queue_clear works. */
-  cell_queue_append(&cq, pc2);
-  cell_queue_append(&cq, pc1);
+  cell_queue_append_tagged(&cq, 2);
+  cell_queue_append_tagged(&cq, 1);
   tt_int_op(cq.n, OP_EQ, 2);
   cell_queue_clear(&cq);
-  pc2 = pc1 = NULL; /* prevent double-free */
   tt_int_op(cq.n, OP_EQ, 0);
+  tt_ptr_op(NULL, OP_EQ, cell_queue_peek(&cq));
 
  done:
-  packed_cell_free(pc1);
-  packed_cell_free(pc2);
-  packed_cell_free(pc3);
-  packed_cell_free(pc4);
   packed_cell_free(pc_tmp);
 
   cell_queue_clear(&cq);
 }
 
+static void
+test_cq_chunks(void *arg)
+{
+  cell_queue_t cq;
+  int i, next_in = 0, next_out = 0;
+  size_t alloc_before = cell_queues_get_total_allocation();
+  (void) arg;
+
+  cell_queue_init(&cq);
+  tt_int_op(cell_queue_get_capacity(&cq), OP_EQ, 0);
+
+  /* A new queue starts with a small multi-cell chunk, and then doubles its
+   * room with each chunk. */
+  cell_queue_append_tagged(&cq, (char)(next_in++ & 0x7f));
+  tt_int_op(cell_queue_get_capacity(&cq), OP_EQ, 2);
+  for (i = 1; i < 100; ++i) {
+    cell_queue_append_tagged(&cq, (char)(next_in++ & 0x7f));
+    tt_int_op(cell_queue_get_capacity(&cq), OP_GE, cq.n);
+    tt_int_op(cell_queue_get_capacity(&cq), OP_LE, 2 * cq.n);
+  }
+  tt_int_op(cell_queue_get_capacity(&cq), OP_EQ, 112);
+
+  /* Fill the queue far enough to need multi-cell chunks, draining it a
+   * little as we go, and make sure everything comes out in order. */
+  for (i = 0; i < 2000; ++i) {
+    cell_queue_append_tagged(&cq, (char)(next_in++ & 0x7f));
+    cell_queue_append_tagged(&cq, (char)(next_in++ & 0x7f));
+    tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, next_out++ & 0x7f);
+    tt_int_op(cq.n, OP_EQ, next_in - next_out);
+    tt_int_op(cell_queue_get_capacity(&cq), OP_GE, cq.n);
+  }
+  tt_int_op(cell_queue_peek(&cq)->body[0], OP_EQ, next_out & 0x7f);
+
+  /* We account for all the room in the chunks, and for their headers, not
+   * just for the cells. */
+  tt_int_op(cell_queues_get_total_allocation() - alloc_before, OP_EQ,
+            cell_queue_get_allocation(&cq));
+  tt_int_op(cell_queue_get_allocation(&cq), OP_GT,
+            cell_queue_get_capacity(&cq) * packed_cell_mem_cost());
+
+  /* Storage doesn't grow much beyond what the queue holds. */
+  tt_int_op(cell_queue_get_capacity(&cq), OP_GT, cq.n);
+  tt_int_op(cell_queue_get_capacity(&cq), OP_LE, cq.n + cq.n / 64);
+
+  while (cq.n) {
+    tt_int_op(cell_queue_pop_tag(&cq), OP_EQ, next_out++ & 0x7f);
+  }
+  tt_int_op(next_out, OP_EQ, next_in);
+  tt_int_op(cell_queue_get_capacity(&cq), OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, alloc_before);
+
+  /* Clearing a multi-chunk queue releases everything. */
+  for (i = 0; i < 100; ++i)
+    cell_queue_append_tagged(&cq, 1);
+  tt_int_op(cell_queue_get_capacity(&cq), OP_GE, 100);
+  tt_int_op(cell_queues_get_total_allocation() - alloc_before, OP_EQ,
+            cell_queue_get_allocation(&cq));
+  cell_queue_clear(&cq);
+  tt_int_op(cell_queue_get_capacity(&cq), OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, alloc_before);
+
+ done:
+  cell_queue_clear(&cq);
+}
+
 static void
 test_circuit_n_cells(void *arg)
 {
-  packed_cell_t *pc1=NULL, *pc2=NULL, *pc3=NULL, *pc4=NULL, *pc5=NULL;
   origin_circuit_t *origin_c=NULL;
   or_circuit_t *or_c=NULL;
 
   (void)arg;
 
-  pc1 = packed_cell_new();
-  pc2 = packed_cell_new();
-  pc3 = packed_cell_new();
-  pc4 = packed_cell_new();
-  pc5 = packed_cell_new();
-  tt_assert(pc1 && pc2 && pc3 && pc4 && pc5);
-
   or_c = or_circuit_new(0, NULL);
   origin_c = origin_circuit_new();
   origin_c->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
 
   tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_c)), OP_EQ, 0);
-  cell_queue_append(&or_c->p_chan_cells, pc1);
+  cell_queue_append_tagged(&or_c->p_chan_cells, 1);
   tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_c)), OP_EQ, 1);
-  cell_queue_append(&or_c->base_.n_chan_cells, pc2);
-  cell_queue_append(&or_c->base_.n_chan_cells, pc3);
+  cell_queue_append_tagged(&or_c->base_.n_chan_cells, 2);
+  cell_queue_append_tagged(&or_c->base_.n_chan_cells, 3);
   tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_c)), OP_EQ, 3);
 
   tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(origin_c)), OP_EQ, 0);
-  cell_queue_append(&origin_c->base_.n_chan_cells, pc4);
-  cell_queue_append(&origin_c->base_.n_chan_cells, pc5);
+  cell_queue_append_tagged(&origin_c->base_.n_chan_cells, 4);
+  cell_queue_append_tagged(&origin_c->base_.n_chan_cells, 5);
   tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(origin_c)), OP_EQ, 2);
 
  done:
@@ -141,6 +217,7 @@ test_circuit_n_cells(void *arg)
 
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
+  { "chunks", test_cq_chunks, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -545,7 +545,7 @@ test_channel_outbound_cell(void *arg)
 {
   int old_count;
   channel_t *chan = NULL;
-  packed_cell_t *p_cell = NULL, *p_cell2 = NULL;
+  cell_t cell;
   origin_circuit_t *circ = NULL;
   cell_queue_t *queue;
 
@@ -573,11 +573,8 @@ test_channel_outbound_cell(void *arg)
   TO_CIRCUIT(circ)->n_circ_id = 42;
   /* This is the outbound test so use the next channel queue. */
   queue = &TO_CIRCUIT(circ)->n_chan_cells;
-  /* Setup packed cell to queue on the circuit. */
-  p_cell = packed_cell_new();
-  tt_assert(p_cell);
-  p_cell2 = packed_cell_new();
-  tt_assert(p_cell2);
+  /* Setup a cell to queue on the circuit. */
+  memset(&cell, 0, sizeof(cell));
   /* Setup a channel to put the circuit on. */
   chan = new_fake_channel();
   tt_assert(chan);
@@ -617,11 +614,9 @@ test_channel_outbound_cell(void *arg)
 
   /* Queue cell onto the next queue that is the outbound direction. Than
    * update its cmux so the circuit can be picked when flushing cells. */
-  cell_queue_append(queue, p_cell);
-  p_cell = NULL;
+  cell_queue_append_packed_copy(NULL, queue, 1, &cell, 0, 0);
   tt_int_op(queue->n, OP_EQ, 1);
-  cell_queue_append(queue, p_cell2);
-  p_cell2 = NULL;
+  cell_queue_append_packed_copy(NULL, queue, 1, &cell, 0, 0);
   tt_int_op(queue->n, OP_EQ, 2);
 
   update_circuit_on_cmux(TO_CIRCUIT(circ), CELL_DIRECTION_OUT);
@@ -669,7 +664,6 @@ test_channel_outbound_cell(void *arg)
   if (circ) {
     circuit_free_(TO_CIRCUIT(circ));
   }
-  tor_free(p_cell);
   channel_free_all();
   UNMOCK(scheduler_release_channel);
   monotime_disable_test_mocking();
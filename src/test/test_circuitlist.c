@@ -182,6 +182,70 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+static void
+test_clist_circid_cache(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  or_circuit_t *or_c1=NULL, *or_c2=NULL;
+  const circid_t id1 = 5, id2 = 5 + CHANNEL_CIRCID_CACHE_SIZE;
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  ch1->cmux = tor_malloc(1);
+
+  /* Two circuits whose IDs land in the same cache slot. */
+  or_c1 = or_circuit_new(id1, ch1);
+  or_c2 = or_circuit_new(id2, ch1);
+  tt_ptr_op(ch1->circid_cache[id1 % CHANNEL_CIRCID_CACHE_SIZE], OP_EQ, NULL);
+
+  tt_ptr_op(circuit_get_by_circid_channel(id1, ch1), OP_EQ,
+            TO_CIRCUIT(or_c1));
+  tt_u64_op(ch1->n_circid_cache_hits, OP_EQ, 0);
+  tt_u64_op(ch1->n_circid_cache_misses, OP_EQ, 1);
+  tt_ptr_op(circuit_get_by_circid_channel(id1, ch1), OP_EQ,
+            TO_CIRCUIT(or_c1));
+  tt_u64_op(ch1->n_circid_cache_hits, OP_EQ, 1);
+
+  /* The colliding circuit evicts the first one, but both stay findable. */
+  tt_ptr_op(circuit_get_by_circid_channel(id2, ch1), OP_EQ,
+            TO_CIRCUIT(or_c2));
+  tt_ptr_op(circuit_get_by_circid_channel(id1, ch1), OP_EQ,
+            TO_CIRCUIT(or_c1));
+  tt_u64_op(ch1->n_circid_cache_hits, OP_EQ, 1);
+  tt_u64_op(ch1->n_circid_cache_misses, OP_EQ, 3);
+
+  /* Changing a circuit's ID must not leave a stale cache entry. */
+  circuit_set_p_circid_chan(or_c1, id1 + 1, ch1);
+  tt_ptr_op(circuit_get_by_circid_channel(id1, ch1), OP_EQ, NULL);
+  tt_ptr_op(circuit_get_by_circid_channel(id1 + 1, ch1), OP_EQ,
+            TO_CIRCUIT(or_c1));
+
+  /* Neither must freeing one, or releasing a pending destroy. */
+  tt_ptr_op(circuit_get_by_circid_channel(id2, ch1), OP_EQ,
+            TO_CIRCUIT(or_c2));
+  TO_CIRCUIT(or_c2)->p_delete_pending = 1;
+  circuit_free_(TO_CIRCUIT(or_c2));
+  or_c2 = NULL;
+  tt_ptr_op(circuit_get_by_circid_channel(id2, ch1), OP_EQ, NULL);
+  tt_int_op(circuit_id_in_use_on_channel(id2, ch1), OP_EQ, 2);
+  channel_note_destroy_not_pending(ch1, id2);
+  tt_ptr_op(ch1->circid_cache[id2 % CHANNEL_CIRCID_CACHE_SIZE], OP_EQ, NULL);
+  tt_int_op(circuit_id_in_use_on_channel(id2, ch1), OP_EQ, 0);
+
+ done:
+  if (or_c1)
+    circuit_free_(TO_CIRCUIT(or_c1));
+  if (or_c2)
+    circuit_free_(TO_CIRCUIT(or_c2));
+  if (ch1)
+    tor_free(ch1->cmux);
+  tor_free(ch1);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -466,6 +530,7 @@ test_hs_circuitmap_isolation(void *arg)
 
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "circid_cache", test_clist_circid_cache, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
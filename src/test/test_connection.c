@@ -6,12 +6,21 @@
 #define CONNECTION_PRIVATE
 #define MAINLOOP_PRIVATE
 #define CONNECTION_OR_PRIVATE
+#define CHANNELTLS_PRIVATE
+#define TOR_CHANNEL_INTERNAL_
+#define HIBERNATE_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
 
+#include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/or/channel.h"
+#include "core/or/channelpadding.h"
+#include "core/or/channeltls.h"
+#include "core/or/circuitmux.h"
 #include "core/or/connection_edge.h"
+#include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_common.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/nodelist/microdesc.h"
@@ -21,6 +30,7 @@
 #include "feature/dircommon/directory.h"
 #include "core/or/connection_or.h"
 #include "lib/net/resolve.h"
+#include "lib/evloop/timers.h"
 
 #include "test/test_connection.h"
 #include "test/test_helpers.h"
@@ -29,6 +39,7 @@
 #include "core/or/entry_connection_st.h"
 #include "feature/nodelist/node_st.h"
 #include "core/or/or_connection_st.h"
+#include "app/config/or_options_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 #include "core/or/socks_request_st.h"
 
@@ -881,6 +892,227 @@ test_failed_orconn_tracker(void *arg)
   ;
 }
 
+static void
+test_conn_type_lists(void *arg)
+{
+  connection_t *dir1 = NULL, *dir2 = NULL;
+  smartlist_t *dir_conns = get_connection_array_by_type(CONN_TYPE_DIR);
+  (void)arg;
+
+  dir1 = test_conn_get_connection(TEST_CONN_STATE, CONN_TYPE_DIR,
+                                  TEST_CONN_BASIC_PURPOSE);
+  dir2 = test_conn_get_connection(TEST_CONN_STATE, CONN_TYPE_DIR,
+                                  TEST_CONN_BASIC_PURPOSE);
+  tt_assert(dir1);
+  tt_assert(dir2);
+
+  /* Every connection is on exactly the list for its type. */
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, 2);
+  tt_int_op(smartlist_len(dir_conns), OP_EQ, 2);
+  tt_ptr_op(smartlist_get(dir_conns, dir1->conn_type_array_index), OP_EQ,
+            dir1);
+  tt_ptr_op(smartlist_get(dir_conns, dir2->conn_type_array_index), OP_EQ,
+            dir2);
+  tt_int_op(smartlist_len(get_connection_array_by_type(CONN_TYPE_AP)), OP_EQ,
+            0);
+  tt_int_op(smartlist_len(get_connection_array_by_type(CONN_TYPE_OR)), OP_EQ,
+            0);
+  tt_int_op(smartlist_len(get_connection_array_by_type(CONN_TYPE_MAX_ + 1)),
+            OP_EQ, 0);
+
+  /* The lookup helpers only need the list for the type they want. */
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_DIR), OP_EQ, dir1);
+  tt_ptr_op(connection_get_by_type_state(CONN_TYPE_DIR, TEST_CONN_STATE),
+            OP_EQ, dir1);
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_AP), OP_EQ, NULL);
+
+  /* Closing a connection takes it off its type list, and keeps the indices
+   * of the others right. */
+  tt_int_op(test_conn_get_basic_teardown(NULL, dir1), OP_EQ, 1);
+  dir1 = NULL;
+  tt_int_op(smartlist_len(dir_conns), OP_EQ, 1);
+  tt_int_op(dir2->conn_type_array_index, OP_EQ, 0);
+  tt_ptr_op(smartlist_get(dir_conns, 0), OP_EQ, dir2);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, 1);
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_DIR), OP_EQ, dir2);
+
+ done:
+  if (dir1)
+    test_conn_get_basic_teardown(NULL, dir1);
+  if (dir2)
+    test_conn_get_basic_teardown(NULL, dir2);
+}
+
+static void
+test_conn_set_type(void *arg)
+{
+  or_connection_t *orconn = NULL;
+  connection_t *conn;
+  smartlist_t *ext_or_conns = get_connection_array_by_type(CONN_TYPE_EXT_OR);
+  smartlist_t *or_conns = get_connection_array_by_type(CONN_TYPE_OR);
+  (void)arg;
+
+  /* A connection that isn't on any list just changes type. */
+  orconn = or_connection_new(CONN_TYPE_EXT_OR, AF_INET);
+  conn = TO_CONN(orconn);
+  connection_set_type(conn, CONN_TYPE_OR);
+  tt_int_op(conn->type, OP_EQ, CONN_TYPE_OR);
+  tt_int_op(conn->conn_type_array_index, OP_EQ, -1);
+  connection_set_type(conn, CONN_TYPE_EXT_OR);
+
+  /* An Extended ORPort connection that turns into an OR connection moves
+   * from one list to the other, and can be removed from its new list. */
+  connection_array_by_type_add(conn);
+  tt_int_op(smartlist_len(ext_or_conns), OP_EQ, 1);
+  tt_int_op(smartlist_len(or_conns), OP_EQ, 0);
+
+  connection_set_type(conn, CONN_TYPE_OR);
+  tt_int_op(conn->type, OP_EQ, CONN_TYPE_OR);
+  tt_int_op(smartlist_len(ext_or_conns), OP_EQ, 0);
+  tt_int_op(smartlist_len(or_conns), OP_EQ, 1);
+  tt_int_op(conn->conn_type_array_index, OP_EQ, 0);
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_OR), OP_EQ, conn);
+
+  connection_array_by_type_remove(conn);
+  tt_int_op(conn->conn_type_array_index, OP_EQ, -1);
+  tt_int_op(smartlist_len(or_conns), OP_EQ, 0);
+
+ done:
+  if (orconn && TO_CONN(orconn)->conn_type_array_index >= 0)
+    connection_array_by_type_remove(TO_CONN(orconn));
+  connection_free_minimal(TO_CONN(orconn));
+}
+
+static void
+test_conn_housekeeping_timers(void *arg)
+{
+  connection_t *dir1 = NULL, *dir2 = NULL;
+  or_options_t *options = get_options_mutable();
+  time_t now = time(NULL);
+  (void)arg;
+
+  options->TestingDirConnectionMaxStall = 300;
+
+  /* Before timers are enabled, connections don't get one. */
+  dir1 = test_conn_get_connection(TEST_CONN_STATE, CONN_TYPE_DIR,
+                                  TEST_CONN_BASIC_PURPOSE);
+  tt_assert(dir1);
+  tt_ptr_op(dir1->housekeeping_timer, OP_EQ, NULL);
+
+  /* Enabling them covers existing and new connections. */
+  timers_initialize();
+  connection_housekeeping_timers_enable();
+  tt_assert(dir1->housekeeping_timer);
+  dir2 = test_conn_get_connection(TEST_CONN_STATE, CONN_TYPE_DIR,
+                                  TEST_CONN_BASIC_PURPOSE);
+  tt_assert(dir2);
+  tt_assert(dir2->housekeeping_timer);
+  connection_reschedule_housekeeping(dir2);
+
+  /* An active directory connection sleeps until it could stall. */
+  dir1->timestamp_last_read_allowed = now - 10;
+  tt_int_op(run_connection_housekeeping(dir1, now), OP_EQ, 291);
+  tt_assert(!dir1->marked_for_close);
+
+  /* A stalled one gets closed, and needs no more housekeeping. */
+  dir2->timestamp_last_read_allowed = now - 301;
+  tt_int_op(run_connection_housekeeping(dir2, now), OP_EQ, 0);
+  tt_assert(dir2->marked_for_close);
+  close_closeable_connections();
+  dir2 = NULL;
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, 1);
+
+ done:
+  if (dir1)
+    test_conn_get_basic_teardown(NULL, dir1);
+  if (dir2)
+    test_conn_get_basic_teardown(NULL, dir2);
+  timers_shutdown();
+}
+
+static connection_t *housekeeping_rescheduled_conn = NULL;
+static int n_housekeeping_reschedules = 0;
+
+static void
+mock_connection_reschedule_housekeeping(connection_t *conn)
+{
+  housekeeping_rescheduled_conn = conn;
+  ++n_housekeeping_reschedules;
+}
+
+static void
+test_conn_housekeeping_or(void *arg)
+{
+  or_connection_t *orconn = NULL;
+  channel_tls_t *tlschan = NULL;
+  channel_t *chan;
+  connection_t *conn;
+  channelpadding_negotiate_t pad_vars;
+  or_options_t *options = get_options_mutable();
+  time_t now = time(NULL);
+  (void)arg;
+
+  options->KeepalivePeriod = 300;
+  options->ORPort_set = 1;
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_LIVE);
+  MOCK(connection_reschedule_housekeeping,
+       mock_connection_reschedule_housekeeping);
+
+  orconn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  conn = TO_CONN(orconn);
+  conn->address = tor_strdup("127.0.0.1");
+  tor_addr_from_ipv4h(&conn->addr, 0x7f000001);
+  tlschan = tor_malloc_zero(sizeof(*tlschan));
+  channel_tls_common_init(tlschan);
+  tlschan->conn = orconn;
+  orconn->chan = tlschan;
+  chan = TLS_CHAN_TO_BASE(tlschan);
+
+  /* A connection that isn't open yet sleeps until it would time out. */
+  conn->state = OR_CONN_STATE_TLS_HANDSHAKING;
+  conn->timestamp_last_write_allowed = now - 100;
+  tt_int_op(run_connection_housekeeping(conn, now), OP_EQ, 200);
+  tt_assert(!conn->marked_for_close);
+
+  /* An open one with no circuits sleeps until its next keepalive, or until
+   * it has been idle too long, whichever comes first. */
+  conn->state = OR_CONN_STATE_OPEN;
+  orconn->idle_timeout = 1000;
+  chan->timestamp_last_had_circuits = now - 10;
+  tt_int_op(run_connection_housekeeping(conn, now), OP_EQ, 200);
+  orconn->idle_timeout = 60;
+  tt_int_op(run_connection_housekeeping(conn, now), OP_EQ, 50);
+  tt_assert(!conn->marked_for_close);
+
+  /* Anything that could change the padding decision, or make the channel
+   * closeable, wakes housekeeping up on the connection. */
+  chan->timestamp_client = 0;
+  channel_timestamp_client(chan);
+  tt_int_op(n_housekeeping_reschedules, OP_EQ, 1);
+  tt_ptr_op(housekeeping_rescheduled_conn, OP_EQ, conn);
+
+  memset(&pad_vars, 0, sizeof(pad_vars));
+  pad_vars.command = CHANNELPADDING_COMMAND_START;
+  tt_int_op(channelpadding_update_padding_for_channel(chan, &pad_vars),
+            OP_EQ, 1);
+  tt_int_op(n_housekeeping_reschedules, OP_EQ, 2);
+
+  channel_mark_bad_for_new_circs(chan);
+  tt_int_op(n_housekeeping_reschedules, OP_EQ, 3);
+  tt_ptr_op(housekeeping_rescheduled_conn, OP_EQ, conn);
+
+ done:
+  UNMOCK(connection_reschedule_housekeeping);
+  if (tlschan) {
+    circuitmux_free(tlschan->base_.cmux);
+    tor_free(tlschan);
+  }
+  if (orconn) {
+    orconn->chan = NULL;
+    connection_free_minimal(TO_CONN(orconn));
+  }
+}
+
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
 
@@ -898,5 +1130,10 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_NS),
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   { "failed_orconn_tracker", test_failed_orconn_tracker, TT_FORK, NULL, NULL },
+  { "type_lists", test_conn_type_lists, TT_FORK, NULL, NULL },
+  { "set_type", test_conn_set_type, TT_FORK, NULL, NULL },
+  { "housekeeping_timers", test_conn_housekeeping_timers, TT_FORK, NULL,
+    NULL },
+  { "housekeeping_or", test_conn_housekeeping_or, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
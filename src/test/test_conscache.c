@@ -5,11 +5,16 @@
 #include "app/config/config.h"
 #include "feature/dircache/conscache.h"
 #include "lib/encoding/confline.h"
+#include "lib/fdio/fdio.h"
+#include "lib/fs/files.h"
 #include "test/test.h"
 
 #ifdef HAVE_UTIME_H
 #include <utime.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 static void
 test_conscache_open_failure(void *arg)
@@ -29,6 +34,7 @@ test_conscache_simple_usage(void *arg)
 {
   (void)arg;
   consensus_cache_entry_t *ent = NULL, *ent2 = NULL;
+  int fd = -1;
 
   /* Make a temporary datadir for these tests */
   char *ddir_fname = tor_strdup(get_fname_rnd("datadir_cache"));
@@ -84,6 +90,19 @@ test_conscache_simple_usage(void *arg)
   tt_mem_op(bp, OP_EQ, "A\0B\0C", 5);
   tt_assert(consensus_cache_entry_is_mapped(ent));
 
+  /* Check open_body */
+  off_t off = 0;
+  char tmp[5];
+  r = consensus_cache_entry_open_body(ent, &fd, &off);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(fd, OP_GE, 0);
+  tt_int_op(0, OP_EQ, tor_fd_setpos(fd, off));
+  tt_int_op(5, OP_EQ, read_all_from_fd(fd, tmp, 5));
+  tt_mem_op(tmp, OP_EQ, "A\0B\0C", 5);
+  tt_int_op(0, OP_EQ, read_all_from_fd(fd, tmp, 5));
+  close(fd);
+  fd = -1;
+
   /* Free and re-create the cache, to rescan the directory. */
   consensus_cache_free(cache);
   consensus_cache_entry_decref(ent);
@@ -110,6 +129,8 @@ test_conscache_simple_usage(void *arg)
   tt_int_op(n, OP_EQ, 2);
 
  done:
+  if (fd >= 0)
+    close(fd);
   consensus_cache_entry_decref(ent);
   tor_free(ddir_fname);
   consensus_cache_free(cache);
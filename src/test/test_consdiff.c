@@ -9,6 +9,7 @@
 
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/log_test_helpers.h"
 
 #define tt_str_eq_line(a,b) \
@@ -108,6 +109,124 @@ test_consdiff_lcs_lengths(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_intern_lines(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  uint32_t ids1[5], ids2[5];
+  memarea_t *area = memarea_new();
+
+  (void)arg;
+  consensus_split_lines(sl1, "x\na\nb\na\nab\n", area);
+  consensus_split_lines(sl2, "b\nc\nab\na\nx\n", area);
+  sls1 = smartlist_slice(sl1, 1, -1);
+  sls2 = smartlist_slice(sl2, 0, 4);
+
+  /* Only the lines in the slices get identifiers. */
+  memset(ids1, 0xff, sizeof(ids1));
+  memset(ids2, 0xff, sizeof(ids2));
+  intern_lines(sls1, sls2, ids1, ids2);
+  tt_ptr_op(sls1->ids, OP_EQ, ids1);
+  tt_ptr_op(sls2->ids, OP_EQ, ids2);
+  tt_uint_op(ids1[0], OP_EQ, UINT32_MAX);
+  tt_uint_op(ids2[4], OP_EQ, UINT32_MAX);
+  memmove(ids1, ids1 + 1, 4 * sizeof(uint32_t));
+  /* Equal lines get equal identifiers ... */
+  tt_int_op(ids1[0], OP_EQ, ids1[2]);
+  tt_int_op(ids1[0], OP_EQ, ids2[3]);
+  tt_int_op(ids1[1], OP_EQ, ids2[0]);
+  tt_int_op(ids1[3], OP_EQ, ids2[2]);
+  /* ... and different lines get different ones. */
+  tt_int_op(ids1[0], OP_NE, ids1[1]);
+  tt_int_op(ids1[0], OP_NE, ids1[3]);
+  tt_int_op(ids1[1], OP_NE, ids1[3]);
+  tt_int_op(ids2[1], OP_NE, ids1[0]);
+  tt_int_op(ids2[1], OP_NE, ids1[1]);
+  tt_int_op(ids2[1], OP_NE, ids1[3]);
+
+ done:
+  tor_free(sls1);
+  tor_free(sls2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
+/* Make sure that calc_changes finds exactly the same changes whether or not
+ * the lines have been interned. */
+static void
+test_consdiff_calc_changes_interned(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  bitarray_t *changed1_i = NULL, *changed2_i = NULL;
+  uint32_t *ids1 = NULL, *ids2 = NULL;
+  static const char *words[] = { "a", "b", "c", "d", "e" };
+  memarea_t *area = memarea_new();
+  int round, i;
+
+  (void)arg;
+  for (round = 0; round < 100; ++round) {
+    const int len1 = crypto_rand_int(40), len2 = crypto_rand_int(40);
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    for (i = 0; i < len1; ++i)
+      smartlist_add_linecpy(sl1, area, words[crypto_rand_int(5)]);
+    for (i = 0; i < len2; ++i)
+      smartlist_add_linecpy(sl2, area, words[crypto_rand_int(5)]);
+
+    changed1 = bitarray_init_zero(len1);
+    changed2 = bitarray_init_zero(len2);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes(sls1, sls2, changed1, changed2);
+    tor_free(sls1);
+    tor_free(sls2);
+
+    changed1_i = bitarray_init_zero(len1);
+    changed2_i = bitarray_init_zero(len2);
+    ids1 = tor_calloc(len1 + 1, sizeof(uint32_t));
+    ids2 = tor_calloc(len2 + 1, sizeof(uint32_t));
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    intern_lines(sls1, sls2, ids1, ids2);
+    calc_changes(sls1, sls2, changed1_i, changed2_i);
+
+    for (i = 0; i < len1; ++i)
+      tt_int_op(!!bitarray_is_set(changed1, i), OP_EQ,
+                !!bitarray_is_set(changed1_i, i));
+    for (i = 0; i < len2; ++i)
+      tt_int_op(!!bitarray_is_set(changed2, i), OP_EQ,
+                !!bitarray_is_set(changed2_i, i));
+
+    tor_free(sls1);
+    tor_free(sls2);
+    tor_free(ids1);
+    tor_free(ids2);
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    bitarray_free(changed1_i);
+    bitarray_free(changed2_i);
+  }
+
+ done:
+  tor_free(sls1);
+  tor_free(sls2);
+  tor_free(ids1);
+  tor_free(ids2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  bitarray_free(changed1_i);
+  bitarray_free(changed2_i);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_trim_slices(void *arg)
 {
@@ -646,6 +765,143 @@ test_consdiff_gen_ed_diff(void *arg)
   memarea_drop_all(area);
 }
 
+/* Make sure that gen_ed_diff produces a correct diff when it has to intern
+ * the lines of large slices. */
+static void
+test_consdiff_gen_ed_diff_large_slices(void *arg)
+{
+  smartlist_t *cons1 = smartlist_new(), *cons2 = smartlist_new();
+  smartlist_t *diff = NULL, *cons2_out = NULL;
+  static const char *words[] = { "a", "b", "c", "d", "e", "f" };
+  memarea_t *area = memarea_new();
+  int round, i;
+
+  (void)arg;
+  for (round = 0; round < 20; ++round) {
+    smartlist_clear(cons1);
+    smartlist_clear(cons2);
+    /* No router lines, so each input is a single slice of 200 lines. */
+    for (i = 0; i < 200; ++i) {
+      smartlist_add_linecpy(cons1, area, words[crypto_rand_int(6)]);
+      smartlist_add_linecpy(cons2, area, words[crypto_rand_int(6)]);
+    }
+
+    diff = gen_ed_diff(cons1, cons2, area);
+    tt_assert(diff);
+    cons2_out = apply_ed_diff(cons1, diff, 0);
+    tt_assert(cons2_out);
+    tt_int_op(smartlist_len(cons2_out), OP_EQ, smartlist_len(cons2));
+    SMARTLIST_FOREACH(cons2, const cdline_t *, line,
+      tt_assert(lines_eq(line, smartlist_get(cons2_out, line_sl_idx))));
+    smartlist_free(diff);
+    smartlist_free(cons2_out);
+  }
+
+ done:
+  smartlist_free(cons1);
+  smartlist_free(cons2);
+  smartlist_free(diff);
+  smartlist_free(cons2_out);
+  memarea_drop_all(area);
+}
+
+static void
+test_consdiff_gen_ed_diff_composed(void *arg)
+{
+  smartlist_t *cons1 = smartlist_new(), *cons2 = smartlist_new();
+  smartlist_t *cons3 = smartlist_new();
+  smartlist_t *diff12 = NULL, *diff23 = NULL, *diff = NULL;
+  smartlist_t *cons3_out = NULL;
+  static const char *words[] = { "a", "b", "c", "d", "e", "f" };
+  memarea_t *area = memarea_new();
+  int round, i;
+
+  (void)arg;
+
+  /* A line that changes, and then changes back, is not in the diff. */
+  smartlist_add_linecpy(cons1, area, "a");
+  smartlist_add_linecpy(cons1, area, "b");
+  smartlist_add_linecpy(cons1, area, "c");
+  smartlist_add_linecpy(cons2, area, "a");
+  smartlist_add_linecpy(cons2, area, "x");
+  smartlist_add_linecpy(cons2, area, "c");
+  smartlist_add_all(cons3, cons1);
+  diff12 = gen_ed_diff(cons1, cons2, area);
+  diff23 = gen_ed_diff(cons2, cons3, area);
+  tt_assert(diff12);
+  tt_assert(diff23);
+  /* gen_ed_diff_composed() expects diffs with a two-line header. */
+  smartlist_insert(diff12, 0, smartlist_get(cons1, 0));
+  smartlist_insert(diff12, 0, smartlist_get(cons1, 0));
+  smartlist_insert(diff23, 0, smartlist_get(cons1, 0));
+  smartlist_insert(diff23, 0, smartlist_get(cons1, 0));
+  diff = gen_ed_diff_composed(cons1, diff12, diff23, cons3, area);
+  tt_assert(diff);
+  tt_int_op(0, OP_EQ, smartlist_len(diff));
+  smartlist_free(diff12);
+  smartlist_free(diff23);
+  smartlist_free(diff);
+  diff12 = diff23 = diff = NULL;
+
+  /* The composed diff of random inputs must produce the target. */
+  for (round = 0; round < 20; ++round) {
+    smartlist_clear(cons1);
+    smartlist_clear(cons2);
+    smartlist_clear(cons3);
+    /* No router lines, so each input is a single slice of 200 lines. */
+    for (i = 0; i < 200; ++i)
+      smartlist_add_linecpy(cons1, area, words[crypto_rand_int(6)]);
+    /* Change some lines of each consensus to make the next one, and
+     * change some of them back. */
+    SMARTLIST_FOREACH_BEGIN(cons1, cdline_t *, line) {
+      if (crypto_rand_int(8) == 0)
+        smartlist_add_linecpy(cons2, area, words[crypto_rand_int(6)]);
+      else if (crypto_rand_int(8) != 0)
+        smartlist_add(cons2, line);
+    } SMARTLIST_FOREACH_END(line);
+    SMARTLIST_FOREACH_BEGIN(cons2, cdline_t *, line) {
+      if (crypto_rand_int(8) == 0)
+        smartlist_add(cons3, smartlist_get(cons1, line_sl_idx));
+      else if (crypto_rand_int(8) == 0)
+        smartlist_add_linecpy(cons3, area, words[crypto_rand_int(6)]);
+      else
+        smartlist_add(cons3, line);
+    } SMARTLIST_FOREACH_END(line);
+
+    diff12 = gen_ed_diff(cons1, cons2, area);
+    diff23 = gen_ed_diff(cons2, cons3, area);
+    tt_assert(diff12);
+    tt_assert(diff23);
+    smartlist_insert(diff12, 0, smartlist_get(cons1, 0));
+    smartlist_insert(diff12, 0, smartlist_get(cons1, 0));
+    smartlist_insert(diff23, 0, smartlist_get(cons1, 0));
+    smartlist_insert(diff23, 0, smartlist_get(cons1, 0));
+
+    diff = gen_ed_diff_composed(cons1, diff12, diff23, cons3, area);
+    tt_assert(diff);
+    cons3_out = apply_ed_diff(cons1, diff, 0);
+    tt_assert(cons3_out);
+    tt_int_op(smartlist_len(cons3_out), OP_EQ, smartlist_len(cons3));
+    SMARTLIST_FOREACH(cons3, const cdline_t *, line,
+      tt_assert(lines_eq(line, smartlist_get(cons3_out, line_sl_idx))));
+    smartlist_free(diff12);
+    smartlist_free(diff23);
+    smartlist_free(diff);
+    smartlist_free(cons3_out);
+    diff12 = diff23 = diff = cons3_out = NULL;
+  }
+
+ done:
+  smartlist_free(cons1);
+  smartlist_free(cons2);
+  smartlist_free(cons3);
+  smartlist_free(diff12);
+  smartlist_free(diff23);
+  smartlist_free(diff);
+  smartlist_free(cons3_out);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_apply_ed_diff(void *arg)
 {
@@ -972,6 +1228,57 @@ test_consdiff_gen_diff(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_compose_to_target(void *arg)
+{
+  char *diff12 = NULL, *diff23 = NULL, *diff = NULL, *applied = NULL;
+  consensus_diff_target_t *target = NULL;
+  (void)arg;
+
+  const char *cons1 =
+    "network-status-version foo\n"
+    "r name ccccccccccccccccc etc\nfoo\n"
+    "r name eeeeeeeeeeeeeeeee etc\nbar\n"
+    "directory-signature foo bar\nbar\n";
+  const char *cons2 =
+    "network-status-version foo\n"
+    "r name aaaaaaaaaaaaaaaaa etc\nfoo\n"
+    "r name ccccccccccccccccc etc\nbaz\n"
+    "directory-signature foo bar\nbaz\n";
+  const char *cons3 =
+    "network-status-version foo\n"
+    "r name aaaaaaaaaaaaaaaaa etc\nfoo\n"
+    "r name ccccccccccccccccc etc\nfoo\n"
+    "r name ddddddddddddddddd etc\nbar\n"
+    "directory-signature foo bar\nquux\n";
+
+  diff12 = consensus_diff_generate(cons1, cons2);
+  diff23 = consensus_diff_generate(cons2, cons3);
+  tt_assert(diff12);
+  tt_assert(diff23);
+  target = consensus_diff_target_new(tor_strdup(cons3));
+  tt_assert(target);
+
+  diff = consensus_diff_compose_to_target(cons1, diff12, diff23, target);
+  tt_assert(diff);
+  applied = consensus_diff_apply(cons1, diff);
+  tt_str_op(applied, OP_EQ, cons3);
+
+  /* The diffs must go from the base consensus to the target. */
+  tor_free(diff);
+  diff = consensus_diff_compose_to_target(cons2, diff12, diff23, target);
+  tt_ptr_op(diff, OP_EQ, NULL);
+  diff = consensus_diff_compose_to_target(cons1, diff12, diff12, target);
+  tt_ptr_op(diff, OP_EQ, NULL);
+
+ done:
+  tor_free(diff12);
+  tor_free(diff23);
+  tor_free(diff);
+  tor_free(applied);
+  consensus_diff_target_free(target);
+}
+
 static void
 test_consdiff_apply_diff(void *arg)
 {
@@ -1169,6 +1476,8 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(smartlist_slice),
   CONSDIFF_LEGACY(smartlist_slice_string_pos),
   CONSDIFF_LEGACY(lcs_lengths),
+  CONSDIFF_LEGACY(intern_lines),
+  CONSDIFF_LEGACY(calc_changes_interned),
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
@@ -1177,8 +1486,11 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(next_router),
   CONSDIFF_LEGACY(base64cmp),
   CONSDIFF_LEGACY(gen_ed_diff),
+  CONSDIFF_LEGACY(gen_ed_diff_large_slices),
+  CONSDIFF_LEGACY(gen_ed_diff_composed),
   CONSDIFF_LEGACY(apply_ed_diff),
   CONSDIFF_LEGACY(gen_diff),
+  CONSDIFF_LEGACY(compose_to_target),
   CONSDIFF_LEGACY(apply_diff),
   END_OF_TESTCASES
 };
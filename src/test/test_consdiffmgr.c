@@ -132,17 +132,31 @@ mock_cpuworker_run_work(void)
   });
   return 0;
 }
+/* Handle the replies for all the work queued so far.  Any work that those
+ * replies queue is left in a new fake_cpuworker_queue. */
 static void
-mock_cpuworker_handle_replies(void)
+mock_cpuworker_handle_replies_once(void)
 {
   if (! fake_cpuworker_queue)
     return;
-  SMARTLIST_FOREACH(fake_cpuworker_queue, fake_work_queue_ent_t *, ent, {
+  smartlist_t *queue = fake_cpuworker_queue;
+  fake_cpuworker_queue = NULL;
+  SMARTLIST_FOREACH(queue, fake_work_queue_ent_t *, ent, {
       ent->reply_fn(ent->arg);
       tor_free(ent);
   });
-  smartlist_free(fake_cpuworker_queue);
-  fake_cpuworker_queue = NULL;
+  smartlist_free(queue);
+}
+/* Handle the replies for all the work queued so far, and then run and
+ * handle any work that those replies queue, until there is none left. */
+static void
+mock_cpuworker_handle_replies(void)
+{
+  mock_cpuworker_handle_replies_once();
+  while (fake_cpuworker_queue) {
+    mock_cpuworker_run_work();
+    mock_cpuworker_handle_replies_once();
+  }
 }
 
 // ==============================  Other helpers
@@ -637,6 +651,164 @@ test_consdiffmgr_diff_pending(void *arg)
 #undef N
 }
 
+static void
+test_consdiffmgr_diff_compression(void *arg)
+{
+#define N 3
+  (void)arg;
+  char *md_body[N];
+  networkstatus_t *md_ns[N];
+  time_t start = approx_time() - 120;
+  char *diff_text = NULL, *applied = NULL;
+  uint8_t sha3[DIGEST256_LEN];
+  consensus_cache_entry_t *ent = NULL;
+  int i;
+  for (i = 0; i < N; ++i) {
+    time_t when = start + i * 30;
+    md_body[i] = fake_ns_body_new(FLAV_MICRODESC, when);
+    md_ns[i] = fake_ns_new(FLAV_MICRODESC, when);
+  }
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  for (i = 0; i < N; ++i)
+    tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[i], md_ns[i]));
+  router_get_networkstatus_v3_sha3_as_signed(sha3, md_body[0]);
+
+  /* One job for each diff... */
+  consdiffmgr_rescan();
+  tt_int_op(N-1, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies_once();
+
+  /* ...which makes the uncompressed diffs available, and queues one job for
+   * each other compression method of each diff. */
+  tt_int_op((N-1) * (n_diff_compression_methods()-1), OP_EQ,
+            smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ,
+       lookup_apply_and_verify_diff(FLAV_MICRODESC, md_body[0], md_body[2]));
+  tt_int_op(0, OP_EQ,
+       lookup_apply_and_verify_diff(FLAV_MICRODESC, md_body[1], md_body[2]));
+  tt_int_op(CONSDIFF_IN_PROGRESS, OP_EQ,
+            consdiffmgr_find_diff_from(&ent, FLAV_MICRODESC,
+                                       DIGEST_SHA3_256, sha3, sizeof(sha3),
+                                       GZIP_METHOD));
+
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies_once();
+  tt_ptr_op(NULL, OP_EQ, fake_cpuworker_queue);
+
+  /* Now the compressed diffs are there too. */
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            consdiffmgr_find_diff_from(&ent, FLAV_MICRODESC,
+                                       DIGEST_SHA3_256, sha3, sizeof(sha3),
+                                       GZIP_METHOD));
+  tt_assert(ent);
+  size_t size;
+  tt_int_op(0, OP_EQ, uncompress_or_copy(&diff_text, &size, ent));
+  applied = consensus_diff_apply(md_body[0], diff_text);
+  tt_str_op(applied, OP_EQ, md_body[2]);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  tor_free(diff_text);
+  tor_free(applied);
+  for (i = 0; i < N; ++i) {
+    tor_free(md_body[i]);
+    networkstatus_vote_free(md_ns[i]);
+  }
+#undef N
+}
+
+static void
+test_consdiffmgr_diff_compose(void *arg)
+{
+#define N 4
+  (void)arg;
+  char *md_body[N];
+  networkstatus_t *md_ns[N];
+  time_t start = approx_time() - 120;
+  consensus_cache_entry_t *ent = NULL;
+  uint8_t sha3[DIGEST256_LEN];
+  char hex[HEX_DIGEST256_LEN+1];
+  int i;
+  for (i = 0; i < N; ++i) {
+    time_t when = start + i * 15;
+    md_body[i] = fake_ns_body_new(FLAV_MICRODESC, when);
+    md_ns[i] = fake_ns_new(FLAV_MICRODESC, when);
+  }
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  get_options_mutable()->ComposeConsensusDiffs = 1;
+
+  for (i = 0; i < N-1; ++i)
+    tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[i], md_ns[i]));
+
+  /* We only compute the diff from the previous consensus at first... */
+  consdiffmgr_rescan();
+  tt_int_op(1, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(CONSDIFF_NOT_FOUND, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[0]));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ,
+       lookup_apply_and_verify_diff(FLAV_MICRODESC, md_body[1], md_body[2]));
+
+  /* ...and once it's done, the others.  There is nothing to compose yet. */
+  consdiffmgr_rescan();
+  tt_int_op(1, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ,
+       lookup_apply_and_verify_diff(FLAV_MICRODESC, md_body[0], md_body[2]));
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[0]));
+  tt_ptr_op(NULL, OP_EQ,
+            consensus_cache_entry_get_value(ent, "composed-via-sha3-digest"));
+
+  /* Now a new consensus arrives.  We keep the uncompressed diffs to the
+   * previous consensus, and drop the rest. */
+  tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[3], md_ns[3]));
+  tt_int_op(2 * (n_diff_compression_methods() - 1) +
+            (n_consensus_compression_methods() - 1), OP_EQ,
+            consdiffmgr_cleanup());
+  consdiffmgr_rescan();
+  tt_int_op(1, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies();
+
+  /* The diffs from the older consensuses get composed. */
+  consdiffmgr_rescan();
+  tt_int_op(2, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies();
+  for (i = 0; i < N-1; ++i) {
+    tt_int_op(0, OP_EQ,
+              lookup_apply_and_verify_diff(FLAV_MICRODESC,
+                                           md_body[i], md_body[3]));
+  }
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[0]));
+  crypto_digest256((char *)sha3, md_body[2], strlen(md_body[2]),
+                   DIGEST_SHA3_256);
+  base16_encode(hex, sizeof(hex), (const char *)sha3, sizeof(sha3));
+  tt_str_op(consensus_cache_entry_get_value(ent, "composed-via-sha3-digest"),
+            OP_EQ, hex);
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[2]));
+  tt_ptr_op(NULL, OP_EQ,
+            consensus_cache_entry_get_value(ent, "composed-via-sha3-digest"));
+
+ done:
+  get_options_mutable()->ComposeConsensusDiffs = 0;
+  UNMOCK(cpuworker_queue_work);
+  for (i = 0; i < N; ++i) {
+    tor_free(md_body[i]);
+    networkstatus_vote_free(md_ns[i]);
+  }
+#undef N
+}
+
 static void
 test_consdiffmgr_cleanup_old(void *arg)
 {
@@ -888,6 +1060,8 @@ struct testcase_t consdiffmgr_tests[] = {
   TEST(diff_rules),
   TEST(diff_failure),
   TEST(diff_pending),
+  TEST(diff_compression),
+  TEST(diff_compose),
   TEST(cleanup_old),
   TEST(cleanup_bad_valid_after),
   TEST(cleanup_no_valid_after),
@@ -772,6 +772,28 @@ test_container_pqueue(void *arg)
   tt_int_op(smartlist_len(sl),OP_EQ, 0);
   OK();
 
+  /* Removing an item can move an item from another subtree into its place
+   * that is smaller than its new parent. */
+  smartlist_pqueue_add(sl, cmp, offset, &apples);
+  smartlist_pqueue_add(sl, cmp, offset, &lobsters);
+  smartlist_pqueue_add(sl, cmp, offset, &cows);
+  smartlist_pqueue_add(sl, cmp, offset, &roquefort);
+  smartlist_pqueue_add(sl, cmp, offset, &squid);
+  smartlist_pqueue_add(sl, cmp, offset, &daschunds);
+  smartlist_pqueue_add(sl, cmp, offset, &eggplants);
+  OK();
+  smartlist_pqueue_remove(sl, cmp, offset, &squid);
+  tt_int_op(smartlist_len(sl),OP_EQ, 6);
+  OK();
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &apples);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &cows);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &daschunds);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &eggplants);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &lobsters);
+  tt_ptr_op(smartlist_pqueue_pop(sl, cmp, offset),OP_EQ, &roquefort);
+  tt_int_op(smartlist_len(sl),OP_EQ, 0);
+  OK();
+
 #undef OK
 
  done:
@@ -1007,6 +1029,76 @@ test_container_order_functions(void *arg)
   ;
 }
 
+/** Helper for test_container_select_functions: compare two uint32_t. */
+static int
+compare_uint32s_(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x < y) ? -1 : (x > y);
+}
+
+/** Run unit tests for selecting the nth lowest element of an array. */
+static void
+test_container_select_functions(void *arg)
+{
+  const int sizes[] = { 1, 2, 3, 15, 16, 17, 100, 1000 };
+  uint32_t *orig = tor_calloc(1000, sizeof(uint32_t));
+  uint32_t *sorted = tor_calloc(1000, sizeof(uint32_t));
+  uint32_t *arr = tor_calloc(1000, sizeof(uint32_t));
+  (void)arg;
+
+  for (unsigned s = 0; s < ARRAY_LENGTH(sizes); ++s) {
+    const int n = sizes[s];
+    /* Random values with lots of duplicates, then sorted, reversed, and
+     * constant arrays. */
+    for (int kind = 0; kind < 4; ++kind) {
+      for (int i = 0; i < n; ++i) {
+        switch (kind) {
+          case 0: orig[i] = crypto_rand_int(n/2 + 1); break;
+          case 1: orig[i] = i; break;
+          case 2: orig[i] = n - i; break;
+          default: orig[i] = 7; break;
+        }
+      }
+      memcpy(sorted, orig, n * sizeof(uint32_t));
+      qsort(sorted, n, sizeof(uint32_t), compare_uint32s_);
+
+      for (int nth = 0; nth < n; nth += (n > 20 ? n / 10 : 1)) {
+        memcpy(arr, orig, n * sizeof(uint32_t));
+        tt_int_op(sorted[nth], OP_EQ, select_nth_uint32(arr, n, nth));
+        tt_int_op(arr[nth], OP_EQ, sorted[nth]);
+        for (int i = 0; i < n; ++i) {
+          if (i < nth)
+            tt_int_op(arr[i], OP_LE, arr[nth]);
+          else
+            tt_int_op(arr[i], OP_GE, arr[nth]);
+        }
+        /* Everything is still there. */
+        qsort(arr, n, sizeof(uint32_t), compare_uint32s_);
+        tt_mem_op(arr, OP_EQ, sorted, n * sizeof(uint32_t));
+      }
+
+      /* Several order statistics, from lowest to highest. */
+      memcpy(arr, orig, n * sizeof(uint32_t));
+      const int a = n/8, b = n/4, c = (n*3)/4;
+      tt_int_op(sorted[a], OP_EQ, select_nth_uint32(arr, n, a));
+      tt_int_op(sorted[b], OP_EQ, select_nth_uint32(arr + a, n - a, b - a));
+      tt_int_op(sorted[c], OP_EQ, select_nth_uint32(arr + b, n - b, c - b));
+    }
+  }
+
+  double dbls[] = { 1e6, 10.0, 1e4, 1.0, 100.0, 1e5 };
+  tt_double_eq(100.0, select_nth_double(dbls, 6, 2));
+  tt_double_eq(1e4, select_nth_double(dbls + 3, 3, 0));
+  long longs[] = { -30, 30, 100, -100, 7 };
+  tt_int_op(7, OP_EQ, select_nth_long(longs, 5, 2));
+
+ done:
+  tor_free(orig);
+  tor_free(sorted);
+  tor_free(arr);
+}
+
 static void
 test_container_di_map(void *arg)
 {
@@ -1292,6 +1384,7 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(strmap),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
+  CONTAINER(select_functions, 0),
   CONTAINER(di_map, 0),
   CONTAINER_LEGACY(fp_pair_map),
   CONTAINER(smartlist_most_frequent, 0),
@@ -14,10 +14,14 @@
 #define DIRSERV_PRIVATE
 #define DIRVOTE_PRIVATE
 #define DLSTATUS_PRIVATE
+#define EXPOSE_ROUTERDESC_TOKEN_TABLE
 #define HIBERNATE_PRIVATE
 #define NETWORKSTATUS_PRIVATE
 #define NS_PARSE_PRIVATE
+#define NS_SNAPSHOT_PRIVATE
 #define NODE_SELECT_PRIVATE
+#define PROCESS_DESCS_PRIVATE
+#define REACHABILITY_PRIVATE
 #define RELAY_PRIVATE
 #define ROUTERLIST_PRIVATE
 #define ROUTER_PRIVATE
@@ -28,6 +32,8 @@
 #include "app/config/config.h"
 #include "app/config/confparse.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/protover.h"
 #include "core/or/relay.h"
 #include "core/or/versions.h"
 #include "feature/client/bridges.h"
@@ -37,6 +43,7 @@
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirauth/dsigs_parse.h"
 #include "feature/dirauth/process_descs.h"
+#include "feature/dirauth/reachability.h"
 #include "feature/dirauth/recommend_pkg.h"
 #include "feature/dirauth/shared_random_state.h"
 #include "feature/dirauth/voteflags.h"
@@ -53,9 +60,11 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/ns_snapshot.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/parsecommon.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/dirparse/unparseable.h"
 #include "feature/nodelist/routerset.h"
@@ -68,14 +77,19 @@
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
+#include "lib/evloop/timers.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 #include "lib/osinfo/uname.h"
+#include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
 #include "test/log_test_helpers.h"
 #include "test/test.h"
 #include "test/test_dir_common.h"
 
 #include "core/or/addr_policy_st.h"
 #include "feature/nodelist/authority_cert_st.h"
+#include "feature/nodelist/desc_store_st.h"
 #include "feature/nodelist/document_signature_st.h"
 #include "feature/nodelist/extrainfo_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -936,6 +950,289 @@ test_dir_load_routers(void *arg)
   tor_free(list);
 }
 
+/** Helpers for rebuild_store_in_background: the last work that
+ * router_rebuild_store() gave to a cpuworker. */
+static workqueue_reply_t (*store_work_fn)(void *, void *) = NULL;
+static void (*store_work_reply_fn)(void *) = NULL;
+static void *store_work_arg = NULL;
+
+static int
+mock_cpuworker_get_n_threads_one(void)
+{
+  return 1;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work_store(workqueue_priority_t priority,
+                                workqueue_reply_t (*fn)(void *, void *),
+                                void (*reply_fn)(void *),
+                                void *arg)
+{
+  (void) priority;
+  store_work_fn = fn;
+  store_work_reply_fn = reply_fn;
+  store_work_arg = arg;
+  /* Never dereferenced: we don't cancel anything in this test. */
+  return (workqueue_entry_t *) &store_work_arg;
+}
+
+/** Helper for rebuild_store_in_background: do the work that we queued, and
+ * handle its reply. */
+static void
+run_store_work(void)
+{
+  tt_assert(store_work_fn);
+  tt_int_op(store_work_fn(NULL, store_work_arg), OP_EQ, WQ_RPL_REPLY);
+  store_work_reply_fn(store_work_arg);
+ done:
+  store_work_fn = NULL;
+}
+
+static void
+test_dir_rebuild_store_in_background(void *arg)
+{
+  (void) arg;
+  desc_store_t *store = &router_get_routerlist()->desc_store;
+  char d_min[DIGEST_LEN], d_max[DIGEST_LEN];
+  signed_descriptor_t *sd_min, *sd_max;
+  char *fname = get_cachedir_fname("cached-descriptors");
+  char *fname_new = get_cachedir_fname("cached-descriptors.new");
+  char *fname_rebuilding =
+    get_cachedir_fname("cached-descriptors.new.rebuilding");
+  char *contents = NULL;
+  struct stat st;
+  workqueue_reply_t (*fn)(void *, void *);
+
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads_one);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_store);
+  update_approx_time(1412510400);
+
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_MINIMAL,
+                                             strlen(EX_RI_MINIMAL), d_min));
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_MAXIMAL,
+                                             strlen(EX_RI_MAXIMAL), d_max));
+
+  /* Put one descriptor in the journal, and pretend that it's long. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname_new, EX_RI_MINIMAL, 1));
+  tt_int_op(1, OP_EQ,
+            router_load_routers_from_string(EX_RI_MINIMAL, NULL,
+                                            SAVED_IN_JOURNAL, NULL, 0, NULL));
+  sd_min = router_get_by_descriptor_digest(d_min);
+  tt_assert(sd_min);
+  tt_int_op(sd_min->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  store->journal_len = 1<<16;
+
+  /* The rebuild moves the journal aside, and hands off to a worker. */
+  tt_int_op(0, OP_EQ, router_rebuild_store(RRS_DONT_REMOVE_OLD, store));
+  tt_assert(store_work_fn);
+  tt_assert(store->rebuild_job);
+  tt_int_op(store->journal_len, OP_EQ, 0);
+  tt_int_op(file_status(fname_rebuilding), OP_EQ, FN_FILE);
+  tt_int_op(file_status(fname_new), OP_EQ, FN_NOENT);
+
+  /* New descriptors can arrive in the meantime, and we don't start a
+   * second rebuild. */
+  tt_int_op(1, OP_EQ,
+            router_load_routers_from_string(EX_RI_MAXIMAL, NULL,
+                                            SAVED_IN_JOURNAL, NULL, 0, NULL));
+  sd_max = router_get_by_descriptor_digest(d_max);
+  tt_assert(sd_max);
+  store->journal_len = 1<<16;
+  fn = store_work_fn;
+  store_work_fn = NULL;
+  tt_int_op(0, OP_EQ, router_rebuild_store(0, store));
+  tt_ptr_op(store_work_fn, OP_EQ, NULL);
+  store_work_fn = fn;
+
+  /* Once the worker is done, the new store is in place... */
+  run_store_work();
+  tt_int_op(file_status(fname_rebuilding), OP_EQ, FN_NOENT);
+  contents = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(contents);
+  tt_int_op(st.st_size, OP_EQ, store->store_len);
+  tt_assert(tor_memstr(contents, st.st_size, EX_RI_MINIMAL));
+  tt_assert(!tor_memstr(contents, st.st_size, EX_RI_MAXIMAL));
+  tor_free(contents);
+  tt_ptr_op(store->old_mmap, OP_EQ, NULL);
+
+  /* ...and we point the descriptors into it a slice at a time. */
+  tt_int_op(sd_min->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(desc_store_run_fixups(store, 1), OP_EQ, 0);
+  tt_ptr_op(store->rebuild_job, OP_EQ, NULL);
+  tt_int_op(sd_min->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_ptr_op(sd_min->signed_descriptor_body, OP_EQ, NULL);
+  tt_mem_op(signed_descriptor_get_body(sd_min), OP_EQ, EX_RI_MINIMAL,
+            strlen(EX_RI_MINIMAL));
+  tt_int_op(sd_max->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  /* Rebuild again: this time, descriptors that we haven't fixed up yet
+   * keep reading from the store that we replaced. */
+  tt_int_op(0, OP_EQ, router_rebuild_store(RRS_DONT_REMOVE_OLD, store));
+  run_store_work();
+  tt_assert(store->old_mmap);
+  tt_int_op(sd_min->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_uint_op(sd_min->store_parity, OP_NE, store->mmap_parity);
+  tt_mem_op(signed_descriptor_get_body(sd_min), OP_EQ, EX_RI_MINIMAL,
+            strlen(EX_RI_MINIMAL));
+  tt_int_op(desc_store_run_fixups(store, 1), OP_EQ, 1);
+  tt_int_op(desc_store_run_fixups(store, 1), OP_EQ, 0);
+  tt_ptr_op(store->old_mmap, OP_EQ, NULL);
+  tt_ptr_op(store->rebuild_job, OP_EQ, NULL);
+  tt_int_op(sd_min->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(sd_max->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_uint_op(sd_min->store_parity, OP_EQ, store->mmap_parity);
+  tt_mem_op(signed_descriptor_get_body(sd_min), OP_EQ, EX_RI_MINIMAL,
+            strlen(EX_RI_MINIMAL));
+  tt_mem_op(signed_descriptor_get_body(sd_max), OP_EQ, EX_RI_MAXIMAL,
+            strlen(EX_RI_MAXIMAL));
+  tt_int_op(store->journal_len, OP_EQ, 0);
+  tt_int_op(file_status(fname_rebuilding), OP_EQ, FN_NOENT);
+
+ done:
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  tor_free(contents);
+  tor_free(fname);
+  tor_free(fname_new);
+  tor_free(fname_rebuilding);
+}
+
+static int n_reachability_tests = 0;
+static uint32_t last_reachability_test_addr = 0;
+
+static void
+mock_dirserv_single_reachability_test(time_t now, routerinfo_t *router)
+{
+  (void) now;
+  ++n_reachability_tests;
+  last_reachability_test_addr = router->addr;
+}
+
+static void
+test_dir_reachability_pacing(void *arg)
+{
+  (void) arg;
+  const char *descs[] = { EX_RI_MINIMAL, EX_RI_MAXIMAL, EX_RI_MINIMAL_ED };
+  routerinfo_t *routers[3];
+  char d[DIGEST_LEN];
+  uint64_t t0;
+  int i;
+
+  update_approx_time(1412510400);
+  timers_initialize();
+  MOCK(dirserv_single_reachability_test,
+       mock_dirserv_single_reachability_test);
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(1, OP_EQ,
+              router_load_routers_from_string(descs[i], NULL, SAVED_IN_JOURNAL,
+                                              NULL, 0, NULL));
+    tt_int_op(0, OP_EQ, router_get_router_hash(descs[i], strlen(descs[i]),
+                                               d));
+    routers[i] = router_get_mutable_by_digest(
+                          router_get_by_descriptor_digest(d)->identity_digest);
+    tt_assert(routers[i]);
+  }
+
+  /* Until we pace our tests, we launch them at once. */
+  dirserv_test_reachability_soon(routers[0]);
+  tt_int_op(n_reachability_tests, OP_EQ, 1);
+  reachability_test_done(routers[0]->cache_info.identity_digest,
+                         monotime_absolute_msec() + 120);
+
+  /* Once we do, we launch one test per second... */
+  dirserv_reachability_enable_pacing();
+  reachability_set_rate(1);
+  t0 = monotime_absolute_msec();
+  for (i = 0; i < 3; ++i)
+    dirserv_test_reachability_soon(routers[i]);
+  tt_int_op(n_reachability_tests, OP_EQ, 2);
+  reachability_dispatch(t0 + 500);
+  tt_int_op(n_reachability_tests, OP_EQ, 2);
+  reachability_dispatch(t0 + 1100);
+  tt_int_op(n_reachability_tests, OP_EQ, 3);
+  /* ...and don't queue a relay twice. */
+  dirserv_test_reachability_soon(routers[1]);
+  reachability_dispatch(t0 + 5000);
+  tt_int_op(n_reachability_tests, OP_EQ, 4);
+  reachability_dispatch(t0 + 10000);
+  tt_int_op(n_reachability_tests, OP_EQ, 4);
+
+  /* We note when relays answer, and when they don't. */
+  reachability_test_done(routers[1]->cache_info.identity_digest, t0 + 5400);
+  reachability_dispatch(t0 + 100000);
+  setup_capture_of_logs(LOG_NOTICE);
+  dirserv_reachability_log_heartbeat();
+  expect_log_msg_containing("4 launched (0 using a connection we were "
+                            "already opening), 2 answered, 2 unanswered "
+                            "after 60 seconds. Relays answered 50%/90%/99% "
+                            "of tests within 250/500/500 msec. 0 tests "
+                            "queued or in flight.");
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(dirserv_single_reachability_test);
+  dirserv_reachability_free_all();
+}
+
+static void
+test_dir_reachability_address_change(void *arg)
+{
+  (void) arg;
+  routerinfo_t *router;
+  char d[DIGEST_LEN];
+  uint32_t old_addr;
+  uint64_t t0;
+
+  update_approx_time(1412510400);
+  timers_initialize();
+  MOCK(dirserv_single_reachability_test,
+       mock_dirserv_single_reachability_test);
+  tt_int_op(1, OP_EQ,
+            router_load_routers_from_string(EX_RI_MINIMAL, NULL,
+                                            SAVED_IN_JOURNAL, NULL, 0, NULL));
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_MINIMAL,
+                                             strlen(EX_RI_MINIMAL), d));
+  router = router_get_mutable_by_digest(
+                          router_get_by_descriptor_digest(d)->identity_digest);
+  tt_assert(router);
+
+  dirserv_reachability_enable_pacing();
+  reachability_set_rate(1);
+  t0 = monotime_absolute_msec();
+  dirserv_test_reachability_soon(router);
+  tt_int_op(n_reachability_tests, OP_EQ, 1);
+  old_addr = router->addr;
+  tt_int_op(last_reachability_test_addr, OP_EQ, old_addr);
+
+  /* The relay moves while we're testing it: we test it again, at its new
+   * address, as soon as our rate limit allows... */
+  router->addr = old_addr + 1;
+  dirserv_test_reachability_soon(router);
+  tt_int_op(n_reachability_tests, OP_EQ, 1);
+  /* ...and an answer from its old address doesn't count... */
+  reachability_test_done(router->cache_info.identity_digest, t0 + 200);
+  reachability_dispatch(t0 + 1100);
+  tt_int_op(n_reachability_tests, OP_EQ, 2);
+  tt_int_op(last_reachability_test_addr, OP_EQ, old_addr + 1);
+  /* ...but one from its new address does. */
+  reachability_test_done(router->cache_info.identity_digest, t0 + 1300);
+  reachability_dispatch(t0 + 100000);
+  tt_int_op(n_reachability_tests, OP_EQ, 2);
+
+  setup_capture_of_logs(LOG_NOTICE);
+  dirserv_reachability_log_heartbeat();
+  expect_log_msg_containing("2 launched (0 using a connection we were "
+                            "already opening), 1 answered, 0 unanswered "
+                            "after 60 seconds. Relays answered 50%/90%/99% "
+                            "of tests within 250/250/250 msec. 0 tests "
+                            "queued or in flight.");
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(dirserv_single_reachability_test);
+  dirserv_reachability_free_all();
+}
+
 static int mock_get_by_ei_dd_calls = 0;
 static int mock_get_by_ei_dd_unrecognized = 0;
 
@@ -1583,6 +1880,8 @@ test_dir_measured_bw_kb(void *arg)
     "node_id=$557365204145532d32353620696e73746561642e bw=",
     "node_id=$557365204145532d32353620696e73746561642e bw=1024",
     "node_id=$557365204145532d32353620696e73746561642e bw=\n",
+    "node_id=$557365204145532d32353620696e73746561642e bw= 1024\n",
+    "node_id=$557365204145532d32353620696e73746561642e bw=\t1024\n",
     "node_id=$557365204145532d32353620696e7374",
     "node_id=$557365204145532d32353620696e7374\n",
     "",
@@ -2019,8 +2318,21 @@ test_dir_measured_bw_kb_cache(void *arg)
   memset(mbwl[2].node_id, 0x03, DIGEST_LEN);
   mbwl[2].bw_kb = 80;
   /* Try caching something */
-  dirserv_cache_measured_bw(&(mbwl[0]), curr);
+  tt_int_op(dirserv_cache_measured_bw(&(mbwl[0]), curr), OP_EQ, 1);
   tt_int_op(dirserv_get_measured_bw_cache_size(),OP_EQ, 1);
+  /* Caching the same thing again doesn't change anything */
+  tt_int_op(dirserv_cache_measured_bw(&(mbwl[0]), curr), OP_EQ, 0);
+  tt_int_op(dirserv_cache_measured_bw(&(mbwl[0]), curr + 1), OP_EQ, 0);
+  tt_assert(dirserv_query_measured_bw_cache_kb(mbwl[0].node_id,&bw, &as_of));
+  tt_int_op(as_of,OP_EQ, MBWC_INIT_TIME + 1);
+  /* But a new bandwidth does */
+  mbwl[0].bw_kb = 30;
+  tt_int_op(dirserv_cache_measured_bw(&(mbwl[0]), curr + 2), OP_EQ, 1);
+  tt_assert(dirserv_query_measured_bw_cache_kb(mbwl[0].node_id,&bw, &as_of));
+  tt_int_op(bw,OP_EQ, 30);
+  dirserv_clear_measured_bw_cache();
+  mbwl[0].bw_kb = 20;
+  dirserv_cache_measured_bw(&(mbwl[0]), curr);
   /* Okay, let's see if we can retrieve it */
   tt_assert(dirserv_query_measured_bw_cache_kb(mbwl[0].node_id,&bw, &as_of));
   tt_int_op(bw,OP_EQ, 20);
@@ -2760,6 +3072,149 @@ get_my_v3_authority_cert_m(void)
   return mock_cert;
 }
 
+/** Helper for tests that have the cpuworkers help out: the threadpool that
+ * our fake cpuworkers use. */
+static threadpool_t *test_rs_threadpool = NULL;
+
+static void *
+test_rs_new_thread_state(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static int
+mock_cpuworker_get_n_threads(void)
+{
+  return 4;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work_rs(workqueue_priority_t priority,
+                             workqueue_reply_t (*fn)(void *, void *),
+                             void (*reply_fn)(void *),
+                             void *arg)
+{
+  return threadpool_queue_work_priority(test_rs_threadpool, priority,
+                                        fn, reply_fn, arg);
+}
+
+/** How many threads of test_rs_threadpool have reached
+ * test_rs_threadpool_drain()? */
+static atomic_counter_t test_rs_n_drained;
+
+static workqueue_reply_t
+test_rs_count_drained(void *state, void *arg)
+{
+  (void) state;
+  (void) arg;
+  atomic_counter_add(&test_rs_n_drained, 1);
+  return WQ_RPL_REPLY;
+}
+
+/** Wait until every thread of test_rs_threadpool is done with the work it
+ * has, then handle all the replies, so that the work's arguments get
+ * freed. */
+static void
+test_rs_threadpool_drain(void)
+{
+  /* Every thread runs the update before it takes any more work, and after
+   * it has queued the reply for the work it was doing. */
+  atomic_counter_init(&test_rs_n_drained);
+  threadpool_queue_update(test_rs_threadpool, NULL, test_rs_count_drained,
+                          NULL, NULL);
+  while (atomic_counter_get(&test_rs_n_drained) < 4)
+    tor_sleep_msec(1);
+  atomic_counter_destroy(&test_rs_n_drained);
+  replyqueue_process(threadpool_get_replyqueue(test_rs_threadpool));
+}
+
+static void
+test_dir_check_descriptor_sigs(void *arg)
+{
+  (void) arg;
+  static const char *descs[] = {
+    EX_RI_MINIMAL, EX_RI_BAD_SIG1, EX_RI_BAD_SIG2, EX_RI_BAD_PORTS,
+    EX_RI_MINIMAL_ED, EX_RI_ED_BAD_SIG1, EX_RI_ED_BAD_SIG2,
+    EX_RI_ED_BAD_SIG3, EX_RI_ED_BAD_CROSSCERT1, EX_RI_ED_BAD_CROSSCERT3,
+    EX_RI_MAXIMAL,
+  };
+  const int n_descs = (int) ARRAY_LENGTH(descs);
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  smartlist_t *sigchecks = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+  int *results = NULL, *results_par = NULL;
+  routerinfo_t *ri = NULL;
+  int i, idx = 0, n_ok = 0;
+  const int old_min = desc_sigcheck_parallel_min;
+  const int old_batch = desc_sigcheck_batch;
+
+  for (i = 0; i < n_descs; ++i)
+    smartlist_add_strdup(chunks, descs[i]);
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  /* We get a sigcheck for every descriptor that parses. */
+  cp = list;
+  tt_int_op(0, OP_EQ,
+            router_parse_list_deferring_sigs(&cp, NULL, dest, SAVED_NOWHERE,
+                                             0, NULL, sigchecks));
+  tt_ptr_op(cp, OP_EQ, list + strlen(list));
+  tt_int_op(smartlist_len(sigchecks), OP_EQ, smartlist_len(dest));
+  results = tor_calloc(smartlist_len(dest), sizeof(int));
+  results_par = tor_calloc(smartlist_len(dest), sizeof(int));
+  tt_int_op(0, OP_EQ, dirserv_check_descriptor_sigs(sigchecks, results));
+
+  /* Together, parsing and checking accept just the descriptors that
+   * router_parse_entry_from_string() accepts. */
+  for (i = 0; i < n_descs; ++i) {
+    int accepted = 0;
+    if (idx < smartlist_len(dest)) {
+      const routerinfo_t *r = smartlist_get(dest, idx);
+      if (!strcmpstart(descs[i], r->cache_info.signed_descriptor_body))
+        accepted = (results[idx++] == 0);
+    }
+    ri = router_parse_entry_from_string(descs[i], NULL, 0, 0, NULL, NULL);
+    tt_int_op(accepted, OP_EQ, ri != NULL);
+    n_ok += accepted;
+    routerinfo_free(ri);
+  }
+  tt_int_op(idx, OP_EQ, smartlist_len(dest));
+  tt_int_op(n_ok, OP_EQ, 3);
+  tt_int_op(smartlist_len(dest), OP_GT, n_ok);
+
+  /* The cpuworkers come up with the same answers. */
+  desc_sigcheck_parallel_min = 1;
+  desc_sigcheck_batch = 1;
+  if (!test_rs_threadpool)
+    test_rs_threadpool = threadpool_new(4, replyqueue_new(0),
+                                        test_rs_new_thread_state,
+                                        tor_free_, NULL);
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_rs);
+  tt_int_op(1, OP_EQ, dirserv_check_descriptor_sigs(sigchecks, results_par));
+  test_rs_threadpool_drain();
+  tt_mem_op(results, OP_EQ, results_par,
+            smartlist_len(dest) * sizeof(int));
+
+ done:
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  desc_sigcheck_parallel_min = old_min;
+  desc_sigcheck_batch = old_batch;
+  tor_free(results);
+  tor_free(results_par);
+  SMARTLIST_FOREACH(sigchecks, router_sigcheck_t *, sc,
+                    router_sigcheck_free(sc));
+  smartlist_free(sigchecks);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, r, routerinfo_free(r));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(list);
+}
+
 /** Run a unit tests for generating and parsing networkstatuses, with
  * the supply test fns. */
 static void
@@ -2796,6 +3251,7 @@ test_a_networkstatus(
   char *consensus_text2=NULL, *consensus_text3=NULL;
   char *consensus_text_md2=NULL, *consensus_text_md3=NULL;
   char *consensus_text_md=NULL;
+  char *consensus_text_par=NULL, *consensus_text_md_par=NULL;
   networkstatus_t *con2=NULL, *con_md2=NULL, *con3=NULL, *con_md3=NULL;
   ns_detached_signatures_t *dsig1=NULL, *dsig2=NULL;
 
@@ -2929,6 +3385,40 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* Having the cpuworkers compute the router entries doesn't change the
+   * consensus at all. */
+  {
+    const int old_min = consensus_parallel_min_routers;
+    const int old_chunk = consensus_chunk_routers;
+    consensus_parallel_min_routers = 1;
+    consensus_chunk_routers = 1;
+    if (!test_rs_threadpool)
+      test_rs_threadpool = threadpool_new(4, replyqueue_new(0),
+                                          test_rs_new_thread_state,
+                                          tor_free_, NULL);
+    MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+    MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_rs);
+    consensus_text_par = networkstatus_compute_consensus(votes, 3,
+                                                   cert3->identity_key,
+                                                   sign_skey_3,
+                                                   "AAAAAAAAAAAAAAAAAAAA",
+                                                   sign_skey_leg1,
+                                                   FLAV_NS);
+    consensus_text_md_par = networkstatus_compute_consensus(votes, 3,
+                                                   cert3->identity_key,
+                                                   sign_skey_3,
+                                                   "AAAAAAAAAAAAAAAAAAAA",
+                                                   sign_skey_leg1,
+                                                   FLAV_MICRODESC);
+    test_rs_threadpool_drain();
+    UNMOCK(cpuworker_get_n_threads);
+    UNMOCK(cpuworker_queue_work);
+    consensus_parallel_min_routers = old_min;
+    consensus_chunk_routers = old_chunk;
+  }
+  tt_str_op(consensus_text_par, OP_EQ, consensus_text);
+  tt_str_op(consensus_text_md_par, OP_EQ, consensus_text_md);
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
@@ -3135,6 +3625,8 @@ test_a_networkstatus(
   smartlist_free(votes);
   tor_free(consensus_text);
   tor_free(consensus_text_md);
+  tor_free(consensus_text_par);
+  tor_free(consensus_text_md_par);
 
   networkstatus_vote_free(vote);
   networkstatus_vote_free(v1);
@@ -3324,6 +3816,40 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_cumulative_index(void *testdata)
+{
+  const uint64_t vals[10] = {3,1,2,0,6,0,7,5,8,9};
+  uint64_t cumulative[10], total = 0, r;
+  int i, n, expected;
+  (void) testdata;
+
+  for (i = 0; i < 10; ++i) {
+    total += vals[i];
+    cumulative[i] = total;
+  }
+
+  /* For every prefix of the array, and every value we could draw, we
+   * should pick the same element as a linear scan would, and never an
+   * element with zero weight. */
+  for (n = 1; n <= 10; ++n) {
+    for (r = 0; r < cumulative[n-1]; ++r) {
+      expected = 0;
+      while (cumulative[expected] <= r)
+        ++expected;
+      tt_int_op(choose_cumulative_index(cumulative, n, r), OP_EQ, expected);
+      tt_u64_op(vals[expected], OP_GT, 0);
+    }
+  }
+
+  /* A singleton is always chosen. */
+  tt_int_op(choose_cumulative_index(cumulative, 1, 0), OP_EQ, 0);
+  tt_int_op(choose_cumulative_index(cumulative, 1, 2), OP_EQ, 0);
+
+ done:
+  ;
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -6060,6 +6586,406 @@ test_dir_assumed_flags(void *arg)
   routerstatus_free(rs);
 }
 
+/** Helper for parse_routerstatuses_parallel: return a newly allocated run
+ * of <b>n</b> consensus routerstatus entries, sorted by identity, with a
+ * broken address on entry <b>bad_addr_idx</b>, a malformed "id" line on
+ * entry <b>bad_line_idx</b>, and an overlong protocol name on entry
+ * <b>long_proto_idx</b>. */
+static char *
+make_consensus_routerstatuses(int n, int bad_addr_idx, int bad_line_idx,
+                              int long_proto_idx)
+{
+  smartlist_t *ids = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  char long_name[MAX_PROTOCOL_NAME_LENGTH + 2];
+  char *result;
+  int i;
+  for (i = 0; i < n; ++i) {
+    char *id = tor_malloc(DIGEST_LEN);
+    crypto_rand(id, DIGEST_LEN);
+    smartlist_add(ids, id);
+  }
+  smartlist_sort_digests(ids);
+  memset(long_name, 'X', sizeof(long_name) - 1);
+  long_name[sizeof(long_name) - 1] = '\0';
+  SMARTLIST_FOREACH_BEGIN(ids, const char *, id) {
+    char id_b64[BASE64_DIGEST_LEN+1];
+    digest_to_base64(id_b64, id);
+    smartlist_add_asprintf(chunks,
+        "r relay%d %s AAAAAAAAAAAAAAAAAAAAAAAAAAA 2018-11-22 06:00:00 "
+        "10.0.%d.%s 9001 0\n"
+        "s Fast%s Running Stable V2Dir Valid\n"
+        "v Tor 0.3.4.9\n"
+        "%s"
+        "pr %s%sCons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 "
+        "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+        "w Bandwidth=%d\n"
+        "p reject 1-65535\n",
+        id_sl_idx, id_b64, id_sl_idx % 256,
+        id_sl_idx == bad_addr_idx ? "x" : "1",
+        (id_sl_idx % 3) ? " Guard" : "",
+        id_sl_idx == bad_line_idx ? "id ed25519\n" : "",
+        id_sl_idx == long_proto_idx ? long_name : "",
+        id_sl_idx == long_proto_idx ? "=1 " : "",
+        1000 + id_sl_idx);
+  } SMARTLIST_FOREACH_END(id);
+  smartlist_add_strdup(chunks, "directory-footer\n");
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  SMARTLIST_FOREACH(ids, char *, cp, tor_free(cp));
+  smartlist_free(ids);
+  return result;
+}
+
+/** Helper for parse_routerstatuses_parallel: return the number of captured
+ * log messages that contain <b>msg</b>. */
+static int
+n_saved_logs_containing(const char *msg)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(mock_saved_logs(), const mock_saved_log_entry_t *, ent,
+                    if (ent->generated_msg && strstr(ent->generated_msg, msg))
+                      ++n);
+  return n;
+}
+
+/** Messages that we expect when parsing the output of
+ * make_consensus_routerstatuses(). */
+static const char *parallel_rs_warnings[] = {
+  "Error parsing router address",
+  "parse error: Too few arguments to id",
+  "Error tokenizing router status",
+  "very large protocol name",
+};
+
+static void
+test_dir_parse_routerstatuses_parallel(void *arg)
+{
+  (void)arg;
+  const int n = 100;
+  char *body = make_consensus_routerstatuses(n, 42, 60, 70);
+  networkstatus_t *ns_serial = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_t *ns_parallel = tor_malloc_zero(sizeof(networkstatus_t));
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  const char *cp, *cp_parallel;
+  int old_min = ns_parse_parallel_min_entries;
+  int old_chunk = ns_parse_chunk_entries;
+  int n_serial_warnings[ARRAY_LENGTH(parallel_rs_warnings)];
+  unsigned i;
+
+  ns_serial->type = ns_parallel->type = NS_TYPE_CONSENSUS;
+  ns_serial->consensus_method = ns_parallel->consensus_method = 28;
+  ns_serial->routerstatus_list = smartlist_new();
+  ns_parallel->routerstatus_list = smartlist_new();
+
+  /* Parse the entries one by one. */
+  setup_full_capture_of_logs(LOG_WARN);
+  cp = body;
+  while (!strcmpstart(cp, "r ")) {
+    routerstatus_t *rs = routerstatus_parse_entry_from_string(area, &cp,
+                                                              tokens,
+                                                              NULL, NULL,
+                                                              28, FLAV_NS);
+    if (rs)
+      smartlist_add(ns_serial->routerstatus_list, rs);
+  }
+  tt_int_op(smartlist_len(ns_serial->routerstatus_list), OP_EQ, n - 2);
+  for (i = 0; i < ARRAY_LENGTH(parallel_rs_warnings); ++i) {
+    n_serial_warnings[i] = n_saved_logs_containing(parallel_rs_warnings[i]);
+    tt_int_op(n_serial_warnings[i], OP_GT, 0);
+  }
+  tt_int_op(n_serial_warnings[0], OP_EQ, 1);
+  tt_int_op(n_serial_warnings[1], OP_EQ, 1);
+  tt_int_op(n_serial_warnings[2], OP_EQ, 1);
+  mock_clean_saved_logs();
+
+  /* Without any threads, or with too few entries, we don't even try. */
+  cp_parallel = body;
+  tt_int_op(-1, OP_EQ, consensus_parse_routerstatuses_parallel(ns_parallel,
+                                                     FLAV_NS, &cp_parallel));
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  tt_int_op(-1, OP_EQ, consensus_parse_routerstatuses_parallel(ns_parallel,
+                                                     FLAV_NS, &cp_parallel));
+  tt_ptr_op(cp_parallel, OP_EQ, body);
+  tt_int_op(0, OP_EQ, smartlist_len(ns_parallel->routerstatus_list));
+
+  /* Now split them into chunks, and have real threads help out. */
+  ns_parse_parallel_min_entries = 10;
+  ns_parse_chunk_entries = 7;
+  if (!test_rs_threadpool)
+    test_rs_threadpool = threadpool_new(4, replyqueue_new(0),
+                                        test_rs_new_thread_state, tor_free_,
+                                        NULL);
+  tt_assert(test_rs_threadpool);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_rs);
+  tt_int_op(0, OP_EQ, consensus_parse_routerstatuses_parallel(ns_parallel,
+                                                     FLAV_NS, &cp_parallel));
+  test_rs_threadpool_drain();
+  /* We stop in the same place, with the same warnings, each logged as
+   * many times as before... */
+  tt_ptr_op(cp_parallel, OP_EQ, cp);
+  for (i = 0; i < ARRAY_LENGTH(parallel_rs_warnings); ++i) {
+    tt_int_op(n_saved_logs_containing(parallel_rs_warnings[i]), OP_EQ,
+              n_serial_warnings[i]);
+  }
+  teardown_capture_of_logs();
+
+  /* ...and the same entries, in the same order. */
+  tt_int_op(smartlist_len(ns_parallel->routerstatus_list), OP_EQ, n - 2);
+  SMARTLIST_FOREACH_BEGIN(ns_serial->routerstatus_list,
+                          const routerstatus_t *, rs1) {
+    const routerstatus_t *rs2 =
+      smartlist_get(ns_parallel->routerstatus_list, rs1_sl_idx);
+    tt_mem_op(rs1->identity_digest, OP_EQ, rs2->identity_digest, DIGEST_LEN);
+    tt_str_op(rs1->nickname, OP_EQ, rs2->nickname);
+    tt_int_op(rs1->addr, OP_EQ, rs2->addr);
+    tt_int_op(rs1->bandwidth_kb, OP_EQ, rs2->bandwidth_kb);
+    tt_int_op(rs1->is_possible_guard, OP_EQ, rs2->is_possible_guard);
+    tt_int_op(rs1->pv.supports_extend2_cells, OP_EQ,
+              rs2->pv.supports_extend2_cells);
+    tt_str_op(rs1->exitsummary, OP_EQ, rs2->exitsummary);
+  } SMARTLIST_FOREACH_END(rs1);
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  ns_parse_parallel_min_entries = old_min;
+  ns_parse_chunk_entries = old_chunk;
+  networkstatus_vote_free(ns_serial);
+  networkstatus_vote_free(ns_parallel);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(body);
+}
+
+/** Helper for consensus_snapshot: return a newly allocated consensus with
+ * <b>n</b> entries, with random identities. */
+static char *
+make_snapshot_consensus(int n)
+{
+  smartlist_t *ids = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < n; ++i) {
+    char *id = tor_malloc(DIGEST_LEN);
+    crypto_rand(id, DIGEST_LEN);
+    smartlist_add(ids, id);
+  }
+  smartlist_sort_digests(ids);
+  smartlist_add_strdup(chunks, "network-status-version 3\n"
+                       "vote-status consensus\n"
+                       "consensus-method 28\n"
+                       "valid-after 2018-11-22 06:00:00\n"
+                       "fresh-until 2018-11-22 07:00:00\n"
+                       "valid-until 2018-11-22 09:00:00\n"
+                       "voting-delay 300 300\n"
+                       "known-flags Exit Fast Guard Running Stable V2Dir "
+                       "Valid\n"
+                       "dir-source auth "
+                       "0000000000000000000000000000000000000000 "
+                       "192.0.2.1 192.0.2.1 80 443\n"
+                       "contact auth@example.com\n"
+                       "vote-digest "
+                       "0000000000000000000000000000000000000000\n");
+  SMARTLIST_FOREACH_BEGIN(ids, const char *, id) {
+    char id_b64[BASE64_DIGEST_LEN+1];
+    char ipv6[64] = "";
+    const int is_exit = (id_sl_idx % 5) == 0;
+    digest_to_base64(id_b64, id);
+    if (id_sl_idx % 2)
+      tor_snprintf(ipv6, sizeof(ipv6), "a [2001:db8::%x]:9001\n",
+                   id_sl_idx);
+    smartlist_add_asprintf(chunks,
+        "r relay%d %s AAAAAAAAAAAAAAAAAAAAAAAAAAA 2018-11-22 06:00:00 "
+        "10.0.%d.1 9001 %d\n"
+        "%s"
+        "s%s Fast%s Running Stable V2Dir Valid\n"
+        "v Tor 0.3.4.9\n"
+        "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 "
+        "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+        "w Bandwidth=%d%s\n"
+        "p %s\n",
+        id_sl_idx, id_b64, id_sl_idx % 256, (id_sl_idx % 3) ? 0 : 9030,
+        ipv6, is_exit ? " Exit" : "", (id_sl_idx % 3) ? " Guard" : "",
+        1000 + id_sl_idx, (id_sl_idx % 7) ? "" : " Unmeasured=1",
+        is_exit ? "accept 80,443" : "reject 1-65535");
+  } SMARTLIST_FOREACH_END(id);
+  smartlist_add_strdup(chunks, "directory-footer\n"
+                       "directory-signature "
+                       "0000000000000000000000000000000000000000 "
+                       "0000000000000000000000000000000000000000\n"
+                       "-----BEGIN SIGNATURE-----\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n"
+                       "-----END SIGNATURE-----\n");
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  SMARTLIST_FOREACH(ids, char *, cp, tor_free(cp));
+  smartlist_free(ids);
+  return result;
+}
+
+static void
+test_dir_consensus_snapshot(void *arg)
+{
+  (void)arg;
+  const int n = 60;
+  char *cons = make_snapshot_consensus(n);
+  char *other = make_snapshot_consensus(n);
+  char *fname = ns_snapshot_get_fname(FLAV_NS);
+  char *body = NULL;
+  networkstatus_t *ns = NULL, *ns2 = NULL;
+  ns_snapshot_t *snap = NULL;
+  struct stat st;
+  int used = -1;
+
+  ns = networkstatus_parse_vote_from_string(cons, NULL, NS_TYPE_CONSENSUS);
+  tt_assert(ns);
+  tt_int_op(smartlist_len(ns->routerstatus_list), OP_EQ, n);
+
+  /* Nothing to open until we write a snapshot. */
+  tt_ptr_op(ns_snapshot_open(FLAV_NS), OP_EQ, NULL);
+  tt_int_op(ns_snapshot_write(ns), OP_EQ, 0);
+  tt_ptr_op(ns_snapshot_open(FLAV_MICRODESC), OP_EQ, NULL);
+  snap = ns_snapshot_open(FLAV_NS);
+  tt_assert(snap);
+
+  /* The snapshot gives us the same entries as the text. */
+  ns2 = networkstatus_parse_consensus_with_snapshot(cons, snap, &used);
+  tt_assert(ns2);
+  tt_int_op(used, OP_EQ, 1);
+  tt_mem_op(&ns->digests, OP_EQ, &ns2->digests, sizeof(ns->digests));
+  tt_int_op(smartlist_len(ns2->voters), OP_EQ, 1);
+  tt_int_op(smartlist_len(ns2->routerstatus_list), OP_EQ, n);
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *,
+                          rs1) {
+    const routerstatus_t *rs2 =
+      smartlist_get(ns2->routerstatus_list, rs1_sl_idx);
+    tt_int_op(rs1->published_on, OP_EQ, rs2->published_on);
+    tt_str_op(rs1->nickname, OP_EQ, rs2->nickname);
+    tt_mem_op(rs1->identity_digest, OP_EQ, rs2->identity_digest, DIGEST_LEN);
+    tt_mem_op(rs1->descriptor_digest, OP_EQ, rs2->descriptor_digest,
+              DIGEST256_LEN);
+    tt_int_op(rs1->addr, OP_EQ, rs2->addr);
+    tt_int_op(rs1->or_port, OP_EQ, rs2->or_port);
+    tt_int_op(rs1->dir_port, OP_EQ, rs2->dir_port);
+    tt_assert(tor_addr_eq(&rs1->ipv6_addr, &rs2->ipv6_addr));
+    tt_int_op(rs1->ipv6_orport, OP_EQ, rs2->ipv6_orport);
+    tt_int_op(rs1->is_exit, OP_EQ, rs2->is_exit);
+    tt_int_op(rs1->is_possible_guard, OP_EQ, rs2->is_possible_guard);
+    tt_int_op(rs1->is_flagged_running, OP_EQ, rs2->is_flagged_running);
+    tt_int_op(rs1->is_v2_dir, OP_EQ, rs2->is_v2_dir);
+    tt_int_op(rs1->bw_is_unmeasured, OP_EQ, rs2->bw_is_unmeasured);
+    tt_int_op(rs1->bandwidth_kb, OP_EQ, rs2->bandwidth_kb);
+    tt_mem_op(&rs1->pv, OP_EQ, &rs2->pv, sizeof(rs1->pv));
+    tt_str_op(rs1->exitsummary, OP_EQ, rs2->exitsummary);
+  } SMARTLIST_FOREACH_END(rs1);
+  networkstatus_vote_free(ns2);
+
+  /* We don't use it with any other consensus. */
+  ns2 = networkstatus_parse_consensus_with_snapshot(other, snap, &used);
+  tt_assert(ns2);
+  tt_int_op(used, OP_EQ, 0);
+  tt_int_op(smartlist_len(ns2->routerstatus_list), OP_EQ, n);
+  networkstatus_vote_free(ns2);
+  ns_snapshot_free(snap);
+
+  /* If the records are damaged, we notice, and parse the text instead. */
+  body = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(body);
+  body[st.st_size / 2] ^= 0x10;
+  tt_int_op(write_bytes_to_file(fname, body, st.st_size, 1), OP_EQ, 0);
+  snap = ns_snapshot_open(FLAV_NS);
+  tt_assert(snap);
+  setup_capture_of_logs(LOG_WARN);
+  ns2 = networkstatus_parse_consensus_with_snapshot(cons, snap, &used);
+  expect_single_log_msg_containing("Consensus snapshot is corrupt");
+  teardown_capture_of_logs();
+  tt_assert(ns2);
+  tt_int_op(used, OP_EQ, 0);
+  tt_int_op(smartlist_len(ns2->routerstatus_list), OP_EQ, n);
+  ns_snapshot_free(snap);
+
+  /* A truncated snapshot doesn't even open. */
+  tt_int_op(write_bytes_to_file(fname, body, st.st_size - 1, 1), OP_EQ, 0);
+  tt_ptr_op(ns_snapshot_open(FLAV_NS), OP_EQ, NULL);
+
+ done:
+  teardown_capture_of_logs();
+  ns_snapshot_free(snap);
+  networkstatus_vote_free(ns);
+  networkstatus_vote_free(ns2);
+  tor_free(cons);
+  tor_free(other);
+  tor_free(fname);
+  tor_free(body);
+}
+
+static void
+test_dir_tokenize_keywords(void *arg)
+{
+  (void)arg;
+  memarea_t *area = memarea_new();
+  directory_token_t *tok;
+  const char *s, *eos;
+
+#define NEXT_TOKEN(str)                                          \
+  STMT_BEGIN                                                    \
+    s = (str);                                                  \
+    eos = s + strlen(s);                                        \
+    tok = get_next_token(area, &s, eos, routerdesc_token_table); \
+  STMT_END
+
+  /* Keywords only match when they have the same length. */
+  NEXT_TOKEN("router a 10.0.0.1 9001 0 0\n");
+  tt_int_op(tok->tp, OP_EQ, K_ROUTER);
+  tt_int_op(tok->n_args, OP_EQ, 5);
+  NEXT_TOKEN("route a 10.0.0.1 9001 0 0\n");
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  NEXT_TOKEN("routers a 10.0.0.1 9001 0 0\n");
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  NEXT_TOKEN("reject6 *:*\n");
+  tt_int_op(tok->tp, OP_EQ, K_REJECT6);
+  NEXT_TOKEN("reject *:*\n");
+  tt_int_op(tok->tp, OP_EQ, K_REJECT);
+  NEXT_TOKEN("opt   reject *:*");
+  tt_int_op(tok->tp, OP_EQ, K_REJECT);
+  tt_int_op(tok->n_args, OP_EQ, 1);
+  tt_str_op(tok->args[0], OP_EQ, "*:*");
+  tt_ptr_op(s, OP_EQ, eos);
+  NEXT_TOKEN("optional reject *:*\n");
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+
+  /* Objects still need a complete begin line. */
+  NEXT_TOKEN("router-signature\n"
+             "-----BEGIN SIGNATURE-----\n"
+             "AAAA\n"
+             "-----END SIGNATURE-----\n");
+  tt_int_op(tok->tp, OP_EQ, K_ROUTER_SIGNATURE);
+  tt_str_op(tok->object_type, OP_EQ, "SIGNATURE");
+  tt_int_op(tok->object_size, OP_EQ, 3);
+  NEXT_TOKEN("router-signature\n-----BEGIN SIGNATURE-----");
+  tt_int_op(tok->tp, OP_EQ, ERR_);
+  tt_str_op(tok->error, OP_EQ, "Missing object for router-signature");
+  NEXT_TOKEN("router-signature\n-----BEGIN");
+  tt_int_op(tok->tp, OP_EQ, ERR_);
+  tt_str_op(tok->error, OP_EQ, "Missing object for router-signature");
+  NEXT_TOKEN("contact a b\n-----BEGIN\n");
+  tt_int_op(tok->tp, OP_EQ, K_CONTACT);
+  tt_ptr_op(tok->object_type, OP_EQ, NULL);
+
+#undef NEXT_TOKEN
+ done:
+  memarea_drop_all(area);
+}
+
 static void
 test_dir_post_parsing(void *arg)
 {
@@ -6303,7 +7229,11 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(check_descriptor_sigs, TT_FORK),
   DIR(load_routers, TT_FORK),
+  DIR(rebuild_store_in_background, TT_FORK),
+  DIR(reachability_pacing, TT_FORK),
+  DIR(reachability_address_change, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR(getinfo_extra, 0),
   DIR_LEGACY(versions),
@@ -6317,6 +7247,7 @@ struct testcase_t dir_tests[] = {
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(cumulative_index, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -6353,6 +7284,9 @@ struct testcase_t dir_tests[] = {
   DIR_ARG(find_dl_min_delay, TT_FORK, "cfr"),
   DIR_ARG(find_dl_min_delay, TT_FORK, "car"),
   DIR(assumed_flags, 0),
+  DIR(parse_routerstatuses_parallel, TT_FORK),
+  DIR(consensus_snapshot, TT_FORK),
+  DIR(tokenize_keywords, 0),
   DIR(networkstatus_compute_bw_weights_v10, 0),
   DIR(platform_str, 0),
   DIR(networkstatus_consensus_has_ipv6, TT_FORK),
@@ -9,15 +9,20 @@
 #define CONFIG_PRIVATE
 #define RENDCACHE_PRIVATE
 #define DIRCACHE_PRIVATE
+#define RESPCACHE_PRIVATE
 
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "feature/dircache/conscache.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircommon/directory.h"
 #include "feature/dircache/dircache.h"
 #include "test/test.h"
 #include "lib/compress/compress.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/confline.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/rend/rendcache.h"
 #include "feature/relay/router.h"
@@ -35,10 +40,12 @@
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/dircache/dirserv.h"
+#include "feature/dircache/respcache.h"
 #include "feature/dirauth/dirvote.h"
 #include "test/log_test_helpers.h"
 #include "feature/dircommon/voting_schedule.h"
 
+#include "feature/dircache/cached_dir_st.h"
 #include "feature/dircommon/dir_connection_st.h"
 #include "feature/dirclient/dir_server_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -561,6 +568,159 @@ test_dir_handle_get_micro_d(void *data)
     microdesc_free_all();
 }
 
+static void
+test_dir_handle_get_micro_d_respcache(void *data)
+{
+  dir_connection_t *conn = NULL;
+  microdesc_cache_t *mc = NULL ;
+  smartlist_t *list = NULL;
+  char digest[DIGEST256_LEN];
+  char digest_base64[128];
+  char path[80];
+  char *header = NULL;
+  char *body[2] = { NULL, NULL };
+  size_t body_used[2] = { 0, 0 };
+  char *uncompressed = NULL;
+  size_t uncompressed_len = 0;
+  int i;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+
+  /* SETUP */
+  init_mock_options();
+  mock_options->CompressedResponseCacheSize = 1<<20;
+
+  crypto_digest256(digest, microdesc, strlen(microdesc), DIGEST_SHA256);
+  base64_encode_nopad(digest_base64, sizeof(digest_base64),
+                      (uint8_t *) digest, DIGEST256_LEN);
+
+  mc = get_microdesc_cache();
+  list = microdescs_add_to_cache(mc, microdesc, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(list));
+
+  /* Ask for the same compressed microdesc twice: the first answer gets
+   * compressed and remembered; the second comes from the cache. */
+  tor_snprintf(path, sizeof(path), MICRODESC_GET("%s.z"), digest_base64);
+  for (i = 0; i < 2; ++i) {
+    conn = new_dir_conn();
+    tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+    tt_ptr_op(conn->spool, OP_EQ, NULL);
+    tt_ptr_op(conn->respcache_buf, OP_EQ, NULL);
+
+    fetch_from_buf_http(TO_CONN(conn)->outbuf, &header, MAX_HEADERS_SIZE,
+                        &body[i], &body_used[i], 4096, 1);
+    tt_assert(header);
+    tt_assert(body[i]);
+    tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
+    tt_assert(strstr(header, "Content-Encoding: deflate\r\n"));
+    tor_free(header);
+    connection_free_minimal(TO_CONN(conn));
+    conn = NULL;
+    tt_int_op(1, OP_EQ, respcache_get_n_entries());
+  }
+
+  tt_int_op(body_used[0], OP_EQ, body_used[1]);
+  tt_mem_op(body[0], OP_EQ, body[1], body_used[0]);
+  tt_int_op(0, OP_EQ, tor_uncompress(&uncompressed, &uncompressed_len,
+                                     body[1], body_used[1], ZLIB_METHOD,
+                                     1, LOG_WARN));
+  tt_str_op(uncompressed, OP_EQ, microdesc);
+
+  /* Uncompressed requests don't touch the cache. */
+  conn = new_dir_conn();
+  tor_snprintf(path, sizeof(path), MICRODESC_GET("%s"), digest_base64);
+  tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+  tt_ptr_op(conn->respcache_buf, OP_EQ, NULL);
+
+  setup_capture_of_logs(LOG_NOTICE);
+  respcache_log_heartbeat();
+  expect_log_msg_containing("1 hits and 1 misses (50.0% hit rate)");
+  teardown_capture_of_logs();
+
+ done:
+  UNMOCK(get_options);
+  UNMOCK(connection_write_to_buf_impl_);
+
+  teardown_capture_of_logs();
+  respcache_free_all();
+  or_options_free(mock_options); mock_options = NULL;
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  tor_free(header);
+  tor_free(body[0]);
+  tor_free(body[1]);
+  tor_free(uncompressed);
+  smartlist_free(list);
+  microdesc_free_all();
+}
+
+static void
+test_dir_handle_get_respcache_lru(void *data)
+{
+  uint8_t keys[6][DIGEST256_LEN];
+  cached_dir_t *d = NULL;
+  int i;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  init_mock_options();
+  mock_options->CompressedResponseCacheSize = 4096;
+
+  for (i = 0; i < 6; ++i)
+    memset(keys[i], 'a' + i, DIGEST256_LEN);
+
+  /* Nothing bigger than a quarter of the cache gets in. */
+  tt_int_op(respcache_max_entry_size(), OP_LT, 1024);
+  respcache_add(keys[5], tor_malloc_zero(1024), 1024);
+  tt_int_op(0, OP_EQ, respcache_get_n_entries());
+
+  /* Four entries fit... */
+  for (i = 0; i < 4; ++i) {
+    respcache_add(keys[i], tor_malloc_zero(800), 800);
+  }
+  tt_int_op(4, OP_EQ, respcache_get_n_entries());
+  tt_int_op(respcache_get_total_bytes(), OP_LE, 4096);
+
+  /* ...and using the oldest one makes the next-oldest the one to go. */
+  d = respcache_lookup(keys[0]);
+  tt_assert(d);
+  tt_int_op(d->dir_compressed_len, OP_EQ, 800);
+  tt_int_op(d->refcnt, OP_EQ, 2);
+  respcache_add(keys[4], tor_malloc_zero(800), 800);
+  tt_int_op(4, OP_EQ, respcache_get_n_entries());
+  tt_int_op(respcache_get_total_bytes(), OP_LE, 4096);
+  tt_ptr_op(respcache_lookup(keys[1]), OP_EQ, NULL);
+  cached_dir_decref(d);
+  d = respcache_lookup(keys[4]);
+  tt_assert(d);
+  cached_dir_decref(d);
+  d = NULL;
+
+  /* Evicted responses stay alive while someone is still sending them. */
+  d = respcache_lookup(keys[2]);
+  tt_assert(d);
+  respcache_free_all();
+  tt_int_op(0, OP_EQ, respcache_get_n_entries());
+  tt_int_op(d->refcnt, OP_EQ, 1);
+  tt_int_op(d->dir_compressed_len, OP_EQ, 800);
+
+  /* Turning the cache off empties it. */
+  respcache_add(keys[3], tor_malloc_zero(800), 800);
+  tt_int_op(1, OP_EQ, respcache_get_n_entries());
+  mock_options->CompressedResponseCacheSize = 0;
+  tt_ptr_op(respcache_lookup(keys[3]), OP_EQ, NULL);
+  tt_int_op(0, OP_EQ, respcache_get_n_entries());
+
+ done:
+  cached_dir_decref(d);
+  respcache_free_all();
+  UNMOCK(get_options);
+  or_options_free(mock_options); mock_options = NULL;
+}
+
 static void
 test_dir_handle_get_micro_d_server_busy(void *data)
 {
@@ -2583,6 +2743,98 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   ;
 }
 
+static void
+mock_connection_start_writing(connection_t *conn)
+{
+  (void)conn;
+}
+
+static void
+test_dir_handle_get_spool_sendfile(void *data)
+{
+  (void)data;
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char *ddir_fname = NULL;
+  consensus_cache_t *cache = NULL;
+  consensus_cache_entry_t *ent = NULL;
+  dir_connection_t *conn = NULL;
+  config_line_t *labels = NULL;
+  const size_t bodylen = 100000;
+  char *body = tor_malloc(bodylen);
+  char *got = tor_malloc_zero(bodylen);
+  size_t n_got = 0;
+  ssize_t n;
+
+  MOCK(connection_start_writing, mock_connection_start_writing);
+
+  crypto_rand(body, bodylen);
+  ddir_fname = tor_strdup(get_fname_rnd("datadir_cache"));
+  tor_free(get_options_mutable()->CacheDirectory);
+  get_options_mutable()->CacheDirectory = tor_strdup(ddir_fname);
+  check_private_dir(ddir_fname, CPD_CREATE, NULL);
+  cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+  config_line_append(&labels, "Hello", "world");
+  ent = consensus_cache_add(cache, labels, (const uint8_t *)body, bodylen);
+  tt_assert(ent);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  conn = dir_connection_new(AF_UNIX);
+  TO_CONN(conn)->s = fds[0];
+  fds[0] = TOR_INVALID_SOCKET; /* conn owns it now. */
+  TO_CONN(conn)->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->spool = smartlist_new();
+  smartlist_add(conn->spool, spooled_resource_new_from_cache_entry(ent));
+
+  /* The body doesn't go through the outbuf... */
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  tt_int_op(0, OP_EQ, connection_get_outbuf_len(TO_CONN(conn)));
+  tt_assert(connection_dirserv_sendfile_pending(conn));
+
+  /* ...but straight from the file to the socket, no more than we ask for
+   * at a time. */
+  while (connection_dirserv_sendfile_pending(conn)) {
+    n = connection_dirserv_sendfile(conn, 16384);
+    tt_int_op(n, OP_GE, 0);
+    tt_int_op(n, OP_LE, 16384);
+    n = tor_socket_recv(fds[1], got + n_got, bodylen - n_got, 0);
+    if (n > 0)
+      n_got += n;
+  }
+  while (n_got < bodylen) {
+    n = tor_socket_recv(fds[1], got + n_got, bodylen - n_got, 0);
+    tt_int_op(n, OP_GT, 0);
+    n_got += n;
+  }
+  tt_mem_op(got, OP_EQ, body, bodylen);
+
+  /* Once it's sent, we're done with it. */
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  tt_ptr_op(conn->spool, OP_EQ, NULL);
+
+ done:
+  UNMOCK(connection_start_writing);
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  config_free_lines(labels);
+  consensus_cache_entry_decref(ent);
+  consensus_cache_free(cache);
+  tor_free(ddir_fname);
+  tor_free(body);
+  tor_free(got);
+#else
+  tt_skip();
+ done:
+  ;
+#endif /* defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) */
+}
+
 #define DIR_HANDLE_CMD(name,flags) \
   { #name, test_dir_handle_get_##name, (flags), NULL, NULL }
 
@@ -2600,6 +2852,8 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(micro_d_not_found, 0),
   DIR_HANDLE_CMD(micro_d_server_busy, 0),
   DIR_HANDLE_CMD(micro_d, 0),
+  DIR_HANDLE_CMD(micro_d_respcache, 0),
+  DIR_HANDLE_CMD(respcache_lru, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_without_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_wrong_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges, 0),
@@ -2642,5 +2896,6 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures_busy, 0),
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures, 0),
   DIR_HANDLE_CMD(parse_accept_encoding, 0),
+  DIR_HANDLE_CMD(spool_sendfile, TT_FORK),
   END_OF_TESTCASES
 };
@@ -9,6 +9,7 @@
 #define ENTRYNODES_PRIVATE
 #define ROUTERLIST_PRIVATE
 #define DIRCLIENT_PRIVATE
+#define NODE_SELECT_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
@@ -23,6 +24,7 @@
 #include "feature/dirclient/dirclient.h"
 #include "feature/client/entrynodes.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/networkstatus.h"
 #include "core/or/policies.h"
 #include "feature/nodelist/routerlist.h"
@@ -186,6 +188,7 @@ big_fake_network_setup(const struct testcase_t *testcase)
       n->md->exit_policy = parse_short_policy("accept 443");
     }
 
+    n->nodelist_idx = smartlist_len(big_fake_net_nodes);
     smartlist_add(big_fake_net_nodes, n);
   }
 
@@ -3001,6 +3004,116 @@ test_entry_guard_vanguard_path_selection(void *arg)
   circuit_free_(circ);
 }
 
+/** Test that router_choose_random_node() never picks a node that we
+ * excluded, or one that doesn't meet our restrictions, whether it finds
+ * one by drawing from its weighted table or by listing the candidates. */
+static void
+test_entry_guard_choose_random_node_exclusions(void *arg)
+{
+  smartlist_t *excluded = smartlist_new();
+  const node_t *node, *only_node;
+  int i;
+  (void)arg;
+
+  /* Exclude every third node. */
+  SMARTLIST_FOREACH(big_fake_net_nodes, node_t *, n,
+                    if (n_sl_idx % 3 == 0) smartlist_add(excluded, n));
+
+  for (i = 0; i < 1000; ++i) {
+    node = router_choose_random_node(excluded, NULL,
+                                     CRN_NEED_GUARD|CRN_NEED_DESC);
+    tt_assert(node);
+    tt_assert(node->is_possible_guard);
+    tt_assert(!smartlist_contains(excluded, node));
+  }
+
+  /* Exclude all but one node: we should almost never draw it from the
+   * table, and must find it by listing the candidates. */
+  only_node = smartlist_get(big_fake_net_nodes, 1);
+  smartlist_clear(excluded);
+  smartlist_add_all(excluded, big_fake_net_nodes);
+  smartlist_remove(excluded, only_node);
+  for (i = 0; i < 10; ++i) {
+    node = router_choose_random_node(excluded, NULL, 0);
+    tt_ptr_op(node, OP_EQ, only_node);
+  }
+
+  /* And if we exclude that one too, there's nothing left. */
+  smartlist_add(excluded, (node_t *)only_node);
+  setup_full_capture_of_logs(LOG_WARN);
+  node = router_choose_random_node(excluded, NULL, 0);
+  tt_ptr_op(node, OP_EQ, NULL);
+  expect_single_log_msg_containing("No available nodes");
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(excluded);
+}
+
+/** Test that the candidates that router_choose_random_node() finds with its
+ * node flag index are the ones we'd get by listing the running nodes and
+ * subtracting the excluded ones, and that the index follows changes to
+ * individual nodes' flags. */
+static void
+test_entry_guard_choose_random_node_flag_index(void *arg)
+{
+  smartlist_t *excluded = smartlist_new();
+  smartlist_t *expected = smartlist_new();
+  smartlist_t *found = smartlist_new();
+  node_t *down_node;
+  int i;
+  (void)arg;
+
+  /* Exclude every fifth node, and make some nodes unstable or not fast. */
+  SMARTLIST_FOREACH_BEGIN(big_fake_net_nodes, node_t *, n) {
+    if (n_sl_idx % 5 == 0)
+      smartlist_add(excluded, n);
+    n->is_stable = (n_sl_idx % 3) != 0;
+    n->is_fast = (n_sl_idx % 7) != 0;
+  } SMARTLIST_FOREACH_END(n);
+  node_select_nodelist_changed();
+
+  router_add_running_nodes_to_smartlist(expected, 1, 1, 1, 0, 0, 0);
+  smartlist_subtract(expected, excluded);
+  router_add_candidate_nodes_to_smartlist(found, NULL, excluded, NULL,
+                        CRN_NEED_UPTIME|CRN_NEED_CAPACITY|CRN_NEED_GUARD);
+  tt_int_op(smartlist_len(found), OP_GT, 0);
+  smartlist_sort_pointers(expected);
+  smartlist_sort_pointers(found);
+  tt_assert(smartlist_ptrs_eq(expected, found));
+
+  /* Build the index while a node is down, and then mark it up again: our
+   * index has to notice. */
+  down_node = smartlist_get(big_fake_net_nodes, 1);
+  tt_assert(!smartlist_contains(excluded, down_node));
+  down_node->is_running = 0;
+  node_select_nodelist_changed();
+  smartlist_clear(found);
+  router_add_candidate_nodes_to_smartlist(found, NULL, excluded, NULL, 0);
+  tt_assert(!smartlist_contains(found, down_node));
+
+  /* Now it's the only node that isn't excluded, so we must pick it once
+   * it's up again. */
+  smartlist_clear(excluded);
+  smartlist_add_all(excluded, big_fake_net_nodes);
+  smartlist_remove(excluded, down_node);
+  down_node->is_running = 1;
+  node_select_node_flags_changed(down_node);
+  smartlist_clear(found);
+  router_add_candidate_nodes_to_smartlist(found, NULL, excluded, NULL, 0);
+  tt_int_op(smartlist_len(found), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(found, 0), OP_EQ, down_node);
+  for (i = 0; i < 10; ++i) {
+    tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ,
+              down_node);
+  }
+
+ done:
+  smartlist_free(excluded);
+  smartlist_free(expected);
+  smartlist_free(found);
+}
+
 static const struct testcase_setup_t big_fake_network = {
   big_fake_network_setup, big_fake_network_cleanup
 };
@@ -3066,6 +3179,8 @@ struct testcase_t entrynodes_tests[] = {
   BFN_TEST(outdated_dirserver_exclusion),
   BFN_TEST(basic_path_selection),
   BFN_TEST(vanguard_path_selection),
+  BFN_TEST(choose_random_node_exclusions),
+  BFN_TEST(choose_random_node_flag_index),
 
   UPGRADE_TEST(upgrade_a_circuit, "c1-done c2-done"),
   UPGRADE_TEST(upgrade_blocked_by_live_primary_guards, "c1-done c2-done"),
@@ -557,6 +557,7 @@ test_descriptor_fetch(void *arg)
   tt_assert(ENTRY_TO_EDGE_CONN(ec)->hs_ident);
   TO_CONN(ENTRY_TO_EDGE_CONN(ec))->state = AP_CONN_STATE_RENDDESC_WAIT;
   smartlist_add(get_connection_array(), &ec->edge_.base_);
+  connection_array_by_type_add(&ec->edge_.base_);
 
   /* 1. FetchHidServDescriptors is false so we shouldn't be able to fetch. */
   get_options_mutable()->FetchHidServDescriptors = 0;
@@ -593,8 +594,10 @@ test_descriptor_fetch(void *arg)
     TO_CONN(dir_conn)->purpose = DIR_PURPOSE_FETCH_HSDESC;
     ed25519_pubkey_copy(&dir_conn->hs_ident->identity_pk, &service_pk);
     smartlist_add(get_connection_array(), TO_CONN(dir_conn));
+    connection_array_by_type_add(TO_CONN(dir_conn));
     ret = hs_client_refetch_hsdesc(&service_pk);
     smartlist_remove(get_connection_array(), TO_CONN(dir_conn));
+    connection_array_by_type_remove(TO_CONN(dir_conn));
     connection_free_minimal(TO_CONN(dir_conn));
     tt_int_op(ret, OP_EQ, HS_CLIENT_FETCH_PENDING);
   }
@@ -782,6 +785,7 @@ helper_build_socks_connection(const ed25519_public_key_t *service_pk,
   ENTRY_TO_EDGE_CONN(socks)->hs_ident = hs_ident_edge_conn_new(service_pk);
   TO_CONN(ENTRY_TO_EDGE_CONN(socks))->state = conn_state;
   smartlist_add(get_connection_array(), &socks->edge_.base_);
+  connection_array_by_type_add(&socks->edge_.base_);
   return socks;
 }
 
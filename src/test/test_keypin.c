@@ -4,10 +4,16 @@
 #include "orconfig.h"
 #define KEYPIN_PRIVATE
 #include "core/or/or.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/dirauth/keypin.h"
+#include "lib/evloop/workqueue.h"
 
 #include "test/test.h"
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
 static void
 test_keypin_parse_line(void *arg)
 {
@@ -240,6 +246,150 @@ test_keypin_journal(void *arg)
   keypin_clear();
 }
 
+static workqueue_reply_t (*queued_fn)(void *, void *) = NULL;
+static void (*queued_reply_fn)(void *) = NULL;
+static void *queued_arg = NULL;
+
+static int
+mock_cpuworker_get_n_threads(void)
+{
+  return 1;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  queued_fn = fn;
+  queued_reply_fn = reply_fn;
+  queued_arg = arg;
+  return (workqueue_entry_t *)&queued_arg;
+}
+
+static void
+test_keypin_store(void *arg)
+{
+  (void)arg;
+  char *contents = NULL;
+  struct stat st;
+  char *fname_store = tor_strdup(get_fname("keypin-store"));
+  const char *fname = get_fname("keypin-store-journal");
+
+#ifdef _WIN32
+  tt_skip();
+#endif
+
+  tt_int_op(0, OP_EQ, keypin_load_store(fname_store)); /* ENOENT is okay */
+  tt_int_op(0, OP_EQ, keypin_load_journal(fname));
+  update_approx_time(1217709000);
+  tt_int_op(0, OP_EQ, keypin_open_journal(fname));
+  tt_int_op(KEYPIN_ADDED, OP_EQ, ADD("king-of-the-herrings",
+                                  "good-for-nothing attorney-at-law"));
+  tt_int_op(KEYPIN_ADDED, OP_EQ, ADD("yellowish-red-yellow",
+                                  "salt-and-pepper high-muck-a-muck"));
+  tt_int_op(KEYPIN_ADDED, OP_EQ,
+            keypin_check_and_add((const uint8_t*)"theatre-in-the-round",
+                     (const uint8_t*)"salt-and-pepper high-muck-a-muck", 1));
+
+  /* With no worker threads, the store gets written right away. */
+  tt_int_op(0, OP_EQ, keypin_compact_store());
+  contents = read_file_to_str(fname_store, RFTS_BIN, NULL);
+  tt_assert(contents);
+  tt_mem_op(contents, OP_EQ, "keypin-store-v1\n\0\0\0\2", 20);
+  tor_free(contents);
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_str_op(contents, OP_EQ,
+            "@compacted-at 2008-08-02 20:30:00\n"
+            "\n"
+            "@opened-at 2008-08-02 20:30:00\n");
+  tor_free(contents);
+
+  /* Lookups now go to the store. */
+  tt_int_op(KEYPIN_FOUND, OP_EQ, ADD("king-of-the-herrings",
+                                  "good-for-nothing attorney-at-law"));
+  tt_int_op(KEYPIN_MISMATCH, OP_EQ, ADD("yellowish-red-yellow",
+                                     "salt-and-pepper high-muck-a-muck"));
+  tt_int_op(KEYPIN_NOT_FOUND, OP_EQ, LONE_RSA("yellowish-red-yellow"));
+  tt_int_op(KEYPIN_MISMATCH, OP_EQ, LONE_RSA("theatre-in-the-round"));
+
+  /* Supersede an entry in the store. */
+  tt_int_op(KEYPIN_ADDED, OP_EQ,
+            keypin_check_and_add((const uint8_t*)"no-deposit-no-return",
+                     (const uint8_t*)"good-for-nothing attorney-at-law", 1));
+  tt_int_op(KEYPIN_NOT_FOUND, OP_EQ, LONE_RSA("king-of-the-herrings"));
+  tt_int_op(KEYPIN_ADDED, OP_EQ, ADD("king-of-the-herrings",
+                                  "across-the-board will-o-the-wisp"));
+  keypin_close_journal();
+  keypin_clear();
+
+  /* Load the store and the journal again. */
+  tt_int_op(0, OP_EQ, keypin_load_store(fname_store));
+  tt_int_op(0, OP_EQ, keypin_load_journal(fname));
+  tt_int_op(KEYPIN_FOUND, OP_EQ, keypin_check(
+                      (const uint8_t*)"no-deposit-no-return",
+                      (const uint8_t*)"good-for-nothing attorney-at-law"));
+  tt_int_op(KEYPIN_FOUND, OP_EQ, keypin_check(
+                      (const uint8_t*)"king-of-the-herrings",
+                      (const uint8_t*)"across-the-board will-o-the-wisp"));
+  tt_int_op(KEYPIN_FOUND, OP_EQ, keypin_check(
+                      (const uint8_t*)"theatre-in-the-round",
+                      (const uint8_t*)"salt-and-pepper high-muck-a-muck"));
+
+  /* Now compact in the background, and supersede a store entry with an
+   * entry that is itself superseded before the worker is done. */
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  update_approx_time(1231041600);
+  tt_int_op(0, OP_EQ, keypin_open_journal(fname));
+  tt_int_op(0, OP_EQ, keypin_compact_store());
+  tt_assert(queued_fn);
+  tt_int_op(-1, OP_EQ, keypin_compact_store()); /* Already running */
+  tt_int_op(KEYPIN_ADDED, OP_EQ,
+            keypin_check_and_add((const uint8_t*)"intellectualizations",
+                     (const uint8_t*)"salt-and-pepper high-muck-a-muck", 1));
+  tt_int_op(KEYPIN_ADDED, OP_EQ,
+            keypin_check_and_add((const uint8_t*)"intellectualizations",
+                     (const uint8_t*)"holier-than-thou jack-in-the-box", 1));
+  tt_int_op(KEYPIN_NOT_FOUND, OP_EQ, LONE_RSA("theatre-in-the-round"));
+  tt_int_op(WQ_RPL_REPLY, OP_EQ, queued_fn(NULL, queued_arg));
+  queued_reply_fn(queued_arg);
+
+  tt_int_op(KEYPIN_NOT_FOUND, OP_EQ, LONE_RSA("theatre-in-the-round"));
+  tt_int_op(KEYPIN_FOUND, OP_EQ, ADD("intellectualizations",
+                                  "holier-than-thou jack-in-the-box"));
+  contents = read_file_to_str(fname_store, RFTS_BIN, &st);
+  tt_assert(contents);
+  tt_mem_op(contents, OP_EQ, "keypin-store-v1\n\0\0\0\3", 20);
+  tt_int_op(st.st_size, OP_EQ, 20 + 3*(20+32+4));
+  tor_free(contents);
+  keypin_close_journal();
+  keypin_clear();
+
+  tt_int_op(0, OP_EQ, keypin_load_store(fname_store));
+  tt_int_op(0, OP_EQ, keypin_load_journal(fname));
+  tt_int_op(KEYPIN_NOT_FOUND, OP_EQ, LONE_RSA("theatre-in-the-round"));
+  tt_int_op(KEYPIN_FOUND, OP_EQ, keypin_check(
+                      (const uint8_t*)"intellectualizations",
+                      (const uint8_t*)"holier-than-thou jack-in-the-box"));
+  keypin_clear();
+
+  /* A corrupt store is an error. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname_store,
+                                        "keypin-store-v1\n\0\0\0\1", 1));
+  tt_int_op(-1, OP_EQ, keypin_load_store(fname_store));
+
+ done:
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  tor_free(contents);
+  tor_free(fname_store);
+  keypin_close_journal();
+  keypin_clear();
+}
+
 #undef ADD
 #undef LONE_RSA
 
@@ -251,6 +401,7 @@ struct testcase_t keypin_tests[] = {
   TEST( parse_file, TT_FORK ),
   TEST( add_entry, TT_FORK ),
   TEST( journal, TT_FORK ),
+  TEST( store, TT_FORK ),
   END_OF_TESTCASES
 };
 
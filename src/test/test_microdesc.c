@@ -20,6 +20,7 @@
 #include "feature/nodelist/routerstatus_st.h"
 
 #include "test/test.h"
+#include "test/log_test_helpers.h"
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -215,6 +216,17 @@ test_md_cache(void *data)
   tt_int_op(md2->last_listed, OP_EQ, time2);
   tt_int_op(md3->last_listed, OP_EQ, time3);
 
+  /* We don't parse the rest of a cached microdescriptor until we need it. */
+  tt_assert(md3->body_is_unparsed);
+  tt_ptr_op(md3->family, OP_EQ, NULL);
+  tt_ptr_op(md3->onion_pkey, OP_EQ, NULL);
+  tt_int_op(microdesc_ensure_parsed(md3), OP_EQ, 0);
+  tt_assert(! md3->body_is_unparsed);
+  tt_ptr_op(md3->onion_pkey, OP_NE, NULL);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  tt_str_op(smartlist_get(md3->family, 0), OP_EQ, "nodeX");
+  tt_int_op(microdesc_ensure_parsed(md3), OP_EQ, 0);
+
   /* Okay, now we are going to clear out everything older than a week old.
    * In practice, that means md3 */
   microdesc_cache_clean(mc, time(NULL)-7*24*60*60, 1/*force*/);
@@ -301,6 +313,68 @@ test_md_cache_broken(void *data)
   microdesc_free_all();
 }
 
+static void
+test_md_cache_unparseable(void *data)
+{
+  or_options_t *options;
+  char *fn = NULL, *s = NULL, *contents = NULL;
+  microdesc_cache_t *mc = NULL;
+  microdesc_t *md1, *md_bad;
+  char d1[DIGEST256_LEN], d_bad[DIGEST256_LEN];
+  const char *bad_body;
+
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test3"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+
+  /* A cache file holding one good microdescriptor, and one whose ntor key
+   * is garbage. */
+  tor_asprintf(&contents, "%s%s%s", test_md1, test_md2,
+               "ntor-onion-key not-base64\n");
+  bad_body = contents + strlen(test_md1);
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d_bad, bad_body, strlen(bad_body), DIGEST_SHA256);
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  tt_int_op(0, OP_EQ, write_str_to_file(fn, contents, 1));
+
+  /* We only notice the problem once we try to use it. */
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md_bad = microdesc_cache_lookup_by_digest256(mc, d_bad);
+  tt_assert(md1);
+  tt_assert(md_bad);
+  tt_int_op(microdesc_ensure_parsed(md1), OP_EQ, 0);
+  setup_full_capture_of_logs(LOG_WARN);
+  tt_int_op(microdesc_ensure_parsed(md_bad), OP_EQ, -1);
+  expect_log_msg_containing("Bogus ntor-onion-key in microdesc");
+  teardown_capture_of_logs();
+
+  /* Now it's gone, and it stays gone when we rebuild the cache. */
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d_bad));
+  tt_ptr_op(md1, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_str_op(s, OP_EQ, test_md1);
+
+ done:
+  teardown_capture_of_logs();
+  if (options)
+    tor_free(options->CacheDirectory);
+  tor_free(fn);
+  tor_free(s);
+  tor_free(contents);
+  microdesc_free_all();
+}
+
 /* Generated by chutney. */
 static const char test_ri[] =
   "router test005r 127.0.0.1 5005 0 7005\n"
@@ -814,6 +888,7 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_unparseable", test_md_cache_unparseable, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
@@ -10,6 +10,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
 
 #include "feature/nodelist/microdesc_st.h"
@@ -231,6 +232,123 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+/** Return a new routerinfo with a random identity, the nickname
+ * <b>nickname</b>, the address <b>addr</b>, and a declared family made of
+ * the space-separated names in <b>family</b>. */
+static routerinfo_t *
+make_family_test_ri(const char *nickname, uint32_t addr, const char *family)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+  ri->nickname = tor_strdup(nickname);
+  ri->addr = addr;
+  ri->or_port = 9001;
+  ri->purpose = ROUTER_PURPOSE_GENERAL;
+  if (family) {
+    ri->declared_family = smartlist_new();
+    smartlist_split_string(ri->declared_family, family, " ",
+                           SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  }
+  return ri;
+}
+
+/** Return a newly allocated "$HEXDIGEST" name for <b>ri</b>, followed by
+ * <b>suffix</b>. */
+static char *
+family_test_hex_name(const routerinfo_t *ri, const char *suffix)
+{
+  char hex[HEX_DIGEST_LEN+1];
+  char *name = NULL;
+  base16_encode(hex, sizeof(hex), ri->cache_info.identity_digest,
+                DIGEST_LEN);
+  tor_asprintf(&name, "$%s%s", hex, suffix);
+  return name;
+}
+
+static void
+test_nodelist_family_index(void *arg)
+{
+#define N_NODES 6
+  routerinfo_t *ri[N_NODES], *ri_new = NULL, *ri_old = NULL;
+  const node_t *n[N_NODES];
+  node_t unlisted;
+  smartlist_t *sl = smartlist_new();
+  int i;
+  (void)arg;
+
+  /* alpha and bravo name each other; charlie and alpha name each other by
+   * digest; delta names alpha, but not the other way around; the two
+   * "echo"s and alpha name each other. */
+  ri[0] = make_family_test_ri("alpha", 0x01010101, "Bravo echo");
+  ri[1] = make_family_test_ri("bravo", 0x02020202, "alpha");
+  ri[2] = make_family_test_ri("charlie", 0x03030303, NULL);
+  ri[3] = make_family_test_ri("delta", 0x04040404, "alpha");
+  ri[4] = make_family_test_ri("echo", 0x05050505, "alpha");
+  ri[5] = make_family_test_ri("ECHO", 0x06060606, "ALPHA");
+  ri[2]->declared_family = smartlist_new();
+  smartlist_add(ri[2]->declared_family, family_test_hex_name(ri[0], ""));
+  smartlist_add(ri[0]->declared_family,
+                family_test_hex_name(ri[2], "~Charlie"));
+
+  for (i = 0; i < N_NODES; ++i) {
+    n[i] = nodelist_set_routerinfo(ri[i], &ri_old);
+    tt_ptr_op(ri_old, OP_EQ, NULL);
+  }
+
+  tt_assert(nodes_in_same_family(n[0], n[1]));
+  tt_assert(nodes_in_same_family(n[1], n[0]));
+  tt_assert(nodes_in_same_family(n[0], n[2]));
+  tt_assert(nodes_in_same_family(n[2], n[0]));
+  tt_assert(!nodes_in_same_family(n[0], n[3]));
+  tt_assert(!nodes_in_same_family(n[3], n[0]));
+  tt_assert(nodes_in_same_family(n[0], n[4]));
+  tt_assert(nodes_in_same_family(n[5], n[0]));
+  tt_assert(!nodes_in_same_family(n[1], n[2]));
+  tt_assert(!nodes_in_same_family(n[4], n[5]));
+
+  nodelist_add_node_and_family(sl, n[0]);
+  tt_assert(smartlist_contains(sl, n[0]));
+  tt_assert(smartlist_contains(sl, n[1]));
+  tt_assert(smartlist_contains(sl, n[2]));
+  tt_assert(!smartlist_contains(sl, n[3]));
+  tt_assert(smartlist_contains(sl, n[4]));
+  tt_assert(smartlist_contains(sl, n[5]));
+  smartlist_clear(sl);
+
+  /* A node that isn't in the nodelist gets the same answers, without the
+   * index. */
+  memcpy(&unlisted, n[3], sizeof(unlisted));
+  unlisted.nodelist_idx = -1;
+  tt_assert(!nodes_in_same_family(&unlisted, n[0]));
+  tt_assert(!nodes_in_same_family(n[0], &unlisted));
+
+  /* Once alpha publishes a descriptor naming delta, they're a family. */
+  ri_new = make_family_test_ri("alpha", 0x01010101, "bravo delta");
+  memcpy(ri_new->cache_info.identity_digest,
+         ri[0]->cache_info.identity_digest, DIGEST_LEN);
+  tt_ptr_op(nodelist_set_routerinfo(ri_new, &ri_old), OP_EQ, n[0]);
+  tt_ptr_op(ri_old, OP_EQ, ri[0]);
+  tt_assert(nodes_in_same_family(n[0], n[3]));
+  tt_assert(nodes_in_same_family(&unlisted, n[0]));
+  tt_assert(!nodes_in_same_family(n[0], n[2]));
+  tt_assert(!nodes_in_same_family(n[0], n[4]));
+  nodelist_add_node_and_family(sl, n[0]);
+  tt_assert(smartlist_contains(sl, n[0]));
+  tt_assert(smartlist_contains(sl, n[1]));
+  tt_assert(!smartlist_contains(sl, n[2]));
+  tt_assert(smartlist_contains(sl, n[3]));
+  tt_assert(!smartlist_contains(sl, n[4]));
+  tt_assert(!smartlist_contains(sl, n[5]));
+
+ done:
+  nodelist_free_all();
+  for (i = 0; i < N_NODES; ++i)
+    routerinfo_free(ri[i]);
+  routerinfo_free(ri_new);
+  smartlist_free(sl);
+#undef N_NODES
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -239,6 +357,7 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(family_index, TT_FORK),
   END_OF_TESTCASES
 };
 
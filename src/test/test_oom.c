@@ -7,11 +7,13 @@
 #define BUFFERS_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define CONNECTION_PRIVATE
+#define MAINLOOP_PRIVATE
 #include "core/or/or.h"
 #include "lib/container/buffers.h"
 #include "core/or/circuitlist.h"
 #include "lib/evloop/compat_libevent.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/or/relay.h"
@@ -65,6 +67,25 @@ dummy_or_circuit_new(int n_p_cells, int n_n_cells)
   return TO_CIRCUIT(circ);
 }
 
+/** Return the number of bytes that a cell queue allocates to hold
+ * <b>n_cells</b> cells, counting from when it was empty. */
+static size_t
+cells_mem_cost(int n_cells)
+{
+  cell_queue_t queue;
+  cell_t cell;
+  size_t cost;
+  int i;
+
+  memset(&cell, 0, sizeof(cell));
+  cell_queue_init(&queue);
+  for (i = 0; i < n_cells; ++i)
+    cell_queue_append_packed_copy(NULL, &queue, 0, &cell, 1, 0);
+  cost = cell_queue_get_allocation(&queue);
+  cell_queue_clear(&queue);
+  return cost;
+}
+
 static void
 add_bytes_to_buf(buf_t *buf, size_t n_bytes)
 {
@@ -98,6 +119,9 @@ dummy_edge_conn_new(circuit_t *circ,
   add_bytes_to_buf(inbuf, in_bytes);
   add_bytes_to_buf(outbuf, out_bytes);
 
+  /* The OOM handler finds streams through the per-type connection lists. */
+  connection_array_by_type_add(TO_CONN(conn));
+
   conn->on_circuit = circ;
   if (type == CONN_TYPE_EXIT) {
     or_circuit_t *oc  = TO_OR_CIRCUIT(circ);
@@ -120,14 +144,20 @@ test_oom_circbuf(void *arg)
   circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL, *c4 = NULL;
   uint64_t now_ns = 1389631048 * (uint64_t)1000000000;
   const uint64_t start_ns = now_ns;
+  /* What the circuits below allocate for their cells, chunk headers and
+   * unused room included. */
+  const size_t cost_c1 = cells_mem_cost(30);
+  const size_t cost_c2 = 2 * cells_mem_cost(20);
+  const size_t cost_c3 = cells_mem_cost(100) + cells_mem_cost(85);
+  const size_t cost_c4 = cells_mem_cost(2);
 
   (void) arg;
 
   monotime_enable_test_mocking();
   MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
 
-  /* Far too low for real life. */
-  options->MaxMemInQueues = 256*packed_cell_mem_cost();
+  /* Far too low for real life: we run out partway through adding c4. */
+  options->MaxMemInQueues = cost_c1 + cost_c2 + cost_c3 + cost_c4 / 2;
   options->CellStatistics = 0;
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
@@ -145,8 +175,8 @@ test_oom_circbuf(void *arg)
 
   tt_int_op(packed_cell_mem_cost(), OP_EQ,
             sizeof(packed_cell_t));
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 70);
+  tt_int_op(cost_c1, OP_GT, packed_cell_mem_cost() * 30);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, cost_c1 + cost_c2);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
 
   now_ns += 10 * 1000000;
@@ -154,7 +184,7 @@ test_oom_circbuf(void *arg)
   c3 = dummy_or_circuit_new(100, 85);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 255);
+            cost_c1 + cost_c2 + cost_c3);
 
   now_ns += 10 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
@@ -162,7 +192,7 @@ test_oom_circbuf(void *arg)
   c4 = dummy_or_circuit_new(2, 0);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 257);
+            cost_c1 + cost_c2 + cost_c3 + cost_c4);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
 
@@ -172,7 +202,7 @@ test_oom_circbuf(void *arg)
   tt_assert(! c4->marked_for_close);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * (257 - 30));
+            cost_c2 + cost_c3 + cost_c4);
 
   circuit_free(c1);
 
@@ -190,7 +220,7 @@ test_oom_circbuf(void *arg)
   tt_assert(! c4->marked_for_close);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * (257 - 30));
+            cost_c2 + cost_c3 + cost_c4);
 
  done:
   circuit_free(c1);
@@ -213,14 +243,17 @@ test_oom_streambuf(void *arg)
   smartlist_t *edgeconns = smartlist_new();
   const uint64_t start_ns = 1389641159 * (uint64_t)1000000000;
   uint64_t now_ns = start_ns;
+  /* What the circuits below allocate for their cells. */
+  const size_t cost_c1_c4 = 2 * cells_mem_cost(10) + 3 * cells_mem_cost(20);
+  const size_t cost_c5 = cells_mem_cost(5);
 
   (void) arg;
   monotime_enable_test_mocking();
 
   MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
 
-  /* Far too low for real life. */
-  options->MaxMemInQueues = 81*packed_cell_mem_cost() + 4096 * 34;
+  /* Far too low for real life: we run out partway through adding c5. */
+  options->MaxMemInQueues = cost_c1_c4 + cost_c5 / 2 + 4096 * 34;
   options->CellStatistics = 0;
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
@@ -241,8 +274,7 @@ test_oom_streambuf(void *arg)
   c3 = dummy_or_circuit_new(20,20);
   monotime_coarse_set_mock_time_nsec(start_ns + 530 * 1000000);
   c4 = dummy_or_circuit_new(0,0);
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 80);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, cost_c1_c4);
 
   now_ns = start_ns + 600 * 1000000;
   monotime_coarse_set_mock_time_nsec(now_ns);
@@ -299,8 +331,7 @@ test_oom_streambuf(void *arg)
   ts_is_approx(circuit_max_queued_item_age(c3, tvts), 480);
   ts_is_approx(circuit_max_queued_item_age(c4, tvts), 370);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 80);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, cost_c1_c4);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*16*2);
 
   /* Now give c4 a very old buffer of modest size */
@@ -323,7 +354,7 @@ test_oom_streambuf(void *arg)
   c5 = dummy_or_circuit_new(0,5);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 85);
+            cost_c1_c4 + cost_c5);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*17*2);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
@@ -336,7 +367,7 @@ test_oom_streambuf(void *arg)
   tt_assert(! c5->marked_for_close);
 
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 85);
+            cost_c1_c4 + cost_c5);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*8*2);
 
  done:
@@ -346,17 +377,78 @@ test_oom_streambuf(void *arg)
   circuit_free(c4);
   circuit_free(c5);
 
-  SMARTLIST_FOREACH(edgeconns, edge_connection_t *, ec,
-                    connection_free_minimal(TO_CONN(ec)));
+  SMARTLIST_FOREACH(edgeconns, edge_connection_t *, ec, {
+    connection_array_by_type_remove(TO_CONN(ec));
+    connection_free_minimal(TO_CONN(ec));
+  });
   smartlist_free(edgeconns);
 
   UNMOCK(circuit_mark_for_close_);
   monotime_disable_test_mocking();
 }
 
+/** Make sure that the OOM handler picks its victims by the age of the cells
+ * that are actually queued, even after cells have left the front of a
+ * queue. */
+static void
+test_oom_cell_age_index(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  circuit_t *c1 = NULL, *c2 = NULL;
+  const uint64_t start_ns = 1389641159 * (uint64_t)1000000000;
+  cell_t cell;
+
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
+  memset(&cell, 0, sizeof(cell));
+
+  c1 = dummy_or_circuit_new(0, 0);
+  c2 = dummy_or_circuit_new(0, 0);
+
+  /* c1 gets a cell at 0 msec and another at 200 msec; c2 gets one at 100
+   * msec. */
+  monotime_coarse_set_mock_time_nsec(start_ns);
+  cell_queue_append_packed_copy(c1, &c1->n_chan_cells, 1, &cell, 1, 0);
+  monotime_coarse_set_mock_time_nsec(start_ns + 100 * 1000000);
+  cell_queue_append_packed_copy(c2, &c2->n_chan_cells, 1, &cell, 1, 0);
+  monotime_coarse_set_mock_time_nsec(start_ns + 200 * 1000000);
+  cell_queue_append_packed_copy(c1, &c1->n_chan_cells, 1, &cell, 1, 0);
+
+  /* Send c1's oldest cell, so that c2 now has the oldest cell. */
+  cell_queue_drop_first(&c1->n_chan_cells);
+  circuit_note_cells_dequeued(c1);
+  tt_int_op(n_cells_in_circ_queues(c1), OP_EQ, 1);
+
+  /* Ask to recover less than either circuit holds: only c2 should die. */
+  monotime_coarse_set_mock_time_nsec(start_ns + 300 * 1000000);
+  options->MaxMemInQueues = 20 * cells_mem_cost(1);
+  circuits_handle_oom(18 * cells_mem_cost(1) + cells_mem_cost(1) / 2);
+
+  tt_assert(! c1->marked_for_close);
+  tt_assert(c2->marked_for_close);
+  tt_int_op(n_cells_in_circ_queues(c1), OP_EQ, 1);
+  tt_int_op(n_cells_in_circ_queues(c2), OP_EQ, 0);
+
+  /* Once c1's queue is empty, there is nothing left to kill. */
+  cell_queue_drop_first(&c1->n_chan_cells);
+  circuit_note_cells_dequeued(c1);
+  circuits_handle_oom(options->MaxMemInQueues);
+  tt_assert(! c1->marked_for_close);
+
+ done:
+  circuit_free(c1);
+  circuit_free(c2);
+
+  UNMOCK(circuit_mark_for_close_);
+  monotime_disable_test_mocking();
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "cell_age_index", test_oom_cell_age_index, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 